@@ -122,6 +122,7 @@ static int thread_instantiate(TALLOC_CTX *ctx, fr_event_list_t *el, UNUSED void
 {
 	if (modules_thread_instantiate(ctx, el) < 0) return -1;
 	if (xlat_thread_instantiate(ctx) < 0) return -1;
+	if (fr_trace_thread_init() < 0) return -1;
 
 	return 0;
 }
@@ -133,6 +134,7 @@ static void thread_detach(UNUSED void *uctx)
 {
 	modules_thread_detach();
 	xlat_thread_detach();
+	fr_trace_thread_detach();
 }
 
 #define EXIT_WITH_FAILURE \
@@ -740,6 +742,13 @@ int main(int argc, char *argv[])
 	 */
 	if (log_global_init(&default_log, config->daemonize) < 0) EXIT_WITH_FAILURE;
 
+	/*
+	 *  Enable request tracing before the workers
+	 *  start, so each one allocates its own ring.
+	 */
+	if (fr_trace_init(global_ctx, config->trace_sample_rate,
+			  config->trace_ring_size, config->trace_file) < 0) EXIT_WITH_FAILURE;
+
 	/*
 	 *	Start the network / worker threads.
 	 */
@@ -752,6 +761,33 @@ int main(int argc, char *argv[])
 		schedule->max_networks = config->max_networks;
 		schedule->stats_interval = config->stats_interval;
 
+		if (config->stats_segment) {
+			uint32_t	num_slots = config->max_networks +
+						    (config->max_workers * (module_instance_count() + 1)) +
+						    FR_STATS_SHM_EXTRA_SLOTS;
+
+			/*
+			 *	The segment is owned by the server user, so
+			 *	that it can be removed on exit, after we've
+			 *	permanently dropped privileges.
+			 */
+#ifdef HAVE_SETUID
+			rad_suid_up();
+			schedule->stats_shm = fr_stats_shm_create(global_ctx, config->stats_segment, num_slots,
+								  config->server_uid, config->server_gid);
+			rad_suid_down();
+#else
+			schedule->stats_shm = fr_stats_shm_create(global_ctx, config->stats_segment, num_slots,
+								  (uid_t)-1, (gid_t)-1);
+#endif
+			if (!schedule->stats_shm) {
+				PERROR("Failed creating statistics segment");
+				EXIT_WITH_FAILURE;
+			}
+			schedule->stats_shm_interval = config->stats_segment_interval;
+			if (!schedule->stats_shm_interval) schedule->stats_shm_interval = NSEC;
+		}
+
 		schedule->network.max_outstanding = config->max_requests;
 		schedule->worker.max_requests = config->max_requests;
 		schedule->worker.max_request_time = config->max_request_time;
@@ -977,6 +1013,11 @@ cleanup:
 	 */
 	(void) fr_schedule_destroy(&sc);
 
+	/*
+	 *  Writes the trace file, if one was configured.
+	 */
+	fr_trace_free();
+
 	/*
 	 *  Frees request specific logging resources which is OK
 	 *  because all the requests will have been stopped.
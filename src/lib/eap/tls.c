@@ -79,6 +79,7 @@ fr_table_num_ordered_t const eap_tls_status_table[] = {
 	{ L("established"),		EAP_TLS_ESTABLISHED		},
 	{ L("fail"),			EAP_TLS_FAIL			},
 	{ L("handled"),			EAP_TLS_HANDLED			},
+	{ L("yield"),			EAP_TLS_YIELD			},
 
 	{ L("start"),			EAP_TLS_START_SEND		},
 	{ L("request"),			EAP_TLS_RECORD_SEND		},
@@ -827,6 +828,7 @@ ignore_length:
  *	- EAP_TLS_HANDLED if we need to send an additional request to the peer.
  *	- EAP_TLS_ESTABLISHED if the handshake completed successfully, and there's
  *	  no more data to send.
+ *	- EAP_TLS_YIELD if the handshake is waiting for an async operation.
  */
 static eap_tls_status_t eap_tls_handshake(request_t *request, eap_session_t *eap_session)
 {
@@ -836,10 +838,18 @@ static eap_tls_status_t eap_tls_handshake(request_t *request, eap_session_t *eap
 	/*
 	 *	Continue the TLS handshake
 	 */
-	if (fr_tls_session_handshake(request, tls_session) < 0) {
+	switch (fr_tls_session_handshake(request, tls_session)) {
+	case -1:
 		REDEBUG("TLS receive handshake failed during operation");
 		fr_tls_cache_deny(tls_session);
 		return EAP_TLS_FAIL;
+
+	case 2:
+		eap_tls_session->async_pending = true;
+		return EAP_TLS_YIELD;
+
+	default:
+		break;
 	}
 
 	/*
@@ -917,6 +927,16 @@ eap_tls_status_t eap_tls_process(request_t *request, eap_session_t *eap_session)
 
 	RDEBUG2("Continuing EAP-TLS");
 
+	/*
+	 *	We yielded whilst the handshake was waiting on an
+	 *	async operation.  The record for this round has
+	 *	already been fed to OpenSSL, so just continue.
+	 */
+	if (eap_tls_session->async_pending) {
+		eap_tls_session->async_pending = false;
+		return eap_tls_handshake(request, eap_session);
+	}
+
 	/*
 	 *	Call eap_tls_verify to sanity check the incoming EAP data.
 	 */
@@ -1051,6 +1071,115 @@ eap_tls_status_t eap_tls_process(request_t *request, eap_session_t *eap_session)
 	return status;
 }
 
+/** Resume the request when the async job's fd becomes ready
+ *
+ */
+static void eap_tls_async_fd_ready(UNUSED module_ctx_t const *mctx, request_t *request,
+				   UNUSED void *rctx, UNUSED int fd)
+{
+	unlang_interpret_mark_runnable(request);
+}
+
+/** Resume the request when the async operation's deadline passes
+ *
+ * The async job notices the deadline has passed when the handshake
+ * is continued, and fails the operation.
+ */
+static void eap_tls_async_timeout(UNUSED module_ctx_t const *mctx, request_t *request,
+				  UNUSED void *rctx, UNUSED fr_time_t fired)
+{
+	RDEBUG2("Timed out waiting for async TLS operation");
+	unlang_interpret_mark_runnable(request);
+}
+
+/** Remove the events inserted by #eap_tls_yield
+ *
+ * Must be called by the resume function passed to #eap_tls_yield before
+ * the handshake is continued, and by the signal function when the request
+ * is cancelled.  Otherwise the fd event outlives the yield, and fires
+ * again for whatever OpenSSL does with the fd next.
+ *
+ * @param[in] request		The current subrequest.
+ * @param[in] rctx		The eap_tls_session_t passed to the resume function.
+ */
+void eap_tls_yield_done(request_t *request, void *rctx)
+{
+	eap_tls_session_t	*eap_tls_session = talloc_get_type_abort(rctx, eap_tls_session_t);
+
+	/*
+	 *	The timeout event is freed when it fires,
+	 *	so this may fail.
+	 */
+	(void) unlang_module_timeout_delete(request, eap_tls_session);
+
+	if (eap_tls_session->async_fd < 0) return;
+
+	(void) unlang_module_fd_delete(request, eap_tls_session, eap_tls_session->async_fd);
+	eap_tls_session->async_fd = -1;
+}
+
+/** Yield the request until an async TLS operation completes
+ *
+ * Should be called by EAP methods when #eap_tls_process returns EAP_TLS_YIELD.
+ * The resume function should call #eap_tls_yield_done, then call #eap_tls_process
+ * again, which will continue the handshake.  The signal function should call
+ * #eap_tls_yield_done if the request is cancelled.
+ *
+ * @param[out] p_result		Result code of the module.
+ * @param[in] request		The current subrequest.
+ * @param[in] eap_session	that's waiting.
+ * @param[in] resume		Called when the async operation has completed.
+ * @param[in] signal		Called if the request is signalled whilst waiting.
+ * @return
+ *	- UNLANG_ACTION_YIELD.
+ *	- UNLANG_ACTION_CALCULATE_RESULT on error.
+ */
+unlang_action_t eap_tls_yield(rlm_rcode_t *p_result, request_t *request, eap_session_t *eap_session,
+			      unlang_module_resume_t resume, unlang_module_signal_t signal)
+{
+	eap_tls_session_t	*eap_tls_session = talloc_get_type_abort(eap_session->opaque, eap_tls_session_t);
+	fr_tls_session_t	*tls_session = eap_tls_session->tls_session;
+	int			fd;
+
+	fr_assert(eap_tls_session->async_fd < 0);
+
+	fd = fr_tls_session_async_fd(tls_session);
+	if (fd < 0) {
+		REDEBUG("Failed retrieving fd for async TLS operation");
+	error:
+		eap_tls_session->async_pending = false;
+		eap_tls_fail(request, eap_session);
+		RETURN_MODULE_FAIL;
+	}
+
+	/*
+	 *	Errors are handled by OpenSSL when we
+	 *	continue the handshake.
+	 */
+	if (unlang_module_fd_add(request,
+				 tls_session->async_want_write ? NULL : eap_tls_async_fd_ready,
+				 tls_session->async_want_write ? eap_tls_async_fd_ready : NULL,
+				 eap_tls_async_fd_ready, eap_tls_session, fd) < 0) {
+		REDEBUG("Failed inserting async TLS fd into event loop");
+		goto error;
+	}
+	eap_tls_session->async_fd = fd;
+
+	/*
+	 *	Operations like OCSP lookups have a deadline,
+	 *	private key operations don't.
+	 */
+	if (tls_session->async_deadline &&
+	    (unlang_module_timeout_add(request, eap_tls_async_timeout, eap_tls_session,
+				       tls_session->async_deadline) < 0)) {
+		REDEBUG("Failed inserting async TLS timeout into event loop");
+		eap_tls_yield_done(request, eap_tls_session);
+		goto error;
+	}
+
+	return unlang_module_yield(request, resume, signal, eap_tls_session);
+}
+
 /** Create a new fr_tls_session_t associated with an #eap_session_t
  *
  * Creates a new server fr_tls_session_t and associates it with an #eap_session_t
@@ -1083,6 +1212,7 @@ eap_tls_session_t *eap_tls_session_init(request_t *request, eap_session_t *eap_s
 	 *	Initial state.
 	 */
 	eap_tls_session->state = EAP_TLS_START_SEND;
+	eap_tls_session->async_fd = -1;
 
 	/*
 	 *	As per the RFC...
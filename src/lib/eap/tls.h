@@ -51,6 +51,7 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/tls/base.h>
 #include <freeradius-devel/eap/base.h>
+#include <freeradius-devel/unlang/module.h>
 
 #define TLS_HEADER_LEN 4
 #define TLS_HEADER_LENGTH_FIELD_LEN 4
@@ -92,6 +93,7 @@ typedef enum {
 	EAP_TLS_ESTABLISHED,       			//!< Session established, send success (or start phase2).
 	EAP_TLS_FAIL,       				//!< Fail, send fail.
 	EAP_TLS_HANDLED,	  			//!< TLS code has handled it.
+	EAP_TLS_YIELD,					//!< Waiting for an async TLS operation to complete.
 
 	/*
 	 *	Composition states, we need to
@@ -131,6 +133,11 @@ typedef struct {
 
 	bool			phase2;			//!< Whether we're in phase 2
 
+	bool			async_pending;		//!< Whether the handshake is waiting for an
+							//!< async TLS operation to complete.
+	int			async_fd;		//!< fd we're waiting on for the async TLS
+							//!< operation, or -1.
+
 	bool			include_length;		//!< A flag to include length in every TLS Data/Alert packet.
 							//!< If set to no then only the first fragment contains length.
 	int			base_flags;		//!< Some protocols use the reserved bits of the EAP-TLS
@@ -156,6 +163,11 @@ extern size_t eap_tls_status_table_len;
  */
 eap_tls_status_t	eap_tls_process(request_t *request, eap_session_t *eap_session) CC_HINT(nonnull);
 
+unlang_action_t		eap_tls_yield(rlm_rcode_t *p_result, request_t *request, eap_session_t *eap_session,
+				      unlang_module_resume_t resume, unlang_module_signal_t signal) CC_HINT(nonnull);
+
+void			eap_tls_yield_done(request_t *request, void *rctx) CC_HINT(nonnull);
+
 int			eap_tls_start(request_t *request, eap_session_t *eap_session) CC_HINT(nonnull);
 
 int			eap_tls_success(request_t *request, eap_session_t *eap_session,
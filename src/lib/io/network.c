@@ -95,6 +95,8 @@ typedef struct {
 	fr_channel_data_t	*pending;		//!< the currently pending partial packet
 	fr_heap_t		*waiting;		//!< packets waiting to be written
 	fr_io_stats_t		stats;
+
+	fr_stats_shm_slot_t	*shm_slot;		//!< where we publish our statistics.
 } fr_network_socket_t;
 
 /*
@@ -1049,6 +1051,8 @@ static int _network_socket_free(fr_network_socket_t *s)
 	fr_rb_delete(nr->sockets, s);
 	fr_rb_delete(nr->sockets_by_num, s);
 
+	if (s->shm_slot) fr_stats_shm_slot_free(s->shm_slot);
+
 	fr_event_fd_delete(nr->el, s->listen->fd, s->filter);
 
 	if (s->listen->app_io->close) {
@@ -1730,6 +1734,46 @@ void fr_network_stats_log(fr_network_t const *nr, fr_log_t const *log)
 	}
 }
 
+/** Publish statistics for a network thread, and its sockets
+ *
+ * Sockets are given slots the first time they're published.
+ * If the segment is full, their statistics aren't published.
+ *
+ * @param[in] nr	the network.
+ * @param[in] shm	the segment to allocate socket slots in.
+ * @param[in] slot	for the network thread.
+ */
+void fr_network_stats_publish(fr_network_t const *nr, fr_stats_shm_t *shm, fr_stats_shm_slot_t *slot)
+{
+	fr_rb_iter_inorder_t	iter;
+	fr_network_socket_t	*s;
+	uint64_t		now = fr_time_to_unix_time(fr_time());
+
+	fr_stats_shm_slot_update_begin(slot);
+	slot->updated = now;
+	slot->stats = nr->stats;
+	slot->active = fr_rb_num_elements(nr->sockets);
+	fr_stats_shm_slot_update_end(slot);
+
+	for (s = fr_rb_iter_init_inorder(&iter, nr->sockets);
+	     s;
+	     s = fr_rb_iter_next_inorder(&iter)) {
+		if (!s->shm_slot) {
+			s->shm_slot = fr_stats_shm_slot_alloc(shm, FR_STATS_SHM_SLOT_LISTENER, s->number,
+							      s->listen->app_io->get_name ?
+							      s->listen->app_io->get_name(s->listen) :
+							      s->listen->app_io->name);
+			if (!s->shm_slot) continue;
+		}
+
+		fr_stats_shm_slot_update_begin(s->shm_slot);
+		s->shm_slot->updated = now;
+		s->shm_slot->stats = s->stats;
+		s->shm_slot->active = s->outstanding;
+		fr_stats_shm_slot_update_end(s->shm_slot);
+	}
+}
+
 static int cmd_stats_self(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
 {
 	fr_network_t const *nr = ctx;
@@ -35,6 +35,7 @@ typedef struct fr_network_s fr_network_t;
 }
 #endif
 
+#include <freeradius-devel/io/stats_shm.h>
 #include <freeradius-devel/io/worker.h>
 #include <freeradius-devel/util/log.h>
 
@@ -75,6 +76,9 @@ int		fr_network_stats(fr_network_t const *nr, int num, uint64_t *stats) CC_HINT(
 
 void		fr_network_stats_log(fr_network_t const *nr, fr_log_t const *log) CC_HINT(nonnull);
 
+void		fr_network_stats_publish(fr_network_t const *nr, fr_stats_shm_t *shm,
+					 fr_stats_shm_slot_t *slot) CC_HINT(nonnull);
+
 extern fr_cmd_table_t cmd_network_table[];
 
 #ifdef __cplusplus
@@ -32,6 +32,7 @@ RCSID("$Id$")
 #include <freeradius-devel/util/dlist.h>
 #include <freeradius-devel/util/rb.h>
 #include <freeradius-devel/util/syserror.h>
+#include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/trigger.h>
 
 #include <pthread.h>
@@ -75,6 +76,15 @@ typedef enum fr_schedule_child_status_t {
 	FR_CHILD_FAIL				//!< failed, and in the exited queue
 } fr_schedule_child_status_t;
 
+/** Slots a worker uses to publish module statistics
+ *
+ */
+typedef struct {
+	fr_stats_shm_t		*shm;			//!< segment the slots are in.
+	unsigned int		id;			//!< of the worker.
+	fr_stats_shm_slot_t	**slots;		//!< indexed by module instance number.
+} fr_schedule_module_slots_t;
+
 /** Scheduler specific information for worker threads
  *
  * Wraps a fr_worker_t, tracking additional information that
@@ -95,6 +105,10 @@ typedef struct {
 
 	fr_schedule_child_status_t status;	//!< status of the worker
 	fr_worker_t	*worker;		//!< the worker data structure
+
+	fr_event_timer_t const *shm_ev;		//!< timer for stats_shm_interval
+	fr_stats_shm_slot_t *shm_slot;		//!< where we publish our statistics
+	fr_schedule_module_slots_t module_slots; //!< where we publish module statistics
 } fr_schedule_worker_t;
 
 /** Scheduler specific information for network threads
@@ -116,6 +130,9 @@ typedef struct {
 	fr_network_t	*nr;			//!< the receive data structure
 
 	fr_event_timer_t const *ev;		//!< timer for stats_interval
+
+	fr_event_timer_t const *shm_ev;		//!< timer for stats_shm_interval
+	fr_stats_shm_slot_t *shm_slot;		//!< where we publish our statistics
 } fr_schedule_network_t;
 
 
@@ -146,6 +163,11 @@ struct fr_schedule_s {
 
 	fr_network_t	*single_network;	//!< for single-threaded mode
 	fr_worker_t	*single_worker;		//!< for single-threaded mode
+
+	fr_event_timer_t const *single_shm_ev;	//!< for single-threaded mode
+	fr_stats_shm_slot_t *single_network_slot; //!< for single-threaded mode
+	fr_stats_shm_slot_t *single_worker_slot; //!< for single-threaded mode
+	fr_schedule_module_slots_t single_module_slots; //!< for single-threaded mode
 };
 
 static _Thread_local int worker_id;		//!< Internal ID of the current worker thread.
@@ -159,6 +181,59 @@ int fr_schedule_worker_id(void)
 	return worker_id;
 }
 
+/** Publish the statistics for one module thread instance
+ *
+ */
+static void module_shm_publish(module_instance_t *mi, module_thread_instance_t *ti, void *uctx)
+{
+	fr_schedule_module_slots_t	*ms = uctx;
+	fr_stats_shm_slot_t		*slot;
+
+	if (mi->number >= talloc_array_length(ms->slots)) return;
+
+	slot = ms->slots[mi->number];
+	if (!slot) {
+		slot = ms->slots[mi->number] = fr_stats_shm_slot_alloc(ms->shm, FR_STATS_SHM_SLOT_MODULE,
+									 ms->id, mi->name);
+		if (!slot) return;
+	}
+
+	fr_stats_shm_slot_update_begin(slot);
+	slot->updated = fr_time_to_unix_time(fr_time());
+	slot->stats.in = ti->total_calls;
+	slot->active = ti->active_callers;
+	slot->cpu_time = ti->run_time;
+	slot->yield_time = ti->yield_time;
+	fr_stats_shm_slot_update_end(slot);
+}
+
+static void module_shm_init(TALLOC_CTX *ctx, fr_schedule_module_slots_t *ms, fr_stats_shm_t *shm, unsigned int id)
+{
+	ms->shm = shm;
+	ms->id = id;
+	MEM(ms->slots = talloc_zero_array(ctx, fr_stats_shm_slot_t *, module_instance_count() + 1));
+}
+
+static void module_shm_free(fr_schedule_module_slots_t *ms)
+{
+	size_t i;
+
+	for (i = 0; i < talloc_array_length(ms->slots); i++) {
+		if (ms->slots[i]) fr_stats_shm_slot_free(ms->slots[i]);
+	}
+	TALLOC_FREE(ms->slots);
+}
+
+static void worker_shm_timer(fr_event_list_t *el, fr_time_t now, void *uctx)
+{
+	fr_schedule_worker_t		*sw = talloc_get_type_abort(uctx, fr_schedule_worker_t);
+
+	fr_worker_stats_publish(sw->worker, sw->shm_slot);
+	module_thread_walk(module_shm_publish, &sw->module_slots);
+
+	(void) fr_event_timer_at(sw, el, &sw->shm_ev, now + sw->sc->config->stats_shm_interval, worker_shm_timer, sw);
+}
+
 /** Entry point for worker threads
  *
  * @param[in] arg	the fr_schedule_worker_t
@@ -229,6 +304,21 @@ static void *fr_schedule_worker_thread(void *arg)
 
 	DEBUG3("%s - Started", worker_name);
 
+	/*
+	 *	Publish statistics for this worker.
+	 */
+	if (sc->config->stats_shm) {
+		sw->shm_slot = fr_stats_shm_slot_alloc(sc->config->stats_shm, FR_STATS_SHM_SLOT_WORKER,
+						       sw->id, worker_name);
+		if (!sw->shm_slot) {
+			PWARN("%s - Not publishing statistics", worker_name);
+		} else {
+			module_shm_init(sw, &sw->module_slots, sc->config->stats_shm, sw->id);
+			(void) fr_event_timer_in(sw, sw->el, &sw->shm_ev, sc->config->stats_shm_interval,
+						 worker_shm_timer, sw);
+		}
+	}
+
 	/*
 	 *	Tell the originator that the thread has started.
 	 */
@@ -246,6 +336,13 @@ static void *fr_schedule_worker_thread(void *arg)
 fail:
 	sw->status = status;
 
+	if (sw->shm_slot) {
+		fr_event_timer_delete(&sw->shm_ev);
+		module_shm_free(&sw->module_slots);
+		fr_stats_shm_slot_free(sw->shm_slot);
+		sw->shm_slot = NULL;
+	}
+
 	if (sw->worker) {
 		fr_worker_destroy(sw->worker);
 		sw->worker = NULL;
@@ -280,6 +377,27 @@ static void stats_timer(fr_event_list_t *el, fr_time_t now, void *uctx)
 	(void) fr_event_timer_at(sn, el, &sn->ev, now + sn->sc->config->stats_interval, stats_timer, sn);
 }
 
+static void network_shm_timer(fr_event_list_t *el, fr_time_t now, void *uctx)
+{
+	fr_schedule_network_t		*sn = talloc_get_type_abort(uctx, fr_schedule_network_t);
+
+	fr_network_stats_publish(sn->nr, sn->sc->config->stats_shm, sn->shm_slot);
+
+	(void) fr_event_timer_at(sn, el, &sn->shm_ev, now + sn->sc->config->stats_shm_interval, network_shm_timer, sn);
+}
+
+static void single_shm_timer(fr_event_list_t *el, fr_time_t now, void *uctx)
+{
+	fr_schedule_t			*sc = talloc_get_type_abort(uctx, fr_schedule_t);
+
+	if (sc->single_network_slot) fr_network_stats_publish(sc->single_network, sc->config->stats_shm,
+							      sc->single_network_slot);
+	if (sc->single_worker_slot) fr_worker_stats_publish(sc->single_worker, sc->single_worker_slot);
+	module_thread_walk(module_shm_publish, &sc->single_module_slots);
+
+	(void) fr_event_timer_at(sc, el, &sc->single_shm_ev, now + sc->config->stats_shm_interval, single_shm_timer, sc);
+}
+
 /** Initialize and run the network thread.
  *
  * @param[in] arg the fr_schedule_network_t
@@ -330,6 +448,21 @@ static void *fr_schedule_network_thread(void *arg)
 	 */
 	if (sc->config->stats_interval) (void) fr_event_timer_in(sn, el, &sn->ev, sn->sc->config->stats_interval, stats_timer, sn);
 
+	/*
+	 *	Publish statistics for this network IO handler, and
+	 *	its sockets.
+	 */
+	if (sc->config->stats_shm) {
+		sn->shm_slot = fr_stats_shm_slot_alloc(sc->config->stats_shm, FR_STATS_SHM_SLOT_NETWORK,
+						       sn->id, network_name);
+		if (!sn->shm_slot) {
+			PWARN("%s - Not publishing statistics", network_name);
+		} else {
+			(void) fr_event_timer_in(sn, el, &sn->shm_ev, sc->config->stats_shm_interval,
+						 network_shm_timer, sn);
+		}
+	}
+
 	/*
 	 *	Call the main event processing loop of the network
 	 *	thread Will not return until the worker is about
@@ -339,6 +472,12 @@ static void *fr_schedule_network_thread(void *arg)
 
 	status = FR_CHILD_EXITED;
 
+	if (sn->shm_slot) {
+		fr_event_timer_delete(&sn->shm_ev);
+		fr_stats_shm_slot_free(sn->shm_slot);
+		sn->shm_slot = NULL;
+	}
+
 fail:
 	sn->status = status;
 
@@ -494,6 +633,18 @@ fr_schedule_t *fr_schedule_create(TALLOC_CTX *ctx, fr_event_list_t *el,
 			goto st_fail;
 		}
 
+		if (sc->config->stats_shm) {
+			sc->single_network_slot = fr_stats_shm_slot_alloc(sc->config->stats_shm,
+									  FR_STATS_SHM_SLOT_NETWORK, 0, "Network");
+			sc->single_worker_slot = fr_stats_shm_slot_alloc(sc->config->stats_shm,
+									 FR_STATS_SHM_SLOT_WORKER, 0, "Worker");
+			if (!sc->single_network_slot || !sc->single_worker_slot) PWARN("Not publishing all statistics");
+			module_shm_init(sc, &sc->single_module_slots, sc->config->stats_shm, 0);
+
+			(void) fr_event_timer_in(sc, el, &sc->single_shm_ev, sc->config->stats_shm_interval,
+						 single_shm_timer, sc);
+		}
+
 		return sc;
 	}
 
@@ -716,6 +867,11 @@ int fr_schedule_destroy(fr_schedule_t **sc_to_free)
 		 *	Destroy the network side first.  It tells the
 		 *	workers to close.
 		 */
+		fr_event_timer_delete(&sc->single_shm_ev);
+		if (sc->single_network_slot) fr_stats_shm_slot_free(sc->single_network_slot);
+		if (sc->single_worker_slot) fr_stats_shm_slot_free(sc->single_worker_slot);
+		if (sc->single_module_slots.slots) module_shm_free(&sc->single_module_slots);
+
 		fr_network_destroy(sc->single_network);
 		fr_worker_destroy(sc->single_worker);
 		goto done;
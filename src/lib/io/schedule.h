@@ -68,6 +68,9 @@ typedef struct {
 	fr_network_config_t network;		//!< configuration for each network;
 
 	fr_time_delta_t	stats_interval;		//!< print channel statistics
+
+	fr_stats_shm_t	*stats_shm;		//!< segment to publish statistics in.
+	fr_time_delta_t	stats_shm_interval;	//!< how often to publish statistics.
 } fr_schedule_config_t;
 
 int			fr_schedule_worker_id(void);
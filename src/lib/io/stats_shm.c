@@ -0,0 +1,192 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @brief Statistics published in a shared memory segment.
+ * @file io/stats_shm.c
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/io/stats_shm.h>
+#include <freeradius-devel/util/strerror.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define STATS_SHM_HEADER_SIZE	ROUND_UP(sizeof(fr_stats_shm_header_t), 64)
+
+struct fr_stats_shm_s {
+	char const		*name;			//!< of the segment, as passed to shm_open().
+	uint8_t			*base;			//!< Where the segment is mapped.
+	size_t			len;			//!< Length of the mapping.
+	uint32_t		num_slots;		//!< Number of slots.
+};
+
+static int _stats_shm_free(fr_stats_shm_t *shm)
+{
+	munmap(shm->base, shm->len);
+	shm_unlink(shm->name);
+
+	return 0;
+}
+
+/** Create and map a statistics segment
+ *
+ * Any existing segment with the same name, e.g. from a server which
+ * crashed, is replaced.  The segment is removed when the returned
+ * structure is freed.
+ *
+ * The segment is given to uid and gid, so that it can still be
+ * removed after the server has permanently dropped privileges.
+ * Changing the owner may need the caller to temporarily regain them.
+ *
+ * @param[in] ctx	to allocate the segment structure in.
+ * @param[in] name	of the segment.  Must start with '/'.
+ * @param[in] num_slots	the maximum number of threads and listeners.
+ * @param[in] uid	to own the segment, or -1 to leave it unchanged.
+ * @param[in] gid	to own the segment, or -1 to leave it unchanged.
+ * @return
+ *	- The new segment.
+ *	- NULL on error.
+ */
+fr_stats_shm_t *fr_stats_shm_create(TALLOC_CTX *ctx, char const *name, uint32_t num_slots, uid_t uid, gid_t gid)
+{
+	fr_stats_shm_t		*shm;
+	fr_stats_shm_header_t	*header;
+	int			fd;
+	size_t			len;
+	void			*base;
+
+	if (name[0] != '/') {
+		fr_strerror_printf("Statistics segment name \"%s\" must start with '/'", name);
+		return NULL;
+	}
+
+	len = STATS_SHM_HEADER_SIZE + ((size_t) num_slots * sizeof(fr_stats_shm_slot_t));
+
+	(void) shm_unlink(name);
+
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR | S_IRGRP);
+	if (fd < 0) {
+		fr_strerror_printf("Failed creating statistics segment \"%s\": %s", name, fr_syserror(errno));
+		return NULL;
+	}
+
+	if (((uid != (uid_t)-1) || (gid != (gid_t)-1)) && (fchown(fd, uid, gid) < 0)) {
+		fr_strerror_printf("Failed changing ownership of statistics segment \"%s\": %s",
+				   name, fr_syserror(errno));
+		goto error;
+	}
+
+	if (ftruncate(fd, len) < 0) {
+		fr_strerror_printf("Failed sizing statistics segment \"%s\": %s", name, fr_syserror(errno));
+		goto error;
+	}
+
+	base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		fr_strerror_printf("Failed mapping statistics segment \"%s\": %s", name, fr_syserror(errno));
+	error:
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
+	close(fd);
+
+	MEM(shm = talloc_zero(ctx, fr_stats_shm_t));
+	shm->name = talloc_typed_strdup(shm, name);
+	shm->base = base;
+	shm->len = len;
+	shm->num_slots = num_slots;
+	talloc_set_destructor(shm, _stats_shm_free);
+
+	/*
+	 *	ftruncate() zeroes the segment, so all slots are
+	 *	free.  Write the magic last, so that readers don't
+	 *	use a partially initialised header.
+	 */
+	header = (fr_stats_shm_header_t *) base;
+	header->version = FR_STATS_SHM_VERSION;
+	header->header_size = STATS_SHM_HEADER_SIZE;
+	header->slot_size = sizeof(fr_stats_shm_slot_t);
+	header->num_slots = num_slots;
+	header->pid = getpid();
+	header->started = fr_time_to_unix_time(fr_time());
+	atomic_thread_fence(memory_order_release);
+	header->magic = FR_STATS_SHM_MAGIC;
+
+	return shm;
+}
+
+/** Allocate a slot for a thread or listener
+ *
+ * May be called from any thread.
+ *
+ * @param[in] shm	to allocate the slot in.
+ * @param[in] type	of thing the slot holds statistics for.
+ * @param[in] id	of the thread or socket.
+ * @param[in] name	of the thread or socket.  Truncated if too long.
+ * @return
+ *	- The slot.
+ *	- NULL if all slots are in use.
+ */
+fr_stats_shm_slot_t *fr_stats_shm_slot_alloc(fr_stats_shm_t *shm, fr_stats_shm_slot_type_t type,
+					     uint32_t id, char const *name)
+{
+	uint32_t		i;
+	fr_stats_shm_slot_t	*slot;
+
+	for (i = 0; i < shm->num_slots; i++) {
+		uint32_t free_type = FR_STATS_SHM_SLOT_FREE;
+
+		slot = (fr_stats_shm_slot_t *) (shm->base + STATS_SHM_HEADER_SIZE + (i * sizeof(*slot)));
+
+		if (!atomic_compare_exchange_strong_explicit(&slot->type, &free_type, type,
+							     memory_order_acquire, memory_order_relaxed)) continue;
+
+		fr_stats_shm_slot_update_begin(slot);
+		slot->id = id;
+		strlcpy(slot->name, name, sizeof(slot->name));
+		slot->updated = fr_time_to_unix_time(fr_time());
+		fr_stats_shm_slot_update_end(slot);
+
+		return slot;
+	}
+
+	fr_strerror_const("No free slots in statistics segment");
+	return NULL;
+}
+
+/** Release a slot so that it can be re-used
+ *
+ * Must be called by the thread which owns the slot.
+ */
+void fr_stats_shm_slot_free(fr_stats_shm_slot_t *slot)
+{
+	fr_stats_shm_slot_update_begin(slot);
+	slot->id = 0;
+	memset(slot->name, 0, sizeof(*slot) - offsetof(fr_stats_shm_slot_t, name));
+	fr_stats_shm_slot_update_end(slot);
+
+	atomic_store_explicit(&slot->type, FR_STATS_SHM_SLOT_FREE, memory_order_release);
+}
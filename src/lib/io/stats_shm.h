@@ -0,0 +1,171 @@
+#pragma once
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file io/stats_shm.h
+ * @brief Statistics published in a shared memory segment.
+ *
+ * The segment starts with a header, followed by an array of
+ * fixed size slots.  Each slot is owned by one thread, which is
+ * the only writer.  External tools map the segment read-only,
+ * and read it without any involvement from the server.
+ *
+ * To read a slot consistently, a reader copies it, and retries
+ * if the sequence number was odd, or changed during the copy.
+ * See fr_stats_shm_slot_read().
+ *
+ * Readers should check the magic and version, and use the
+ * header and slot sizes from the header, rather than sizeof().
+ * New fields are only ever added to the end of the header or
+ * slots.  Incompatible changes increment the version.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSIDH(stats_shm_h, "$Id$")
+
+#include <freeradius-devel/io/base.h>
+#include <freeradius-devel/util/time.h>
+
+#include <stdalign.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FR_STATS_SHM_MAGIC		0x46525353	//!< "FRSS"
+#define FR_STATS_SHM_VERSION		1
+#define FR_STATS_SHM_NAME_LEN		64
+#define FR_STATS_SHM_EXTRA_SLOTS	1024		//!< Slots for listeners, in addition
+							///< to the threads and modules.
+
+typedef enum {
+	FR_STATS_SHM_SLOT_FREE = 0,			//!< Slot is not in use.
+	FR_STATS_SHM_SLOT_NETWORK,			//!< Network thread.
+	FR_STATS_SHM_SLOT_WORKER,			//!< Worker thread.
+	FR_STATS_SHM_SLOT_LISTENER,			//!< Socket managed by a network thread.
+	FR_STATS_SHM_SLOT_MODULE			//!< Module instance, as used by one worker thread.
+} fr_stats_shm_slot_type_t;
+
+/** Start of the segment
+ *
+ */
+typedef struct {
+	uint32_t		magic;			//!< FR_STATS_SHM_MAGIC.
+	uint32_t		version;		//!< FR_STATS_SHM_VERSION.
+	uint32_t		header_size;		//!< Offset of the first slot.
+	uint32_t		slot_size;		//!< Distance between slots.
+	uint32_t		num_slots;		//!< Number of slots in the segment.
+	uint32_t		pid;			//!< Of the server which created the segment.
+	uint64_t		started;		//!< Unix time (in nanoseconds) the segment was created.
+} fr_stats_shm_header_t;
+
+/** Statistics for one thread, listener, or module
+ *
+ * Slots are cache line aligned, so that threads updating their own
+ * slots don't contend with each other.
+ */
+typedef struct {
+	alignas(64) _Atomic(uint64_t) seq;		//!< Odd while the owner is updating the slot.
+	_Atomic(uint32_t)	type;			//!< fr_stats_shm_slot_type_t.
+	uint32_t		id;			//!< Thread or socket number.
+	char			name[FR_STATS_SHM_NAME_LEN];	//!< Human readable name.
+
+	uint64_t		updated;		//!< Unix time (in nanoseconds) of the last update.
+
+	fr_io_stats_t		stats;			//!< Packets in, out, duplicate, and dropped.
+							///< For modules, "in" is the number of calls.
+	uint64_t		active;			//!< Requests (worker), sockets (network), or
+							///< yielded calls (module) in progress.
+
+	fr_time_elapsed_t	cpu_time;		//!< Histogram of time spent running per request
+							///< (worker), or per call (module).  Measured with
+							///< the wall clock, so it includes time blocked.
+	fr_time_elapsed_t	wall_clock;		//!< Histogram of wall clock time per request (worker).
+	fr_time_elapsed_t	yield_time;		//!< Histogram of time spent yielded per call (module).
+} fr_stats_shm_slot_t;
+
+typedef struct fr_stats_shm_s fr_stats_shm_t;
+
+fr_stats_shm_t		*fr_stats_shm_create(TALLOC_CTX *ctx, char const *name, uint32_t num_slots,
+					     uid_t uid, gid_t gid) CC_HINT(nonnull(2));
+
+fr_stats_shm_slot_t	*fr_stats_shm_slot_alloc(fr_stats_shm_t *shm, fr_stats_shm_slot_type_t type,
+						 uint32_t id, char const *name) CC_HINT(nonnull);
+
+void			fr_stats_shm_slot_free(fr_stats_shm_slot_t *slot) CC_HINT(nonnull);
+
+/** Start updating a slot
+ *
+ * Only the thread which allocated the slot may update it.
+ */
+static inline void fr_stats_shm_slot_update_begin(fr_stats_shm_slot_t *slot)
+{
+	uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+
+	atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+/** Finish updating a slot
+ *
+ */
+static inline void fr_stats_shm_slot_update_end(fr_stats_shm_slot_t *slot)
+{
+	uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+
+	atomic_store_explicit(&slot->seq, seq + 1, memory_order_release);
+}
+
+/** Take a consistent copy of a slot
+ *
+ * For use by readers of the segment.
+ *
+ * @param[out] out	Where to write the copy.
+ * @param[in] slot	to copy.
+ * @param[in] tries	How many times to retry if the slot is being updated.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the slot was being updated on every attempt.
+ */
+static inline int fr_stats_shm_slot_read(fr_stats_shm_slot_t *out, fr_stats_shm_slot_t *slot, unsigned int tries)
+{
+	uint64_t seq;
+
+	while (tries-- > 0) {
+		seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		if (seq & 1) continue;
+
+		memcpy(out, slot, sizeof(*out));
+		atomic_thread_fence(memory_order_acquire);
+
+		if (atomic_load_explicit(&slot->seq, memory_order_relaxed) == seq) return 0;
+	}
+
+	return -1;
+}
+
+#ifdef __cplusplus
+}
+#endif
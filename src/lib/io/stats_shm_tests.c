@@ -0,0 +1,152 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for the statistics segment
+ *
+ * @file src/lib/io/stats_shm_tests.c
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+#include <freeradius-devel/util/acutest.h>
+
+#include <freeradius-devel/io/stats_shm.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static char const *segment_name(void)
+{
+	static char name[64];
+
+	snprintf(name, sizeof(name), "/fr_stats_shm_tests_%u", (unsigned int) getpid());
+
+	return name;
+}
+
+static void test_create(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	char const		*name = segment_name();
+	fr_stats_shm_t		*shm;
+	fr_stats_shm_header_t	*header;
+	struct stat		st;
+	int			fd;
+
+	shm = fr_stats_shm_create(ctx, name, 4, getuid(), getgid());
+	TEST_CHECK(shm != NULL);
+
+	/*
+	 *	Readers only need to open the segment read-only.
+	 */
+	fd = shm_open(name, O_RDONLY, 0);
+	TEST_CHECK(fd >= 0);
+	TEST_CHECK(fstat(fd, &st) == 0);
+	TEST_CHECK(st.st_uid == getuid());
+	TEST_CHECK(st.st_gid == getgid());
+	TEST_CHECK((st.st_mode & 0777) == (S_IRUSR | S_IWUSR | S_IRGRP));
+
+	header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	TEST_CHECK(header != MAP_FAILED);
+	close(fd);
+
+	TEST_CHECK(header->magic == FR_STATS_SHM_MAGIC);
+	TEST_CHECK(header->version == FR_STATS_SHM_VERSION);
+	TEST_CHECK(header->slot_size == sizeof(fr_stats_shm_slot_t));
+	TEST_CHECK(header->num_slots == 4);
+	TEST_CHECK(header->pid == (uint32_t) getpid());
+	TEST_CHECK(header->header_size + (header->num_slots * header->slot_size) <= (size_t) st.st_size);
+	munmap(header, st.st_size);
+
+	/*
+	 *	The segment is removed when the server exits.
+	 */
+	talloc_free(ctx);
+	TEST_CHECK(shm_open(name, O_RDONLY, 0) < 0);
+	TEST_CHECK(errno == ENOENT);
+}
+
+static void test_bad_name(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+
+	TEST_CHECK(fr_stats_shm_create(ctx, "no_slash", 4, (uid_t)-1, (gid_t)-1) == NULL);
+
+	talloc_free(ctx);
+}
+
+static void test_slots(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	fr_stats_shm_t		*shm;
+	fr_stats_shm_slot_t	*a, *b, *c, copy;
+
+	shm = fr_stats_shm_create(ctx, segment_name(), 2, (uid_t)-1, (gid_t)-1);
+	TEST_CHECK(shm != NULL);
+
+	a = fr_stats_shm_slot_alloc(shm, FR_STATS_SHM_SLOT_WORKER, 1, "worker 1");
+	TEST_CHECK(a != NULL);
+	b = fr_stats_shm_slot_alloc(shm, FR_STATS_SHM_SLOT_NETWORK, 2, "network 2");
+	TEST_CHECK(b != NULL);
+	TEST_CHECK(a != b);
+
+	/*
+	 *	All slots are in use.
+	 */
+	TEST_CHECK(fr_stats_shm_slot_alloc(shm, FR_STATS_SHM_SLOT_LISTENER, 3, "listener 3") == NULL);
+
+	fr_stats_shm_slot_update_begin(a);
+	a->stats.in = 10;
+	a->active = 3;
+	fr_stats_shm_slot_update_end(a);
+
+	TEST_CHECK(fr_stats_shm_slot_read(&copy, a, 1) == 0);
+	TEST_CHECK(copy.type == FR_STATS_SHM_SLOT_WORKER);
+	TEST_CHECK(copy.id == 1);
+	TEST_CHECK(strcmp(copy.name, "worker 1") == 0);
+	TEST_CHECK(copy.stats.in == 10);
+	TEST_CHECK(copy.active == 3);
+
+	/*
+	 *	Readers give up on slots which are being updated.
+	 */
+	fr_stats_shm_slot_update_begin(a);
+	TEST_CHECK(fr_stats_shm_slot_read(&copy, a, 3) < 0);
+	fr_stats_shm_slot_update_end(a);
+
+	/*
+	 *	Freed slots are cleared, and re-used.
+	 */
+	fr_stats_shm_slot_free(a);
+	TEST_CHECK(fr_stats_shm_slot_read(&copy, a, 1) == 0);
+	TEST_CHECK(copy.type == FR_STATS_SHM_SLOT_FREE);
+	TEST_CHECK(copy.stats.in == 0);
+	TEST_CHECK(copy.name[0] == '\0');
+
+	c = fr_stats_shm_slot_alloc(shm, FR_STATS_SHM_SLOT_LISTENER, 3, "listener 3");
+	TEST_CHECK(c == a);
+
+	talloc_free(ctx);
+}
+
+TEST_LIST = {
+	{ "stats_shm_create",		test_create },
+	{ "stats_shm_bad_name",		test_bad_name },
+	{ "stats_shm_slots",		test_slots },
+
+	{ NULL }
+};
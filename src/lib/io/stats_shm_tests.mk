@@ -0,0 +1,8 @@
+TARGET		:= stats_shm_tests
+
+SOURCES		:= stats_shm_tests.c
+
+TGT_LDLIBS	:= $(LIBS) $(GPERFTOOLS_LIBS)
+TGT_LDFLAGS	:= $(LDFLAGS) $(GPERFTOOLS_LDFLAGS)
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-unlang.a libfreeradius-io.a
@@ -57,6 +57,7 @@ RCSID("$Id$")
 #include <freeradius-devel/io/message.h>
 #include <freeradius-devel/io/time_tracking.h>
 #include <freeradius-devel/io/worker.h>
+#include <freeradius-devel/server/trace.h>
 #include <freeradius-devel/unlang/call.h>
 #include <freeradius-devel/unlang/interpret.h>
 #include <freeradius-devel/util/dlist.h>
@@ -542,6 +543,7 @@ static void worker_send_reply(fr_worker_t *worker, request_t *request, size_t si
 		ssize_t slen = 0;
 		fr_listen_t const *listen = request->async->listen;
 
+		FR_TRACE(request, FR_TRACE_ENCODE, FR_TRACE_BEGIN, listen->app->name);
 		if (listen->app->encode) {
 			slen = listen->app->encode(listen->app_instance, request,
 						   reply->m.data, reply->m.rb_size);
@@ -549,6 +551,7 @@ static void worker_send_reply(fr_worker_t *worker, request_t *request, size_t si
 			slen = listen->app_io->encode(listen->app_io_instance, request,
 						      reply->m.data, reply->m.rb_size);
 		}
+		FR_TRACE(request, FR_TRACE_ENCODE, FR_TRACE_END, listen->app->name);
 		if (slen < 0) {
 			RPERROR("Failed encoding request");
 			*reply->m.data = 0;
@@ -710,11 +713,14 @@ static void worker_request_bootstrap(fr_worker_t *worker, fr_channel_data_t *cd,
 	 *
 	 *	Note that this also sets the "async process" function.
 	 */
+	FR_TRACE(request, FR_TRACE_DISPATCH, FR_TRACE_BEGIN, cf_section_name2(listen->server_cs));
+	FR_TRACE(request, FR_TRACE_DECODE, FR_TRACE_BEGIN, listen->app->name);
 	if (listen->app->decode) {
 		ret = listen->app->decode(listen->app_instance, request, cd->m.data, cd->m.data_size);
 	} else if (listen->app_io->decode) {
 		ret = listen->app_io->decode(listen->app_io_instance, request, cd->m.data, cd->m.data_size);
 	}
+	FR_TRACE(request, FR_TRACE_DECODE, FR_TRACE_END, listen->app->name);
 
 	if (ret < 0) {
 		talloc_free(ctx);
@@ -879,6 +885,7 @@ void fr_worker_destroy(fr_worker_t *worker)
 	 *	Stop any new requests running with this interpreter
 	 */
 	unlang_interpret_set_thread_default(NULL);
+	unlang_interpret_stack_pool_reset();
 
 	/*
 	 *	Destroy all of the active requests.  These are ones
@@ -991,6 +998,7 @@ static void _worker_request_done_external(request_t *request, UNUSED rlm_rcode_t
 	}
 
 	worker_send_reply(worker, request, request->master_state == REQUEST_STOP_PROCESSING ? 1 : 0, now);
+	FR_TRACE(request, FR_TRACE_DISPATCH, FR_TRACE_END, cf_section_name2(request->async->listen->server_cs));
 	talloc_free(request);
 }
 
@@ -1305,6 +1313,7 @@ nomem:
 		goto fail;
 	}
 	unlang_interpret_set_thread_default(worker->intp);
+	unlang_interpret_stack_pool_reset();
 
 	return worker;
 }
@@ -1500,6 +1509,20 @@ int fr_worker_stats(fr_worker_t const *worker, int num, uint64_t *stats)
 	return 6;
 }
 
+/** Publish statistics for a worker
+ *
+ */
+void fr_worker_stats_publish(fr_worker_t const *worker, fr_stats_shm_slot_t *slot)
+{
+	fr_stats_shm_slot_update_begin(slot);
+	slot->updated = fr_time_to_unix_time(fr_time());
+	slot->stats = worker->stats;
+	slot->active = worker->num_active;
+	slot->cpu_time = worker->cpu_time;
+	slot->wall_clock = worker->wall_clock;
+	fr_stats_shm_slot_update_end(slot);
+}
+
 static int cmd_stats_worker(FILE *fp, UNUSED FILE *fp_err, void *ctx, fr_cmd_info_t const *info)
 {
 	fr_worker_t const *worker = ctx;
@@ -1533,6 +1556,10 @@ static int cmd_stats_worker(FILE *fp, UNUSED FILE *fp_err, void *ctx, fr_cmd_inf
 		fr_time_elapsed_fprint(fp, &worker->wall_clock, "time.requests", 4);
 	}
 
+	if ((info->argc == 0) || (strcmp(info->argv[0], "section") == 0)) {
+		unlang_interpret_section_stats_fprint(fp, worker->intp);
+	}
+
 	return 0;
 }
 
@@ -1548,7 +1575,7 @@ fr_cmd_table_t cmd_worker_table[] = {
 		.parent = "stats worker",
 		.add_name = true,
 		.name = "self",
-		.syntax = "[(count|cpu)]",
+		.syntax = "[(count|cpu|section)]",
 		.func = cmd_stats_worker,
 		.help = "Show statistics for a specific worker thread.",
 		.read_only = true
@@ -42,6 +42,7 @@ typedef struct fr_worker_s fr_worker_t;
 #endif
 
 #include <freeradius-devel/io/base.h>
+#include <freeradius-devel/io/stats_shm.h>
 #include <freeradius-devel/server/command.h>
 #include <freeradius-devel/util/event.h>
 #include <freeradius-devel/util/heap.h>
@@ -85,6 +86,8 @@ fr_channel_t	*fr_worker_channel_create(fr_worker_t *worker, TALLOC_CTX *ctx, fr_
 
 int		fr_worker_stats(fr_worker_t const *worker, int num, uint64_t *stats) CC_HINT(nonnull);
 
+void		fr_worker_stats_publish(fr_worker_t const *worker, fr_stats_shm_slot_t *slot) CC_HINT(nonnull);
+
 #include <freeradius-devel/server/module.h>
 
 int		fr_worker_subrequest_add(request_t *request) CC_HINT(nonnull);
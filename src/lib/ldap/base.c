@@ -35,6 +35,7 @@ USES_APPLE_DEPRECATED_API
 
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/ldap/base.h>
+#include <freeradius-devel/unlang/base.h>
 
 LDAP *ldap_global_handle;			//!< Hack for OpenLDAP libldap global initialisation.
 
@@ -767,6 +768,106 @@ fr_ldap_rcode_t fr_ldap_search_async(int *msgid, request_t *request,
 	return LDAP_PROC_SUCCESS;
 }
 
+/** Release any resources held by a trunked query
+ *
+ * If the query is still outstanding, the trunk request is cancelled,
+ * which will cause the server to abandon the search.
+ */
+static int _ldap_query_free(fr_ldap_query_t *query)
+{
+	if (query->treq) fr_trunk_request_signal_cancel(query->treq);
+	if (query->ldap_conn) fr_dlist_remove(&query->ldap_conn->completed, query);
+	if (query->result) ldap_msgfree(query->result);
+
+	return 0;
+}
+
+/** The server didn't respond to a trunked query in time
+ *
+ */
+static void _ldap_query_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	fr_ldap_query_t	*query = talloc_get_type_abort(uctx, fr_ldap_query_t);
+	request_t	*request = query->request;
+
+	REDEBUG("Timeout waiting for search result");
+
+	query->ret = LDAP_PROC_TIMEOUT;
+	if (query->treq) {
+		fr_trunk_request_signal_cancel(query->treq);
+		query->treq = NULL;
+	}
+
+	unlang_interpret_mark_runnable(request);
+}
+
+/** Search for something in the LDAP directory using a trunked connection
+ *
+ * The search is queued on the thread's trunk, and will be multiplexed onto
+ * whichever connection has capacity.  The caller should yield, and will
+ * be resumed when the search completes, fails or times out.  The result
+ * is then available in the returned query, and should be parsed with the
+ * handle of query->ldap_conn, the connection which received it.
+ *
+ * Searches are always performed as the admin user.
+ *
+ * @param[in] ctx		to allocate the query in.  Freeing the query
+ *				before it completes cancels the search.
+ * @param[in] request		Current request.
+ * @param[in] ttrunk		to enqueue the search on.
+ * @param[in] base_dn		to use as base for the search.
+ * @param[in] scope		to use (LDAP_SCOPE_BASE, LDAP_SCOPE_ONE, LDAP_SCOPE_SUB).
+ * @param[in] filter		to use, should be pre-escaped.
+ * @param[in] attrs		to retrieve.  Must remain valid until the query completes.
+ * @param[in] serverctrls	Search controls to pass to the server.  May be NULL.
+ * @param[in] clientctrls	Search controls for ldap_search.  May be NULL.
+ * @return
+ *	- A new query on success.
+ *	- NULL if the search could not be enqueued.
+ */
+fr_ldap_query_t *fr_ldap_trunk_search(TALLOC_CTX *ctx, request_t *request, fr_ldap_thread_trunk_t *ttrunk,
+				      char const *base_dn, int scope, char const *filter, char const * const *attrs,
+				      LDAPControl **serverctrls, LDAPControl **clientctrls)
+{
+	fr_ldap_query_t	*query;
+	size_t		i;
+
+	MEM(query = talloc_zero(ctx, fr_ldap_query_t));
+	query->request = request;
+	query->base_dn = talloc_strdup(query, base_dn);
+	query->scope = scope;
+	if (filter) query->filter = talloc_strdup(query, filter);
+	query->attrs = attrs;
+
+	/*
+	 *	Leave space for the NULL terminator
+	 */
+	if (serverctrls) for (i = 0; serverctrls[i] && (i < (LDAP_MAX_CONTROLS - 1)); i++) {
+		query->serverctrls[i] = serverctrls[i];
+	}
+	if (clientctrls) for (i = 0; clientctrls[i] && (i < (LDAP_MAX_CONTROLS - 1)); i++) {
+		query->clientctrls[i] = clientctrls[i];
+	}
+
+	if (fr_trunk_request_enqueue(&query->treq, ttrunk->trunk, request, query, NULL) < 0) {
+		REDEBUG("Unable to enqueue LDAP search");
+		fr_trunk_request_free(&query->treq);
+		talloc_free(query);
+		return NULL;
+	}
+	talloc_set_destructor(query, _ldap_query_free);
+
+	if (ttrunk->config->res_timeout &&
+	    (fr_event_timer_in(query, ttrunk->el, &query->ev, ttrunk->config->res_timeout,
+			       _ldap_query_timeout, query) < 0)) {
+		RPEDEBUG("Failed inserting search timeout");
+		talloc_free(query);
+		return NULL;
+	}
+
+	return query;
+}
+
 /** Modify something in the LDAP directory
  *
  * Binds as the administrative user and attempts to modify an LDAP object.
@@ -12,6 +12,7 @@
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/connection.h>
 #include <freeradius-devel/server/map.h>
+#include <freeradius-devel/server/trunk.h>
 
 #define LDAP_DEPRECATED 0	/* Quiet warnings about LDAP_DEPRECATED not being defined */
 
@@ -302,6 +303,11 @@ typedef struct {
 
 	fr_ldap_state_t		state;			//!< LDAP connection state machine.
 
+	fr_rb_tree_t		*queries;		//!< Outstanding queries, keyed by msgid.
+							///< Only used when the connection is part of a trunk.
+	fr_dlist_head_t		completed;		//!< Completed queries whose results haven't been freed.
+							///< Only used when the connection is part of a trunk.
+
 	void			*uctx;			//!< User data associated with the handle.
 } fr_ldap_connection_t;
 
@@ -354,6 +360,47 @@ typedef enum {
 							//!< exit, and retry the operation with a NULL cookie.
 } fr_ldap_rcode_t;
 
+/** A search multiplexed over a trunked LDAP connection
+ *
+ * Allocated in the context of the request, so if the request is freed
+ * before the search completes, the trunk request is cancelled and any
+ * result is released.
+ */
+typedef struct {
+	fr_rb_node_t		node;			//!< Entry in the connection's tree of outstanding queries.
+	fr_dlist_t		entry;			//!< Entry in the connection's list of completed queries.
+	int			msgid;			//!< libldap message ID of the search.
+
+	request_t		*request;		//!< The request this query was issued for.
+	fr_trunk_request_t	*treq;			//!< Trunk request, NULL once the query has completed.
+	fr_ldap_connection_t	*ldap_conn;		//!< Connection the search was sent on.  Once the
+							///< search completes, this is the connection the
+							///< result should be parsed with, or NULL if that
+							///< connection has since been closed.
+
+	char const		*base_dn;		//!< To start the search at.
+	int			scope;			//!< Search scope, one of the LDAP_SCOPE_* values.
+	char const		*filter;		//!< Search filter.
+	char const * const	*attrs;			//!< Attributes to retrieve.
+
+	LDAPControl		*serverctrls[LDAP_MAX_CONTROLS];	//!< Extra server controls for this search.
+	LDAPControl		*clientctrls[LDAP_MAX_CONTROLS];	//!< Extra client controls for this search.
+
+	LDAPMessage		*result;		//!< Entries returned by the server.
+	fr_ldap_rcode_t		ret;			//!< Result code of the search.
+
+	fr_event_timer_t const	*ev;			//!< Fires if the server doesn't respond in time.
+} fr_ldap_query_t;
+
+/** Per-thread trunk of LDAP connections
+ *
+ */
+typedef struct {
+	fr_trunk_t		*trunk;			//!< Connections used to run searches.
+	fr_ldap_config_t const	*config;		//!< Connection configuration.
+	fr_event_list_t		*el;			//!< Event list the trunk runs in.
+} fr_ldap_thread_trunk_t;
+
 /*
  *	Tables for resolving strings to LDAP constants
  */
@@ -417,6 +464,10 @@ fr_ldap_rcode_t	fr_ldap_search_async(int *msgid, request_t *request,
 				     char const *dn, int scope, char const *filter, char const * const *attrs,
 				     LDAPControl **serverctrls, LDAPControl **clientctrls);
 
+fr_ldap_query_t	*fr_ldap_trunk_search(TALLOC_CTX *ctx, request_t *request, fr_ldap_thread_trunk_t *ttrunk,
+				     char const *base_dn, int scope, char const *filter, char const * const *attrs,
+				     LDAPControl **serverctrls, LDAPControl **clientctrls);
+
 fr_ldap_rcode_t	fr_ldap_modify(request_t *request, fr_ldap_connection_t **pconn,
 			       char const *dn, LDAPMod *mods[],
 			       LDAPControl **serverctrls, LDAPControl **clientctrls);
@@ -505,6 +556,10 @@ int		fr_ldap_connection_timeout_set(fr_ldap_connection_t const *conn, fr_time_de
 
 int		fr_ldap_connection_timeout_reset(fr_ldap_connection_t const *conn);
 
+fr_ldap_thread_trunk_t *fr_ldap_trunk_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
+					    fr_ldap_config_t const *config, fr_trunk_conf_t const *trunk_conf,
+					    char const *log_prefix);
+
 /*
  *	state.c - Connection state machine
  */
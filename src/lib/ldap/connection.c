@@ -26,7 +26,9 @@ RCSID("$Id$")
 USES_APPLE_DEPRECATED_API
 
 #include <freeradius-devel/ldap/base.h>
+#include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/syserror.h>
 
 #if LDAP_SET_REBIND_PROC_ARGS == 3
 /** Callback for OpenLDAP to rebind and chase referrals
@@ -334,6 +336,14 @@ static void _ldap_connection_close(UNUSED fr_event_list_t *el, void *h, UNUSED v
  */
 static int _ldap_connection_free(fr_ldap_connection_t *c)
 {
+	fr_ldap_query_t	*query;
+
+	/*
+	 *	Results which haven't been processed yet
+	 *	can't be parsed with this handle any more.
+	 */
+	if (c->queries) while ((query = fr_dlist_pop_head(&c->completed))) query->ldap_conn = NULL;
+
 	talloc_free_children(c);	/* Force inverted free order */
 
 	fr_ldap_control_clear(c);
@@ -360,6 +370,16 @@ static int _ldap_connection_free(fr_ldap_connection_t *c)
 	return 0;
 }
 
+/** Compare two outstanding queries by message ID
+ *
+ */
+static int8_t ldap_query_cmp(void const *one, void const *two)
+{
+	fr_ldap_query_t const *a = one, *b = two;
+
+	return CMP(a->msgid, b->msgid);
+}
+
 /** Allocate our ldap connection handle layer
  *
  * This is using handles outside of the connection state machine.
@@ -436,6 +456,9 @@ static fr_connection_state_t _ldap_connection_init(void **h, fr_connection_t *co
 	fr_ldap_state_t		state;
 
 	c = fr_ldap_connection_alloc(conn);
+	c->conn = conn;
+	MEM(c->queries = fr_rb_inline_talloc_alloc(c, fr_ldap_query_t, node, ldap_query_cmp, NULL));
+	fr_dlist_init(&c->completed, fr_ldap_query_t, entry);
 
 	/*
 	 *	Configure/allocate the libldap handle
@@ -531,3 +554,390 @@ int fr_ldap_connection_timeout_reset(fr_ldap_connection_t const *c)
 error:
 	return -1;
 }
+
+/** Allocate a new LDAP connection for a trunk
+ *
+ * @param[in] tconn		The trunk connection this connection will be bound to.
+ * @param[in] el		to insert I/O and timer callbacks into.
+ * @param[in] conf		Connection configuration from the trunk.
+ * @param[in] log_prefix	to prepend to connection state messages.
+ * @param[in] uctx		Our #fr_ldap_thread_trunk_t.
+ * @return
+ *	- A new connection on success.
+ *	- NULL on failure.
+ */
+static fr_connection_t *ldap_trunk_connection_alloc(fr_trunk_connection_t *tconn, fr_event_list_t *el,
+						    fr_connection_conf_t const *conf,
+						    char const *log_prefix, void *uctx)
+{
+	fr_ldap_thread_trunk_t	*ttrunk = talloc_get_type_abort(uctx, fr_ldap_thread_trunk_t);
+
+	return fr_connection_alloc(tconn, el,
+				   &(fr_connection_funcs_t){
+				   	.init = _ldap_connection_init,
+				   	.close = _ldap_connection_close
+				   },
+				   conf, log_prefix, ttrunk->config);
+}
+
+/** Signal the trunk that there are responses to read
+ *
+ */
+static void _ldap_trunk_io_read(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+
+	fr_trunk_connection_signal_readable(tconn);
+}
+
+/** Signal the trunk that more searches can be written
+ *
+ */
+static void _ldap_trunk_io_write(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+
+	fr_trunk_connection_signal_writable(tconn);
+}
+
+/** Error reading from or writing to the file descriptor
+ *
+ */
+static void _ldap_trunk_io_error(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags,
+				 int fd_errno, void *uctx)
+{
+	fr_trunk_connection_t	*tconn = talloc_get_type_abort(uctx, fr_trunk_connection_t);
+
+	ERROR("%s - Connection failed: %s", tconn->conn->log_prefix, fr_syserror(fd_errno));
+
+	fr_connection_signal_reconnect(tconn->conn, FR_CONNECTION_FAILED);
+}
+
+/** Change which I/O events we're interested in for a trunked connection
+ *
+ * We always listen for reads, even when there are no outstanding searches,
+ * so that unsolicited notifications (such as a notice of disconnection)
+ * are processed promptly.
+ */
+static void ldap_trunk_connection_notify(fr_trunk_connection_t *tconn, fr_connection_t *conn,
+					 fr_event_list_t *el,
+					 fr_trunk_connection_event_t notify_on, UNUSED void *uctx)
+{
+	fr_ldap_connection_t	*c = talloc_get_type_abort(conn->h, fr_ldap_connection_t);
+	fr_event_fd_cb_t	write_fn = NULL;
+	int			fd = -1;
+
+	switch (notify_on) {
+	case FR_TRUNK_CONN_EVENT_NONE:
+	case FR_TRUNK_CONN_EVENT_READ:
+		break;
+
+	case FR_TRUNK_CONN_EVENT_WRITE:
+	case FR_TRUNK_CONN_EVENT_BOTH:
+		write_fn = _ldap_trunk_io_write;
+		break;
+	}
+
+	if ((ldap_get_option(c->handle, LDAP_OPT_DESC, &fd) != LDAP_OPT_SUCCESS) || (fd < 0) ||
+	    (fr_event_fd_insert(c, el, fd,
+				_ldap_trunk_io_read,
+				write_fn,
+				_ldap_trunk_io_error,
+				tconn) < 0)) {
+		PERROR("%s - Failed inserting FD event", conn->log_prefix);
+
+		/*
+		 *	May free the connection!
+		 */
+		fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+	}
+}
+
+/** Write as many pending searches as we can to the connection
+ *
+ * libldap buffers the encoded search internally, so once ldap_search_ext
+ * returns the search is considered sent.
+ */
+static void ldap_trunk_request_mux(UNUSED fr_event_list_t *el,
+				   fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+{
+	fr_ldap_connection_t	*c = talloc_get_type_abort(conn->h, fr_ldap_connection_t);
+	fr_trunk_request_t	*treq;
+
+	LDAPControl		*our_serverctrls[LDAP_MAX_CONTROLS];
+	LDAPControl		*our_clientctrls[LDAP_MAX_CONTROLS];
+
+	/*
+	 *	A referral caused the handle to be bound as
+	 *	someone else.  All searches must be performed
+	 *	as the admin user, so get a new connection.
+	 */
+	if (c->rebound) {
+		fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+		return;
+	}
+
+	while (fr_trunk_connection_pop_request(&treq, tconn) == 0) {
+		fr_ldap_query_t	*query = talloc_get_type_abort(treq->preq, fr_ldap_query_t);
+		request_t	*request = treq->request;
+		char		**search_attrs;
+		int		ret;
+
+		fr_ldap_control_merge(our_serverctrls, our_clientctrls,
+				      NUM_ELEMENTS(our_serverctrls),
+				      NUM_ELEMENTS(our_clientctrls),
+				      c, query->serverctrls, query->clientctrls);
+
+		/*
+		 *	OpenLDAP library doesn't declare attrs array as const, but
+		 *	it really should be *sigh*.
+		 */
+		memcpy(&search_attrs, &query->attrs, sizeof(search_attrs));
+
+		if (query->filter) {
+			ROPTIONAL(RDEBUG2, DEBUG2, "Performing search in \"%s\" with filter \"%s\", scope \"%s\"",
+				  query->base_dn, query->filter,
+				  fr_table_str_by_value(fr_ldap_scope, query->scope, "<INVALID>"));
+		} else {
+			ROPTIONAL(RDEBUG2, DEBUG2, "Performing unfiltered search in \"%s\", scope \"%s\"",
+				  query->base_dn, fr_table_str_by_value(fr_ldap_scope, query->scope, "<INVALID>"));
+		}
+
+		ret = ldap_search_ext(c->handle, query->base_dn, query->scope, query->filter, search_attrs,
+				      0, our_serverctrls, our_clientctrls, NULL, 0, &query->msgid);
+		switch (ret) {
+		case LDAP_SUCCESS:
+			break;
+
+		/*
+		 *	The connection is unusable.  The search is
+		 *	still pending, and will be requeued on
+		 *	another connection.
+		 */
+		case LDAP_SERVER_DOWN:
+		case LDAP_TIMEOUT:
+		case LDAP_CONNECT_ERROR:
+			ERROR("%s - Failed performing search: %s", conn->log_prefix, ldap_err2string(ret));
+			fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+			return;
+
+		default:
+			ROPTIONAL(REDEBUG, ERROR, "Failed performing search: %s", ldap_err2string(ret));
+			fr_trunk_request_signal_fail(treq);
+			continue;
+		}
+
+		query->ldap_conn = c;
+		if (!fr_cond_assert(fr_rb_insert(c->queries, query))) {
+			ldap_abandon_ext(c->handle, query->msgid, NULL, NULL);
+			fr_trunk_request_signal_fail(treq);
+			continue;
+		}
+
+		fr_trunk_request_signal_sent(treq);
+	}
+}
+
+/** Read all complete responses from the connection, and match them with their queries
+ *
+ */
+static void ldap_trunk_request_demux(fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+{
+	fr_ldap_connection_t	*c = talloc_get_type_abort(conn->h, fr_ldap_connection_t);
+	struct timeval		poll = { 0, 0 };
+
+	for (;;) {
+		LDAPMessage	*result = NULL, *msg;
+		fr_ldap_query_t	*query;
+		request_t	*request;
+		fr_ldap_rcode_t	status = LDAP_PROC_SUCCESS;
+		int		ret, count;
+
+		ret = ldap_result(c->handle, LDAP_RES_ANY, LDAP_MSG_ALL, &poll, &result);
+		switch (ret) {
+		case 0:		/* Nothing more to read */
+			return;
+
+		case -1:
+			PERROR("%s - Failed reading results: %s", conn->log_prefix, fr_ldap_error_str(c));
+			fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+			return;
+
+		default:
+			break;
+		}
+
+		/*
+		 *	Unsolicited notifications are sent with a
+		 *	message ID of zero, and mean the server is
+		 *	about to close the connection.
+		 */
+		if (ldap_msgid(result) == 0) {
+			WARN("%s - Received unsolicited notification, reconnecting", conn->log_prefix);
+			ldap_msgfree(result);
+			fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+			return;
+		}
+
+		query = fr_rb_remove(c->queries, &(fr_ldap_query_t){ .msgid = ldap_msgid(result) });
+		if (!query) {
+			DEBUG2("%s - Ignoring result for unknown message ID %i", conn->log_prefix, ldap_msgid(result));
+			ldap_msgfree(result);
+			continue;
+		}
+		request = query->request;
+
+		for (msg = ldap_first_message(c->handle, result);
+		     msg;
+		     msg = ldap_next_message(c->handle, msg)) {
+			status = fr_ldap_error_check(NULL, c, msg, query->base_dn);
+			if (status != LDAP_PROC_SUCCESS) break;
+		}
+
+		switch (status) {
+		case LDAP_PROC_SUCCESS:
+			count = ldap_count_entries(c->handle, result);
+			if (count < 0) {
+				REDEBUG("Error counting results: %s", fr_ldap_error_str(c));
+				status = LDAP_PROC_ERROR;
+			} else if (count == 0) {
+				RDEBUG2("Search returned no results");
+				status = LDAP_PROC_NO_RESULT;
+			}
+			break;
+
+		case LDAP_PROC_BAD_DN:
+			RPDEBUG("Failed performing search");
+			break;
+
+		default:
+			RPERROR("Failed performing search");
+			break;
+		}
+
+		if (status == LDAP_PROC_SUCCESS) {
+			query->result = result;
+		} else {
+			ldap_msgfree(result);
+		}
+		query->ret = status;
+
+		fr_trunk_request_signal_complete(query->treq);
+
+		/*
+		 *	The server has gone away, any other outstanding
+		 *	queries will be requeued.
+		 */
+		if (status == LDAP_PROC_BAD_CONN) {
+			fr_trunk_connection_signal_reconnect(tconn, FR_CONNECTION_FAILED);
+			return;
+		}
+	}
+}
+
+/** Remove a sent query from the connection's tracking tree
+ *
+ * If the query was cancelled because the request no longer needs the
+ * result, tell the server to stop processing it.
+ */
+static void ldap_trunk_request_cancel(UNUSED fr_connection_t *conn, void *preq,
+				      fr_trunk_cancel_reason_t reason, UNUSED void *uctx)
+{
+	fr_ldap_query_t		*query = talloc_get_type_abort(preq, fr_ldap_query_t);
+	fr_ldap_connection_t	*c = query->ldap_conn;
+
+	if (!c) return;
+
+	fr_rb_remove(c->queries, query);
+	if (reason == FR_TRUNK_CANCEL_REASON_SIGNAL) ldap_abandon_ext(c->handle, query->msgid, NULL, NULL);
+
+	query->ldap_conn = NULL;
+	query->msgid = 0;
+}
+
+/** Record that the query completed, and resume the request
+ *
+ * The query keeps a pointer to the connection that received the result,
+ * so that the result is parsed with the same libldap handle.
+ */
+static void ldap_trunk_request_complete(request_t *request, void *preq, UNUSED void *rctx, UNUSED void *uctx)
+{
+	fr_ldap_query_t		*query = talloc_get_type_abort(preq, fr_ldap_query_t);
+
+	query->treq = NULL;
+	if (query->ldap_conn) fr_dlist_insert_tail(&query->ldap_conn->completed, query);
+	fr_event_timer_delete(&query->ev);
+
+	unlang_interpret_mark_runnable(request);
+}
+
+/** Record that the query failed, and resume the request
+ *
+ */
+static void ldap_trunk_request_fail(request_t *request, void *preq, UNUSED void *rctx,
+				    UNUSED fr_trunk_request_state_t state, UNUSED void *uctx)
+{
+	fr_ldap_query_t		*query = talloc_get_type_abort(preq, fr_ldap_query_t);
+
+	query->treq = NULL;
+	query->ldap_conn = NULL;
+	query->ret = LDAP_PROC_ERROR;
+	fr_event_timer_delete(&query->ev);
+
+	unlang_interpret_mark_runnable(request);
+}
+
+/** Allocate a trunk of LDAP connections for a worker thread
+ *
+ * Searches submitted with #fr_ldap_trunk_search are written to whichever
+ * connection in the trunk is least loaded, so many searches can be
+ * outstanding on a single connection at once.
+ *
+ * @param[in] ctx		to allocate the trunk in.
+ * @param[in] el		to insert I/O and timer callbacks into.
+ * @param[in] config		to use to bind the connections to an LDAP server.
+ * @param[in] trunk_conf	controlling how many connections are opened, and
+ *				how many searches may be outstanding on each.
+ * @param[in] log_prefix	to prepend to connection state messages.
+ * @return
+ *	- A new trunk on success.
+ *	- NULL on failure.
+ */
+fr_ldap_thread_trunk_t *fr_ldap_trunk_alloc(TALLOC_CTX *ctx, fr_event_list_t *el,
+					    fr_ldap_config_t const *config, fr_trunk_conf_t const *trunk_conf,
+					    char const *log_prefix)
+{
+	fr_ldap_thread_trunk_t	*ttrunk;
+	fr_ldap_config_t	*conn_config;
+
+	MEM(ttrunk = talloc_zero(ctx, fr_ldap_thread_trunk_t));
+
+	/*
+	 *	Module instances embed their config, so take a
+	 *	typed copy for _ldap_connection_init to check.
+	 *	Strings are still owned by the instance, which
+	 *	outlives the thread.
+	 */
+	MEM(conn_config = talloc_memdup(ttrunk, config, sizeof(*config)));
+	talloc_set_type(conn_config, fr_ldap_config_t);
+	ttrunk->config = conn_config;
+	ttrunk->el = el;
+
+	ttrunk->trunk = fr_trunk_alloc(ttrunk, el,
+				       &(fr_trunk_io_funcs_t){
+				       		.connection_alloc = ldap_trunk_connection_alloc,
+				       		.connection_notify = ldap_trunk_connection_notify,
+				       		.request_mux = ldap_trunk_request_mux,
+				       		.request_demux = ldap_trunk_request_demux,
+				       		.request_cancel = ldap_trunk_request_cancel,
+				       		.request_complete = ldap_trunk_request_complete,
+				       		.request_fail = ldap_trunk_request_fail
+				       },
+				       trunk_conf, log_prefix, ttrunk, false);
+	if (!ttrunk->trunk) {
+		talloc_free(ttrunk);
+		return NULL;
+	}
+
+	return ttrunk;
+}
@@ -85,9 +85,18 @@
  *   indexes in the fr_redis_cluster_t.node array.  We use 8bit unsigned integers instead of
  *   pointers to save space.  Using pointers, the node[] array would need 784K, using IDs
  *   it uses 112K.  Still not light on memory, but a bit more acceptable.
- *   Currently the key_slot array is shadowed by key_slot_pending, used to stage new key_slot
- *   mappings.  This doubles the memory used.  We may want to consider allocating key_slot_pending
- *   only during remappings and freeing it after.
+ *
+ *   The key_slot array lives in an immutable #cluster_slot_map_t snapshot.  Workers never
+ *   take the cluster mutex to resolve a key slot to a node.  A remap builds a new snapshot,
+ *   and publishes it with an atomic pointer swap.
+ *
+ *   Each thread which reads snapshots has its own reader record in the cluster.  Before
+ *   loading the snapshot pointer a reader writes the current epoch into its record, and
+ *   clears it when done, so readers never write to memory shared with other threads.
+ *   The publisher advances the epoch after the swap, and puts the replaced snapshot on a
+ *   retired list.  Retired snapshots are freed once no reader record holds an epoch from
+ *   before they were replaced.  Nothing waits for readers, snapshots which are still in
+ *   use are checked again on the next publish, and freed with the cluster at the latest.
  *
  * Mapping/Remapping the cluster
  * -----------------------------
@@ -103,9 +112,9 @@
  *     4. Connecting to nodes that were in the result, but not in the tree.
  *        Note: If we can't connect to any of the masters, we count the map as invalid, roll
  *        back any newly connected nodes, and error out. Slave failure is OK.
- *     5. Mapping keyslot ranges to nodes in the key_slot_pending array.
+ *     5. Mapping keyslot ranges to nodes in a new slot map snapshot.
  *     6. Verifying there are no holes in the ranges (if there are, we roll back and error out).
- *     7. Applying the new keyslot ranges.
+ *     7. Publishing the new snapshot.
  *     8. Removing nodes no longer used by the key slots, and adding them back to the free
  *        nodes queue.
  *
@@ -128,7 +137,9 @@
  *
  *   The code treats '-ASK' (temporary redirect) and '-MOVE' (permanent redirect) responses
  *   similarly.  If the node is known, then a connection is reserved from its pool, if the node
- *   is not known, a new pool is established, and a connection reserved.
+ *   is not known, a new pool is established, and a connection reserved.  Nodes in the current
+ *   slot map snapshot are found without locking, the cluster mutex is only needed when the
+ *   redirect is to a node outside of it.
  *
  *   The difference between '-ASK' and '-MOVE' is that '-MOVE' attempts a cluster remap before
  *   following the redirect.
@@ -157,11 +168,18 @@
 #include "cluster.h"
 #include "crc16.h"
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
 #define KEY_SLOTS		16384			//!< Maximum number of keyslots (should not change).
 
 #define MAX_SLAVES		5			//!< Maximum number of slaves associated
 							//!< with a keyslot.
 
+
 /*
  *	Periods and weights for live node selection
  */
@@ -233,6 +251,38 @@ struct fr_redis_cluster_key_slot_s {
 	uint8_t			master;			//!< R/W node (master) for this key slot.
 };
 
+/** An immutable snapshot of the key slot to node mappings
+ *
+ * Never modified after it's been published, a remap allocates a new one.
+ */
+typedef struct cluster_slot_map_s cluster_slot_map_t;
+
+struct cluster_slot_map_s {
+	fr_redis_cluster_key_slot_t	key_slot[KEY_SLOTS];	//!< Lookup table of slots to pools.
+	bool			single_slot;		//!< Every key slot maps to the same nodes, so
+							//!< keys don't need hashing.
+
+	uint64_t		retired;		//!< Epoch in which the map was replaced.
+	cluster_slot_map_t	*next_retired;		//!< Next map waiting to be freed.
+};
+
+typedef _Atomic(cluster_slot_map_t *) cluster_slot_map_ptr_t;
+
+typedef struct cluster_slot_map_reader_s cluster_slot_map_reader_t;
+
+/** Tracks which key slot map a thread may be reading
+ *
+ * One per thread which reads the key slot map, and only ever written by that thread.
+ */
+struct cluster_slot_map_reader_s {
+	atomic_uint_fast64_t	epoch;			//!< The thread started reading in, or 0 if it's
+							//!< not reading.
+	pthread_t		owner;			//!< Thread the record belongs to.
+	cluster_slot_map_reader_t *next;		//!< Next reader in the cluster.
+};
+
+typedef _Atomic(cluster_slot_map_reader_t *) cluster_slot_map_reader_ptr_t;
+
 /** A redis cluster
  *
  * Holds all the structures and collections of nodes, to represent a Redis cluster.
@@ -258,8 +308,11 @@ struct fr_redis_cluster {
 	fr_fifo_t		*free_nodes;		//!< Queue of free nodes (or nodes waiting to be reused).
 	fr_rb_tree_t		*used_nodes;		//!< Tree of used nodes.
 
-	fr_redis_cluster_key_slot_t	key_slot[KEY_SLOTS];		//!< Lookup table of slots to pools.
-	fr_redis_cluster_key_slot_t	key_slot_pending[KEY_SLOTS];	//!< Pending key slot table.
+	uint64_t		id;			//!< Identifies the cluster to per-thread reader caches.
+	cluster_slot_map_ptr_t	slot_map;		//!< Current key slot map.  Read without locking.
+	atomic_uint_fast64_t	slot_map_epoch;		//!< Advanced each time the key slot map is replaced.
+	cluster_slot_map_reader_ptr_t slot_map_readers;	//!< One per thread reading the key slot map.
+	cluster_slot_map_t	*slot_map_retired;	//!< Replaced maps which may still be being read.
 
 	pthread_mutex_t		mutex;			//!< Mutex to synchronise cluster operations.
 };
@@ -273,6 +326,169 @@ fr_table_num_sorted_t const fr_redis_cluster_rcodes_table[] = {
 };
 size_t fr_redis_cluster_rcodes_table_len = NUM_ELEMENTS(fr_redis_cluster_rcodes_table);
 
+#define SLOT_MAP_READER_CACHE_SIZE	4
+
+/** The reader records this thread used most recently, by cluster id
+ *
+ * Cluster ids are never reused, so entries for freed clusters never match.
+ */
+static _Thread_local struct {
+	uint64_t			id;
+	cluster_slot_map_reader_t	*reader;
+} slot_map_reader_cache[SLOT_MAP_READER_CACHE_SIZE];
+
+/** Find or add the calling thread's reader record for a cluster
+ *
+ * Records are only added, never removed, until the cluster is freed, so the
+ * list can be walked and extended without locking.
+ *
+ * @param[in] cluster	to get the reader record for.
+ * @return the reader record.
+ */
+static cluster_slot_map_reader_t *cluster_slot_map_reader(fr_redis_cluster_t *cluster)
+{
+	unsigned int			i = cluster->id & (SLOT_MAP_READER_CACHE_SIZE - 1);
+	cluster_slot_map_reader_t	*reader, *head;
+	pthread_t			self;
+
+	if (likely(slot_map_reader_cache[i].id == cluster->id)) return slot_map_reader_cache[i].reader;
+
+	self = pthread_self();
+	head = atomic_load_explicit(&cluster->slot_map_readers, memory_order_acquire);
+	for (reader = head; reader; reader = reader->next) {
+		if (pthread_equal(reader->owner, self)) goto done;
+	}
+
+	MEM(reader = talloc_zero(NULL, cluster_slot_map_reader_t));
+	reader->owner = self;
+	atomic_init(&reader->epoch, 0);
+
+	do {
+		reader->next = head;
+	} while (!atomic_compare_exchange_weak_explicit(&cluster->slot_map_readers, &head, reader,
+							memory_order_release, memory_order_acquire));
+
+done:
+	slot_map_reader_cache[i].id = cluster->id;
+	slot_map_reader_cache[i].reader = reader;
+
+	return reader;
+}
+
+/** Start reading the current key slot map
+ *
+ * The map remains valid until #cluster_slot_map_release is called, which
+ * should be done as soon as whatever is needed has been copied out of it.
+ *
+ * @param[in] cluster	to get the map for.
+ * @param[out] reader	to pass to #cluster_slot_map_release.
+ * @return the current map.
+ */
+static inline CC_HINT(always_inline) cluster_slot_map_t *cluster_slot_map_acquire(fr_redis_cluster_t *cluster,
+										   cluster_slot_map_reader_t **reader)
+{
+	cluster_slot_map_reader_t *our_reader = cluster_slot_map_reader(cluster);
+
+	/*
+	 *	Both sequentially consistent, so either the
+	 *	publisher sees our epoch, or we see its map.
+	 */
+	atomic_store(&our_reader->epoch, atomic_load(&cluster->slot_map_epoch));
+	*reader = our_reader;
+
+	return atomic_load(&cluster->slot_map);
+}
+
+/** Finish reading a key slot map
+ *
+ * @param[in] reader	as returned by #cluster_slot_map_acquire.
+ */
+static inline CC_HINT(always_inline) void cluster_slot_map_release(cluster_slot_map_reader_t *reader)
+{
+	atomic_store_explicit(&reader->epoch, 0, memory_order_release);
+}
+
+/** Free retired key slot maps which no thread can still be reading
+ *
+ * @note Must be called with the cluster mutex held.  Doesn't wait for readers.
+ *
+ * @param[in] cluster	to free retired maps in.
+ */
+static void cluster_slot_map_reclaim(fr_redis_cluster_t *cluster)
+{
+	cluster_slot_map_reader_t	*reader;
+	cluster_slot_map_t		*map, **prev;
+	uint64_t			oldest = UINT64_MAX, epoch;
+
+	if (!cluster->slot_map_retired) return;
+
+	/*
+	 *	Find the earliest epoch a reader started in.
+	 *	It may have loaded any map which was still
+	 *	current in that epoch.
+	 */
+	for (reader = atomic_load_explicit(&cluster->slot_map_readers, memory_order_acquire);
+	     reader;
+	     reader = reader->next) {
+		epoch = atomic_load(&reader->epoch);
+		if (epoch && (epoch < oldest)) oldest = epoch;
+	}
+
+	prev = &cluster->slot_map_retired;
+	while ((map = *prev)) {
+		if (map->retired > oldest) {
+			prev = &map->next_retired;
+			continue;
+		}
+		*prev = map->next_retired;
+		talloc_free(map);
+	}
+}
+/** Record whether keys need hashing to find their key slot in a new map
+ *
+ * @param[in] map	to examine.
+ */
+static void cluster_slot_map_single(cluster_slot_map_t *map)
+{
+	unsigned int i;
+
+	map->single_slot = true;
+	for (i = 1; i < KEY_SLOTS; i++) {
+		if (memcmp(&map->key_slot[i], &map->key_slot[0], sizeof(map->key_slot[0])) != 0) {
+			map->single_slot = false;
+			return;
+		}
+	}
+}
+
+/** Make a new key slot map visible to workers, and retire the one it replaces
+ *
+ * @note Must be called with the cluster mutex held.
+ *
+ * @param[in] cluster	to publish the map in.
+ * @param[in] map	to publish.  Must not be modified after this call.
+ */
+static void cluster_slot_map_publish(fr_redis_cluster_t *cluster, cluster_slot_map_t *map)
+{
+	cluster_slot_map_t	*old;
+
+	cluster_slot_map_single(map);
+
+	old = atomic_exchange(&cluster->slot_map, map);
+	if (!old) return;
+
+	/*
+	 *	Readers which started in an earlier epoch may
+	 *	have loaded the old map.  Anyone starting after
+	 *	the epoch advances gets the new one.
+	 */
+	old->retired = atomic_fetch_add(&cluster->slot_map_epoch, 1) + 1;
+	old->next_retired = cluster->slot_map_retired;
+	cluster->slot_map_retired = old;
+
+	cluster_slot_map_reclaim(cluster);
+}
+
 /** Resolve key to key slot
  *
  * Identical to the example implementation, except it uses memchr which will
@@ -531,6 +747,8 @@ static fr_redis_cluster_rcode_t cluster_map_apply(fr_redis_cluster_t *cluster, r
 	uint8_t		rollback[UINT8_MAX];		// Set of nodes to re-add to the queue on failure.
 	bool		active[UINT8_MAX];		// Set of nodes active in the new cluster map.
 	bool		master[UINT8_MAX];		// Master nodes.
+
+	cluster_slot_map_t	*slot_map;		// The new key slot map.
 #ifndef NDEBUG
 #  define SET_ADDR(_addr, _map) \
 do { \
@@ -573,13 +791,14 @@ do { \
 	cluster->remapping = true;
 
 	/*
-	 *	Must be cleared with the mutex held
+	 *	Workers carry on using the current map until
+	 *	this one is complete and published.
 	 */
-	memset(&cluster->key_slot_pending, 0, sizeof(cluster->key_slot_pending));
+	MEM(slot_map = talloc_zero(cluster, cluster_slot_map_t));
 
 	/*
 	 *	Insert new nodes and markup the keyslot indexes
-	 *	in our temporary keyslot_array.
+	 *	in the new map.
 	 *
 	 *	A map consists of an array with the following indexes:
 	 *	  [0]    -> key_slot_start
@@ -622,6 +841,7 @@ do { \
 			cluster->last_updated = time(NULL);
 			/* Re-insert new nodes back into the free_nodes queue */
 			for (i = 0; i < r; i++) SET_INACTIVE(&cluster->node[rollback[i]]);
+			talloc_free(slot_map);
 			return rcode;
 		}
 
@@ -679,13 +899,12 @@ do { \
 		 *	specified by the range for this map.
 		 */
 		for (k = map->element[0]->integer; k <= map->element[1]->integer; k++) {
-			memcpy(&cluster->key_slot_pending[k], &tmpl_slot,
-			       sizeof(*(cluster->key_slot_pending)));
+			memcpy(&slot_map->key_slot[k], &tmpl_slot, sizeof(slot_map->key_slot[k]));
 		}
 	}
 
 	/*
-	 *	Check for holes in the pending_addr key_slot array
+	 *	Check for holes in the new key_slot array
 	 *
 	 *	The cluster specification says that upon
 	 *	detecting a 'NULL' key_slot we should
@@ -696,24 +915,13 @@ do { \
 	 *	error out.
 	 */
 	for (i = 0; i < KEY_SLOTS; i++) {
-		if (cluster->key_slot_pending[i].master == 0) {
+		if (slot_map->key_slot[i].master == 0) {
 			fr_strerror_printf("Cluster is misconfigured, no node assigned for key %zu", i);
 			rcode = FR_REDIS_CLUSTER_RCODE_BAD_INPUT;
 			goto error;
 		}
 	}
 
-	/*
-	 *	We have connections/pools for all the nodes in
-	 *	the new map, apply it to the live cluster.
-	 *
-	 *	Other workers may be using the key slot table,
-	 *	but that's ok. Nodes and pools are never freed,
-	 *	so the worst that will happen, is they'll hit
-	 *	the wrong node for the key, and get redirected.
-	 */
-	memcpy(&cluster->key_slot, &cluster->key_slot_pending, sizeof(cluster->key_slot));
-
 	/*
 	 *	Anything not in the active set of nodes gets
 	 *	added back into the queue, to be re-used.
@@ -745,6 +953,17 @@ do { \
 		}
 	}
 
+	/*
+	 *	We have connections/pools for all the nodes in
+	 *	the new map, apply it to the live cluster.
+	 *
+	 *	Other workers may still be using the old map,
+	 *	but that's ok. Nodes and pools are never freed,
+	 *	so the worst that will happen, is they'll hit
+	 *	the wrong node for the key, and get redirected.
+	 */
+	cluster_slot_map_publish(cluster, slot_map);
+
 	cluster->remapping = false;
 	cluster->last_updated = time(NULL);
 
@@ -1112,6 +1331,10 @@ static fr_redis_cluster_rcode_t cluster_redirect(fr_redis_cluster_node_t **out,
 
 	if (cluster_node_conf_from_redirect(&key, &find.addr, reply) < 0) return FR_REDIS_CLUSTER_RCODE_FAILED;
 
+	/*
+	 *	Node addresses are changed with the mutex held,
+	 *	so they can only be compared with it held too.
+	 */
 	pthread_mutex_lock(&cluster->mutex);
 	/*
 	 *	If we have already have a pool for the
@@ -1538,6 +1761,68 @@ void *fr_redis_cluster_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delt
 	return conn;
 }
 
+/** Resolve a key to a key slot index in the specified map
+ *
+ * @param[in] map	to resolve the key in.
+ * @param[in] request	The current request.
+ * @param[in] key	the key to resolve.
+ * @param[in] key_len	the length of the key.
+ * @return key slot index.
+ */
+static uint16_t cluster_slot_by_key(cluster_slot_map_t const *map, request_t *request,
+				    uint8_t const *key, size_t key_len)
+{
+	uint16_t slot;
+
+	if (!key || (key_len == 0)) {
+		slot = (uint16_t)(fr_rand() & (KEY_SLOTS - 1));
+		ROPTIONAL(RDEBUG2, DEBUG2, "Key rand() -> slot %u", slot);
+
+		return slot;
+	}
+
+	/*
+	 *	Avoid CRC16 if we're operating with one cluster node or
+	 *	without clustering.
+	 */
+	if (!map->single_slot) {
+		slot = cluster_key_hash(key, key_len);
+		ROPTIONAL(RDEBUG2, DEBUG2, "Key \"%pV\" -> slot %u",
+			  fr_box_strvalue_len((char const *)key, key_len), slot);
+
+		return slot;
+	}
+	ROPTIONAL(RDEBUG3, DEBUG3, "Single node available, skipping key selection");
+
+	return 0;
+}
+
+/** Copy the key slot a key resolves to out of the current map
+ *
+ * The copy remains valid however many remaps happen while it's in use.
+ *
+ * @param[out] out	Where to write the key slot.
+ * @param[in] cluster	to resolve the key in.
+ * @param[in] request	The current request.
+ * @param[in] key	the key to resolve.
+ * @param[in] key_len	the length of the key.
+ * @return key slot index.
+ */
+static uint16_t cluster_key_slot_copy(fr_redis_cluster_key_slot_t *out, fr_redis_cluster_t *cluster,
+				      request_t *request, uint8_t const *key, size_t key_len)
+{
+	cluster_slot_map_t		*map;
+	cluster_slot_map_reader_t	*reader;
+	uint16_t			slot;
+
+	map = cluster_slot_map_acquire(cluster, &reader);
+	slot = cluster_slot_by_key(map, request, key, key_len);
+	memcpy(out, &map->key_slot[slot], sizeof(*out));
+	cluster_slot_map_release(reader);
+
+	return slot;
+}
+
 /** Implements the key slot selection scheme used by freeradius
  *
  * Like the scheme in the clustering specification but with some differences
@@ -1546,6 +1831,10 @@ void *fr_redis_cluster_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delt
  * If there's only a single node in the cluster, then we avoid the CRC16
  * and just use key slot 0.
  *
+ * @note The key slot is copied out of the current key slot map into storage
+ *	private to the calling thread.  The pointer is only valid until the
+ *	next call from the same thread, so should be used immediately.
+ *
  * @param cluster to determine key slot for.
  * @param request The current request.
  * @param key the key to resolve.
@@ -1555,29 +1844,11 @@ void *fr_redis_cluster_conn_create(TALLOC_CTX *ctx, void *instance, fr_time_delt
 fr_redis_cluster_key_slot_t const *fr_redis_cluster_slot_by_key(fr_redis_cluster_t *cluster, request_t *request,
 								uint8_t const *key, size_t key_len)
 {
-	fr_redis_cluster_key_slot_t *key_slot;
+	static _Thread_local fr_redis_cluster_key_slot_t key_slot;
 
-	if (!key || (key_len == 0)) {
-		key_slot = &cluster->key_slot[(uint16_t)(fr_rand() & (KEY_SLOTS - 1))];
-		ROPTIONAL(RDEBUG2, DEBUG2, "Key rand() -> slot %zu", key_slot - cluster->key_slot);
+	(void)cluster_key_slot_copy(&key_slot, cluster, request, key, key_len);
 
-		return key_slot;
-	}
-
-	/*
-	 *	Avoid CRC16 if we're operating with one cluster node or
-	 *	without clustering.
-	 */
-	if (fr_rb_num_elements(cluster->used_nodes) > 1) {
-		key_slot = &cluster->key_slot[cluster_key_hash(key, key_len)];
-		ROPTIONAL(RDEBUG2, DEBUG2, "Key \"%pV\" -> slot %zu",
-			  fr_box_strvalue_len((char const *)key, key_len), key_slot - cluster->key_slot);
-
-		return key_slot;
-	}
-	ROPTIONAL(RDEBUG3, DEBUG3, "Single node available, skipping key selection");
-
-	return &cluster->key_slot[0];
+	return &key_slot;
 }
 
 /** Return the master node that would be used for a particular key
@@ -1695,7 +1966,8 @@ fr_redis_rcode_t fr_redis_cluster_state_init(fr_redis_cluster_state_t *state, fr
 					     uint8_t const *key, size_t key_len, bool read_only)
 {
 	fr_redis_cluster_node_t			*node;
-	fr_redis_cluster_key_slot_t const	*key_slot;
+	fr_redis_cluster_key_slot_t		key_slot;
+	uint16_t				slot;
 	uint8_t					first, i;
 	uint64_t				used_nodes;
 
@@ -1713,23 +1985,23 @@ fr_redis_rcode_t fr_redis_cluster_state_init(fr_redis_cluster_state_t *state, fr
 	}
 
 again:
-	key_slot = fr_redis_cluster_slot_by_key(cluster, request, key, key_len);
+	slot = cluster_key_slot_copy(&key_slot, cluster, request, key, key_len);
 
 	/*
 	 *	1. Try each of the slaves for the key slot
 	 *	2. Fall through to trying the master, and a single alternate node.
 	 */
 	if (read_only) {
-		first = fr_rand() & key_slot->slave_num;
-		for (i = 0; i < key_slot->slave_num; i++) {
+		first = fr_rand() & key_slot.slave_num;
+		for (i = 0; i < key_slot.slave_num; i++) {
 			uint8_t node_id;
 
-			node_id = key_slot->slave[(first + i) % key_slot->slave_num];
+			node_id = key_slot.slave[(first + i) % key_slot.slave_num];
 			node = &cluster->node[node_id];
 			*conn = fr_pool_connection_get(node->pool, request);
 			if (!*conn) {
-				ROPTIONAL(RDEBUG2, DEBUG2, "[%i] No connections available (key slot %zu slave %i)",
-					  node->id, key_slot - cluster->key_slot, (first + i) % key_slot->slave_num);
+				ROPTIONAL(RDEBUG2, DEBUG2, "[%i] No connections available (key slot %u slave %i)",
+					  node->id, slot, (first + i) % key_slot.slave_num);
 				cluster->remap_needed = true;
 				continue;	/* Continue until we find a live pool */
 			}
@@ -1745,11 +2017,11 @@ again:
 	 *	3. If there are no pools, or we can't reserve a handle,
 	 *	   give up.
 	 */
-	node = &cluster->node[key_slot->master];
+	node = &cluster->node[key_slot.master];
 	*conn = fr_pool_connection_get(node->pool, request);
 	if (!*conn) {
-		ROPTIONAL(RDEBUG2, DEBUG2, "[%i] No connections available (key slot %zu master)",
-			  node->id, key_slot - cluster->key_slot);
+		ROPTIONAL(RDEBUG2, DEBUG2, "[%i] No connections available (key slot %u master)",
+			  node->id, slot);
 		cluster->remap_needed = true;
 
 		if (cluster_node_find_live(&node, conn, request, cluster, node) < 0) return REDIS_RCODE_RECONNECT;
@@ -1895,7 +2167,7 @@ fr_redis_rcode_t fr_redis_cluster_state_next(fr_redis_cluster_state_t *state, fr
 	 */
 	case REDIS_RCODE_RECONNECT:
 	{
-		fr_redis_cluster_key_slot_t const *key_slot;
+		fr_redis_cluster_key_slot_t key_slot;
 
 		ROPTIONAL(RPERROR, PERROR, "[%i] Failed communicating with %s:%i",
 			  state->node->id, state->node->name,
@@ -1912,8 +2184,8 @@ fr_redis_rcode_t fr_redis_cluster_state_next(fr_redis_cluster_state_t *state, fr
 		/*
 		 *	Refresh the key slot
 		 */
-		key_slot = fr_redis_cluster_slot_by_key(cluster, request, state->key, state->key_len);
-		state->node = &cluster->node[key_slot->master];
+		(void)cluster_key_slot_copy(&key_slot, cluster, request, state->key, state->key_len);
+		state->node = &cluster->node[key_slot.master];
 
 		*conn = fr_pool_connection_get(state->node->pool, request);
 		if (!*conn) {
@@ -2132,6 +2404,16 @@ ssize_t fr_redis_cluster_node_addr_by_role(TALLOC_CTX *ctx, fr_socket_t *out[],
  */
 static int _fr_redis_cluster_free(fr_redis_cluster_t *cluster)
 {
+	cluster_slot_map_reader_t *reader, *next;
+
+	/*
+	 *	Retired maps are freed with the cluster.
+	 */
+	for (reader = atomic_load(&cluster->slot_map_readers); reader; reader = next) {
+		next = reader->next;
+		talloc_free(reader);
+	}
+
 	pthread_mutex_destroy(&cluster->mutex);
 
 	return 0;
@@ -2321,6 +2603,13 @@ fr_redis_cluster_t *fr_redis_cluster_alloc(TALLOC_CTX *ctx,
 
 	cluster->conf = conf;
 
+	{
+		static atomic_uint_fast64_t	cluster_ids = 1;
+
+		cluster->id = atomic_fetch_add(&cluster_ids, 1);
+	}
+	atomic_init(&cluster->slot_map_epoch, 1);
+
 	pthread_mutex_init(&cluster->mutex, NULL);
 	talloc_set_destructor(cluster, _fr_redis_cluster_free);
 
@@ -2481,7 +2770,13 @@ fr_redis_cluster_t *fr_redis_cluster_alloc(TALLOC_CTX *ctx,
 	 *	hopefully we'll get one when we start processing
 	 *	requests.
 	 */
-	for (s = 0; s < KEY_SLOTS; s++) cluster->key_slot[s].master = (s % (uint16_t) num_nodes) + 1;
+	{
+		cluster_slot_map_t *slot_map;
+
+		MEM(slot_map = talloc_zero(cluster, cluster_slot_map_t));
+		for (s = 0; s < KEY_SLOTS; s++) slot_map->key_slot[s].master = (s % (uint16_t) num_nodes) + 1;
+		cluster_slot_map_publish(cluster, slot_map);
+	}
 
 	return cluster;
 }
@@ -54,16 +54,117 @@ static void _redis_disconnected(redisAsyncContext const *ac, UNUSED int status)
 	fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
 }
 
+/** Check the reply to a command sent while setting up the connection
+ *
+ * @param[in] reply	to check.
+ * @param[in] command	name, for logging.
+ * @return
+ *	- 0 if the command succeeded.
+ *	- -1 if it failed.
+ */
+static int _redis_setup_reply_check(redisReply *reply, char const *command)
+{
+	int ret = 0;
+
+	if (reply->type == REDIS_REPLY_ERROR) {
+		ERROR("%s failed: %s", command, reply->str);
+		ret = -1;
+	} else if ((reply->type != REDIS_REPLY_STATUS) || (strcmp(reply->str, "OK") != 0)) {
+		ERROR("%s failed: Unexpected reply", command);
+		ret = -1;
+	}
+
+#ifdef REDIS_NO_AUTO_FREE_REPLIES
+	freeReplyObject(reply);
+#endif
+
+	return ret;
+}
+
+/** Called by hiredis with the result of selecting a database
+ *
+ */
+static void _redis_select_done(redisAsyncContext *ac, void *reply, UNUSED void *privdata)
+{
+	fr_connection_t		*conn = talloc_get_type_abort(ac->data, fr_connection_t);
+
+	if (!reply) return;	/* Connection closed, the disconnect callback deals with it */
+
+	if (_redis_setup_reply_check(reply, "SELECT") < 0) {
+		fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+		return;
+	}
+
+	DEBUG4("Database selected, connection is open");
+
+	fr_connection_signal_connected(conn);
+}
+
+/** Select the configured database, or signal that the connection is open
+ *
+ */
+static void _redis_select(redisAsyncContext *ac)
+{
+	fr_connection_t		*conn = talloc_get_type_abort(ac->data, fr_connection_t);
+	fr_redis_handle_t	*h = conn->h;
+
+	if (!h->conf->database) {
+		fr_connection_signal_connected(conn);
+		return;
+	}
+
+	DEBUG4("Executing: SELECT %u", h->conf->database);
+
+	if (redisAsyncCommand(ac, _redis_select_done, NULL, "SELECT %u", h->conf->database) != REDIS_OK) {
+		ERROR("Failed sending SELECT: %s", ac->errstr);
+		fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+	}
+}
+
+/** Called by hiredis with the result of authenticating
+ *
+ */
+static void _redis_auth_done(redisAsyncContext *ac, void *reply, UNUSED void *privdata)
+{
+	fr_connection_t		*conn = talloc_get_type_abort(ac->data, fr_connection_t);
+
+	if (!reply) return;	/* Connection closed, the disconnect callback deals with it */
+
+	if (_redis_setup_reply_check(reply, "AUTH") < 0) {
+		fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+		return;
+	}
+
+	_redis_select(ac);
+}
+
 /** Called by hiredis to indicate the connection is live
  *
+ * If a password or database are configured, the connection
+ * isn't signalled as open until they've been sent, and the
+ * server has accepted them.
  */
 static void _redis_connected(redisAsyncContext const *ac, UNUSED int status)
 {
 	fr_connection_t		*conn = talloc_get_type_abort(ac->data, fr_connection_t);
+	fr_redis_handle_t	*h = conn->h;
+	redisAsyncContext	*our_ac;
 
 	DEBUG4("Signalled by hiredis, connection is open");
 
-	fr_connection_signal_connected(conn);
+	memcpy(&our_ac, &ac, sizeof(our_ac));
+
+	if (!h->conf->password) {
+		_redis_select(our_ac);
+		return;
+	}
+
+	DEBUG4("Executing: AUTH <password>");
+
+	if (redisAsyncCommand(our_ac, _redis_auth_done, NULL, "AUTH %s", h->conf->password) != REDIS_OK) {
+		ERROR("Failed sending AUTH: %s", ac->errstr);
+		fr_connection_signal_reconnect(conn, FR_CONNECTION_FAILED);
+	}
 }
 
 /** Redis FD became readable
@@ -320,6 +421,7 @@ static fr_connection_state_t _redis_io_connection_init(void **h_out, fr_connecti
 		return FR_CONNECTION_STATE_FAILED;
 	}
 	talloc_set_destructor(h, _redis_handle_free);
+	h->conf = conf;
 
 	h->ac = redisAsyncConnect(host, port);
 	if (!h->ac) {
@@ -343,6 +445,14 @@ static fr_connection_state_t _redis_io_connection_init(void **h_out, fr_connecti
 	 */
 	memcpy(&h->ac->data, &conn, sizeof(h->ac->data));
 
+#ifdef REDIS_NO_AUTO_FREE_REPLIES
+	/*
+	 *	Replies belong to the command they were
+	 *	received for, and are freed with it.
+	 */
+	h->ac->c.flags |= REDIS_NO_AUTO_FREE_REPLIES;
+#endif
+
 	/*
 	 *	Handle has to be associated with the
 	 *	conn in case I/O handlers want to get
@@ -70,6 +70,7 @@ typedef struct {
 							///< a callback loop.
 	fr_event_timer_t const	*timer;			//!< Connection timer.
 
+	fr_redis_io_conf_t const *conf;			//!< Server, password and database number.
 
 	redisAsyncContext	*ac;			//!< Async handle for hiredis.
 
@@ -72,6 +72,8 @@ struct fr_redis_command_s {
 
 	char const			*str;		//!< The command string.
 	size_t				len;		//!< Length of the command string.
+	bool				formatted;	//!< str is already encoded in the redis protocol
+							///< format, and can be written out as is.
 
 	uint64_t			sqn;		//!< The sequence number of the command.  This is only
 							///< valid for a specific handle, and is unique within
@@ -262,7 +264,9 @@ fr_redis_command_set_t *fr_redis_command_set_alloc(TALLOC_CTX *ctx,
  */
 static int _redis_command_free(fr_redis_command_t *cmd)
 {
-	//if (cmd->result) fr_redis_reply_free(&cmd->result);
+#ifdef REDIS_NO_AUTO_FREE_REPLIES
+	if (cmd->result) fr_redis_reply_free(&cmd->result);
+#endif
 
 	return 0;
 }
@@ -272,40 +276,46 @@ redisReply *fr_redis_command_get_result(fr_redis_command_t *cmd)
 	return cmd->result;
 }
 
-/** Add a preformatted/expanded command to the command set
+/** Take ownership of the result of a command
  *
- * The command must either be entirely static, or parented by the command set.
+ * The command set is freed as soon as the complete or fail callback returns.
+ * Results needed after that must be stolen, and freed by the caller with
+ * #fr_redis_reply_free.
  *
- * @note Caller should disallow "SUBSCRIBE" et al, if they're not appropriate.
- * 	 As subscribing to a stream where we're not expecting it would break
- * 	 things, badly.
+ * @param[in] cmd	to steal the result from.
+ * @return The result of the command, or NULL if there was no result.
+ */
+redisReply *fr_redis_command_steal_result(fr_redis_command_t *cmd)
+{
+	redisReply *reply = cmd->result;
+
+	cmd->result = NULL;
+
+	return reply;
+}
+
+/** Determine what type of command we're adding to the command set
  *
- * @param[in] cmds	Command set to add command to.
- * @param[in] cmd_str	A fully expanded/formatted command to send to redis.
- *			Must be static, or have the same lifetime as the
- *			command set (allocated with the command set as the parent).
- * @param[in] cmd_len	Length of the command.
+ * Because commands from many different requests share the same connection
+ * we need to ensure that transaction blocks aren't left dangling and
+ * that the commands are all in the right order.
+ *
+ * We try very hard to do this without incurring a performance penalty
+ * for non-transactional commands.
+ *
+ * @param[out] out	The type of command.
+ * @param[in] cmds	Command set the command will be added to.
+ * @param[in] cmd_str	The command, or the command name.
  * @return
- *	- FR_REDIS_PIPELINE_BAD_CMDS if a bad command sequence is enqueued.
- *	- FR_REDIS_PIPELINE_OK if command was enqueued successfully.
+ *	- FR_REDIS_PIPELINE_BAD_CMDS if the command would result in a bad command sequence.
+ *	- FR_REDIS_PIPELINE_OK if the command can be added.
  */
-fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_set_t *cmds,
-							     char const *cmd_str, size_t cmd_len)
+static fr_redis_pipeline_status_t redis_command_type(fr_redis_command_type_t *out,
+						     fr_redis_command_set_t *cmds, char const *cmd_str)
 {
-	request_t			*request = cmds->request;
-	fr_redis_command_t	*cmd;
+	request_t		*request = cmds->request;
 	fr_redis_command_type_t	type = FR_REDIS_COMMAND_NORMAL;
 
-	/*
-	 *	Transaction sanity checks.
-	 *
-	 *	Because commands from many different requests share the same connection
-	 *	we need to ensure that transaction blocks aren't left dangling and
-	 *	that the commands are all in the right order.
-	 *
-	 *	We try very hard to do this without incurring a performance penalty
-	 *      for non-transactional commands.
-	 */
 	switch (tolower(cmd_str[0])) {
 	case 'm':
 		if (tolower(cmd_str[1] != 'u')) break;
@@ -366,13 +376,90 @@ fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_se
 		break;
 	}
 
+	*out = type;
+
+	return FR_REDIS_PIPELINE_OK;
+}
+
+/** Add a command to the pending list of the command set
+ *
+ */
+static void redis_command_add(fr_redis_command_set_t *cmds, fr_redis_command_type_t type,
+			      char const *cmd_str, size_t cmd_len, bool formatted)
+{
+	fr_redis_command_t	*cmd;
+
 	MEM(cmd = talloc_zero(cmds, fr_redis_command_t));
 	talloc_set_destructor(cmd, _redis_command_free);
 	cmd->cmds = cmds;
 	cmd->type = type;
 	cmd->str = cmd_str;
 	cmd->len = cmd_len;
+	cmd->formatted = formatted;
 	fr_dlist_insert_tail(&cmds->pending, cmd);
+}
+
+/** Add a preformatted/expanded command to the command set
+ *
+ * The command must either be entirely static, or parented by the command set.
+ *
+ * @note Caller should disallow "SUBSCRIBE" et al, if they're not appropriate.
+ * 	 As subscribing to a stream where we're not expecting it would break
+ * 	 things, badly.
+ *
+ * @param[in] cmds	Command set to add command to.
+ * @param[in] cmd_str	A fully expanded/formatted command to send to redis.
+ *			Must be static, or have the same lifetime as the
+ *			command set (allocated with the command set as the parent).
+ * @param[in] cmd_len	Length of the command.
+ * @return
+ *	- FR_REDIS_PIPELINE_BAD_CMDS if a bad command sequence is enqueued.
+ *	- FR_REDIS_PIPELINE_OK if command was enqueued successfully.
+ */
+fr_redis_pipeline_status_t fr_redis_command_preformatted_add(fr_redis_command_set_t *cmds,
+							     char const *cmd_str, size_t cmd_len)
+{
+	fr_redis_command_type_t	type;
+
+	if (redis_command_type(&type, cmds, cmd_str) != FR_REDIS_PIPELINE_OK) return FR_REDIS_PIPELINE_BAD_CMDS;
+
+	redis_command_add(cmds, type, cmd_str, cmd_len, false);
+
+	return FR_REDIS_PIPELINE_OK;
+}
+
+/** Add a command, split into its arguments, to the command set
+ *
+ * Unlike #fr_redis_command_preformatted_add, arguments may contain spaces
+ * and binary data.  The command is encoded immediately, so the arguments
+ * don't need to persist after this function returns.
+ *
+ * @param[in] cmds	Command set to add command to.
+ * @param[in] argc	Number of arguments, including the command name.
+ * @param[in] argv	Arguments.  argv[0] is the command name, and must be
+ *			\0 terminated.
+ * @param[in] argvlen	Length of each of the arguments.
+ * @return
+ *	- FR_REDIS_PIPELINE_BAD_CMDS if a bad command sequence is enqueued.
+ *	- FR_REDIS_PIPELINE_FAIL if the command could not be encoded.
+ *	- FR_REDIS_PIPELINE_OK if command was enqueued successfully.
+ */
+fr_redis_pipeline_status_t fr_redis_command_argv_add(fr_redis_command_set_t *cmds,
+						     int argc, char const **argv, size_t const *argvlen)
+{
+	fr_redis_command_type_t	type;
+	char			*formatted, *cmd_str;
+	long long		cmd_len;
+
+	if (redis_command_type(&type, cmds, argv[0]) != FR_REDIS_PIPELINE_OK) return FR_REDIS_PIPELINE_BAD_CMDS;
+
+	cmd_len = redisFormatCommandArgv(&formatted, argc, argv, argvlen);
+	if (cmd_len < 0) return FR_REDIS_PIPELINE_FAIL;
+
+	MEM(cmd_str = talloc_memdup(cmds, formatted, (size_t)cmd_len));
+	redisFreeCommand(formatted);
+
+	redis_command_add(cmds, type, cmd_str, (size_t)cmd_len, true);
 
 	return FR_REDIS_PIPELINE_OK;
 }
@@ -409,6 +496,19 @@ fr_redis_pipeline_status_t redis_command_set_enqueue(fr_redis_trunk_t *rtrunk, f
 	}
 }
 
+/** Cancel a command set that was previously enqueued
+ *
+ * Any responses to commands already sent are discarded, and neither
+ * the complete nor the fail callbacks are called.  The command set is
+ * freed by the trunk, and must not be used after calling this function.
+ *
+ * @param[in] cmds	Command set to cancel.
+ */
+void fr_redis_command_set_signal_cancel(fr_redis_command_set_t *cmds)
+{
+	fr_trunk_request_signal_cancel(cmds->treq);
+}
+
 /** Callback for for receiving Redis replies
  *
  * This is called by hiredis for each response is receives.  privData is set to the
@@ -470,32 +570,34 @@ static fr_connection_t *_redis_pipeline_connection_alloc(fr_trunk_connection_t *
 	return fr_redis_connection_alloc(tconn, el, conf, rtrunk->io_conf, log_prefix);
 }
 
-/** Enqueue one or more command sets onto a redis handle
- *
- * Because the trunk is in always writable mode, _redis_pipeline_mux
- * will be called any time fr_trunk_request_enqueue is called, so there'll only
- * ever be one command to dequeue.
+/** Write all the pending commands in a command set to a redis handle
  *
- * @param[in] tconn		Trunk connection holding the commands to enqueue.
- * @param[in] conn		Connection handle containing the fr_redis_handle_t.
- * @param[in] uctx		fr_redis_cluster_t.  Unused.
+ * @param[in] h		to write the commands to.
+ * @param[in] treq	containing the command set.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.  The trunk request will have been failed.
  */
-static void _redis_pipeline_mux(fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+static int redis_command_set_send(fr_redis_handle_t *h, fr_trunk_request_t *treq)
 {
-	fr_trunk_request_t	*treq;
-	fr_redis_command_set_t 	*cmds;
+	fr_redis_command_set_t 	*cmds = talloc_get_type_abort(treq->preq, fr_redis_command_set_t);
 	fr_redis_command_t	*cmd;
-	fr_redis_handle_t	*h = talloc_get_type_abort(conn->h, fr_redis_handle_t);
-	request_t			*request;
+	request_t		*request = treq->request;
+	int			ret;
 
-	treq = fr_trunk_connection_pop_request(&request, (void *)&cmds, NULL, tconn);
 	while ((cmd = fr_dlist_head(&cmds->pending))) {
+		if (cmd->formatted) {
+			ret = redisAsyncFormattedCommand(h->ac, _redis_pipeline_demux, cmd, cmd->str, cmd->len);
+		} else {
+			ret = redisAsyncCommand(h->ac, _redis_pipeline_demux, cmd, "%s", cmd->str);
+		}
+
 		/*
 		 *	If this fails it probably means the connection
 		 *	is disconnecting, but if that's happening then
 		 *	we shouldn't be enqueueing new requests?
 		 */
-		if (unlikely(redisAsyncCommand(h->ac, _redis_pipeline_demux, cmd, "%s", cmd->str) != REDIS_OK)) {
+		if (unlikely(ret != REDIS_OK)) {
 			ROPTIONAL(ERROR, REDEBUG, "Unexpected error queueing REDIS command");
 
 			while ((cmd = fr_dlist_head(&cmds->sent))) {
@@ -504,13 +606,36 @@ static void _redis_pipeline_mux(fr_trunk_connection_t *tconn, fr_connection_t *c
 				fr_dlist_insert_tail(&cmds->pending, cmd);
 			}
 			fr_trunk_request_signal_fail(treq);
-			return;
+			return -1;
 		}
 		cmd->sqn = fr_redis_connection_sent_request(h);
 		fr_dlist_remove(&cmds->pending, cmd);
 		fr_dlist_insert_tail(&cmds->sent, cmd);
 	}
 	fr_trunk_request_signal_sent(treq);
+
+	return 0;
+}
+
+/** Enqueue one or more command sets onto a redis handle
+ *
+ * Because the trunk is in always writable mode, _redis_pipeline_mux
+ * will be called any time fr_trunk_request_enqueue is called.  Commands
+ * from all the command sets are buffered by hiredis, and written out
+ * together when the connection next becomes writable.
+ *
+ * @param[in] el		Event list.  Unused.
+ * @param[in] tconn		Trunk connection holding the commands to enqueue.
+ * @param[in] conn		Connection handle containing the fr_redis_handle_t.
+ * @param[in] uctx		fr_redis_cluster_t.  Unused.
+ */
+static void _redis_pipeline_mux(UNUSED fr_event_list_t *el,
+				fr_trunk_connection_t *tconn, fr_connection_t *conn, UNUSED void *uctx)
+{
+	fr_trunk_request_t	*treq;
+	fr_redis_handle_t	*h = talloc_get_type_abort(conn->h, fr_redis_handle_t);
+
+	while (fr_trunk_connection_pop_request(&treq, tconn) == 0) (void)redis_command_set_send(h, treq);
 }
 
 /** Deal with cancellation of sent requests
@@ -519,7 +644,7 @@ static void _redis_pipeline_mux(fr_trunk_connection_t *tconn, fr_connection_t *c
  * on why the commands were cancelled, we either tell the handle to ignore
  * them, or move them back into the pending list.
  */
-static void _redis_pipeline_command_set_cancel(fr_connection_t *conn, UNUSED fr_trunk_request_t *treq, void *preq,
+static void _redis_pipeline_command_set_cancel(fr_connection_t *conn, void *preq,
 					       fr_trunk_cancel_reason_t reason, UNUSED void *uctx)
 {
 	fr_redis_command_set_t	*cmds = talloc_get_type_abort(preq, fr_redis_command_set_t);
@@ -541,6 +666,7 @@ static void _redis_pipeline_command_set_cancel(fr_connection_t *conn, UNUSED fr_
 	 *	execution by another handle.
 	 */
 	case FR_TRUNK_CANCEL_REASON_MOVE:
+	case FR_TRUNK_CANCEL_REASON_REQUEUE:
 		fr_dlist_move(&cmds->pending, &cmds->sent);
 		return;
 
@@ -564,6 +690,7 @@ static void _redis_pipeline_command_set_cancel(fr_connection_t *conn, UNUSED fr_
 			fr_redis_connection_ignore_response(h, cmd->sqn);
 		}
 	}
+		return;
 
 	case FR_TRUNK_CANCEL_REASON_NONE:
 		fr_assert(0);
@@ -586,7 +713,7 @@ static void _redis_pipeline_command_set_complete(UNUSED request_t *request, void
  *
  */
 static void _redis_pipeline_command_set_fail(UNUSED request_t *request, void *preq,
-					     UNUSED void *rctx, UNUSED void *uctx)
+					     UNUSED void *rctx, UNUSED fr_trunk_request_state_t state, UNUSED void *uctx)
 {
 	fr_redis_command_set_t	*cmds = talloc_get_type_abort(preq, fr_redis_command_set_t);
 
@@ -625,6 +752,16 @@ fr_redis_trunk_t *fr_redis_trunk_alloc(fr_redis_cluster_thread_t *cluster_thread
 					.request_free		= _redis_pipeline_command_set_free
 				};
 
+#ifndef REDIS_NO_AUTO_FREE_REPLIES
+	/*
+	 *	Older versions of hiredis free replies as soon as
+	 *	the reply callback returns, so we can't hold on to
+	 *	the results for the rest of the command set.
+	 */
+	fr_strerror_const("Pipelining requires hiredis >= 1.1.0");
+	return NULL;
+#endif
+
 	MEM(rtrunk = talloc_zero(cluster_thread, fr_redis_trunk_t));
 	rtrunk->io_conf = io_conf;
 	rtrunk->trunk = fr_trunk_alloc(rtrunk, cluster_thread->el,
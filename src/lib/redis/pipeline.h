@@ -66,13 +66,20 @@ typedef void (*fr_redis_command_set_fail_t)(request_t *request, fr_dlist_head_t
 fr_redis_pipeline_status_t	fr_redis_command_preformatted_add(fr_redis_command_set_t *cmds,
 							     	  char const *cmd_str, size_t cmd_len);
 
+fr_redis_pipeline_status_t	fr_redis_command_argv_add(fr_redis_command_set_t *cmds,
+							  int argc, char const **argv, size_t const *argvlen);
+
 /*
  *	TEMPORARY
  */
 fr_redis_pipeline_status_t redis_command_set_enqueue(fr_redis_trunk_t *rtrunk, fr_redis_command_set_t *cmds);
 
+void fr_redis_command_set_signal_cancel(fr_redis_command_set_t *cmds);
+
 redisReply *fr_redis_command_get_result(fr_redis_command_t *cmd);
 
+redisReply *fr_redis_command_steal_result(fr_redis_command_t *cmd);
+
 fr_redis_command_set_t		*fr_redis_command_set_alloc(TALLOC_CTX *ctx,
 							    request_t *request,
 							    fr_redis_command_set_complete_t complete,
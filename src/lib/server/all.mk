@@ -1,4 +1,7 @@
 SUBMAKEFILES := \
 	libfreeradius-server.mk \
+	cred_cache_tests.mk \
+	detail_spool_tests.mk \
 	pair_server_tests.mk \
+	trace_tests.mk \
 	trunk_tests.mk
@@ -35,11 +35,13 @@ RCSIDH(base_h, "$Id$")
 #include <freeradius-devel/server/components.h>
 #include <freeradius-devel/server/cond_eval.h>
 #include <freeradius-devel/server/connection.h>
+#include <freeradius-devel/server/cred_cache.h>
 #include <freeradius-devel/server/crypt.h>
 #include <freeradius-devel/server/dependency.h>
 #include <freeradius-devel/server/dl_module.h>
 #include <freeradius-devel/server/exec.h>
 #include <freeradius-devel/server/exfile.h>
+#include <freeradius-devel/server/helper.h>
 #include <freeradius-devel/server/listen.h>
 #include <freeradius-devel/server/log.h>
 #include <freeradius-devel/server/main_config.h>
@@ -64,6 +66,7 @@ RCSIDH(base_h, "$Id$")
 #include <freeradius-devel/server/sysutmp.h>
 #include <freeradius-devel/server/tcp.h>
 #include <freeradius-devel/server/tmpl.h>
+#include <freeradius-devel/server/trace.h>
 #include <freeradius-devel/server/trigger.h>
 #include <freeradius-devel/server/users_file.h>
 #include <freeradius-devel/server/util.h>
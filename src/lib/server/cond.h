@@ -31,6 +31,7 @@ extern "C" {
 
 #include <freeradius-devel/server/tmpl.h>
 #include <freeradius-devel/server/map.h>
+#include <freeradius-devel/util/htrie.h>
 
 #ifndef RADIUSD_H
 /*
@@ -57,7 +58,8 @@ typedef enum {
 	COND_TYPE_MAP,
 	COND_TYPE_AND,
 	COND_TYPE_OR,
-	COND_TYPE_CHILD
+	COND_TYPE_CHILD,
+	COND_TYPE_SET
 } fr_cond_type_t;
 
 typedef enum {
@@ -67,6 +69,18 @@ typedef enum {
 	PASS2_PAIRCOMPARE
 } fr_cond_pass2_t;
 
+/** Set membership test
+ *
+ * Created by #fr_cond_optimise from chains of comparisons against
+ * the same attribute, e.g. "&Foo == a || &Foo == b || &Foo == c".
+ */
+typedef struct {
+	tmpl_t			*vpt;		//!< Attribute to check.
+	fr_value_box_t		*values;	//!< Array of values to check against, in the
+						///< order they were written.
+	fr_htrie_t		*ht;		//!< Index of values.
+} fr_cond_set_t;
+
 /*
  *	Allow for the following structures:
  *
@@ -83,6 +97,7 @@ struct fr_cond_s {
 		map_t			*map;		//!< Binary expression.
 		tmpl_t			*vpt;		//!< Unary expression.
 		fr_cond_t  		*child;		//!< Nested condition.
+		fr_cond_set_t		*set;		//!< Set membership test.
 		rlm_rcode_t		rcode;		//!< Rcode check.   We handle this outside of
 							///< tmpls as it doesn't apply anywhere else.
 	} data;
@@ -107,6 +122,8 @@ int fr_cond_from_map(TALLOC_CTX *ctx, fr_cond_t **head, map_t *map);
 
 void fr_cond_async_update(fr_cond_t *cond);
 
+void fr_cond_optimise(fr_cond_t *head) CC_HINT(nonnull);
+
 #ifdef __cplusplus
 }
 #endif
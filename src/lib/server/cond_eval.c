@@ -53,6 +53,7 @@ static fr_table_num_sorted_t const cond_type_table[] = {
 	{ L("false"),		COND_TYPE_FALSE		},
 	{ L("invalid"),		COND_TYPE_INVALID	},
 	{ L("map"),		COND_TYPE_MAP		},
+	{ L("set"),		COND_TYPE_SET		},
 	{ L("true"),		COND_TYPE_TRUE		},
 };
 static size_t cond_type_table_len = NUM_ELEMENTS(cond_type_table);
@@ -102,6 +103,17 @@ void cond_debug(fr_cond_t const *cond)
 			INFO(")");
 			break;
 
+		case COND_TYPE_SET:
+		{
+			size_t i;
+
+			tmpl_debug(c->data.set->vpt);
+			for (i = 0; i < talloc_array_length(c->data.set->values); i++) {
+				INFO("\tvalue  : %pV", &c->data.set->values[i]);
+			}
+		}
+			break;
+
 		case COND_TYPE_AND:
 			INFO("&& ");
 			break;
@@ -842,6 +854,34 @@ done:
 	return rcode;
 }
 
+/** Check if any instance of an attribute matches one of a set of values
+ *
+ * @param[in] request	the request_t
+ * @param[in] set	to check.
+ * @return
+ *	- <0 on failure.
+ *	- 0 for "no match".
+ *	- 1 for "match".
+ */
+static int cond_eval_set(request_t *request, fr_cond_set_t const *set)
+{
+	int			rcode = 0;
+	fr_pair_t		*vp;
+	fr_dcursor_t		cursor;
+	tmpl_pair_cursor_ctx_t	cc;
+
+	for (vp = tmpl_pair_cursor_init(&rcode, request, &cc, &cursor, request, set->vpt);
+	     vp;
+	     vp = fr_dcursor_next(&cursor)) {
+		if (fr_htrie_find(set->ht, &vp->data)) {
+			rcode = 1;
+			break;
+		}
+	}
+	tmpl_pair_cursor_clear(&cc);
+
+	return rcode;
+}
 
 /** Evaluate a fr_cond_t;
  *
@@ -879,6 +919,10 @@ int cond_eval(request_t *request, rlm_rcode_t modreturn, fr_cond_t const *c)
 			rcode = cond_eval_map(request, c, NULL, NULL);
 			break;
 
+		case COND_TYPE_SET:
+			rcode = cond_eval_set(request, c->data.set);
+			break;
+
 		case COND_TYPE_CHILD:
 			c = c->data.child;
 			continue;
@@ -112,6 +112,24 @@ ssize_t cond_print(fr_sbuff_t *out, fr_cond_t const *in)
 			FR_SBUFF_IN_CHAR_RETURN(&our_out, ')');
 			break;
 
+		/*
+		 *	Print sets as the chain of comparisons they
+		 *	were created from.
+		 */
+		case COND_TYPE_SET:
+		{
+			size_t i;
+
+			for (i = 0; i < talloc_array_length(c->data.set->values); i++) {
+				if (i > 0) FR_SBUFF_IN_STRCPY_LITERAL_RETURN(&our_out, " || ");
+				FR_SBUFF_RETURN(tmpl_print_quoted, &our_out, c->data.set->vpt, TMPL_ATTR_REF_PREFIX_YES);
+				FR_SBUFF_IN_STRCPY_LITERAL_RETURN(&our_out, " == ");
+				FR_SBUFF_RETURN(fr_value_box_print_quoted, &our_out, &c->data.set->values[i],
+						T_SINGLE_QUOTED_STRING);
+			}
+		}
+			break;
+
 		case COND_TYPE_AND:
 			FR_SBUFF_IN_STRCPY_LITERAL_RETURN(&our_out, " && ");
 			break;
@@ -1606,6 +1624,7 @@ bool fr_cond_walk(fr_cond_t *c, bool (*callback)(fr_cond_t *cond, void *uctx), v
 		case COND_TYPE_RCODE:
 		case COND_TYPE_TMPL:
 		case COND_TYPE_MAP:
+		case COND_TYPE_SET:
 		case COND_TYPE_AND:
 		case COND_TYPE_OR:
 		case COND_TYPE_TRUE:
@@ -1652,6 +1671,7 @@ void fr_cond_async_update(fr_cond_t *c)
 		case COND_TYPE_OR:
 		case COND_TYPE_TRUE:
 		case COND_TYPE_FALSE:
+		case COND_TYPE_SET:
 			break;
 
 		case COND_TYPE_TMPL:
@@ -1687,6 +1707,458 @@ void fr_cond_async_update(fr_cond_t *c)
 	}
 }
 
+/*
+ *	Minimum number of "&Foo == bar" operands in a chain of || before
+ *	they are replaced with a set membership test.
+ */
+#define COND_SET_MIN	(3)
+
+static int8_t cond_set_cmp(void const *one, void const *two)
+{
+	return fr_value_box_cmp(one, two);
+}
+
+static uint32_t cond_set_hash(void const *data)
+{
+	return fr_value_box_hash(data);
+}
+
+static int cond_set_to_key(uint8_t **out, size_t *outlen, void const *data)
+{
+	return fr_value_box_to_key(out, outlen, data);
+}
+
+/** Return the talloc'd data of a condition node, if it has any
+ *
+ */
+static void *cond_data(fr_cond_t *c)
+{
+	switch (c->type) {
+	case COND_TYPE_TMPL:
+		return c->data.vpt;
+
+	case COND_TYPE_MAP:
+		return c->data.map;
+
+	case COND_TYPE_CHILD:
+		return c->data.child;
+
+	case COND_TYPE_SET:
+		return c->data.set;
+
+	default:
+		return NULL;
+	}
+}
+
+/** Replace a condition node with a constant
+ *
+ */
+static void cond_to_bool(fr_cond_t *c, bool value)
+{
+	talloc_free(cond_data(c));
+
+	c->type = (value != c->negate) ? COND_TYPE_TRUE : COND_TYPE_FALSE;
+	memset(&c->data, 0, sizeof(c->data));
+	c->negate = false;
+	c->pass2_fixup = PASS2_FIXUP_NONE;
+	c->async_required = false;
+}
+
+/** Whether evaluating a condition node can return an error
+ *
+ * Errors abort evaluation of the whole condition, so nodes which can
+ * fail can't be moved or removed without changing the result.  That
+ * includes comparisons against attributes which don't exist.
+ */
+static bool cond_infallible(fr_cond_t const *c)
+{
+	switch (c->type) {
+	case COND_TYPE_TRUE:
+	case COND_TYPE_FALSE:
+	case COND_TYPE_RCODE:
+	case COND_TYPE_AND:
+	case COND_TYPE_OR:
+		return true;
+
+	/*
+	 *	Existence checks.
+	 */
+	case COND_TYPE_TMPL:
+		return (tmpl_is_attr(c->data.vpt) || tmpl_is_list(c->data.vpt)) &&
+			fr_type_is_null(c->data.vpt->cast);
+
+	case COND_TYPE_CHILD:
+		for (c = c->data.child; c; c = c->next) {
+			if (!cond_infallible(c)) return false;
+		}
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/** Relative cost of evaluating an infallible condition node
+ *
+ */
+static int cond_cost(fr_cond_t const *c)
+{
+	int cost = 0;
+
+	switch (c->type) {
+	case COND_TYPE_TRUE:
+	case COND_TYPE_FALSE:
+		return 0;
+
+	case COND_TYPE_RCODE:
+		return 1;
+
+	case COND_TYPE_CHILD:
+		for (c = c->data.child; c; c = c->next) {
+			int child_cost = cond_cost(c);
+
+			if (child_cost > cost) cost = child_cost;
+		}
+		return cost;
+
+	case COND_TYPE_AND:
+	case COND_TYPE_OR:
+		return 0;
+
+	default:
+		return 2;
+	}
+}
+
+/** Whether a condition node can be converted to a set membership test
+ *
+ */
+static bool cond_set_eligible(fr_cond_t const *c)
+{
+	map_t const	*map;
+	fr_type_t	type;
+
+	if ((c->type != COND_TYPE_MAP) || c->negate || c->async_required ||
+	    (c->pass2_fixup != PASS2_FIXUP_NONE)) return false;
+
+	map = c->data.map;
+	if ((map->op != T_OP_CMP_EQ) || !tmpl_is_attr(map->lhs) || !fr_type_is_null(map->lhs->cast) ||
+	    !tmpl_is_data(map->rhs)) return false;
+
+	type = tmpl_da(map->lhs)->type;
+	if (tmpl_value_type(map->rhs) != type) return false;
+
+	/*
+	 *	Comparisons against prefixes check whether one
+	 *	contains the other, which a lookup can't do.
+	 */
+	if ((type == FR_TYPE_IPV4_PREFIX) || (type == FR_TYPE_IPV6_PREFIX)) return false;
+
+	return (fr_htrie_hint(type) != FR_HTRIE_INVALID);
+}
+
+static bool cond_set_same(fr_cond_t const *a, fr_cond_t const *b)
+{
+	tmpl_t const *a_vpt = a->data.map->lhs;
+	tmpl_t const *b_vpt = b->data.map->lhs;
+
+	return (tmpl_da(a_vpt) == tmpl_da(b_vpt)) &&
+	       (a_vpt->len == b_vpt->len) && (memcmp(a_vpt->name, b_vpt->name, a_vpt->len) == 0);
+}
+
+/** Convert a run of "&Foo == bar" comparisons to a set membership test
+ *
+ * The first node in the run becomes the set, the caller is responsible
+ * for freeing the others.
+ *
+ * @param[in] run	of conditions to convert.
+ * @param[in] num	of conditions in the run.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, the conditions are left as-is.
+ */
+static int cond_set_alloc(fr_cond_t **run, size_t num)
+{
+	fr_cond_t	*c = run[0];
+	fr_cond_set_t	*set;
+	tmpl_t		*vpt = c->data.map->lhs;
+	size_t		i;
+
+	MEM(set = talloc_zero(c, fr_cond_set_t));
+	MEM(set->values = talloc_zero_array(set, fr_value_box_t, num));
+	MEM(set->ht = fr_htrie_alloc(set, fr_htrie_hint(tmpl_da(vpt)->type),
+				     cond_set_hash, cond_set_cmp, cond_set_to_key, NULL));
+
+	for (i = 0; i < num; i++) {
+		if (fr_value_box_copy(set->values, &set->values[i], tmpl_value(run[i]->data.map->rhs)) < 0) {
+			talloc_free(set);
+			return -1;
+		}
+
+		/*
+		 *	Duplicates are harmless, the first one wins.
+		 */
+		(void) fr_htrie_insert(set->ht, &set->values[i]);
+	}
+
+	set->vpt = talloc_steal(set, vpt);
+	talloc_free(c->data.map);
+
+	c->type = COND_TYPE_SET;
+	c->data.set = set;
+
+	return 0;
+}
+
+/** Fold a single operand of a condition chain
+ *
+ */
+static void cond_fold(fr_cond_t *c)
+{
+	switch (c->type) {
+	case COND_TYPE_TRUE:
+	case COND_TYPE_FALSE:
+		cond_to_bool(c, (c->type == COND_TYPE_TRUE));
+		break;
+
+	/*
+	 *	pass2 may have resolved both sides to data.
+	 */
+	case COND_TYPE_MAP:
+	{
+		map_t const	*map = c->data.map;
+		int		rcode;
+
+		if (!tmpl_is_data(map->lhs) || !tmpl_is_data(map->rhs) ||
+		    !fr_type_is_null(map->lhs->cast) ||
+		    (map->op == T_OP_REG_EQ) || (map->op == T_OP_REG_NE) ||
+		    (tmpl_value_type(map->lhs) != tmpl_value_type(map->rhs))) break;
+
+		rcode = fr_value_box_cmp_op(map->op, tmpl_value(map->lhs), tmpl_value(map->rhs));
+		if (rcode < 0) break;
+
+		cond_to_bool(c, (rcode == 1));
+	}
+		break;
+
+	/*
+	 *	(FOO) -> FOO
+	 *	!(FOO) -> !FOO
+	 */
+	case COND_TYPE_CHILD:
+	{
+		fr_cond_t *child = c->data.child;
+
+		fr_cond_optimise(child);
+		if (child->next) break;
+
+		c->type = child->type;
+		c->data = child->data;
+		c->negate = (c->negate != child->negate);
+		c->pass2_fixup = child->pass2_fixup;
+		c->async_required = child->async_required;
+
+		(void) talloc_steal(c, cond_data(c));
+		if (c->type == COND_TYPE_CHILD) cond_reparent(c->data.child, c);
+		talloc_free(child);
+
+		if ((c->type == COND_TYPE_TRUE) || (c->type == COND_TYPE_FALSE)) {
+			cond_to_bool(c, (c->type == COND_TYPE_TRUE));
+		}
+	}
+		break;
+
+	default:
+		break;
+	}
+}
+
+/** Optimise a condition after pass2 has resolved its tmpls
+ *
+ *  - Comparisons between literals, and "true" / "false" operands are folded.
+ *  - Runs of "&Foo == a || &Foo == b || ..." are replaced with a single
+ *    set membership test.
+ *  - Operands which can't fail are sorted so that the cheapest ones are
+ *    evaluated first, and short-circuit the more expensive ones.
+ *
+ *  Operands which may fail are never moved or removed, as an error aborts
+ *  evaluation of the entire condition.  Chains which mix && and || are only
+ *  folded.
+ *
+ *  The head of the chain is never freed, so any references to it remain
+ *  valid.
+ *
+ * @param[in] head	of the condition to optimise.
+ */
+void fr_cond_optimise(fr_cond_t *head)
+{
+	fr_cond_t	*c, *next, **ops, **keep, *moved;
+	fr_cond_type_t	conn = COND_TYPE_INVALID, stop, ignore;
+	bool		mixed = false;
+	size_t		num = 0, num_eval, num_keep = 0, i, j;
+
+	for (c = head; c; c = c->next) {
+		if ((c->type == COND_TYPE_AND) || (c->type == COND_TYPE_OR)) {
+			if (conn == COND_TYPE_INVALID) {
+				conn = c->type;
+			} else if (c->type != conn) {
+				mixed = true;
+			}
+			continue;
+		}
+
+		cond_fold(c);
+		num++;
+	}
+
+	if ((num < 2) || mixed) return;
+
+	MEM(ops = talloc_array(NULL, fr_cond_t *, num));
+	MEM(keep = talloc_array(ops, fr_cond_t *, num));
+	for (c = head, i = 0; c; c = c->next) {
+		if ((c->type == COND_TYPE_AND) || (c->type == COND_TYPE_OR)) continue;
+		ops[i++] = c;
+	}
+
+	if (conn == COND_TYPE_AND) {
+		stop = COND_TYPE_FALSE;
+		ignore = COND_TYPE_TRUE;
+	} else {
+		stop = COND_TYPE_TRUE;
+		ignore = COND_TYPE_FALSE;
+	}
+
+	/*
+	 *	Nothing after "false" in an && chain, or "true" in an
+	 *	|| chain, is ever evaluated.  If nothing before it can
+	 *	fail, then the result is known.
+	 */
+	for (i = 0; i < num; i++) {
+		if (ops[i]->type == stop) break;
+	}
+	num_eval = num;
+	if (i < num) {
+		for (j = 0; j < i; j++) {
+			if (!cond_infallible(ops[j])) break;
+		}
+
+		if (j == i) {
+			keep[num_keep++] = ops[i];
+			goto rebuild;
+		}
+		num_eval = i + 1;
+	}
+
+	/*
+	 *	"true" in an && chain, and "false" in an || chain
+	 *	don't change the result.
+	 */
+	for (i = 0; i < num_eval; i++) {
+		if (ops[i]->type == ignore) continue;
+		keep[num_keep++] = ops[i];
+	}
+	if (!num_keep) keep[num_keep++] = ops[0];
+
+	/*
+	 *	&Foo == a || &Foo == b || &Foo == c -> set lookup
+	 */
+	if (conn == COND_TYPE_OR) {
+		size_t run;
+
+		for (i = 0, j = 0; i < num_keep; i = run) {
+			run = i + 1;
+			if (cond_set_eligible(keep[i])) {
+				while ((run < num_keep) && cond_set_eligible(keep[run]) &&
+				       cond_set_same(keep[i], keep[run])) run++;
+			}
+
+			if (((run - i) >= COND_SET_MIN) && (cond_set_alloc(&keep[i], run - i) == 0)) {
+				keep[j++] = keep[i];
+				continue;
+			}
+
+			while (i < run) keep[j++] = keep[i++];
+		}
+		num_keep = j;
+	}
+
+	/*
+	 *	Sort each run of infallible operands by cost.  Chains
+	 *	are short, so an insertion sort is fine, and it's
+	 *	stable.
+	 */
+	for (i = 1; i < num_keep; i++) {
+		fr_cond_t	*this = keep[i];
+		int		cost;
+
+		if (!cond_infallible(this)) continue;
+
+		cost = cond_cost(this);
+		for (j = i; (j > 0) && cond_infallible(keep[j - 1]) && (cond_cost(keep[j - 1]) > cost); j--) {
+			keep[j] = keep[j - 1];
+		}
+		keep[j] = this;
+	}
+
+rebuild:
+	if (num_keep == num) {
+		for (i = 0; i < num; i++) {
+			if (keep[i] != ops[i]) break;
+		}
+		if (i == num) goto done;
+	}
+
+	/*
+	 *	Siblings are allocated from their older siblings.
+	 *	Flatten that so we can free nodes individually.
+	 */
+	for (c = head->next; c; c = c->next) (void) talloc_steal(head, c);
+
+	/*
+	 *	Free the data for operands we're not keeping, and copy
+	 *	out the ones we are.
+	 */
+	for (i = 0; i < num; i++) {
+		for (j = 0; j < num_keep; j++) {
+			if (keep[j] == ops[i]) break;
+		}
+		if (j == num_keep) talloc_free(cond_data(ops[i]));
+	}
+
+	MEM(moved = talloc_array(ops, fr_cond_t, num_keep));
+	for (i = 0; i < num_keep; i++) moved[i] = *keep[i];
+
+	/*
+	 *	The operands we're keeping go into the first nodes of
+	 *	the chain, so the head and the connectors stay where
+	 *	they are.
+	 */
+	for (i = 0; i < num_keep; i++) {
+		c = ops[i];
+
+		c->type = moved[i].type;
+		c->data = moved[i].data;
+		c->negate = moved[i].negate;
+		c->pass2_fixup = moved[i].pass2_fixup;
+		c->async_required = moved[i].async_required;
+
+		(void) talloc_steal(c, cond_data(c));
+		if (c->type == COND_TYPE_CHILD) cond_reparent(c->data.child, c);
+	}
+
+	c = ops[num_keep - 1]->next;
+	ops[num_keep - 1]->next = NULL;
+	while (c) {
+		next = c->next;
+		talloc_free(c);
+		c = next;
+	}
+
+done:
+	talloc_free(ops);
+}
+
 /** Convert a single map to a condition.
  *
  * @param ctx	the talloc context where the condition is allocated
@@ -0,0 +1,299 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * @file src/lib/server/cred_cache.c
+ * @brief Short lived cache of credential verification results
+ *
+ * Authentication modules use this to avoid repeating expensive
+ * verifications for clients which send the same credentials over
+ * and over, and to throttle repeated attempts with bad credentials.
+ *
+ * Entries are keyed by an HMAC of the user name, the credentials
+ * presented by the user, and the "known good" reference they were
+ * checked against.  The HMAC key is random, and private to each
+ * cache, so neither the credentials nor the reference can be
+ * recovered from memory, and a change in the reference invalidates
+ * the entry.
+ *
+ * Caches are not thread safe.  They are intended to be allocated
+ * per module thread instance.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/cred_cache.h>
+
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
+#include <freeradius-devel/util/rand.h>
+
+#define CRED_CACHE_BLOCK_LEN	64	//!< SHA1 block size.
+
+struct fr_cred_cache_s {
+	fr_cred_cache_conf_t const	*conf;		//!< TTLs and size limit.
+	fr_hash_table_t			*ht;		//!< Entries indexed by key.
+	fr_dlist_head_t			lru;		//!< Entries in insertion order, oldest first.
+
+	fr_sha1_ctx			inner;		//!< SHA1 state after hashing key ^ ipad.
+	fr_sha1_ctx			outer;		//!< SHA1 state after hashing key ^ opad.
+};
+
+typedef struct {
+	fr_cred_cache_key_t		key;		//!< HMAC of the credentials.
+	fr_dlist_t			entry;		//!< Entry in the LRU list.
+	fr_time_t			expires;	//!< When the entry should no longer be used.
+	bool				valid;		//!< Whether the credentials were valid.
+	size_t				data_len;	//!< Length of data.
+	uint8_t				data[FR_CRED_CACHE_DATA_MAX];	//!< Data the module wants to keep with the result.
+} fr_cred_cache_entry_t;
+
+CONF_PARSER const fr_cred_cache_config[] = {
+	{ FR_CONF_OFFSET("ttl", FR_TYPE_TIME_DELTA, fr_cred_cache_conf_t, ttl), .dflt = "0" },
+	{ FR_CONF_OFFSET("negative_ttl", FR_TYPE_TIME_DELTA, fr_cred_cache_conf_t, negative_ttl), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, fr_cred_cache_conf_t, max_entries), .dflt = "16384" },
+
+	CONF_PARSER_TERMINATOR
+};
+
+static uint32_t cred_cache_entry_hash(void const *data)
+{
+	fr_cred_cache_entry_t const	*entry = data;
+	uint32_t			hash;
+
+	/*
+	 *	The key is already a keyed hash.
+	 */
+	memcpy(&hash, entry->key.key, sizeof(hash));
+
+	return hash;
+}
+
+static int8_t cred_cache_entry_cmp(void const *one, void const *two)
+{
+	fr_cred_cache_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = memcmp(a->key.key, b->key.key, sizeof(a->key.key));
+	return CMP(ret, 0);
+}
+
+static void cred_cache_entry_free(fr_cred_cache_t *cache, fr_cred_cache_entry_t *entry)
+{
+	fr_hash_table_remove(cache->ht, entry);
+	fr_dlist_remove(&cache->lru, entry);
+	talloc_free(entry);
+}
+
+/** Allocate a new credential cache
+ *
+ * @param[in] ctx	to allocate the cache in.
+ * @param[in] conf	TTLs and size limit.  Must remain valid for the lifetime of the cache.
+ * @return
+ *	- A new cache.
+ *	- NULL on error.
+ */
+fr_cred_cache_t *fr_cred_cache_alloc(TALLOC_CTX *ctx, fr_cred_cache_conf_t const *conf)
+{
+	fr_cred_cache_t	*cache;
+	uint8_t		secret[CRED_CACHE_BLOCK_LEN];
+	uint8_t		pad[CRED_CACHE_BLOCK_LEN];
+	size_t		i;
+
+	MEM(cache = talloc_zero(ctx, fr_cred_cache_t));
+	cache->conf = conf;
+
+	cache->ht = fr_hash_table_alloc(cache, cred_cache_entry_hash, cred_cache_entry_cmp, NULL);
+	if (!cache->ht) {
+		talloc_free(cache);
+		return NULL;
+	}
+	fr_dlist_talloc_init(&cache->lru, fr_cred_cache_entry_t, entry);
+
+	/*
+	 *	Pre-compute the HMAC inner and outer states,
+	 *	so each key only costs two SHA1 finalisations.
+	 */
+	for (i = 0; i < sizeof(secret); i += sizeof(uint32_t)) {
+		uint32_t r = fr_rand();
+
+		memcpy(secret + i, &r, sizeof(r));
+	}
+
+	for (i = 0; i < sizeof(pad); i++) pad[i] = secret[i] ^ 0x36;
+	fr_sha1_init(&cache->inner);
+	fr_sha1_update(&cache->inner, pad, sizeof(pad));
+
+	for (i = 0; i < sizeof(pad); i++) pad[i] = secret[i] ^ 0x5c;
+	fr_sha1_init(&cache->outer);
+	fr_sha1_update(&cache->outer, pad, sizeof(pad));
+
+	memset(secret, 0, sizeof(secret));
+	memset(pad, 0, sizeof(pad));
+
+	return cache;
+}
+
+static inline void cred_cache_key_update(fr_sha1_ctx *ctx, uint8_t const *in, size_t inlen)
+{
+	uint8_t len[4];
+
+	/*
+	 *	Length prefix each component, so that
+	 *	moving bytes between them changes the key.
+	 */
+	len[0] = (inlen >> 24) & 0xff;
+	len[1] = (inlen >> 16) & 0xff;
+	len[2] = (inlen >> 8) & 0xff;
+	len[3] = inlen & 0xff;
+
+	fr_sha1_update(ctx, len, sizeof(len));
+	if (inlen) fr_sha1_update(ctx, in, inlen);
+}
+
+/** Calculate the key for a set of credentials
+ *
+ * @param[out] out	Where to write the key.
+ * @param[in] cache	The key is only valid for this cache.
+ * @param[in] type	of the reference, so that references of different types never match.
+ * @param[in] user	Name of the user.  May be NULL.
+ * @param[in] user_len	Length of the user name.
+ * @param[in] cred	Credentials presented by the user.  May be NULL.
+ * @param[in] cred_len	Length of the credentials.
+ * @param[in] ref	"known good" reference the credentials are checked against.  May be NULL.
+ * @param[in] ref_len	Length of the reference.
+ */
+void fr_cred_cache_key(fr_cred_cache_key_t *out, fr_cred_cache_t const *cache, uint32_t type,
+		       uint8_t const *user, size_t user_len,
+		       uint8_t const *cred, size_t cred_len,
+		       uint8_t const *ref, size_t ref_len)
+{
+	fr_sha1_ctx	ctx;
+	uint8_t		digest[SHA1_DIGEST_LENGTH];
+	uint8_t		type_buff[4];
+
+	type_buff[0] = (type >> 24) & 0xff;
+	type_buff[1] = (type >> 16) & 0xff;
+	type_buff[2] = (type >> 8) & 0xff;
+	type_buff[3] = type & 0xff;
+
+	ctx = cache->inner;
+	fr_sha1_update(&ctx, type_buff, sizeof(type_buff));
+	cred_cache_key_update(&ctx, user, user ? user_len : 0);
+	cred_cache_key_update(&ctx, cred, cred ? cred_len : 0);
+	cred_cache_key_update(&ctx, ref, ref ? ref_len : 0);
+	fr_sha1_final(digest, &ctx);
+
+	ctx = cache->outer;
+	fr_sha1_update(&ctx, digest, sizeof(digest));
+	fr_sha1_final(out->key, &ctx);
+}
+
+/** Find the result of a recent verification
+ *
+ * @param[out] data	Data stored with the result.  May be NULL.
+ * @param[out] data_len	Length of the data.  May be NULL.
+ * @param[in] cache	to search.
+ * @param[in] key	of the credentials.
+ * @return
+ *	- FR_CRED_CACHE_MISS if there's no unexpired entry.
+ *	- FR_CRED_CACHE_VALID if the credentials were valid.
+ *	- FR_CRED_CACHE_INVALID if the credentials were invalid.
+ */
+fr_cred_cache_result_t fr_cred_cache_find(uint8_t const **data, size_t *data_len,
+					  fr_cred_cache_t *cache, fr_cred_cache_key_t const *key)
+{
+	fr_cred_cache_entry_t	find, *entry;
+
+	find.key = *key;
+	entry = fr_hash_table_find(cache->ht, &find);
+	if (!entry) return FR_CRED_CACHE_MISS;
+
+	if (entry->expires <= fr_time()) {
+		cred_cache_entry_free(cache, entry);
+		return FR_CRED_CACHE_MISS;
+	}
+
+	if (data) *data = entry->data;
+	if (data_len) *data_len = entry->data_len;
+
+	return entry->valid ? FR_CRED_CACHE_VALID : FR_CRED_CACHE_INVALID;
+}
+
+/** Record the result of a verification
+ *
+ * Results for which the corresponding TTL is zero are not recorded.
+ *
+ * @param[in] cache	to insert the result into.
+ * @param[in] key	of the credentials.
+ * @param[in] valid	Whether the credentials were valid.
+ * @param[in] data	to store with the result, e.g. session keys.  May be NULL.
+ * @param[in] data_len	Length of data.  Must be no more than FR_CRED_CACHE_DATA_MAX.
+ */
+void fr_cred_cache_insert(fr_cred_cache_t *cache, fr_cred_cache_key_t const *key, bool valid,
+			  uint8_t const *data, size_t data_len)
+{
+	fr_cred_cache_entry_t	find, *entry;
+	fr_time_delta_t		ttl = valid ? cache->conf->ttl : cache->conf->negative_ttl;
+	fr_time_t		now;
+
+	if (ttl <= 0) return;
+
+	if (!data) data_len = 0;
+	if (!fr_cond_assert(data_len <= FR_CRED_CACHE_DATA_MAX)) return;
+
+	now = fr_time();
+
+	/*
+	 *	Replace any existing entry for the same credentials.
+	 */
+	find.key = *key;
+	entry = fr_hash_table_find(cache->ht, &find);
+	if (entry) cred_cache_entry_free(cache, entry);
+
+	/*
+	 *	Make room, and discard expired entries
+	 *	from the head of the list.
+	 */
+	while ((entry = fr_dlist_head(&cache->lru)) &&
+	       ((fr_dlist_num_elements(&cache->lru) >= cache->conf->max_entries) || (entry->expires <= now))) {
+		cred_cache_entry_free(cache, entry);
+	}
+
+	if (cache->conf->max_entries == 0) return;
+
+	MEM(entry = talloc_zero(cache, fr_cred_cache_entry_t));
+	entry->key = *key;
+	entry->expires = now + ttl;
+	entry->valid = valid;
+	entry->data_len = data_len;
+	if (data_len) memcpy(entry->data, data, data_len);
+
+	if (!fr_hash_table_insert(cache->ht, entry)) {
+		talloc_free(entry);
+		return;
+	}
+	fr_dlist_insert_tail(&cache->lru, entry);
+}
+
+/** Return the number of entries in the cache, including expired ones
+ *
+ */
+uint32_t fr_cred_cache_num_entries(fr_cred_cache_t const *cache)
+{
+	return fr_dlist_num_elements(&cache->lru);
+}
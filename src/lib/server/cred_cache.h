@@ -0,0 +1,89 @@
+#pragma once
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * @file src/lib/server/cred_cache.h
+ * @brief Short lived cache of credential verification results
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSIDH(cred_cache_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <freeradius-devel/server/request.h>
+#include <freeradius-devel/server/cf_parse.h>
+#include <freeradius-devel/util/sha1.h>
+#include <freeradius-devel/util/time.h>
+
+#define FR_CRED_CACHE_KEY_LEN		SHA1_DIGEST_LENGTH	//!< Length of a cache key.
+#define FR_CRED_CACHE_DATA_MAX		32			//!< Maximum data stored with a result.
+
+typedef struct fr_cred_cache_s fr_cred_cache_t;
+
+/** Cache key, a keyed hash of the credentials
+ *
+ */
+typedef struct {
+	uint8_t			key[FR_CRED_CACHE_KEY_LEN];
+} fr_cred_cache_key_t;
+
+/** Common configuration for credential caches
+ *
+ */
+typedef struct {
+	fr_time_delta_t		ttl;			//!< How long successful verifications are remembered.
+	fr_time_delta_t		negative_ttl;		//!< How long failed verifications are remembered.
+	uint32_t		max_entries;		//!< Maximum number of entries in the cache.
+} fr_cred_cache_conf_t;
+
+typedef enum {
+	FR_CRED_CACHE_MISS = 0,				//!< No unexpired entry for the credentials.
+	FR_CRED_CACHE_VALID,				//!< Credentials were recently verified.
+	FR_CRED_CACHE_INVALID				//!< Credentials recently failed verification.
+} fr_cred_cache_result_t;
+
+extern CONF_PARSER const fr_cred_cache_config[];
+
+/** Whether a cache should be allocated for this configuration
+ *
+ */
+static inline bool fr_cred_cache_enabled(fr_cred_cache_conf_t const *conf)
+{
+	return (conf->ttl > 0) || (conf->negative_ttl > 0);
+}
+
+fr_cred_cache_t		*fr_cred_cache_alloc(TALLOC_CTX *ctx, fr_cred_cache_conf_t const *conf) CC_HINT(nonnull);
+
+void			fr_cred_cache_key(fr_cred_cache_key_t *out, fr_cred_cache_t const *cache, uint32_t type,
+					  uint8_t const *user, size_t user_len,
+					  uint8_t const *cred, size_t cred_len,
+					  uint8_t const *ref, size_t ref_len) CC_HINT(nonnull(1,2));
+
+fr_cred_cache_result_t	fr_cred_cache_find(uint8_t const **data, size_t *data_len,
+					   fr_cred_cache_t *cache, fr_cred_cache_key_t const *key) CC_HINT(nonnull(3,4));
+
+void			fr_cred_cache_insert(fr_cred_cache_t *cache, fr_cred_cache_key_t const *key, bool valid,
+					     uint8_t const *data, size_t data_len) CC_HINT(nonnull(1,2));
+
+uint32_t		fr_cred_cache_num_entries(fr_cred_cache_t const *cache) CC_HINT(nonnull);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,236 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for the credential cache
+ *
+ * @file src/lib/server/cred_cache_tests.c
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+#include <freeradius-devel/util/acutest.h>
+
+#include <freeradius-devel/server/cred_cache.h>
+#include <freeradius-devel/util/time.h>
+
+#define TEST_TYPE	1
+
+static fr_cred_cache_conf_t const default_conf = {
+	.ttl = (fr_time_delta_t)NSEC * 60,
+	.negative_ttl = (fr_time_delta_t)NSEC * 60,
+	.max_entries = 16
+};
+
+static void key_make(fr_cred_cache_key_t *out, fr_cred_cache_t const *cache, uint32_t type,
+		     char const *user, char const *cred, char const *ref)
+{
+	fr_cred_cache_key(out, cache, type,
+			  (uint8_t const *)user, user ? strlen(user) : 0,
+			  (uint8_t const *)cred, cred ? strlen(cred) : 0,
+			  (uint8_t const *)ref, ref ? strlen(ref) : 0);
+}
+
+static void test_miss(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	fr_cred_cache_t		*cache;
+	fr_cred_cache_key_t	key;
+
+	cache = fr_cred_cache_alloc(ctx, &default_conf);
+	TEST_CHECK(cache != NULL);
+
+	key_make(&key, cache, TEST_TYPE, "bob", "hello", "known good");
+	TEST_CHECK(fr_cred_cache_find(NULL, NULL, cache, &key) == FR_CRED_CACHE_MISS);
+	TEST_CHECK(fr_cred_cache_num_entries(cache) == 0);
+
+	talloc_free(ctx);
+}
+
+static void test_hit(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	fr_cred_cache_t		*cache;
+	fr_cred_cache_key_t	key;
+	uint8_t const		session_key[] = { 0x01, 0x02, 0x03, 0x04 };
+	uint8_t const		*data = NULL;
+	size_t			data_len = 0;
+
+	cache = fr_cred_cache_alloc(ctx, &default_conf);
+	TEST_CHECK(cache != NULL);
+
+	key_make(&key, cache, TEST_TYPE, "bob", "hello", "known good");
+	fr_cred_cache_insert(cache, &key, true, session_key, sizeof(session_key));
+
+	TEST_CHECK(fr_cred_cache_find(&data, &data_len, cache, &key) == FR_CRED_CACHE_VALID);
+	TEST_CHECK(data_len == sizeof(session_key));
+	TEST_CHECK(data && (memcmp(data, session_key, sizeof(session_key)) == 0));
+	TEST_CHECK(fr_cred_cache_num_entries(cache) == 1);
+
+	/*
+	 *	Replacing the result doesn't add an entry
+	 */
+	fr_cred_cache_insert(cache, &key, false, NULL, 0);
+	TEST_CHECK(fr_cred_cache_find(NULL, NULL, cache, &key) == FR_CRED_CACHE_INVALID);
+	TEST_CHECK(fr_cred_cache_num_entries(cache) == 1);
+
+	talloc_free(ctx);
+}
+
+static void test_negative(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	fr_cred_cache_t		*cache;
+	fr_cred_cache_key_t	key;
+	fr_cred_cache_conf_t	conf = default_conf;
+
+	cache = fr_cred_cache_alloc(ctx, &default_conf);
+	TEST_CHECK(cache != NULL);
+
+	key_make(&key, cache, TEST_TYPE, "bob", "wrong", "known good");
+	fr_cred_cache_insert(cache, &key, false, NULL, 0);
+	TEST_CHECK(fr_cred_cache_find(NULL, NULL, cache, &key) == FR_CRED_CACHE_INVALID);
+	talloc_free(cache);
+
+	/*
+	 *	Failures aren't recorded without a negative_ttl
+	 */
+	conf.negative_ttl = 0;
+	cache = fr_cred_cache_alloc(ctx, &conf);
+	TEST_CHECK(cache != NULL);
+
+	key_make(&key, cache, TEST_TYPE, "bob", "wrong", "known good");
+	fr_cred_cache_insert(cache, &key, false, NULL, 0);
+	TEST_CHECK(fr_cred_cache_find(NULL, NULL, cache, &key) == FR_CRED_CACHE_MISS);
+	TEST_CHECK(fr_cred_cache_num_entries(cache) == 0);
+
+	talloc_free(ctx);
+}
+
+static void test_key(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	fr_cred_cache_t		*cache, *other;
+	fr_cred_cache_key_t	key, check;
+
+	cache = fr_cred_cache_alloc(ctx, &default_conf);
+	TEST_CHECK(cache != NULL);
+
+	key_make(&key, cache, TEST_TYPE, "bob", "hello", "known good");
+	fr_cred_cache_insert(cache, &key, true, NULL, 0);
+
+	key_make(&check, cache, TEST_TYPE, "bob", "hello", "known good");
+	TEST_CHECK(fr_cred_cache_find(NULL, NULL, cache, &check) == FR_CRED_CACHE_VALID);
+
+	/*
+	 *	Changing any part of the credentials is a miss
+	 */
+	key_make(&check, cache, TEST_TYPE + 1, "bob", "hello", "known good");
+	TEST_CHECK(fr_cred_cache_find(NULL, NULL, cache, &check) == FR_CRED_CACHE_MISS);
+
+	key_make(&check, cache, TEST_TYPE, "alice", "hello", "known good");
+	TEST_CHECK(fr_cred_cache_find(NULL, NULL, cache, &check) == FR_CRED_CACHE_MISS);
+
+	key_make(&check, cache, TEST_TYPE, "bob", "goodbye", "known good");
+	TEST_CHECK(fr_cred_cache_find(NULL, NULL, cache, &check) == FR_CRED_CACHE_MISS);
+
+	key_make(&check, cache, TEST_TYPE, "bob", "hello", "new known good");
+	TEST_CHECK(fr_cred_cache_find(NULL, NULL, cache, &check) == FR_CRED_CACHE_MISS);
+
+	/*
+	 *	Moving bytes between components changes the key
+	 */
+	key_make(&check, cache, TEST_TYPE, "bobh", "ello", "known good");
+	TEST_CHECK(fr_cred_cache_find(NULL, NULL, cache, &check) == FR_CRED_CACHE_MISS);
+
+	/*
+	 *	Keys are private to each cache
+	 */
+	other = fr_cred_cache_alloc(ctx, &default_conf);
+	TEST_CHECK(other != NULL);
+
+	key_make(&check, other, TEST_TYPE, "bob", "hello", "known good");
+	TEST_CHECK(memcmp(key.key, check.key, sizeof(key.key)) != 0);
+
+	talloc_free(ctx);
+}
+
+static void test_expiry(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	fr_cred_cache_t		*cache;
+	fr_cred_cache_key_t	key;
+	fr_cred_cache_conf_t	conf = default_conf;
+
+	conf.ttl = fr_time_delta_from_msec(10);
+
+	cache = fr_cred_cache_alloc(ctx, &conf);
+	TEST_CHECK(cache != NULL);
+
+	key_make(&key, cache, TEST_TYPE, "bob", "hello", "known good");
+	fr_cred_cache_insert(cache, &key, true, NULL, 0);
+	TEST_CHECK(fr_cred_cache_find(NULL, NULL, cache, &key) == FR_CRED_CACHE_VALID);
+
+	usleep(20 * 1000);
+
+	TEST_CHECK(fr_cred_cache_find(NULL, NULL, cache, &key) == FR_CRED_CACHE_MISS);
+	TEST_CHECK(fr_cred_cache_num_entries(cache) == 0);
+
+	talloc_free(ctx);
+}
+
+static void test_max_entries(void)
+{
+	TALLOC_CTX		*ctx = talloc_init_const("test");
+	fr_cred_cache_t		*cache;
+	fr_cred_cache_key_t	first, key;
+	fr_cred_cache_conf_t	conf = default_conf;
+	char			cred[16];
+	int			i;
+
+	conf.max_entries = 4;
+
+	cache = fr_cred_cache_alloc(ctx, &conf);
+	TEST_CHECK(cache != NULL);
+
+	key_make(&first, cache, TEST_TYPE, "bob", "cred0", "known good");
+	fr_cred_cache_insert(cache, &first, true, NULL, 0);
+
+	for (i = 1; i <= 4; i++) {
+		snprintf(cred, sizeof(cred), "cred%i", i);
+		key_make(&key, cache, TEST_TYPE, "bob", cred, "known good");
+		fr_cred_cache_insert(cache, &key, true, NULL, 0);
+		TEST_CHECK(fr_cred_cache_num_entries(cache) <= 4);
+	}
+
+	/*
+	 *	The oldest entry made room for the newest
+	 */
+	TEST_CHECK(fr_cred_cache_num_entries(cache) == 4);
+	TEST_CHECK(fr_cred_cache_find(NULL, NULL, cache, &first) == FR_CRED_CACHE_MISS);
+	TEST_CHECK(fr_cred_cache_find(NULL, NULL, cache, &key) == FR_CRED_CACHE_VALID);
+
+	talloc_free(ctx);
+}
+
+TEST_LIST = {
+	{ "cred_cache_miss",		test_miss },
+	{ "cred_cache_hit",		test_hit },
+	{ "cred_cache_negative",	test_negative },
+	{ "cred_cache_key",		test_key },
+	{ "cred_cache_expiry",		test_expiry },
+	{ "cred_cache_max_entries",	test_max_entries },
+
+	{ NULL }
+};
@@ -0,0 +1,196 @@
+#pragma once
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file lib/server/detail_spool.h
+ * @brief Binary detail file format.
+ *
+ * A binary detail file is a series of records.  Each record is a
+ * fixed size header, followed by the packet exactly as it was
+ * received.  All fields in the header are in network byte order.
+ *
+ *     0    magic		"FRDS"
+ *     4    version		FR_DETAIL_SPOOL_VERSION
+ *     5    flags		FR_DETAIL_SPOOL_FLAG_*
+ *     6    header length	offset of the packet from the start of the record
+ *     8    packet length
+ *    12    protocol		number of the dictionary the packet is in
+ *    16    timestamp		unix time (in nanoseconds) the packet was received
+ *    24    src af, dst af	AF_INET or AF_INET6
+ *    26    src port
+ *    28    dst port
+ *    30    reserved
+ *    32    src address		16 bytes, IPv4 addresses use the first 4
+ *    48    dst address		16 bytes
+ *
+ * Readers mark records as done by setting FR_DETAIL_SPOOL_FLAG_DONE in
+ * place, so the flags byte is the only part of a record which changes
+ * once it has been written.  Readers should skip any extra header bytes
+ * using the header length, so that fields can be added to the end of
+ * the header without changing the version.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSIDH(detail_spool_h, "$Id$")
+
+#include <freeradius-devel/util/inet.h>
+#include <freeradius-devel/util/net.h>
+#include <freeradius-devel/util/time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FR_DETAIL_SPOOL_MAGIC		0x46524453	//!< "FRDS"
+#define FR_DETAIL_SPOOL_VERSION		1
+#define FR_DETAIL_SPOOL_HEADER_LEN	64		//!< Size of the header we write.
+#define FR_DETAIL_SPOOL_FLAGS_OFFSET	5		//!< Where readers mark records as done.
+
+#define FR_DETAIL_SPOOL_FLAG_DONE	0x01		//!< The record has been processed.
+
+/** The decoded form of a record header
+ *
+ */
+typedef struct {
+	uint8_t			version;		//!< FR_DETAIL_SPOOL_VERSION.
+	uint8_t			flags;			//!< FR_DETAIL_SPOOL_FLAG_*.
+	uint16_t		header_len;		//!< Offset of the packet in the record.
+	uint32_t		packet_len;		//!< Length of the packet.
+	uint32_t		protocol;		//!< Dictionary number, e.g. 1 for RADIUS.
+	fr_unix_time_t		timestamp;		//!< When the packet was received.
+
+	fr_ipaddr_t		src_ipaddr;		//!< Where the packet came from.
+	fr_ipaddr_t		dst_ipaddr;		//!< Where the packet was sent to.
+	uint16_t		src_port;
+	uint16_t		dst_port;
+} fr_detail_spool_header_t;
+
+static inline void _detail_spool_addr_encode(uint8_t *af, uint8_t addr[static 16], fr_ipaddr_t const *ipaddr)
+{
+	switch (ipaddr->af) {
+	case AF_INET:
+		*af = AF_INET;
+		memcpy(addr, &ipaddr->addr.v4, sizeof(ipaddr->addr.v4));
+		break;
+
+	case AF_INET6:
+		*af = AF_INET6;
+		memcpy(addr, &ipaddr->addr.v6, sizeof(ipaddr->addr.v6));
+		break;
+
+	default:
+		break;
+	}
+}
+
+static inline int _detail_spool_addr_decode(fr_ipaddr_t *ipaddr, uint8_t af, uint8_t const addr[static 16])
+{
+	memset(ipaddr, 0, sizeof(*ipaddr));
+
+	switch (af) {
+	case 0:
+		ipaddr->af = AF_INET;
+		ipaddr->addr.v4.s_addr = htonl(INADDR_NONE);
+		return 0;
+
+	case AF_INET:
+		ipaddr->af = AF_INET;
+		ipaddr->prefix = 32;
+		memcpy(&ipaddr->addr.v4, addr, sizeof(ipaddr->addr.v4));
+		return 0;
+
+	case AF_INET6:
+		ipaddr->af = AF_INET6;
+		ipaddr->prefix = 128;
+		memcpy(&ipaddr->addr.v6, addr, sizeof(ipaddr->addr.v6));
+		return 0;
+
+	default:
+		return -1;
+	}
+}
+
+/** Write a record header
+ *
+ * @param[out] out	Where to write the header.
+ * @param[in] header	to write.  header_len and version are ignored.
+ */
+static inline void fr_detail_spool_header_encode(uint8_t out[static FR_DETAIL_SPOOL_HEADER_LEN],
+						 fr_detail_spool_header_t const *header)
+{
+	memset(out, 0, FR_DETAIL_SPOOL_HEADER_LEN);
+
+	fr_net_from_uint32(out, FR_DETAIL_SPOOL_MAGIC);
+	out[4] = FR_DETAIL_SPOOL_VERSION;
+	out[FR_DETAIL_SPOOL_FLAGS_OFFSET] = header->flags;
+	fr_net_from_uint16(out + 6, FR_DETAIL_SPOOL_HEADER_LEN);
+	fr_net_from_uint32(out + 8, header->packet_len);
+	fr_net_from_uint32(out + 12, header->protocol);
+	fr_net_from_uint64(out + 16, fr_unix_time_to_nsec(header->timestamp));
+
+	_detail_spool_addr_encode(out + 24, out + 32, &header->src_ipaddr);
+	_detail_spool_addr_encode(out + 25, out + 48, &header->dst_ipaddr);
+	fr_net_from_uint16(out + 26, header->src_port);
+	fr_net_from_uint16(out + 28, header->dst_port);
+}
+
+/** Read a record header
+ *
+ * @param[out] header	The decoded header.
+ * @param[in] data	start of the record.
+ * @param[in] data_len	bytes available from the start of the record.
+ * @return
+ *	- >0 the total length of the record.
+ *	- 0 if there isn't enough data for the whole record.
+ *	- <0 if the record is malformed.
+ */
+static inline ssize_t fr_detail_spool_header_decode(fr_detail_spool_header_t *header,
+						    uint8_t const *data, size_t data_len)
+{
+	size_t record_len;
+
+	if (data_len < FR_DETAIL_SPOOL_HEADER_LEN) return 0;
+
+	if (fr_net_to_uint32(data) != FR_DETAIL_SPOOL_MAGIC) return -1;
+
+	header->version = data[4];
+	if (header->version != FR_DETAIL_SPOOL_VERSION) return -1;
+
+	header->flags = data[FR_DETAIL_SPOOL_FLAGS_OFFSET];
+	header->header_len = fr_net_to_uint16(data + 6);
+	if (header->header_len < FR_DETAIL_SPOOL_HEADER_LEN) return -1;
+
+	header->packet_len = fr_net_to_uint32(data + 8);
+	header->protocol = fr_net_to_uint32(data + 12);
+	header->timestamp = fr_unix_time_from_nsec(fr_net_to_uint64(data + 16));
+
+	if (_detail_spool_addr_decode(&header->src_ipaddr, data[24], data + 32) < 0) return -1;
+	if (_detail_spool_addr_decode(&header->dst_ipaddr, data[25], data + 48) < 0) return -1;
+	header->src_port = fr_net_to_uint16(data + 26);
+	header->dst_port = fr_net_to_uint16(data + 28);
+
+	record_len = (size_t) header->header_len + header->packet_len;
+	if (record_len > data_len) return 0;
+
+	return record_len;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,198 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for the binary detail file format
+ *
+ * @file src/lib/server/detail_spool_tests.c
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+#include <freeradius-devel/util/acutest.h>
+
+#include <freeradius-devel/server/detail_spool.h>
+
+#define PACKET_LEN	(20)
+#define TIMESTAMP	(((uint64_t) 1609459200 * NSEC) + 1234)
+
+/** Write a record the same way rlm_detail does
+ *
+ */
+static size_t record_encode(uint8_t *out, char const *src, char const *dst, uint8_t flags)
+{
+	fr_detail_spool_header_t	header = {
+		.flags = flags,
+		.packet_len = PACKET_LEN,
+		.protocol = 1,
+		.timestamp = fr_unix_time_from_nsec(TIMESTAMP),
+		.src_port = 1234,
+		.dst_port = 1813,
+	};
+
+	TEST_CHECK(fr_inet_pton(&header.src_ipaddr, src, -1, AF_UNSPEC, false, false) == 0);
+	TEST_CHECK(fr_inet_pton(&header.dst_ipaddr, dst, -1, AF_UNSPEC, false, false) == 0);
+
+	fr_detail_spool_header_encode(out, &header);
+	memset(out + FR_DETAIL_SPOOL_HEADER_LEN, 0x42, PACKET_LEN);
+
+	return FR_DETAIL_SPOOL_HEADER_LEN + PACKET_LEN;
+}
+
+static bool ipaddr_equal(fr_ipaddr_t const *ipaddr, char const *str)
+{
+	fr_ipaddr_t	expected;
+
+	if (fr_inet_pton(&expected, str, -1, AF_UNSPEC, false, false) < 0) return false;
+	if (ipaddr->af != expected.af) return false;
+
+	if (ipaddr->af == AF_INET) return memcmp(&ipaddr->addr.v4, &expected.addr.v4, sizeof(expected.addr.v4)) == 0;
+
+	return memcmp(&ipaddr->addr.v6, &expected.addr.v6, sizeof(expected.addr.v6)) == 0;
+}
+
+static void test_roundtrip(char const *src, char const *dst)
+{
+	uint8_t				record[FR_DETAIL_SPOOL_HEADER_LEN + PACKET_LEN];
+	fr_detail_spool_header_t	header;
+	size_t				len;
+
+	len = record_encode(record, src, dst, 0);
+
+	TEST_CHECK(fr_detail_spool_header_decode(&header, record, len) == (ssize_t) len);
+	TEST_CHECK(header.version == FR_DETAIL_SPOOL_VERSION);
+	TEST_CHECK(header.flags == 0);
+	TEST_CHECK(header.header_len == FR_DETAIL_SPOOL_HEADER_LEN);
+	TEST_CHECK(header.packet_len == PACKET_LEN);
+	TEST_CHECK(header.protocol == 1);
+	TEST_CHECK(fr_unix_time_to_nsec(header.timestamp) == TIMESTAMP);
+	TEST_CHECK(ipaddr_equal(&header.src_ipaddr, src));
+	TEST_CHECK(ipaddr_equal(&header.dst_ipaddr, dst));
+	TEST_CHECK(header.src_port == 1234);
+	TEST_CHECK(header.dst_port == 1813);
+}
+
+static void test_roundtrip_ipv4(void)
+{
+	test_roundtrip("192.0.2.1", "192.0.2.2");
+}
+
+static void test_roundtrip_ipv6(void)
+{
+	test_roundtrip("2001:db8::1", "2001:db8::2");
+}
+
+static void test_truncated(void)
+{
+	uint8_t				record[FR_DETAIL_SPOOL_HEADER_LEN + PACKET_LEN];
+	fr_detail_spool_header_t	header;
+	size_t				len;
+
+	len = record_encode(record, "192.0.2.1", "192.0.2.2", 0);
+
+	/*
+	 *	Part of a header, and a header without all of its
+	 *	packet, both need more data.
+	 */
+	TEST_CHECK(fr_detail_spool_header_decode(&header, record, 10) == 0);
+	TEST_CHECK(fr_detail_spool_header_decode(&header, record, len - 1) == 0);
+}
+
+static void test_malformed(void)
+{
+	uint8_t				record[FR_DETAIL_SPOOL_HEADER_LEN + PACKET_LEN];
+	fr_detail_spool_header_t	header;
+	size_t				len;
+
+	len = record_encode(record, "192.0.2.1", "192.0.2.2", 0);
+	record[0] = 'X';
+	TEST_CHECK(fr_detail_spool_header_decode(&header, record, len) < 0);
+
+	len = record_encode(record, "192.0.2.1", "192.0.2.2", 0);
+	record[4] = FR_DETAIL_SPOOL_VERSION + 1;
+	TEST_CHECK(fr_detail_spool_header_decode(&header, record, len) < 0);
+
+	len = record_encode(record, "192.0.2.1", "192.0.2.2", 0);
+	fr_net_from_uint16(record + 6, FR_DETAIL_SPOOL_HEADER_LEN - 1);
+	TEST_CHECK(fr_detail_spool_header_decode(&header, record, len) < 0);
+
+	len = record_encode(record, "192.0.2.1", "192.0.2.2", 0);
+	record[24] = 255;
+	TEST_CHECK(fr_detail_spool_header_decode(&header, record, len) < 0);
+}
+
+static void test_done(void)
+{
+	uint8_t				record[FR_DETAIL_SPOOL_HEADER_LEN + PACKET_LEN];
+	fr_detail_spool_header_t	header;
+	size_t				len;
+
+	/*
+	 *	Readers mark records as done in place.
+	 */
+	len = record_encode(record, "192.0.2.1", "192.0.2.2", 0);
+	record[FR_DETAIL_SPOOL_FLAGS_OFFSET] |= FR_DETAIL_SPOOL_FLAG_DONE;
+
+	TEST_CHECK(fr_detail_spool_header_decode(&header, record, len) == (ssize_t) len);
+	TEST_CHECK(header.flags == FR_DETAIL_SPOOL_FLAG_DONE);
+	TEST_CHECK(header.packet_len == PACKET_LEN);
+	TEST_CHECK(ipaddr_equal(&header.src_ipaddr, "192.0.2.1"));
+}
+
+static void test_longer_header(void)
+{
+	uint8_t				record[FR_DETAIL_SPOOL_HEADER_LEN + 8 + PACKET_LEN];
+	fr_detail_spool_header_t	header;
+	size_t				len;
+
+	/*
+	 *	Fields added by later writers are skipped.
+	 */
+	len = record_encode(record, "192.0.2.1", "192.0.2.2", 0);
+	memmove(record + FR_DETAIL_SPOOL_HEADER_LEN + 8, record + FR_DETAIL_SPOOL_HEADER_LEN, PACKET_LEN);
+	memset(record + FR_DETAIL_SPOOL_HEADER_LEN, 0xff, 8);
+	fr_net_from_uint16(record + 6, FR_DETAIL_SPOOL_HEADER_LEN + 8);
+	len += 8;
+
+	TEST_CHECK(fr_detail_spool_header_decode(&header, record, len) == (ssize_t) len);
+	TEST_CHECK(header.header_len == FR_DETAIL_SPOOL_HEADER_LEN + 8);
+	TEST_CHECK(record[header.header_len] == 0x42);
+}
+
+static void test_no_address(void)
+{
+	uint8_t				record[FR_DETAIL_SPOOL_HEADER_LEN + PACKET_LEN];
+	fr_detail_spool_header_t	header = { .packet_len = PACKET_LEN, .protocol = 1 };
+
+	/*
+	 *	Packets without a source address are still readable.
+	 */
+	fr_detail_spool_header_encode(record, &header);
+
+	TEST_CHECK(fr_detail_spool_header_decode(&header, record, sizeof(record)) == (ssize_t) sizeof(record));
+	TEST_CHECK(header.src_ipaddr.af == AF_INET);
+	TEST_CHECK(header.src_ipaddr.addr.v4.s_addr == htonl(INADDR_NONE));
+}
+
+TEST_LIST = {
+	{ "detail_spool_roundtrip_ipv4",	test_roundtrip_ipv4 },
+	{ "detail_spool_roundtrip_ipv6",	test_roundtrip_ipv6 },
+	{ "detail_spool_truncated",		test_truncated },
+	{ "detail_spool_malformed",		test_malformed },
+	{ "detail_spool_done",			test_done },
+	{ "detail_spool_longer_header",		test_longer_header },
+	{ "detail_spool_no_address",		test_no_address },
+
+	{ NULL }
+};
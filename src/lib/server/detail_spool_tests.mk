@@ -0,0 +1,8 @@
+TARGET		:= detail_spool_tests
+
+SOURCES		:= detail_spool_tests.c
+
+TGT_LDLIBS	:= $(LIBS) $(GPERFTOOLS_LIBS)
+TGT_LDFLAGS	:= $(LDFLAGS) $(GPERFTOOLS_LDFLAGS)
+
+TGT_PREREQS	:= libfreeradius-util.a
@@ -0,0 +1,635 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * @file src/lib/server/helper.c
+ * @brief Pools of long running helper processes
+ *
+ * A helper is a copy of a program which reads request frames from its
+ * stdin, and writes a reply to each one on its stdout, one at a time.
+ * Keeping helpers running avoids forking a new process for every
+ * request.
+ *
+ * A frame is written to an idle helper, and the request yields until
+ * the reply has been read by the event loop.  The caller's reply
+ * callback decides where the reply ends.  Requests arriving when every
+ * helper is busy wait for one to become idle.
+ *
+ * A helper which exits, times out, or sends garbage is discarded.
+ * Pools keep at least `min` helpers running, replacing them after a
+ * short delay, and start more on demand, up to `max`.
+ *
+ * Pools are not thread safe.  They are intended to be allocated per
+ * module thread instance.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/helper.h>
+
+#include <freeradius-devel/server/exec.h>
+#include <freeradius-devel/server/log.h>
+#include <freeradius-devel/unlang/interpret.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <signal.h>
+#include <sys/wait.h>
+
+/** A running helper
+ *
+ */
+struct fr_helper_s {
+	fr_dlist_t		entry;		//!< Entry in the pool's list of helpers.
+	fr_helper_pool_t	*pool;		//!< Pool the helper belongs to.
+
+	pid_t			pid;		//!< Of the helper, or -1 once it has been reaped.
+	int			to_helper;	//!< The helper's stdin.
+	int			from_helper;	//!< The helper's stdout.
+
+	fr_event_pid_t const	*ev_pid;	//!< Tells us when the helper exits.
+	fr_event_timer_t const	*ev_timeout;	//!< Timeout for the exchange in progress.
+
+	bool			starting;	//!< We're still starting the helper.
+	bool			writing;	//!< Waiting for stdin to become writable.
+	bool			busy;		//!< An exchange is in progress.
+	fr_helper_exchange_t	*ex;		//!< Exchange in progress.  NULL if busy, but the
+						//!< exchange has been cancelled.
+	char const		*frame;		//!< Being written to the helper.
+	size_t			frame_len;	//!< Length of the frame.
+	size_t			sent;		//!< How much of the frame has been written.
+
+	char			buff[8192];	//!< Partial line read from the helper.
+	size_t			used;		//!< How much of buff is used.
+};
+
+struct fr_helper_pool_s {
+	fr_helper_pool_conf_t	conf;		//!< How to run the helpers.
+	fr_event_list_t		*el;		//!< Event list the helpers are serviced by.
+
+	fr_dlist_head_t		helpers;	//!< Running helpers.
+	unsigned int		num_helpers;	//!< Number of running helpers.
+	fr_dlist_head_t		waiting;	//!< Exchanges waiting for an idle helper.
+
+	fr_event_timer_t const	*ev_restart;	//!< Replaces helpers which have stopped.
+	bool			freeing;	//!< Don't replace helpers.
+};
+
+static void helper_dispatch(fr_helper_pool_t *pool);
+static void _helper_writable(fr_event_list_t *el, int fd, int flags, void *uctx);
+
+/** Finish an exchange, and resume the request
+ *
+ */
+static void helper_exchange_done(fr_helper_exchange_t *ex, char const *error)
+{
+	ex->helper = NULL;
+	ex->error = error;
+	unlang_interpret_mark_runnable(ex->request);
+}
+
+static int _helper_free(fr_helper_t *helper)
+{
+	fr_helper_pool_t *pool = helper->pool;
+
+	fr_dlist_remove(&pool->helpers, helper);
+	pool->num_helpers--;
+
+	if (helper->ex) {
+		helper_exchange_done(helper->ex, "Helper stopped");
+		helper->ex = NULL;
+	}
+
+	/*
+	 *	The events are parented by the helper, but must be
+	 *	removed before their fds are closed, and possibly
+	 *	reused.
+	 */
+	if (helper->writing) (void) fr_event_fd_delete(pool->el, helper->to_helper, FR_EVENT_FILTER_IO);
+	if (helper->to_helper >= 0) close(helper->to_helper);
+	if (helper->from_helper >= 0) {
+		(void) fr_event_fd_delete(pool->el, helper->from_helper, FR_EVENT_FILTER_IO);
+		close(helper->from_helper);
+	}
+
+	/*
+	 *	Still running, stop it, and make sure
+	 *	it doesn't become a zombie.
+	 */
+	if (helper->pid > 0) {
+		fr_event_pid_t const *ev_pid = helper->ev_pid;
+
+		helper->ev_pid = NULL;
+		talloc_const_free(ev_pid);
+
+		DEBUG2("Stopping %s (pid %u)", pool->conf.name, (unsigned int) helper->pid);
+		kill(helper->pid, SIGTERM);
+		if (fr_event_pid_wait(pool->el, pool->el, NULL, helper->pid, NULL, NULL) < 0) {
+			(void) waitpid(helper->pid, NULL, 0);
+		}
+	}
+
+	return 0;
+}
+
+static void _helper_restart(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx);
+
+/** Replace stopped helpers after a short delay
+ *
+ * The delay stops a program which fails immediately from
+ * being restarted in a tight loop.
+ */
+static void helper_restart_schedule(fr_helper_pool_t *pool)
+{
+	if (pool->ev_restart || pool->freeing || (pool->num_helpers >= pool->conf.min)) return;
+
+	if (fr_event_timer_in(pool, pool->el, &pool->ev_restart, pool->conf.restart_delay,
+			      _helper_restart, pool) < 0) {
+		PERROR("Failed scheduling %s restart", pool->conf.name);
+	}
+}
+
+/** Stop a helper, replacing it later if necessary
+ *
+ * @param[in] helper	to stop.
+ * @param[in] error	Why the exchange in progress failed.  May be NULL.
+ */
+static void helper_fail(fr_helper_t *helper, char const *error)
+{
+	fr_helper_pool_t *pool = helper->pool;
+
+	if (helper->ex) {
+		helper_exchange_done(helper->ex, error ? error : "Helper failed");
+		helper->ex = NULL;
+	}
+
+	talloc_free(helper);
+	helper_restart_schedule(pool);
+}
+
+static void _helper_exited(UNUSED fr_event_list_t *el, pid_t pid, int status, void *uctx)
+{
+	fr_helper_t		*helper = talloc_get_type_abort(uctx, fr_helper_t);
+	fr_helper_pool_t	*pool = helper->pool;
+
+	WARN("%s (pid %u) exited with status %i", pool->conf.name, (unsigned int) pid, status);
+
+	helper->pid = -1;
+	helper->ev_pid = NULL;
+
+	/*
+	 *	Exited before we'd finished starting it,
+	 *	helper_start() frees it.
+	 */
+	if (helper->starting) return;
+
+	helper_fail(helper, "Helper exited");
+	helper_dispatch(pool);
+}
+
+static void _helper_timeout(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	fr_helper_t		*helper = talloc_get_type_abort(uctx, fr_helper_t);
+	fr_helper_pool_t	*pool = helper->pool;
+
+	WARN("%s (pid %u) timed out", pool->conf.name, (unsigned int) helper->pid);
+
+	/*
+	 *	We can't tell which reply is which if it
+	 *	eventually answers, so the helper is replaced.
+	 */
+	helper_fail(helper, "Helper timed out");
+	helper_dispatch(pool);
+}
+
+static void _helper_read(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_helper_t		*helper = talloc_get_type_abort(uctx, fr_helper_t);
+	fr_helper_pool_t	*pool = helper->pool;
+	ssize_t			slen;
+	char			*p, *nl, *end;
+	bool			done = false;
+
+	slen = read(helper->from_helper, helper->buff + helper->used, sizeof(helper->buff) - helper->used);
+	if (slen < 0) {
+		if ((errno == EAGAIN) || (errno == EINTR)) return;
+
+		ERROR("Failed reading from %s (pid %u): %s",
+		      pool->conf.name, (unsigned int) helper->pid, fr_syserror(errno));
+		helper_fail(helper, "Failed reading from helper");
+		helper_dispatch(pool);
+		return;
+	}
+
+	if (slen == 0) {
+		ERROR("%s (pid %u) closed its stdout", pool->conf.name, (unsigned int) helper->pid);
+		helper_fail(helper, "Helper closed its stdout");
+		helper_dispatch(pool);
+		return;
+	}
+
+	if (!helper->busy) {
+		ERROR("Unexpected output from idle %s (pid %u)", pool->conf.name, (unsigned int) helper->pid);
+		helper_fail(helper, NULL);
+		helper_dispatch(pool);
+		return;
+	}
+
+	helper->used += slen;
+	end = helper->buff + helper->used;
+
+	for (p = helper->buff; !done && (nl = memchr(p, '\n', end - p)); p = nl + 1) {
+		int ret;
+
+		*nl = '\0';
+		ret = pool->conf.reply(helper->ex, p, nl - p);
+		if (ret < 0) {
+			ERROR("Invalid reply from %s (pid %u)", pool->conf.name, (unsigned int) helper->pid);
+			helper_fail(helper, "Invalid reply from helper");
+			helper_dispatch(pool);
+			return;
+		}
+		done = (ret == 1);
+	}
+
+	if (done) {
+		fr_helper_exchange_t *ex = helper->ex;
+
+		fr_event_timer_delete(&helper->ev_timeout);
+
+		helper->busy = false;
+		helper->ex = NULL;
+		helper->frame = NULL;
+		helper->frame_len = 0;
+		helper->sent = 0;
+		if (ex) helper_exchange_done(ex, NULL);
+
+		/*
+		 *	Anything after the end of the reply
+		 *	belongs to no exchange.
+		 */
+		if (p < end) {
+			ERROR("%s (pid %u) sent data after its reply", pool->conf.name, (unsigned int) helper->pid);
+			helper_fail(helper, NULL);
+			helper_dispatch(pool);
+			return;
+		}
+	}
+
+	helper->used = end - p;
+	if (helper->used == sizeof(helper->buff)) {
+		ERROR("Line from %s (pid %u) is too long", pool->conf.name, (unsigned int) helper->pid);
+		helper_fail(helper, "Line from helper is too long");
+		helper_dispatch(pool);
+		return;
+	}
+	if (helper->used) memmove(helper->buff, p, helper->used);
+
+	if (done) helper_dispatch(pool);
+}
+
+/** Start a new helper
+ *
+ */
+static fr_helper_t *helper_start(fr_helper_pool_t *pool)
+{
+	fr_helper_t *helper;
+
+	MEM(helper = talloc_zero(pool, fr_helper_t));
+	helper->pool = pool;
+	helper->to_helper = -1;
+	helper->from_helper = -1;
+	helper->starting = true;
+
+	/*
+	 *	There's no request, so the command is split
+	 *	into arguments, but not expanded.
+	 */
+	helper->pid = radius_start_program(&helper->to_helper, &helper->from_helper, NULL,
+					   pool->conf.program, NULL, true, NULL, false);
+	if (helper->pid < 0) {
+		PERROR("Failed starting %s", pool->conf.name);
+		talloc_free(helper);
+		return NULL;
+	}
+
+	fr_dlist_insert_tail(&pool->helpers, helper);
+	pool->num_helpers++;
+	talloc_set_destructor(helper, _helper_free);
+
+	if (fr_event_pid_wait(helper, pool->el, &helper->ev_pid, helper->pid, _helper_exited, helper) < 0) {
+		PERROR("Failed watching %s", pool->conf.name);
+	error:
+		talloc_free(helper);
+		return NULL;
+	}
+	if (helper->pid < 0) {
+		ERROR("%s exited immediately", pool->conf.name);
+		goto error;
+	}
+
+	fr_nonblock(helper->to_helper);
+	fr_nonblock(helper->from_helper);
+	if (fr_event_fd_insert(helper, pool->el, helper->from_helper, _helper_read, NULL, NULL, helper) < 0) {
+		PERROR("Failed inserting %s into event loop", pool->conf.name);
+		goto error;
+	}
+
+	DEBUG2("Started %s (pid %u)", pool->conf.name, (unsigned int) helper->pid);
+	helper->starting = false;
+
+	return helper;
+}
+
+static void _helper_restart(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	fr_helper_pool_t *pool = talloc_get_type_abort(uctx, fr_helper_pool_t);
+
+	while (pool->num_helpers < pool->conf.min) {
+		if (!helper_start(pool)) {
+			helper_restart_schedule(pool);
+			break;
+		}
+	}
+
+	helper_dispatch(pool);
+}
+
+/** Write as much of the current frame as the pipe will take
+ *
+ * @return
+ *	- 0 on success, or if we need to wait for the pipe to drain.
+ *	- -1 on failure.
+ */
+static int helper_write(fr_helper_t *helper)
+{
+	fr_helper_pool_t *pool = helper->pool;
+
+	while (helper->sent < helper->frame_len) {
+		ssize_t slen;
+
+		slen = write(helper->to_helper, helper->frame + helper->sent, helper->frame_len - helper->sent);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+
+			if (errno == EAGAIN) {
+				if (helper->writing) return 0;
+
+				if (fr_event_fd_insert(helper, pool->el, helper->to_helper,
+						       NULL, _helper_writable, NULL, helper) < 0) {
+					PERROR("Failed inserting %s into event loop", pool->conf.name);
+					return -1;
+				}
+				helper->writing = true;
+				return 0;
+			}
+
+			ERROR("Failed writing to %s (pid %u): %s",
+			      pool->conf.name, (unsigned int) helper->pid, fr_syserror(errno));
+			return -1;
+		}
+
+		helper->sent += slen;
+	}
+
+	if (helper->writing) {
+		(void) fr_event_fd_delete(pool->el, helper->to_helper, FR_EVENT_FILTER_IO);
+		helper->writing = false;
+	}
+
+	return 0;
+}
+
+static void _helper_writable(UNUSED fr_event_list_t *el, UNUSED int fd, UNUSED int flags, void *uctx)
+{
+	fr_helper_t		*helper = talloc_get_type_abort(uctx, fr_helper_t);
+	fr_helper_pool_t	*pool = helper->pool;
+
+	if (helper_write(helper) < 0) {
+		helper_fail(helper, "Failed writing to helper");
+		helper_dispatch(pool);
+	}
+}
+
+/** Pass an exchange to an idle helper
+ *
+ * The exchange is only associated with the helper if this succeeds,
+ * so the caller decides how the exchange fails.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.  The helper should be discarded.
+ */
+static int helper_send(fr_helper_t *helper, fr_helper_exchange_t *ex)
+{
+	fr_helper_pool_t	*pool = helper->pool;
+	request_t		*request = ex->request;
+
+	RDEBUG2("Passing request to %s (pid %u)", pool->conf.name, (unsigned int) helper->pid);
+
+	helper->busy = true;
+	helper->frame = ex->frame;
+	helper->frame_len = ex->frame_len;
+	helper->sent = 0;
+
+	if ((pool->conf.timeout > 0) &&
+	    (fr_event_timer_in(helper, pool->el, &helper->ev_timeout, pool->conf.timeout,
+			       _helper_timeout, helper) < 0)) {
+		RPERROR("Failed inserting %s timeout", pool->conf.name);
+		return -1;
+	}
+
+	if (helper_write(helper) < 0) return -1;
+
+	helper->ex = ex;
+	ex->helper = helper;
+
+	return 0;
+}
+
+/** Find an idle helper, starting a new one if they're all busy and we're allowed
+ *
+ * New helpers aren't started while we're waiting to replace ones which
+ * stopped.
+ */
+static fr_helper_t *helper_idle(fr_helper_pool_t *pool)
+{
+	fr_helper_t *helper = NULL;
+
+	while ((helper = fr_dlist_next(&pool->helpers, helper))) {
+		if (!helper->busy) return helper;
+	}
+
+	if ((pool->num_helpers >= pool->conf.max) || pool->ev_restart) return NULL;
+
+	return helper_start(pool);
+}
+
+/** Give waiting exchanges to idle helpers
+ *
+ */
+static void helper_dispatch(fr_helper_pool_t *pool)
+{
+	fr_helper_exchange_t *ex;
+
+	if (pool->freeing) return;
+
+	while ((ex = fr_dlist_head(&pool->waiting))) {
+		fr_helper_t *helper;
+
+		helper = helper_idle(pool);
+		if (!helper) {
+			/*
+			 *	Nothing is running, don't leave
+			 *	exchanges waiting indefinitely.
+			 */
+			if (pool->num_helpers > 0) return;
+
+			while ((ex = fr_dlist_head(&pool->waiting))) {
+				fr_dlist_remove(&pool->waiting, ex);
+				helper_exchange_done(ex, "No helpers running");
+			}
+			return;
+		}
+
+		fr_dlist_remove(&pool->waiting, ex);
+		if (helper_send(helper, ex) < 0) {
+			helper_fail(helper, NULL);
+			helper_exchange_done(ex, "Failed sending request to helper");
+		}
+	}
+}
+
+/** Pass a request frame to a helper
+ *
+ * The request should yield if this function succeeds.  It will be marked
+ * as runnable once the reply has been passed to the reply callback, or
+ * the exchange fails.  It is never marked as runnable by this function.
+ *
+ * @param[in] pool	to pass the frame to.
+ * @param[in] ex	The exchange.  request, frame, frame_len and uctx
+ *			must be set.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, ex->error describes the failure.
+ */
+int fr_helper_pool_send(fr_helper_pool_t *pool, fr_helper_exchange_t *ex)
+{
+	fr_helper_t *helper;
+
+	ex->helper = NULL;
+	ex->error = NULL;
+
+	/*
+	 *	Don't jump the queue.
+	 */
+	if (fr_dlist_num_elements(&pool->waiting) > 0) goto wait;
+
+	helper = helper_idle(pool);
+	if (!helper) {
+		if (pool->num_helpers == 0) {
+			ex->error = "No helpers running";
+			return -1;
+		}
+
+	wait:
+		fr_dlist_insert_tail(&pool->waiting, ex);
+		return 0;
+	}
+
+	if (helper_send(helper, ex) < 0) {
+		helper_fail(helper, NULL);
+		ex->error = "Failed sending request to helper";
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Stop waiting for the result of an exchange
+ *
+ * If the frame has been written, the helper still has to reply, but the
+ * reply is discarded.  If only part of it has been written, the frame
+ * can't be completed once the caller frees it, so the helper is replaced.
+ */
+void fr_helper_pool_cancel(fr_helper_pool_t *pool, fr_helper_exchange_t *ex)
+{
+	fr_helper_t *helper = ex->helper;
+
+	if (!helper) {
+		if (fr_dlist_entry_in_list(&ex->entry)) fr_dlist_remove(&pool->waiting, ex);
+		return;
+	}
+
+	helper->ex = NULL;
+	ex->helper = NULL;
+
+	if (helper->sent < helper->frame_len) {
+		helper_fail(helper, NULL);
+		helper_dispatch(pool);
+		return;
+	}
+	helper->frame = NULL;
+}
+
+static int _helper_pool_free(fr_helper_pool_t *pool)
+{
+	fr_helper_t *helper;
+
+	pool->freeing = true;
+	fr_event_timer_delete(&pool->ev_restart);
+
+	while ((helper = fr_dlist_head(&pool->helpers))) talloc_free(helper);
+
+	return 0;
+}
+
+/** Allocate a pool of helpers, and start the first conf->min of them
+ *
+ * @param[in] ctx	to allocate the pool in.  Freeing the pool stops
+ *			the helpers.
+ * @param[in] el	to service the helpers with.
+ * @param[in] conf	How to run the helpers.  The strings must remain
+ *			valid for the lifetime of the pool.
+ * @return
+ *	- A new pool.
+ *	- NULL if the helpers couldn't be started.
+ */
+fr_helper_pool_t *fr_helper_pool_alloc(TALLOC_CTX *ctx, fr_event_list_t *el, fr_helper_pool_conf_t const *conf)
+{
+	fr_helper_pool_t *pool;
+
+	fr_assert(conf->program && conf->reply && (conf->max > 0) && (conf->min <= conf->max));
+
+	MEM(pool = talloc_zero(ctx, fr_helper_pool_t));
+	pool->conf = *conf;
+	if (!pool->conf.name) pool->conf.name = "helper";
+	pool->el = el;
+	fr_dlist_talloc_init(&pool->helpers, fr_helper_t, entry);
+	fr_dlist_init(&pool->waiting, fr_helper_exchange_t, entry);
+	talloc_set_destructor(pool, _helper_pool_free);
+
+	while (pool->num_helpers < pool->conf.min) {
+		if (!helper_start(pool)) {
+			talloc_free(pool);
+			return NULL;
+		}
+	}
+
+	return pool;
+}
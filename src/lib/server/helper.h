@@ -0,0 +1,87 @@
+#pragma once
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * @file src/lib/server/helper.h
+ * @brief Pools of long running helper processes
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSIDH(helper_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <freeradius-devel/server/request.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/event.h>
+#include <freeradius-devel/util/time.h>
+
+typedef struct fr_helper_pool_s fr_helper_pool_t;
+typedef struct fr_helper_s fr_helper_t;
+
+/** A request frame passed to a helper, and the helper's reply
+ *
+ * Embedded in the caller's per-request state, which must remain valid
+ * until the request is resumed, or the exchange is cancelled.
+ */
+typedef struct {
+	fr_dlist_t		entry;		//!< Entry in the pool's list of waiting exchanges.
+	request_t		*request;	//!< Marked as runnable when the exchange completes.
+	char const		*frame;		//!< To write to the helper.
+	size_t			frame_len;	//!< Length of the frame.
+	void			*uctx;		//!< Caller's state, for the reply callback.
+
+	fr_helper_t		*helper;	//!< Helper processing the exchange.
+	char const		*error;		//!< Why the exchange failed, NULL on success.
+} fr_helper_exchange_t;
+
+/** Process a line of a helper's reply
+ *
+ * @param[in] ex	Exchange the reply is for.  NULL if the exchange was
+ *			cancelled, and the reply is being discarded.
+ * @param[in] line	The line, without the newline, and nul terminated.
+ * @param[in] len	Length of the line.
+ * @return
+ *	- 1 if the reply is complete.
+ *	- 0 if more lines are expected.
+ *	- -1 if the reply is invalid.  The helper is replaced.
+ */
+typedef int (*fr_helper_reply_t)(fr_helper_exchange_t *ex, char *line, size_t len);
+
+typedef struct {
+	char const		*name;		//!< Of the helpers, for log messages.
+	char const		*program;	//!< Command to start a helper.  It is split into
+						//!< arguments, but not expanded.
+	unsigned int		min;		//!< Helpers to keep running.
+	unsigned int		max;		//!< Helpers to start on demand.
+	fr_time_delta_t		timeout;	//!< For each exchange.  0 for no timeout.
+	fr_time_delta_t		restart_delay;	//!< Before replacing helpers which stop, when
+						//!< fewer than min are running.
+	fr_helper_reply_t	reply;		//!< Called for each line the helpers write.
+} fr_helper_pool_conf_t;
+
+fr_helper_pool_t	*fr_helper_pool_alloc(TALLOC_CTX *ctx, fr_event_list_t *el, fr_helper_pool_conf_t const *conf);
+
+int			fr_helper_pool_send(fr_helper_pool_t *pool, fr_helper_exchange_t *ex);
+
+void			fr_helper_pool_cancel(fr_helper_pool_t *pool, fr_helper_exchange_t *ex);
+
+#ifdef __cplusplus
+}
+#endif
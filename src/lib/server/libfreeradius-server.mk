@@ -11,11 +11,13 @@ SOURCES	:= \
 	cond_eval.c \
 	cond_tokenize.c \
 	connection.c \
+	cred_cache.c \
 	crypt.c \
 	dependency.c \
 	dl_module.c \
 	exec.c \
 	exfile.c \
+	helper.c \
 	log.c \
 	main_config.c \
 	main_loop.c \
@@ -37,6 +39,7 @@ SOURCES	:= \
 	stats.c \
 	tmpl_eval.c \
 	tmpl_tokenize.c \
+	trace.c \
 	trigger.c \
 	trunk.c \
 	users_file.c \
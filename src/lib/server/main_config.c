@@ -164,6 +164,17 @@ static const CONF_PARSER thread_config[] = {
 
 	{ FR_CONF_OFFSET("stats_interval | FR_TYPE_HIDDEN", FR_TYPE_TIME_DELTA, main_config_t, stats_interval), },
 
+	{ FR_CONF_OFFSET("stats_segment", FR_TYPE_STRING, main_config_t, stats_segment) },
+	{ FR_CONF_OFFSET("stats_segment_interval", FR_TYPE_TIME_DELTA, main_config_t, stats_segment_interval), .dflt = "1" },
+
+	CONF_PARSER_TERMINATOR
+};
+
+static const CONF_PARSER trace_config[] = {
+	{ FR_CONF_OFFSET("sample_rate", FR_TYPE_UINT32, main_config_t, trace_sample_rate), .dflt = "0" },
+	{ FR_CONF_OFFSET("ring_size", FR_TYPE_UINT32, main_config_t, trace_ring_size), .dflt = "65536" },
+	{ FR_CONF_OFFSET("file", FR_TYPE_STRING, main_config_t, trace_file) },
+
 	CONF_PARSER_TERMINATOR
 };
 
@@ -196,6 +207,8 @@ static const CONF_PARSER server_config[] = {
 
 	{ FR_CONF_POINTER("thread", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) thread_config, .ident2 = CF_IDENT_ANY },
 
+	{ FR_CONF_POINTER("trace", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) trace_config },
+
 	CONF_PARSER_TERMINATOR
 };
 
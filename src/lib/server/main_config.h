@@ -137,6 +137,13 @@ struct main_config_s {
 	uint32_t	max_workers;			//!< for the scheduler
 	fr_time_delta_t	stats_interval;			//!< for the scheduler
 
+	char const	*stats_segment;			//!< Name of the shared memory statistics segment.
+	fr_time_delta_t	stats_segment_interval;		//!< How often threads publish their statistics.
+
+	uint32_t	trace_sample_rate;		//!< Trace one in every N requests.  0 disables tracing.
+	uint32_t	trace_ring_size;		//!< Number of trace events kept per worker.
+	char const	*trace_file;			//!< Where to write the trace on exit.
+
 };
 
 void			main_config_name_set_default(main_config_t *config, char const *name, bool overwrite_config);
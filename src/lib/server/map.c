@@ -967,12 +967,36 @@ int map_to_vp(TALLOC_CTX *ctx, fr_pair_list_t *out, request_t *request, map_t co
 		RDEBUG2("EXPAND %s", map->rhs->name);
 		RINDENT();
 
+		/*
+		 *	Single values are evaluated directly to the
+		 *	type of the attribute, so copying e.g. an IP
+		 *	address doesn't require printing and re-parsing
+		 *	it.
+		 */
+		if (unlang_xlat_eval_type_ok(tmpl_xlat(map->rhs), n->da->type)) {
+			rcode = unlang_xlat_eval_type(n, &n->data, n->da->type, n->da, request, tmpl_xlat(map->rhs));
+			REXDENT();
+
+			if (rcode < 0) {
+				talloc_free(n);
+				goto error;
+			}
+			n->type = VT_DATA;
+
+			RDEBUG2("--> %pV", &n->data);
+
+			n->op = map->op;
+			fr_pair_append(out, n);
+			break;
+		}
+
 		str = NULL;
 		slen = xlat_aeval_compiled(request, &str, request, tmpl_xlat(map->rhs), NULL, NULL);
 		REXDENT();
 
 		if (slen < 0) {
 			rcode = slen;
+			talloc_free(n);
 			goto error;
 		}
 
@@ -981,7 +1005,7 @@ int map_to_vp(TALLOC_CTX *ctx, fr_pair_list_t *out, request_t *request, map_t co
 		rcode = fr_pair_value_from_str(n, str, -1, '\0', false);
 		talloc_free(str);
 		if (rcode < 0) {
-			talloc_free(&n);
+			talloc_free(n);
 			goto error;
 		}
 		n->op = map->op;
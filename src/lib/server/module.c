@@ -143,6 +143,43 @@ static int cmd_show_module_status(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUS
 	return 0;
 }
 
+static void elapsed_add(fr_time_elapsed_t *out, fr_time_elapsed_t const *in)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_ELEMENTS(out->array); i++) out->array[i] += in->array[i];
+}
+
+static int cmd_show_module_stats(FILE *fp, UNUSED FILE *fp_err, void *ctx, UNUSED fr_cmd_info_t const *info)
+{
+	module_instance_t		*mi = ctx;
+	module_thread_instance_t	*ti;
+	uint64_t			calls = 0, active = 0;
+	fr_time_elapsed_t		run_time = { .array = { 0 } }, yield_time = { .array = { 0 } };
+
+	/*
+	 *	The counters are written by the worker threads
+	 *	without locks, so the totals are only approximate.
+	 */
+	pthread_mutex_lock(&mi->threads_mutex);
+	for (ti = fr_dlist_head(&mi->threads);
+	     ti != NULL;
+	     ti = fr_dlist_next(&mi->threads, ti)) {
+		calls += ti->total_calls;
+		active += ti->active_callers;
+		elapsed_add(&run_time, &ti->run_time);
+		elapsed_add(&yield_time, &ti->yield_time);
+	}
+	pthread_mutex_unlock(&mi->threads_mutex);
+
+	fprintf(fp, "count.calls			%" PRIu64 "\n", calls);
+	fprintf(fp, "count.active			%" PRIu64 "\n", active);
+	fr_time_elapsed_fprint(fp, &run_time, "run.calls", 4);
+	fr_time_elapsed_fprint(fp, &yield_time, "yield.calls", 4);
+
+	return 0;
+}
+
 static int cmd_set_module_status(UNUSED FILE *fp, FILE *fp_err, void *ctx, fr_cmd_info_t const *info)
 {
 	module_instance_t *mi = ctx;
@@ -176,6 +213,15 @@ static fr_cmd_table_t cmd_module_table[] = {
 		.read_only = true,
 	},
 
+	{
+		.parent = "show module",
+		.add_name = true,
+		.name = "stats",
+		.func = cmd_show_module_stats,
+		.help = "Show call latency statistics for a module.",
+		.read_only = true,
+	},
+
 	{
 		.parent = "show module",
 		.add_name = true,
@@ -1170,6 +1216,12 @@ static int _module_thread_inst_array_free(module_thread_instance_t **array)
 		 */
 		if (ti->module && ti->module->thread_detach) (void) ti->module->thread_detach(ti->el, ti->data);
 
+		if (ti->mi) {
+			pthread_mutex_lock(&ti->mi->threads_mutex);
+			fr_dlist_remove(&ti->mi->threads, ti);
+			pthread_mutex_unlock(&ti->mi->threads_mutex);
+		}
+
 		talloc_free(ti);
 	}
 
@@ -1245,11 +1297,45 @@ int modules_thread_instantiate(TALLOC_CTX *ctx, fr_event_list_t *el)
 
 		fr_assert(mi->number < talloc_array_length(module_thread_inst_array));
 		module_thread_inst_array[mi->number] = ti;
+
+		ti->mi = mi;
+		pthread_mutex_lock(&mi->threads_mutex);
+		fr_dlist_insert_tail(&mi->threads, ti);
+		pthread_mutex_unlock(&mi->threads_mutex);
 	}
 
 	return 0;
 }
 
+/** Call a function for each of this thread's module thread instances
+ *
+ * @param[in] walk	function to call.
+ * @param[in] uctx	to pass to the function.
+ */
+void module_thread_walk(module_thread_walk_t walk, void *uctx)
+{
+	size_t i, len;
+
+	if (!module_thread_inst_array) return;
+
+	len = talloc_array_length(module_thread_inst_array);
+	for (i = 1; i < len; i++) {
+		module_thread_instance_t *ti = module_thread_inst_array[i];
+
+		if (!ti || !ti->mi) continue;
+
+		walk(ti->mi, ti, uctx);
+	}
+}
+
+/** Return the number of module instances
+ *
+ */
+uint32_t module_instance_count(void)
+{
+	return instance_num - 1;
+}
+
 /** Explicitly call thread_detach and free any module thread instances
  *
  * Call this function if the module thread instances need to be free explicitly before
@@ -1439,6 +1525,7 @@ static int _module_instance_free(module_instance_t *mi)
 		 */
 		pthread_mutex_destroy(mi->mutex);
 	}
+	pthread_mutex_destroy(&mi->threads_mutex);
 
 	/*
 	 *	Remove all xlat's registered to module instance.
@@ -1502,6 +1589,8 @@ module_instance_t *module_bootstrap(module_instance_t const *parent, CONF_SECTIO
 	}
 
 	MEM(mi = talloc_zero(parent ? parent : instance_ctx, module_instance_t));
+	pthread_mutex_init(&mi->threads_mutex, NULL);
+	fr_dlist_init(&mi->threads, module_thread_instance_t, entry);
 	talloc_set_destructor(mi, _module_instance_free);
 
 	if (dl_module_instance(mi, &mi->dl_inst, cs,
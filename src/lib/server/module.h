@@ -209,6 +209,10 @@ struct module_instance_s {
 
 	bool				instantiated;	//!< Whether the module has been instantiated yet.
 
+	pthread_mutex_t			threads_mutex;	//!< Protects the list of thread instances.
+	fr_dlist_head_t			threads;	//!< Thread instances, so that their statistics
+							///< can be read from other threads.
+
 	/** @name Return code overrides
 	 * @{
  	 */
@@ -245,6 +249,17 @@ struct module_thread_instance_s {
 
 	uint64_t			total_calls;	//! total number of times we've been called
 	uint64_t			active_callers; //! number of active callers.  i.e. number of current yields
+
+	module_instance_t		*mi;		//!< Module instance this is the thread instance of.
+	fr_dlist_t			entry;		//!< Entry in the module instance's list of threads.
+
+	/** @name Latency of calls, written only by the owning thread
+	 * @{
+ 	 */
+	fr_time_elapsed_t		run_time;	//!< histogram of wall clock time spent running the
+							///< module's functions, per call.
+	fr_time_elapsed_t		yield_time;	//!< histogram of time spent yielded, per call.
+	/** @} */
 };
 
 /** Map string values to module state method
@@ -311,6 +326,13 @@ module_instance_t	*module_by_data(void const *data);
 module_thread_instance_t *module_thread(module_instance_t *mi);
 
 module_thread_instance_t *module_thread_by_data(void const *data);
+
+typedef void (*module_thread_walk_t)(module_instance_t *mi, module_thread_instance_t *ti, void *uctx);
+
+void		module_thread_walk(module_thread_walk_t walk, void *uctx) CC_HINT(nonnull(1));
+
+uint32_t	module_instance_count(void);
+
 /** @} */
 
 /** @name Module and module thread initialisation and instantiation
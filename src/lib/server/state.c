@@ -52,16 +52,41 @@ RCSID("$Id$")
 
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/hash.h>
 #include <freeradius-devel/util/md5.h>
 #include <freeradius-devel/util/misc.h>
 #include <freeradius-devel/util/rand.h>
 
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+/** Number of independently locked shards in a state tree
+ *
+ * Must be a power of 2.
+ */
+#define STATE_SHARDS		16
+
+/** One slice of the state tree
+ *
+ * Entries are assigned to a shard by hashing their state value, so
+ * requests for unrelated sessions rarely contend for the same mutex.
+ */
+typedef struct {
+	fr_rb_tree_t		*tree;				//!< rbtree used to lookup state value.
+	fr_dlist_head_t		to_expire;			//!< Linked list of entries to free.
+	pthread_mutex_t		mutex;				//!< Synchronisation mutex.
+} state_shard_t;
+
 /** Holds a state value, and associated fr_pair_ts and data
  *
  */
 typedef struct {
 	uint64_t		id;				//!< State number within state heap.
 	fr_rb_node_t		node;				//!< Entry in the state rbtree.
+	state_shard_t		*shard;				//!< Shard the entry was inserted into.
 	union {
 		/** Server ID components
 		 *
@@ -132,17 +157,16 @@ typedef struct {
 } state_child_entry_t;
 
 struct fr_state_tree_s {
-	uint64_t		id;				//!< Next ID to assign.
-	uint64_t		timed_out;			//!< Number of states that were cleaned up due to
+	atomic_uint_fast64_t	id;				//!< Next ID to assign.
+	atomic_uint_fast64_t	timed_out;			//!< Number of states that were cleaned up due to
 								//!< timeout.
+	atomic_uint_fast32_t	num_entries;			//!< Number of entries across all shards.
 	uint32_t		max_sessions;			//!< Maximum number of sessions we track.
-	fr_rb_tree_t		*tree;				//!< rbtree used to lookup state value.
-	fr_dlist_head_t		to_expire;			//!< Linked list of entries to free.
+	state_shard_t		shard[STATE_SHARDS];		//!< Independently locked slices of the tree.
 
 	fr_time_delta_t		timeout;			//!< How long to wait before cleaning up state entires.
 
-	bool			thread_safe;			//!< Whether we lock the tree whilst modifying it.
-	pthread_mutex_t		mutex;				//!< Synchronisation mutex.
+	bool			thread_safe;			//!< Whether we lock the shards whilst modifying them.
 
 	uint8_t			server_id;			//!< ID to use for load balancing.
 	uint32_t		context_id;			//!< ID binding state values to a context such
@@ -156,6 +180,15 @@ struct fr_state_tree_s {
 
 static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry);
 
+/** Return the shard a state value belongs to
+ *
+ * @note The state value must already have been xor'd with the context_id.
+ */
+static inline CC_HINT(always_inline) state_shard_t *state_shard(fr_state_tree_t *state, fr_state_entry_t const *entry)
+{
+	return &state->shard[fr_hash(entry->state, sizeof(entry->state)) & (STATE_SHARDS - 1)];
+}
+
 /** Compare two fr_state_entry_t based on their state value i.e. the value of the attribute
  *
  */
@@ -173,22 +206,33 @@ static int8_t state_entry_cmp(void const *one, void const *two)
  */
 static int _state_tree_free(fr_state_tree_t *state)
 {
-	fr_state_entry_t *entry;
-
-	if (state->thread_safe) pthread_mutex_destroy(&state->mutex);
+	fr_state_entry_t	*entry;
+	size_t			i;
 
 	DEBUG4("Freeing state tree %p", state);
 
-	while ((entry = fr_dlist_head(&state->to_expire))) {
-		DEBUG4("Freeing state entry %p (%"PRIu64")", entry, entry->id);
-		state_entry_unlink(state, entry);
-		talloc_free(entry);
-	}
+	for (i = 0; i < STATE_SHARDS; i++) {
+		state_shard_t *shard = &state->shard[i];
 
-	/*
-	 *	Free the rbtree
-	 */
-	talloc_free(state->tree);
+		/*
+		 *	Shards are initialised in order, so the
+		 *	first one without a tree marks the end.
+		 */
+		if (!shard->tree) break;
+
+		if (state->thread_safe) pthread_mutex_destroy(&shard->mutex);
+
+		while ((entry = fr_dlist_head(&shard->to_expire))) {
+			DEBUG4("Freeing state entry %p (%"PRIu64")", entry, entry->id);
+			state_entry_unlink(state, entry);
+			talloc_free(entry);
+		}
+
+		/*
+		 *	Free the rbtree
+		 */
+		talloc_free(shard->tree);
+	}
 
 	return 0;
 }
@@ -212,6 +256,7 @@ fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, fr_dict_attr_t const *da, b
 				    uint8_t server_id, uint32_t context_id)
 {
 	fr_state_tree_t *state;
+	size_t		i;
 
 	state = talloc_zero(NULL, fr_state_tree_t);
 	if (!state) return 0;
@@ -228,30 +273,36 @@ fr_state_tree_t *fr_state_tree_init(TALLOC_CTX *ctx, fr_dict_attr_t const *da, b
 	 */
 	talloc_link_ctx(ctx, state);
 
-	if (thread_safe && (pthread_mutex_init(&state->mutex, NULL) != 0)) {
-		talloc_free(state);
-		return NULL;
-	}
+	state->thread_safe = thread_safe;
+	talloc_set_destructor(state, _state_tree_free);
 
-	fr_dlist_talloc_init(&state->to_expire, fr_state_entry_t, list);
+	for (i = 0; i < STATE_SHARDS; i++) {
+		state_shard_t *shard = &state->shard[i];
 
-	/*
-	 *	We need to do controlled freeing of the
-	 *	rbtree, so that all the state entries
-	 *	are freed before it's destroyed.  Hence
-	 *	it being parented from the NULL ctx.
-	 */
-	state->tree = fr_rb_inline_talloc_alloc(NULL, fr_state_entry_t, node, state_entry_cmp, NULL);
-	if (!state->tree) {
-		talloc_free(state);
-		return NULL;
+		if (thread_safe && (pthread_mutex_init(&shard->mutex, NULL) != 0)) {
+			talloc_free(state);
+			return NULL;
+		}
+
+		fr_dlist_talloc_init(&shard->to_expire, fr_state_entry_t, list);
+
+		/*
+		 *	We need to do controlled freeing of the
+		 *	rbtree, so that all the state entries
+		 *	are freed before it's destroyed.  Hence
+		 *	it being parented from the NULL ctx.
+		 */
+		shard->tree = fr_rb_inline_talloc_alloc(NULL, fr_state_entry_t, node, state_entry_cmp, NULL);
+		if (!shard->tree) {
+			if (thread_safe) pthread_mutex_destroy(&shard->mutex);
+			talloc_free(state);
+			return NULL;
+		}
 	}
-	talloc_set_destructor(state, _state_tree_free);
 
 	state->da = da;		/* Remember which attribute we use to load/store state */
 	state->server_id = server_id;
 	state->context_id = context_id;
-	state->thread_safe = thread_safe;
 
 	return state;
 }
@@ -266,9 +317,11 @@ static void state_entry_unlink(fr_state_tree_t *state, fr_state_entry_t *entry)
 	 */
 	(void) talloc_get_type_abort(entry, fr_state_entry_t);
 
-	fr_dlist_remove(&state->to_expire, entry);
+	fr_dlist_remove(&entry->shard->to_expire, entry);
 
-	fr_rb_delete(state->tree, entry);
+	if (fr_rb_delete(entry->shard->tree, entry)) {
+		atomic_fetch_sub_explicit(&state->num_entries, 1, memory_order_relaxed);
+	}
 
 	DEBUG4("State ID %" PRIu64 " unlinked", entry->id);
 }
@@ -311,37 +364,28 @@ static int _state_entry_free(fr_state_entry_t *entry)
 	return 0;
 }
 
-/** Create a new state entry
+/** Remove expired entries from a shard
  *
- * @note Called with the mutex held.
+ * Entries are only ever appended to the shard's expiry list, so it's
+ * implicitly ordered by cleanup time, and we can stop at the first
+ * entry which hasn't expired.
+ *
+ * @note Called with the shard's mutex free.
  */
-static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *request,
-					    fr_pair_list_t *reply_list, fr_state_entry_t *old)
+static void state_shard_expire(fr_state_tree_t *state, request_t *request, state_shard_t *shard, fr_time_t now)
 {
-	size_t			i;
-	uint32_t		x;
-	fr_time_t		now = fr_time();
-	fr_pair_t		*vp;
 	fr_state_entry_t	*entry, *next;
-
-	uint8_t			old_state[sizeof(old->state)];
-	int			old_tries = 0;
 	uint64_t		timed_out = 0;
-	bool			too_many = false;
 	fr_dlist_head_t		to_free;
 
 	fr_dlist_init(&to_free, fr_state_entry_t, list);
 
-	/*
-	 *	Clean up old entries.
-	 */
-	for (entry = fr_dlist_head(&state->to_expire);
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	for (entry = fr_dlist_head(&shard->to_expire);
 	     entry != NULL;
 	     entry = next) {
 		(void)talloc_get_type_abort(entry, fr_state_entry_t);	/* Allow examination */
-		next = fr_dlist_next(&state->to_expire, entry);		/* Advance *before* potential unlinking */
-
-		if (entry == old) continue;
+		next = fr_dlist_next(&shard->to_expire, entry);		/* Advance *before* potential unlinking */
 
 		/*
 		 *	Too old, we can delete it.
@@ -355,10 +399,49 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *r
 
 		break;
 	}
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	if (timed_out == 0) return;
+
+	atomic_fetch_add_explicit(&state->timed_out, timed_out, memory_order_relaxed);
+
+	RWDEBUG("Cleaning up %"PRIu64" timed out state entries", timed_out);
+
+	/*
+	 *	Now free the unlinked entries.
+	 *
+	 *	We do it here as freeing may involve significantly more
+	 *	work than just freeing the data.
+	 *
+	 *	If there's request data that was persisted it will now
+	 *	be freed also, and it may have complex destructors associated
+	 *	with it.
+	 */
+	while ((entry = fr_dlist_head(&to_free)) != NULL) {
+		fr_dlist_remove(&to_free, entry);
+		talloc_free(entry);
+	}
+}
 
-	state->timed_out += timed_out;
+/** Create a new state entry
+ *
+ * @note Called with the mutex of old's shard held, if old is not NULL.
+ *	This mutex is released before the new entry is created.
+ *	On success, returns with the mutex of the new entry's shard held.
+ *	On failure, returns with no mutex held.
+ */
+static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *request,
+					    fr_pair_list_t *reply_list, fr_state_entry_t *old)
+{
+	size_t			i;
+	uint32_t		x;
+	fr_time_t		now = fr_time();
+	fr_pair_t		*vp;
+	fr_state_entry_t	*entry, *to_free = NULL;
+	state_shard_t		*shard;
 
-	if (!old && (fr_rb_num_elements(state->tree) >= (uint32_t) state->max_sessions)) too_many = true;
+	uint8_t			old_state[sizeof(old->state)];
+	int			old_tries = 0;
 
 	/*
 	 *	Record the information from the old state, we may base the
@@ -377,38 +460,26 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *r
 		 */
 		if (fr_dlist_empty(&old->data)) {
 			state_entry_unlink(state, old);
-			fr_dlist_insert_tail(&to_free, old);
+			to_free = old;
 		}
-	}
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+		PTHREAD_MUTEX_UNLOCK(&old->shard->mutex);
 
-	if (timed_out > 0) RWDEBUG("Cleaning up %"PRIu64" timed out state entries", timed_out);
+		talloc_free(to_free);
 
 	/*
-	 *	Now free the unlinked entries.
-	 *
-	 *	We do it here as freeing may involve significantly more
-	 *	work than just freeing the data.
-	 *
-	 *	If there's request data that was persisted it will now
-	 *	be freed also, and it may have complex destructors associated
-	 *	with it.
+	 *	Expiry is normally amortised across inserts into
+	 *	each shard.  If we're at the limit, some of the
+	 *	other shards may be holding expired entries, so
+	 *	sweep all of them before giving up.
 	 */
-	while ((entry = fr_dlist_head(&to_free)) != NULL) {
-		fr_dlist_remove(&to_free, entry);
-		talloc_free(entry);
-	}
+	} else if (atomic_load_explicit(&state->num_entries, memory_order_relaxed) >= state->max_sessions) {
+		for (i = 0; i < STATE_SHARDS; i++) state_shard_expire(state, request, &state->shard[i], now);
 
-	/*
-	 *	Have to do this post-cleanup, else we end up returning with
-	 *	a list full of entries to free with none of them being
-	 *	freed which is bad...
-	 */
-	if (too_many) {
-		RERROR("Failed inserting state entry - At maximum ongoing session limit (%u)",
-		       state->max_sessions);
-		PTHREAD_MUTEX_LOCK(&state->mutex);	/* Caller expects this to be locked */
-		return NULL;
+		if (atomic_load_explicit(&state->num_entries, memory_order_relaxed) >= state->max_sessions) {
+			RERROR("Failed inserting state entry - At maximum ongoing session limit (%u)",
+			       state->max_sessions);
+			return NULL;
+		}
 	}
 
 	/*
@@ -419,7 +490,7 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *r
 
 	request_data_list_init(&entry->data);
 	talloc_set_destructor(entry, _state_entry_free);
-	entry->id = state->id++;
+	entry->id = atomic_fetch_add_explicit(&state->id, 1, memory_order_relaxed);
 
 	/*
 	 *	Limit the lifetime of this entry based on how long the
@@ -506,8 +577,6 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *r
 	DEBUG4("State ID %" PRIu64 " created, value 0x%pH, expires %" PRIu64 "s",
 	       entry->id, fr_box_octets(entry->state, sizeof(entry->state)), (uint64_t)entry->cleanup - now);
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
-
 	/*
 	 *	XOR the server hash with four bytes of random data.
 	 *	We XOR is again before resolving, to ensure state lookups
@@ -516,28 +585,40 @@ static fr_state_entry_t *state_entry_create(fr_state_tree_t *state, request_t *r
 	 */
 	*((uint32_t *)(&entry->state_comp.context_id)) ^= state->context_id;
 
-	if (!fr_rb_insert(state->tree, entry)) {
+	/*
+	 *	Only the shard we're inserting into is swept, so
+	 *	the cost of expiry is spread over all the shards.
+	 */
+	shard = entry->shard = state_shard(state, entry);
+	state_shard_expire(state, request, shard, now);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	if (!fr_rb_insert(shard->tree, entry)) {
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 		RERROR("Failed inserting state entry - Insertion into state tree failed");
 		fr_pair_delete_by_da(reply_list, state->da);
 		talloc_free(entry);
 		return NULL;
 	}
+	atomic_fetch_add_explicit(&state->num_entries, 1, memory_order_relaxed);
 
 	/*
 	 *	Link it to the end of the list, which is implicitely
 	 *	ordered by cleanup time.
 	 */
-	fr_dlist_insert_tail(&state->to_expire, entry);
+	fr_dlist_insert_tail(&shard->to_expire, entry);
 
 	return entry;
 }
 
 /** Find the entry, based on the State attribute
  *
+ * @note If an entry is found, returns with the mutex of its shard held.
  */
 static fr_state_entry_t *state_entry_find(fr_state_tree_t *state, fr_value_box_t const *vb)
 {
-	fr_state_entry_t *entry, my_entry;
+	fr_state_entry_t	*entry, my_entry;
+	state_shard_t		*shard;
 
 	/*
 	 *	Assume our own State first.
@@ -566,9 +647,16 @@ static fr_state_entry_t *state_entry_find(fr_state_tree_t *state, fr_value_box_t
 	 */
 	my_entry.state_comp.context_id ^= state->context_id;
 
-	entry = fr_rb_find(state->tree, &my_entry);
+	shard = state_shard(state, &my_entry);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	entry = fr_rb_find(shard->tree, &my_entry);
+	if (!entry) {
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+		return NULL;
+	}
 
-	if (entry) (void) talloc_get_type_abort(entry, fr_state_entry_t);
+	(void) talloc_get_type_abort(entry, fr_state_entry_t);
 
 	return entry;
 }
@@ -584,14 +672,11 @@ void fr_state_discard(fr_state_tree_t *state, request_t *request)
 	vp = fr_pair_find_by_da(&request->request_pairs, state->da, 0);
 	if (!vp) return;
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
 	entry = state_entry_find(state, &vp->data);
-	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
-		return;
-	}
+	if (!entry) return;
+
 	state_entry_unlink(state, entry);
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	PTHREAD_MUTEX_UNLOCK(&entry->shard->mutex);
 
 	/*
 	 *	If fr_state_to_request was never called, this ensures
@@ -649,13 +734,12 @@ int fr_state_to_request(fr_state_tree_t *state, request_t *request)
 		return 1;
 	}
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
 	entry = state_entry_find(state, &vp->data);
 	if (entry) {
 		(void)talloc_get_type_abort(entry, fr_state_entry_t);
 		if (entry->thawed) {
 			REDEBUG("State entry has already been thawed by a request %"PRIu64, entry->thawed->number);
-			PTHREAD_MUTEX_UNLOCK(&state->mutex);
+			PTHREAD_MUTEX_UNLOCK(&entry->shard->mutex);
 			return -2;
 		}
 		if (request->session_state_ctx) old_ctx = request->session_state_ctx;	/* Store for later freeing */
@@ -668,9 +752,8 @@ int fr_state_to_request(fr_state_tree_t *state, request_t *request)
 
 		entry->ctx = NULL;
 		entry->thawed = request;
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
+		PTHREAD_MUTEX_UNLOCK(&entry->shard->mutex);
 	} else {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
 		REDEBUG("No state entry matching &request.%pP found", vp);
 		return -1;
 	}
@@ -717,12 +800,10 @@ int fr_request_to_state(fr_state_tree_t *state, request_t *request)
 
 	vp = fr_pair_find_by_da(&request->request_pairs, state->da, 0);
 
-	PTHREAD_MUTEX_LOCK(&state->mutex);
 	if (vp) old = state_entry_find(state, &vp->data);
 
 	entry = state_entry_create(state, request, &request->reply_pairs, old);
 	if (!entry) {
-		PTHREAD_MUTEX_UNLOCK(&state->mutex);
 		RERROR("Creating state entry failed");
 		request_data_restore(request, &data);	/* Put it back again */
 		return -1;
@@ -735,7 +816,7 @@ int fr_request_to_state(fr_state_tree_t *state, request_t *request)
 	entry->ctx = request->session_state_ctx;
 	fr_dlist_move(&entry->data, &data);
 
-	PTHREAD_MUTEX_UNLOCK(&state->mutex);
+	PTHREAD_MUTEX_UNLOCK(&entry->shard->mutex);
 
 	MEM(request->session_state_ctx = fr_pair_afrom_da(NULL, request_attr_state));	/* fixme - should use a pool */
 
@@ -896,7 +977,7 @@ uint64_t fr_state_entries_created(fr_state_tree_t *state)
  */
 uint64_t fr_state_entries_timeout(fr_state_tree_t *state)
 {
-	return state->timed_out;
+	return atomic_load_explicit(&state->timed_out, memory_order_relaxed);
 }
 
 /** Return number of entries we're currently tracking
@@ -904,5 +985,5 @@ uint64_t fr_state_entries_timeout(fr_state_tree_t *state)
  */
 uint64_t fr_state_entries_tracked(fr_state_tree_t *state)
 {
-	return fr_rb_num_elements(state->tree);
+	return atomic_load_explicit(&state->num_entries, memory_order_relaxed);
 }
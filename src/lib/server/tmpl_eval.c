@@ -323,6 +323,22 @@ ssize_t _tmpl_to_type(void *out,
 
 		RDEBUG4("EXPAND TMPL XLAT PARSED");
 		RDEBUG2("EXPAND %s", vpt->name); /* xlat_struct doesn't do this */
+
+		/*
+		 *	Non-string outputs are fixed size, so they
+		 *	can be evaluated straight to the output type
+		 *	without using the expansion buffer.
+		 */
+		if (!escape && unlang_xlat_eval_type_ok(tmpl_xlat(vpt), dst_type)) {
+			if (unlang_xlat_eval_type(NULL, &value_to_cast, dst_type, NULL, request, tmpl_xlat(vpt)) < 0) {
+				return -1;
+			}
+			src_type = dst_type;
+
+			RDEBUG2("   --> %pV", &value_to_cast);
+			break;
+		}
+
 		if (!buff) {
 			fr_strerror_const("Missing expansion buffer for XLAT_STRUCT");
 			return -1;
@@ -636,6 +652,20 @@ ssize_t _tmpl_to_atype(TALLOC_CTX *ctx, void *out,
 		RDEBUG4("EXPAND TMPL XLAT STRUCT");
 		RDEBUG2("EXPAND %s", vpt->name); /* xlat_struct doesn't do this */
 
+		/*
+		 *	Single values being cast to a non-string type
+		 *	are evaluated straight to the output type, so
+		 *	they're never printed and re-parsed.  String
+		 *	outputs keep the string expansion semantics.
+		 */
+		if (!escape && unlang_xlat_eval_type_ok(tmpl_xlat(vpt), dst_type)) {
+			if (unlang_xlat_eval_type(tmp_ctx, &value, dst_type, NULL, request, tmpl_xlat(vpt)) < 0) goto error;
+			to_cast = &value;
+
+			RDEBUG2("   --> %pV", &value);
+			break;
+		}
+
 		/* Error in expansion, this is distinct from zero length expansion */
 		slen = xlat_aeval_compiled(tmp_ctx, (char **)&value.datum.ptr, request, tmpl_xlat(vpt), escape, escape_ctx);
 		if (slen < 0) goto error;
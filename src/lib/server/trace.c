@@ -0,0 +1,395 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * @file src/lib/server/trace.c
+ * @brief Lightweight request tracing
+ *
+ * Each worker thread records begin, end, and instant events for a
+ * sample of requests into its own fixed size ring of binary events.
+ * Recording an event costs a clock read, a handful of stores, and
+ * a copy of the span name.  Nothing is formatted, allocated, or
+ * locked.  When the ring is full, the oldest events are overwritten.
+ *
+ * Span names are copied into the event, rather than referenced, as
+ * the rings outlive the modules, listeners, and trunks which name
+ * the spans.  The trace file is written after they have been freed.
+ *
+ * The rings are dumped on demand (via radmin), or when the server
+ * exits, as Chrome trace event JSON.  The output can be loaded into
+ * chrome://tracing, Perfetto, or similar tools.  Each request is an
+ * async track, identified by the request number, so interleaved
+ * requests on the same thread don't interfere with each other.
+ *
+ * Events are read while the owning thread may be overwriting them.
+ * Each event has a sequence number, which is cleared before the
+ * event is written and set once it's complete.  Readers skip events
+ * whose sequence number is not the one they expect, or which changed
+ * while they were being copied.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/server/command.h>
+#include <freeradius-devel/server/log.h>
+#include <freeradius-devel/server/trace.h>
+
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/syserror.h>
+
+#include <pthread.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
+
+/** A single trace event
+ *
+ */
+typedef struct {
+	_Atomic(uint64_t)	seq;			//!< Position in the ring + 1, or 0 while
+							///< the event is being written.
+	fr_time_t		when;			//!< The event occurred.
+	uint64_t		number;			//!< Of the request.
+	uint8_t			category;		//!< fr_trace_category_t.
+	uint8_t			phase;			//!< fr_trace_phase_t.
+	char			name[FR_TRACE_NAME_LEN];	//!< Of the span, truncated if too long.
+} fr_trace_event_t;
+
+struct fr_trace_ring_s {
+	fr_dlist_t		entry;			//!< Entry in the list of rings.
+	uint32_t		id;			//!< Used as the "tid" in the output.
+	uint32_t		mask;			//!< Number of events - 1.
+	_Atomic(uint64_t)	head;			//!< Position of the next event to write.
+	fr_trace_event_t	events[];		//!< The ring.
+};
+
+uint32_t			fr_trace_sample_rate;		//!< Record one in every N requests.
+_Thread_local fr_trace_ring_t	*fr_trace_thread_ring;		//!< Ring for this thread, if tracing.
+
+static TALLOC_CTX		*trace_ctx;			//!< Rings are allocated here.
+static char const		*trace_file;			//!< Written when tracing is stopped.
+static uint32_t			trace_ring_size;		//!< Events per ring, a power of 2.
+static uint32_t			trace_ring_id;			//!< For the next ring.
+static fr_dlist_head_t		trace_rings;			//!< All rings, protected by trace_mutex.
+static pthread_mutex_t		trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static char const *trace_category_names[FR_TRACE_CATEGORY_MAX] = {
+	[FR_TRACE_DECODE]	= "decode",
+	[FR_TRACE_DISPATCH]	= "dispatch",
+	[FR_TRACE_SECTION]	= "section",
+	[FR_TRACE_MODULE]	= "module",
+	[FR_TRACE_TRUNK]	= "trunk",
+	[FR_TRACE_ENCODE]	= "encode"
+};
+
+/*
+ *	Async events, so that spans from different
+ *	requests on the same thread nest correctly.
+ */
+static char const trace_phase_names[] = {
+	[FR_TRACE_BEGIN]	= 'b',
+	[FR_TRACE_END]		= 'e',
+	[FR_TRACE_INSTANT]	= 'n'
+};
+
+/** Record an event in this thread's ring
+ *
+ * Use FR_TRACE() instead, which checks whether the request is
+ * being sampled first.
+ */
+void fr_trace_record(request_t const *request, fr_trace_category_t category,
+		     fr_trace_phase_t phase, char const *name)
+{
+	fr_trace_ring_t		*ring = fr_trace_thread_ring;
+	fr_trace_event_t	*ev;
+	uint64_t		pos;
+
+	pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	ev = &ring->events[pos & ring->mask];
+
+	atomic_store_explicit(&ev->seq, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	ev->when = fr_time();
+	ev->number = request->number;
+	strlcpy(ev->name, name ? name : "", sizeof(ev->name));
+	ev->category = category;
+	ev->phase = phase;
+
+	atomic_store_explicit(&ev->seq, pos + 1, memory_order_release);
+	atomic_store_explicit(&ring->head, pos + 1, memory_order_release);
+}
+
+static void trace_json_string(FILE *fp, char const *p)
+{
+	fputc('"', fp);
+	for (; *p; p++) {
+		switch (*p) {
+		case '"':
+		case '\\':
+			fputc('\\', fp);
+			fputc(*p, fp);
+			break;
+
+		default:
+			if ((uint8_t) *p < 0x20) {
+				fprintf(fp, "\\u%04x", (uint8_t) *p);
+				break;
+			}
+			fputc(*p, fp);
+			break;
+		}
+	}
+	fputc('"', fp);
+}
+
+static void trace_ring_dump(FILE *fp, fr_trace_ring_t *ring, pid_t pid, bool *first)
+{
+	uint64_t		head, pos;
+	fr_trace_event_t	ev;
+
+	head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	pos = (head > (ring->mask + 1)) ? head - (ring->mask + 1) : 0;
+
+	for (; pos < head; pos++) {
+		fr_trace_event_t *p = &ring->events[pos & ring->mask];
+
+		/*
+		 *	Skip events which have been overwritten
+		 *	since we read the head, or which are being
+		 *	written now.
+		 */
+		if (atomic_load_explicit(&p->seq, memory_order_acquire) != (pos + 1)) continue;
+
+		ev.when = p->when;
+		ev.number = p->number;
+		memcpy(ev.name, p->name, sizeof(ev.name));
+		ev.category = p->category;
+		ev.phase = p->phase;
+		atomic_thread_fence(memory_order_acquire);
+
+		if (atomic_load_explicit(&p->seq, memory_order_relaxed) != (pos + 1)) continue;
+		ev.name[sizeof(ev.name) - 1] = '\0';
+
+		if ((ev.category >= FR_TRACE_CATEGORY_MAX) || (ev.phase > FR_TRACE_INSTANT)) continue;
+
+		fprintf(fp, "%s\n{\"name\":", *first ? "" : ",");
+		trace_json_string(fp, ev.name);
+		fprintf(fp, ",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%" PRIu64 ",\"pid\":%u,\"tid\":%u,"
+			"\"id\":\"0x%" PRIx64 "\",\"args\":{\"request\":%" PRIu64 "}}",
+			trace_category_names[ev.category], trace_phase_names[ev.phase],
+			fr_unix_time_to_usec(fr_time_to_unix_time(ev.when)), (unsigned int) pid, ring->id,
+			ev.number, ev.number);
+		*first = false;
+	}
+}
+
+/** Write the contents of all rings as Chrome trace event JSON
+ *
+ * May be called from any thread, while other threads are recording.
+ *
+ * @param[in] fp	to write the events to.
+ * @return
+ *	- 0 on success.
+ *	- -1 if tracing isn't enabled.
+ */
+int fr_trace_dump(FILE *fp)
+{
+	fr_trace_ring_t	*ring = NULL;
+	bool		first = true;
+	pid_t		pid = getpid();
+
+	if (!trace_ctx) {
+		fr_strerror_const("Tracing is not enabled");
+		return -1;
+	}
+
+	fputc('[', fp);
+
+	pthread_mutex_lock(&trace_mutex);
+	while ((ring = fr_dlist_next(&trace_rings, ring))) trace_ring_dump(fp, ring, pid, &first);
+	pthread_mutex_unlock(&trace_mutex);
+
+	fputs("\n]\n", fp);
+
+	return 0;
+}
+
+static int trace_dump_file(char const *file)
+{
+	FILE	*fp;
+	int	ret;
+
+	fp = fopen(file, "w");
+	if (!fp) {
+		fr_strerror_printf("Failed opening %s: %s", file, fr_syserror(errno));
+		return -1;
+	}
+
+	ret = fr_trace_dump(fp);
+
+	if (fclose(fp) < 0) {
+		fr_strerror_printf("Failed writing %s: %s", file, fr_syserror(errno));
+		return -1;
+	}
+
+	return ret;
+}
+
+static int cmd_trace_dump(FILE *fp, FILE *fp_err, UNUSED void *ctx, fr_cmd_info_t const *info)
+{
+	char const *file;
+
+	if (info->argc > 0) {
+		file = info->box[0]->vb_strvalue;
+	} else {
+		file = trace_file;
+	}
+
+	if (!file) {
+		fprintf(fp_err, "No file given, and no trace file configured\n");
+		return -1;
+	}
+
+	if (trace_dump_file(file) < 0) {
+		fprintf(fp_err, "%s\n", fr_strerror());
+		return -1;
+	}
+
+	fprintf(fp, "Wrote trace to %s\n", file);
+
+	return 0;
+}
+
+static fr_cmd_table_t cmd_trace_table[] = {
+	{
+		.name = "trace",
+		.help = "Request tracing.",
+		.read_only = true,
+	},
+
+	{
+		.parent = "trace",
+		.name = "dump",
+		.syntax = "[STRING]",
+		.func = cmd_trace_dump,
+		.help = "Write recorded trace events to a file, as Chrome trace JSON.",
+		.read_only = false,
+	},
+
+	CMD_TABLE_END
+};
+
+/** Enable tracing
+ *
+ * Must be called before any threads call fr_trace_thread_init().
+ *
+ * @param[in] ctx		to allocate the rings in.
+ * @param[in] sample_rate	Record one in every N requests.  0 disables tracing.
+ * @param[in] ring_size		Number of events in each thread's ring.  Rounded up
+ *				to a power of 2.
+ * @param[in] file		Where to write the trace when the server exits.  May be NULL.
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+int fr_trace_init(TALLOC_CTX *ctx, uint32_t sample_rate, uint32_t ring_size, char const *file)
+{
+	if (!sample_rate) return 0;
+
+	if (ring_size < 64) ring_size = 64;
+	if (ring_size > (1 << 24)) ring_size = 1 << 24;
+
+	MEM(trace_ctx = talloc_named_const(ctx, 0, "trace"));
+	trace_file = file ? talloc_typed_strdup(trace_ctx, file) : NULL;
+	trace_ring_size = (uint32_t) 1 << fr_high_bit_pos(ring_size - 1);
+	trace_ring_id = 0;
+	fr_dlist_init(&trace_rings, fr_trace_ring_t, entry);
+
+	if (fr_command_register_hook(NULL, NULL, NULL, cmd_trace_table) < 0) {
+		PERROR("Failed registering trace commands");
+		TALLOC_FREE(trace_ctx);
+		return -1;
+	}
+
+	fr_trace_sample_rate = sample_rate;
+
+	return 0;
+}
+
+/** Disable tracing, writing the trace file if one was configured
+ *
+ * Must be called after all threads have exited.
+ */
+void fr_trace_free(void)
+{
+	if (!trace_ctx) return;
+
+	if (trace_file && (trace_dump_file(trace_file) < 0)) PERROR("Failed writing trace");
+
+	fr_trace_sample_rate = 0;
+	fr_trace_thread_ring = NULL;
+	fr_dlist_init(&trace_rings, fr_trace_ring_t, entry);
+	TALLOC_FREE(trace_ctx);
+}
+
+/** Allocate a ring for the current thread
+ *
+ * Does nothing if tracing is disabled.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on error.
+ */
+int fr_trace_thread_init(void)
+{
+	fr_trace_ring_t	*ring;
+
+	if (!trace_ctx || fr_trace_thread_ring) return 0;
+
+	pthread_mutex_lock(&trace_mutex);
+	ring = talloc_zero_size(trace_ctx, sizeof(*ring) + (trace_ring_size * sizeof(ring->events[0])));
+	if (!ring) {
+		pthread_mutex_unlock(&trace_mutex);
+		fr_strerror_const("Out of memory");
+		return -1;
+	}
+	talloc_set_name_const(ring, "fr_trace_ring_t");
+
+	ring->id = trace_ring_id++;
+	ring->mask = trace_ring_size - 1;
+	fr_dlist_insert_tail(&trace_rings, ring);
+	pthread_mutex_unlock(&trace_mutex);
+
+	fr_trace_thread_ring = ring;
+
+	return 0;
+}
+
+/** Stop recording events for the current thread
+ *
+ * The ring is kept, so that its events are included in the
+ * trace written when the server exits.
+ */
+void fr_trace_thread_detach(void)
+{
+	fr_trace_thread_ring = NULL;
+}
@@ -0,0 +1,99 @@
+#pragma once
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * @file src/lib/server/trace.h
+ * @brief Lightweight request tracing
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSIDH(trace_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <freeradius-devel/server/request.h>
+#include <freeradius-devel/util/time.h>
+
+#define FR_TRACE_NAME_LEN	32			//!< Including the terminating nul.
+
+typedef struct fr_trace_ring_s fr_trace_ring_t;
+
+/** What part of request processing an event is for
+ *
+ */
+typedef enum {
+	FR_TRACE_DECODE = 0,				//!< Decoding the packet.
+	FR_TRACE_DISPATCH,				//!< Request running in a worker.
+	FR_TRACE_SECTION,				//!< Virtual server section, e.g. "recv Access-Request".
+	FR_TRACE_MODULE,				//!< Module call.
+	FR_TRACE_TRUNK,					//!< Request enqueued on, and sent by, a trunk.
+	FR_TRACE_ENCODE,				//!< Encoding the reply.
+	FR_TRACE_CATEGORY_MAX
+} fr_trace_category_t;
+
+typedef enum {
+	FR_TRACE_BEGIN = 0,				//!< Start of a span.
+	FR_TRACE_END,					//!< End of a span.
+	FR_TRACE_INSTANT				//!< Something happened.
+} fr_trace_phase_t;
+
+extern uint32_t				fr_trace_sample_rate;
+extern _Thread_local fr_trace_ring_t	*fr_trace_thread_ring;
+
+/** Whether events should be recorded for a request
+ *
+ * Only threads which called fr_trace_thread_init() record events,
+ * and then only for one in every fr_trace_sample_rate requests.
+ */
+static inline bool fr_trace_sampled(request_t const *request)
+{
+	if (likely(!fr_trace_thread_ring) || !request) return false;
+
+	return (request->number % fr_trace_sample_rate) == 0;
+}
+
+void	fr_trace_record(request_t const *request, fr_trace_category_t category,
+			fr_trace_phase_t phase, char const *name) CC_HINT(nonnull(1));
+
+/** Record a trace event, if the request is being sampled
+ *
+ * @param[in] _request	the event is for.  May be NULL.
+ * @param[in] _category	fr_trace_category_t.
+ * @param[in] _phase	fr_trace_phase_t.
+ * @param[in] _name	of the span.  Copied into the event, and truncated
+ *			to FR_TRACE_NAME_LEN - 1 characters.
+ */
+#define FR_TRACE(_request, _category, _phase, _name) \
+do { \
+	if (fr_trace_sampled(_request)) fr_trace_record(_request, _category, _phase, _name); \
+} while (0)
+
+int	fr_trace_init(TALLOC_CTX *ctx, uint32_t sample_rate, uint32_t ring_size, char const *file);
+
+void	fr_trace_free(void);
+
+int	fr_trace_thread_init(void);
+
+void	fr_trace_thread_detach(void);
+
+int	fr_trace_dump(FILE *fp) CC_HINT(nonnull);
+
+#ifdef __cplusplus
+}
+#endif
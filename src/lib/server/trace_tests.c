@@ -0,0 +1,164 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/** Tests for request tracing
+ *
+ * @file src/lib/server/trace_tests.c
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+#include <freeradius-devel/util/acutest.h>
+
+#include <freeradius-devel/server/command.h>
+#include <freeradius-devel/server/trace.h>
+
+static int command_register_noop(UNUSED TALLOC_CTX *talloc_ctx, UNUSED char const *name,
+				 UNUSED void *ctx, UNUSED fr_cmd_table_t *table)
+{
+	return 0;
+}
+
+/** Dump the trace into a nul terminated buffer
+ *
+ */
+static void trace_dump_buffer(char *out, size_t outlen)
+{
+	FILE *fp;
+
+	memset(out, 0, outlen);
+
+	fp = fmemopen(out, outlen - 1, "w");
+	TEST_CHECK(fp != NULL);
+	TEST_CHECK(fr_trace_dump(fp) == 0);
+	fclose(fp);
+}
+
+static size_t count_events(char const *json)
+{
+	size_t		count = 0;
+	char const	*p = json;
+
+	while ((p = strstr(p, "{\"name\":"))) {
+		count++;
+		p++;
+	}
+
+	return count;
+}
+
+static void test_disabled(void)
+{
+	char buffer[64];
+	FILE *fp;
+
+	fp = fmemopen(buffer, sizeof(buffer), "w");
+	TEST_CHECK(fp != NULL);
+	TEST_CHECK(fr_trace_dump(fp) < 0);
+	fclose(fp);
+}
+
+static void test_json(void)
+{
+	TALLOC_CTX	*ctx = talloc_init_const("test");
+	request_t	sampled = { .number = 2 }, skipped = { .number = 3 };
+	char		*name;
+	char		buffer[4096];
+
+	fr_command_register_hook = command_register_noop;
+
+	TEST_CHECK(fr_trace_init(ctx, 2, 64, NULL) == 0);
+	TEST_CHECK(fr_trace_thread_init() == 0);
+
+	/*
+	 *	Names are copied, so they only need to be valid
+	 *	while the event is recorded.
+	 */
+	name = talloc_typed_strdup(ctx, "ldap");
+	FR_TRACE(&sampled, FR_TRACE_MODULE, FR_TRACE_BEGIN, name);
+	FR_TRACE(&skipped, FR_TRACE_MODULE, FR_TRACE_BEGIN, name);
+	FR_TRACE(&sampled, FR_TRACE_MODULE, FR_TRACE_END, name);
+	memset(name, 'x', strlen(name));
+	talloc_free(name);
+
+	FR_TRACE(&sampled, FR_TRACE_TRUNK, FR_TRACE_INSTANT, "say \"hi\"");
+	FR_TRACE(&sampled, FR_TRACE_SECTION, FR_TRACE_BEGIN,
+		 "a section name which is much too long to fit in an event");
+
+	trace_dump_buffer(buffer, sizeof(buffer));
+	TEST_MSG("%s", buffer);
+
+	TEST_CHECK(buffer[0] == '[');
+	TEST_CHECK(strcmp(buffer + strlen(buffer) - 3, "\n]\n") == 0);
+	TEST_CHECK(count_events(buffer) == 4);
+
+	TEST_CHECK(strstr(buffer, "{\"name\":\"ldap\",\"cat\":\"module\",\"ph\":\"b\",") != NULL);
+	TEST_CHECK(strstr(buffer, "{\"name\":\"ldap\",\"cat\":\"module\",\"ph\":\"e\",") != NULL);
+	TEST_CHECK(strstr(buffer, "\"id\":\"0x2\",\"args\":{\"request\":2}}") != NULL);
+	TEST_CHECK(strstr(buffer, "\"request\":3") == NULL);
+
+	TEST_CHECK(strstr(buffer, "{\"name\":\"say \\\"hi\\\"\",\"cat\":\"trunk\",\"ph\":\"n\",") != NULL);
+	TEST_CHECK(strstr(buffer, "{\"name\":\"a section name which is much to\",\"cat\":\"section\"") != NULL);
+
+	fr_trace_thread_detach();
+	fr_trace_free();
+
+	TEST_CHECK(!fr_trace_sampled(&sampled));
+
+	talloc_free(ctx);
+}
+
+static void test_wrap(void)
+{
+	TALLOC_CTX	*ctx = talloc_init_const("test");
+	request_t	request = { .number = 1 };
+	char		*buffer;
+	size_t		buffer_len = 64 * 1024;
+	int		i;
+
+	fr_command_register_hook = command_register_noop;
+
+	TEST_CHECK(fr_trace_init(ctx, 1, 64, NULL) == 0);
+	TEST_CHECK(fr_trace_thread_init() == 0);
+
+	/*
+	 *	The oldest events are overwritten.
+	 */
+	for (i = 0; i < 100; i++) {
+		request.number = i;
+		FR_TRACE(&request, FR_TRACE_DISPATCH, FR_TRACE_INSTANT, "default");
+	}
+
+	buffer = talloc_array(ctx, char, buffer_len);
+	trace_dump_buffer(buffer, buffer_len);
+
+	TEST_CHECK(count_events(buffer) == 64);
+	TEST_CHECK(strstr(buffer, "\"request\":35}") == NULL);
+	TEST_CHECK(strstr(buffer, "\"request\":36}") != NULL);
+	TEST_CHECK(strstr(buffer, "\"request\":99}") != NULL);
+
+	fr_trace_thread_detach();
+	fr_trace_free();
+
+	talloc_free(ctx);
+}
+
+TEST_LIST = {
+	{ "trace_disabled",	test_disabled },
+	{ "trace_json",		test_json },
+	{ "trace_wrap",		test_wrap },
+
+	{ NULL }
+};
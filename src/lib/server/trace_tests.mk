@@ -0,0 +1,8 @@
+TARGET		:= trace_tests
+
+SOURCES		:= trace_tests.c
+
+TGT_LDLIBS	:= $(LIBS) $(GPERFTOOLS_LIBS)
+TGT_LDFLAGS	:= $(LDFLAGS) $(GPERFTOOLS_LDFLAGS)
+
+TGT_PREREQS	:= libfreeradius-util.a libfreeradius-server.a libfreeradius-unlang.a
@@ -38,6 +38,7 @@ typedef struct fr_trunk_s fr_trunk_t;
 #include <freeradius-devel/server/trunk.h>
 
 #include <freeradius-devel/server/connection.h>
+#include <freeradius-devel/server/trace.h>
 #include <freeradius-devel/server/trigger.h>
 #include <freeradius-devel/unlang/base.h>
 #include <freeradius-devel/util/misc.h>
@@ -1107,6 +1108,7 @@ static void trunk_request_enter_sent(fr_trunk_request_t *treq)
 	}
 
 	REQUEST_STATE_TRANSITION(FR_TRUNK_REQUEST_STATE_SENT);
+	FR_TRACE(treq->pub.request, FR_TRACE_TRUNK, FR_TRACE_INSTANT, trunk->log_prefix);
 	fr_dlist_insert_tail(&tconn->sent, treq);
 
 	/*
@@ -1180,6 +1182,10 @@ static void trunk_request_enter_cancel(fr_trunk_request_t *treq, fr_trunk_cancel
 	fr_dlist_insert_tail(&tconn->cancel, treq);
 	treq->cancel_reason = reason;
 
+	if (reason == FR_TRUNK_CANCEL_REASON_SIGNAL) {
+		FR_TRACE(treq->pub.request, FR_TRACE_TRUNK, FR_TRACE_END, trunk->log_prefix);
+	}
+
 	DO_REQUEST_CANCEL(treq, reason);
 
 	/*
@@ -1332,6 +1338,7 @@ static void trunk_request_enter_complete(fr_trunk_request_t *treq)
 	}
 
 	REQUEST_STATE_TRANSITION(FR_TRUNK_REQUEST_STATE_COMPLETE);
+	FR_TRACE(treq->pub.request, FR_TRACE_TRUNK, FR_TRACE_END, trunk->log_prefix);
 	DO_REQUEST_COMPLETE(treq);
 	fr_trunk_request_free(&treq);	/* Free the request */
 }
@@ -1363,6 +1370,7 @@ static void trunk_request_enter_failed(fr_trunk_request_t *treq)
 	}
 
 	REQUEST_STATE_TRANSITION(FR_TRUNK_REQUEST_STATE_FAILED);
+	FR_TRACE(treq->pub.request, FR_TRACE_TRUNK, FR_TRACE_END, trunk->log_prefix);
 	DO_REQUEST_FAIL(treq, prev);
 	fr_trunk_request_free(&treq);	/* Free the request */
 }
@@ -2353,6 +2361,7 @@ fr_trunk_enqueue_t fr_trunk_request_enqueue(fr_trunk_request_t **treq_out, fr_tr
 		}
 		treq->pub.preq = preq;
 		treq->pub.rctx = rctx;
+		FR_TRACE(request, FR_TRACE_TRUNK, FR_TRACE_BEGIN, trunk->log_prefix);
 		if (trunk->conf.always_writable) {
 			fr_connection_signals_pause(tconn->pub.conn);
 			trunk_request_enter_pending(treq, tconn, true);
@@ -2371,6 +2380,7 @@ fr_trunk_enqueue_t fr_trunk_request_enqueue(fr_trunk_request_t **treq_out, fr_tr
 		}
 		treq->pub.preq = preq;
 		treq->pub.rctx = rctx;
+		FR_TRACE(request, FR_TRACE_TRUNK, FR_TRACE_BEGIN, trunk->log_prefix);
 		trunk_request_enter_backlog(treq, true);
 		break;
 
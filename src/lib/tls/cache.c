@@ -32,11 +32,60 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/unlang/base.h>
+#include <freeradius-devel/util/hex.h>
+
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#  include <openssl/core_names.h>
+#endif
 
 #include "base.h"
 #include "missing.h"
 #include "attrs.h"
 
+#define TICKET_KEY_NAME_LEN	16		//!< Length of the name identifying a ticket key.
+#define TICKET_KEY_LEN		32		//!< Length of the AES-256 and HMAC-SHA256 keys.
+#define TICKET_ID_LEN		16		//!< Length of the identifier embedded in tickets.
+#define TICKET_REVOKED_MAX	65536		//!< Maximum number of revoked tickets we remember.
+
+/** A key used to protect stateless session tickets
+ *
+ */
+typedef struct {
+	uint8_t			name[TICKET_KEY_NAME_LEN];	//!< Included in tickets so we know which key
+								///< to use when they're presented.
+	uint8_t			aes_key[TICKET_KEY_LEN];	//!< Encrypts the session state.
+	uint8_t			hmac_key[TICKET_KEY_LEN];	//!< Authenticates the ticket.
+	fr_time_t		retired;			//!< When we stopped issuing tickets with this key.
+} tls_ticket_key_t;
+
+/** A ticket which must not be used for resumption
+ *
+ */
+typedef struct {
+	fr_rb_node_t		node;				//!< Entry in the revoked tree.
+	fr_dlist_t		entry;				//!< Entry in the revoked list.
+	uint8_t			id[TICKET_ID_LEN];		//!< Identifier embedded in the ticket.
+	fr_time_t		expires;			//!< When the ticket would have expired anyway.
+} tls_ticket_revoked_t;
+
+/** The ring of keys used to protect session tickets
+ *
+ * Shared by all SSL_CTXs created from a configuration.
+ */
+struct fr_tls_ticket_keys_s {
+	pthread_mutex_t		mutex;				//!< Synchronisation mutex.
+	fr_rb_tree_t		*revoked;			//!< Tickets issued to sessions which later failed.
+	fr_dlist_head_t		revoked_list;			//!< Revoked tickets, oldest first.
+	tls_ticket_key_t	*keys;				//!< The first key is used to issue tickets,
+								///< all keys may be used to decrypt them.
+	char const		*file;				//!< Key ring to load.  If NULL we generate
+								///< our own keys.
+	fr_time_delta_t		rotate;				//!< How often keys are rotated or reloaded.
+	fr_time_delta_t		lifetime;			//!< How long tickets can be resumed after.
+	fr_time_t		next_rotate;			//!< When keys should next be rotated or reloaded.
+};
+
 /** Add attributes identifying the TLS session to be acted upon, and the action to be performed
  *
  * Adds the following attributes to the request:
@@ -469,6 +518,89 @@ static void fr_tls_cache_delete(SSL_CTX *ctx, SSL_SESSION *sess)
 	}
 }
 
+/** Return the identifier embedded in tickets issued to this session
+ *
+ * The identifier is generated when the first ticket is issued.  Sessions
+ * resumed from a ticket use the identifier from that ticket.
+ *
+ * @param[in] session	to return the identifier for.
+ * @return the ticket identifier, TICKET_ID_LEN bytes long.
+ */
+static uint8_t const *ticket_id(fr_tls_session_t *session)
+{
+	/*
+	 *	Only uniqueness matters, the identifier is
+	 *	encrypted along with the rest of the ticket.
+	 */
+	if (!session->ticket_id) {
+		MEM(session->ticket_id = talloc_array(session, uint8_t, TICKET_ID_LEN));
+		fr_rand_buffer(session->ticket_id, TICKET_ID_LEN);
+	}
+
+	return session->ticket_id;
+}
+
+/** Prevent tickets carrying an identifier from being used for resumption
+ *
+ * Entries are kept until tickets issued with the identifier would have
+ * expired anyway.  If more than #TICKET_REVOKED_MAX tickets are revoked
+ * in that time, the oldest entries are discarded early.
+ *
+ * @param[in] tk	Key ring the tickets were issued with.
+ * @param[in] id	Ticket identifier, TICKET_ID_LEN bytes long.
+ */
+static void ticket_revoke(fr_tls_ticket_keys_t *tk, uint8_t const *id)
+{
+	tls_ticket_revoked_t	*revoked, find;
+	fr_time_t		now = fr_time();
+
+	memcpy(find.id, id, sizeof(find.id));
+
+	pthread_mutex_lock(&tk->mutex);
+	while ((revoked = fr_dlist_head(&tk->revoked_list)) && (revoked->expires <= now)) {
+		fr_dlist_remove(&tk->revoked_list, revoked);
+		fr_rb_delete(tk->revoked, revoked);
+		talloc_free(revoked);
+	}
+
+	if (!fr_rb_find(tk->revoked, &find)) {
+		if (fr_dlist_num_elements(&tk->revoked_list) >= TICKET_REVOKED_MAX) {
+			revoked = fr_dlist_pop_head(&tk->revoked_list);
+			fr_rb_delete(tk->revoked, revoked);
+			talloc_free(revoked);
+		}
+
+		MEM(revoked = talloc_zero(tk, tls_ticket_revoked_t));
+		memcpy(revoked->id, id, sizeof(revoked->id));
+		revoked->expires = now + tk->lifetime;
+
+		fr_rb_insert(tk->revoked, revoked);
+		fr_dlist_insert_tail(&tk->revoked_list, revoked);
+	}
+	pthread_mutex_unlock(&tk->mutex);
+}
+
+/** Check whether tickets carrying an identifier have been revoked
+ *
+ * @param[in] tk	Key ring the ticket was issued with.
+ * @param[in] id	Ticket identifier, TICKET_ID_LEN bytes long.
+ * @return true if the ticket must not be used.
+ */
+static bool ticket_revoked(fr_tls_ticket_keys_t *tk, uint8_t const *id)
+{
+	tls_ticket_revoked_t	*revoked, find;
+	bool			ret;
+
+	memcpy(find.id, id, sizeof(find.id));
+
+	pthread_mutex_lock(&tk->mutex);
+	revoked = fr_rb_find(tk->revoked, &find);
+	ret = revoked && (revoked->expires > fr_time());
+	pthread_mutex_unlock(&tk->mutex);
+
+	return ret;
+}
+
 /** Prevent a TLS session from being cached
  *
  * Usually called if the session has failed for some reason.
@@ -480,12 +612,23 @@ static void fr_tls_cache_delete(SSL_CTX *ctx, SSL_SESSION *sess)
  */
 void fr_tls_cache_deny(fr_tls_session_t *session)
 {
+	fr_tls_conf_t	*conf = SSL_get_ex_data(session->ssl, FR_TLS_EX_INDEX_CONF);
+
 	/*
 	 *	Even for 1.1.0 we don't know when this function
 	 *	will be called, so better to remove the session
 	 *	directly.
 	 */
 	SSL_CTX_remove_session(session->ctx, session->session);
+
+	/*
+	 *	The client may already hold a ticket for this
+	 *	session, which we can't take back, so remember
+	 *	not to accept it.  If no ticket has been issued
+	 *	yet, it's revoked when it is.
+	 */
+	session->ticket_denied = true;
+	if (conf && conf->ticket_keys && session->ticket_id) ticket_revoke(conf->ticket_keys, session->ticket_id);
 }
 
 /** Prevent a TLS session from being resumed in future
@@ -554,15 +697,406 @@ int fr_tls_cache_disable_cb(SSL *ssl,
 	return 0;
 }
 
+/** Load a ticket key ring from a file
+ *
+ * Each non-empty line not starting with '#' contains one key, as 160 hex
+ * digits.  These are the 16 byte key name, the 32 byte AES key and the
+ * 32 byte HMAC key.  The first key is used to issue new tickets.
+ *
+ * @param[in] ctx	to allocate the key array in.
+ * @param[in] file	to read.
+ * @return
+ *	- An array of keys.
+ *	- NULL on error.
+ */
+static tls_ticket_key_t *ticket_keys_load(TALLOC_CTX *ctx, char const *file)
+{
+	FILE			*fp;
+	char			buffer[256];
+	int			lineno = 0;
+	size_t			num = 0;
+	tls_ticket_key_t	*keys;
+	uint8_t			bin[sizeof(keys->name) + sizeof(keys->aes_key) + sizeof(keys->hmac_key)];
+
+	fp = fopen(file, "r");
+	if (!fp) {
+		fr_strerror_printf("Failed opening %s: %s", file, fr_syserror(errno));
+		return NULL;
+	}
+
+	MEM(keys = talloc_array(ctx, tls_ticket_key_t, 0));
+	while (fgets(buffer, sizeof(buffer), fp)) {
+		char	*p = buffer;
+		size_t	len;
+
+		lineno++;
+
+		fr_skip_whitespace(p);
+		if ((*p == '\0') || (*p == '#')) continue;
+
+		len = strcspn(p, " \t\r\n");
+		if ((len != (sizeof(bin) * 2)) ||
+		    (fr_hex2bin(NULL, &FR_DBUFF_TMP(bin, sizeof(bin)), &FR_SBUFF_IN(p, len), true) != sizeof(bin))) {
+			fr_strerror_printf("%s[%d]: Ticket keys must be %zu hex digits", file, lineno, sizeof(bin) * 2);
+		error:
+			OPENSSL_cleanse(bin, sizeof(bin));
+			OPENSSL_cleanse(keys, talloc_array_length(keys) * sizeof(*keys));
+			talloc_free(keys);
+			fclose(fp);
+			return NULL;
+		}
+
+		MEM(keys = talloc_realloc(ctx, keys, tls_ticket_key_t, num + 1));
+		memcpy(keys[num].name, bin, sizeof(keys[num].name));
+		memcpy(keys[num].aes_key, bin + sizeof(keys[num].name), sizeof(keys[num].aes_key));
+		memcpy(keys[num].hmac_key, bin + sizeof(keys[num].name) + sizeof(keys[num].aes_key),
+		       sizeof(keys[num].hmac_key));
+		keys[num].retired = 0;
+		num++;
+	}
+
+	if (num == 0) {
+		fr_strerror_printf("%s: No ticket keys found", file);
+		goto error;
+	}
+
+	OPENSSL_cleanse(bin, sizeof(bin));
+	fclose(fp);
+
+	return keys;
+}
+
+/** Rotate or reload the ticket keys
+ *
+ * If the keys come from a file, the file is re-read, so that keys can be
+ * rotated across a group of servers.  Otherwise a new key is generated and
+ * older keys are kept until tickets issued with them would have expired.
+ *
+ * @note Called with the mutex held.
+ *
+ * @param[in] tk	Key ring to update.
+ * @param[in] now	The current time.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, in which case the existing keys are kept.
+ */
+static int ticket_keys_rotate(fr_tls_ticket_keys_t *tk, fr_time_t now)
+{
+	tls_ticket_key_t	*keys;
+	size_t			i, num = 0, old_num = talloc_array_length(tk->keys);
+
+	tk->next_rotate = now + tk->rotate;
+
+	if (tk->file) {
+		keys = ticket_keys_load(tk, tk->file);
+		if (!keys) return -1;
+	} else {
+		tls_ticket_key_t	key = { .retired = 0 };
+
+		if ((RAND_bytes(key.name, sizeof(key.name)) != 1) ||
+		    (RAND_bytes(key.aes_key, sizeof(key.aes_key)) != 1) ||
+		    (RAND_bytes(key.hmac_key, sizeof(key.hmac_key)) != 1)) {
+			fr_strerror_const("Failed generating ticket key");
+			OPENSSL_cleanse(&key, sizeof(key));
+			return -1;
+		}
+
+		/*
+		 *	Keep previous keys around for as long as
+		 *	tickets issued with them remain valid.
+		 *	The array must only contain keys we can
+		 *	use, as its length is how many we search.
+		 */
+		num = 1;
+		for (i = 0; i < old_num; i++) {
+			if (!tk->keys[i].retired) tk->keys[i].retired = now;
+			if ((now - tk->keys[i].retired) < tk->lifetime) num++;
+		}
+
+		MEM(keys = talloc_array(tk, tls_ticket_key_t, num));
+		keys[0] = key;
+		OPENSSL_cleanse(&key, sizeof(key));
+
+		num = 1;
+		for (i = 0; i < old_num; i++) {
+			if ((now - tk->keys[i].retired) >= tk->lifetime) continue;
+
+			keys[num++] = tk->keys[i];
+		}
+	}
+
+	if (tk->keys) {
+		OPENSSL_cleanse(tk->keys, old_num * sizeof(*tk->keys));
+		talloc_free(tk->keys);
+	}
+	tk->keys = keys;
+
+	return 0;
+}
+
+static int8_t ticket_revoked_cmp(void const *one, void const *two)
+{
+	tls_ticket_revoked_t const *a = one, *b = two;
+
+	return CMP(memcmp(a->id, b->id, sizeof(a->id)), 0);
+}
+
+static int _ticket_keys_free(fr_tls_ticket_keys_t *tk)
+{
+	if (tk->keys) OPENSSL_cleanse(tk->keys, talloc_array_length(tk->keys) * sizeof(*tk->keys));
+	pthread_mutex_destroy(&tk->mutex);
+
+	return 0;
+}
+
+/** Allocate the ring of keys used to protect stateless session tickets
+ *
+ * @param[in] ctx		to allocate the key ring in.
+ * @param[in] file		to load keys from.  If NULL keys are generated locally,
+ *				and tickets can only be resumed by this server.
+ * @param[in] rotate		How often to generate a new key, or reload the file.
+ * @param[in] lifetime		How long tickets can be resumed after they're issued.
+ * @return
+ *	- A new key ring.
+ *	- NULL on failure.
+ */
+fr_tls_ticket_keys_t *fr_tls_cache_ticket_keys_alloc(TALLOC_CTX *ctx, char const *file,
+						     uint32_t rotate, uint32_t lifetime)
+{
+	fr_tls_ticket_keys_t	*tk;
+
+	MEM(tk = talloc_zero(ctx, fr_tls_ticket_keys_t));
+	if (pthread_mutex_init(&tk->mutex, NULL) != 0) {
+		fr_strerror_const("Failed initialising ticket key mutex");
+		talloc_free(tk);
+		return NULL;
+	}
+	talloc_set_destructor(tk, _ticket_keys_free);
+
+	MEM(tk->revoked = fr_rb_inline_alloc(tk, tls_ticket_revoked_t, node, ticket_revoked_cmp, NULL));
+	fr_dlist_talloc_init(&tk->revoked_list, tls_ticket_revoked_t, entry);
+
+	tk->file = file;
+	tk->rotate = fr_time_delta_from_sec(rotate);
+	tk->lifetime = fr_time_delta_from_sec(lifetime);
+
+	if (ticket_keys_rotate(tk, fr_time()) < 0) {
+		talloc_free(tk);
+		return NULL;
+	}
+
+	return tk;
+}
+
+/** Select the key used to issue or decrypt a session ticket
+ *
+ * @param[in] ssl		The current OpenSSL session.
+ * @param[in,out] key_name	Written when issuing a ticket, read when decrypting one.
+ * @param[out] iv		Generated when issuing a ticket.
+ * @param[in] cipher_ctx	to initialise with the AES key.
+ * @param[in] mac_ctx		to initialise with the HMAC key.
+ * @param[in] enc		Whether we're issuing (1) or decrypting (0) a ticket.
+ * @return
+ *	- -1 on error.
+ *	- 0 if the ticket was issued with a key we don't have.
+ *	- 1 on success.
+ *	- 2 if the ticket was decrypted with an old key and should be reissued.
+ */
+static int fr_tls_cache_ticket_key_cb(SSL *ssl, unsigned char key_name[TICKET_KEY_NAME_LEN], unsigned char *iv,
+				      EVP_CIPHER_CTX *cipher_ctx,
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+				      EVP_MAC_CTX *mac_ctx,
+#else
+				      HMAC_CTX *mac_ctx,
+#endif
+				      int enc)
+{
+	fr_tls_conf_t		*conf = talloc_get_type_abort(SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_CONF), fr_tls_conf_t);
+	request_t		*request = SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_REQUEST);
+	fr_tls_ticket_keys_t	*tk = conf->ticket_keys;
+	tls_ticket_key_t	key;
+	fr_time_t		now = fr_time();
+	size_t			i, num;
+	int			ret = 1;
+
+	pthread_mutex_lock(&tk->mutex);
+	if (now >= tk->next_rotate) {
+		if (ticket_keys_rotate(tk, now) < 0) ROPTIONAL(RPERROR, PERROR, "Failed rotating session ticket keys");
+	}
+
+	if (enc) {
+		key = tk->keys[0];
+	} else {
+		num = talloc_array_length(tk->keys);
+		for (i = 0; i < num; i++) {
+			if (memcmp(key_name, tk->keys[i].name, sizeof(tk->keys[i].name)) == 0) break;
+		}
+		if (i == num) {
+			pthread_mutex_unlock(&tk->mutex);
+			ROPTIONAL(RDEBUG2, DEBUG2, "Session ticket key not found, performing full handshake");
+			return 0;
+		}
+		key = tk->keys[i];
+		if (i > 0) ret = 2;	/* Issue a new ticket with the current key */
+	}
+	pthread_mutex_unlock(&tk->mutex);
+
+	if (enc) {
+		memcpy(key_name, key.name, sizeof(key.name));
+		if ((RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1) ||
+		    (EVP_EncryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL, key.aes_key, iv) != 1)) {
+		error:
+			OPENSSL_cleanse(&key, sizeof(key));
+			return -1;
+		}
+	} else if (EVP_DecryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL, key.aes_key, iv) != 1) {
+		goto error;
+	}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	{
+		OSSL_PARAM params[] = {
+			OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac_key, sizeof(key.hmac_key)),
+			OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0),
+			OSSL_PARAM_construct_end()
+		};
+
+		if (EVP_MAC_CTX_set_params(mac_ctx, params) != 1) goto error;
+	}
+#else
+	if (HMAC_Init_ex(mac_ctx, key.hmac_key, sizeof(key.hmac_key), EVP_sha256(), NULL) != 1) goto error;
+#endif
+	OPENSSL_cleanse(&key, sizeof(key));
+
+	return ret;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+/** Embed the session's ticket identifier in a new ticket
+ *
+ * @param[in] ssl	The current OpenSSL session.
+ * @param[in] arg	unused.
+ * @return
+ *	- 1 on success.
+ *	- 0 on failure, which fails the handshake.
+ */
+static int fr_tls_cache_ticket_gen_cb(SSL *ssl, UNUSED void *arg)
+{
+	fr_tls_conf_t		*conf = talloc_get_type_abort(SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_CONF), fr_tls_conf_t);
+	fr_tls_session_t	*tls_session;
+	uint8_t const		*id;
+
+	tls_session = talloc_get_type_abort(SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_TLS_SESSION), fr_tls_session_t);
+	id = ticket_id(tls_session);
+
+	/*
+	 *	The session was denied before OpenSSL got
+	 *	around to issuing the ticket.
+	 */
+	if (tls_session->ticket_denied) ticket_revoke(conf->ticket_keys, id);
+
+	return SSL_SESSION_set1_ticket_appdata(SSL_get0_session(ssl), id, TICKET_ID_LEN);
+}
+
+/** Refuse tickets issued to sessions which were later denied
+ *
+ * @param[in] ssl		The current OpenSSL session.
+ * @param[in] sess		decrypted from the ticket.
+ * @param[in] keyname		unused.
+ * @param[in] keyname_len	unused.
+ * @param[in] status		of the decryption.
+ * @param[in] arg		unused.
+ * @return what OpenSSL should do with the ticket.
+ */
+static SSL_TICKET_RETURN fr_tls_cache_ticket_dec_cb(SSL *ssl, SSL_SESSION *sess,
+						    UNUSED unsigned char const *keyname, UNUSED size_t keyname_len,
+						    SSL_TICKET_STATUS status, UNUSED void *arg)
+{
+	fr_tls_conf_t		*conf = talloc_get_type_abort(SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_CONF), fr_tls_conf_t);
+	request_t		*request = SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_REQUEST);
+	fr_tls_session_t	*tls_session;
+	void			*id = NULL;
+	size_t			id_len = 0;
+
+	/*
+	 *	What OpenSSL does if there's no callback
+	 */
+	switch (status) {
+	case SSL_TICKET_SUCCESS:
+	case SSL_TICKET_SUCCESS_RENEW:
+		break;
+
+	case SSL_TICKET_EMPTY:
+	case SSL_TICKET_NO_DECRYPT:
+		return SSL_TICKET_RETURN_IGNORE_RENEW;
+
+	default:
+		return SSL_TICKET_RETURN_ABORT;
+	}
+
+	if ((SSL_SESSION_get0_ticket_appdata(sess, &id, &id_len) != 1) || (id_len != TICKET_ID_LEN)) {
+		ROPTIONAL(RDEBUG2, DEBUG2, "Session ticket has no identifier, performing full handshake");
+		return SSL_TICKET_RETURN_IGNORE_RENEW;
+	}
+
+	if (ticket_revoked(conf->ticket_keys, id)) {
+		ROPTIONAL(RDEBUG2, DEBUG2, "Session ticket was revoked, performing full handshake");
+		return SSL_TICKET_RETURN_IGNORE_RENEW;
+	}
+
+	/*
+	 *	Carry the identifier over, so that if this session
+	 *	fails, the ticket it was resumed from is revoked.
+	 */
+	tls_session = talloc_get_type_abort(SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_TLS_SESSION), fr_tls_session_t);
+	if (!tls_session->ticket_id) {
+		MEM(tls_session->ticket_id = talloc_memdup(tls_session, id, TICKET_ID_LEN));
+	} else {
+		memcpy(tls_session->ticket_id, id, TICKET_ID_LEN);
+	}
+
+	return (status == SSL_TICKET_SUCCESS_RENEW) ? SSL_TICKET_RETURN_USE_RENEW : SSL_TICKET_RETURN_USE;
+}
+#endif
+
 /** Sets callbacks on a SSL_CTX to enable/disable session resumption
  *
  * @param ctx			to modify.
  * @param enabled		Whether session caching should be enabled.
+ * @param tickets		Whether stateless session tickets should be issued.
+ *				The key ring must have been allocated with
+ *				#fr_tls_cache_ticket_keys_alloc.
  * @param lifetime		The maximum period a cached session remains
  *				valid for.
  */
-void fr_tls_cache_init(SSL_CTX *ctx, bool enabled, uint32_t lifetime)
+void fr_tls_cache_init(SSL_CTX *ctx, bool enabled, bool tickets, uint32_t lifetime)
 {
+	if (tickets) {
+		/*
+		 *	Session state is held by the client, so
+		 *	resumption needs no lookups, and works on
+		 *	any server sharing the key ring.
+		 */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, fr_tls_cache_ticket_key_cb);
+#else
+		SSL_CTX_set_tlsext_ticket_key_cb(ctx, fr_tls_cache_ticket_key_cb);
+#endif
+		SSL_CTX_set_quiet_shutdown(ctx, 1);
+		SSL_CTX_set_timeout(ctx, lifetime);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+		SSL_CTX_set_num_tickets(ctx, 1);
+		SSL_CTX_set_session_ticket_cb(ctx, fr_tls_cache_ticket_gen_cb, fr_tls_cache_ticket_dec_cb, NULL);
+#endif
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+		SSL_CTX_set_not_resumable_session_callback(ctx, fr_tls_cache_disable_cb);
+#endif
+		if (!enabled) {
+			SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+			return;
+		}
+	}
+
 	if (!enabled) {
 #if OPENSSL_VERSION_NUMBER >= 0x10101000L
 		/*
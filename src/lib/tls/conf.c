@@ -37,6 +37,7 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
+#include <freeradius-devel/tls/engine.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/syserror.h>
 
@@ -72,6 +73,10 @@ static CONF_PARSER cache_config[] = {
 	{ FR_CONF_OFFSET("lifetime", FR_TYPE_UINT32, fr_tls_conf_t, session_cache_lifetime), .dflt = "86400" },
 	{ FR_CONF_OFFSET("verify", FR_TYPE_BOOL, fr_tls_conf_t, session_cache_verify), .dflt = "no" },
 
+	{ FR_CONF_OFFSET("stateless", FR_TYPE_BOOL, fr_tls_conf_t, session_ticket), .dflt = "no" },
+	{ FR_CONF_OFFSET("ticket_key_file", FR_TYPE_FILE_INPUT, fr_tls_conf_t, session_ticket_key_file) },
+	{ FR_CONF_OFFSET("ticket_key_rotate", FR_TYPE_UINT32, fr_tls_conf_t, session_ticket_key_rotate), .dflt = "3600" },
+
 #if OPENSSL_VERSION_NUMBER >= 0x10100000L
 	{ FR_CONF_OFFSET("require_extended_master_secret", FR_TYPE_BOOL, fr_tls_conf_t, session_cache_require_extms), .dflt = "yes" },
 	{ FR_CONF_OFFSET("require_perfect_forward_secrecy", FR_TYPE_BOOL, fr_tls_conf_t, session_cache_require_pfs), .dflt = "no" },
@@ -99,8 +104,9 @@ static CONF_PARSER ocsp_config[] = {
 	{ FR_CONF_OFFSET("override_cert_url", FR_TYPE_BOOL, fr_tls_ocsp_conf_t, override_url), .dflt = "no" },
 	{ FR_CONF_OFFSET("url", FR_TYPE_STRING, fr_tls_ocsp_conf_t, url) },
 	{ FR_CONF_OFFSET("use_nonce", FR_TYPE_BOOL, fr_tls_ocsp_conf_t, use_nonce), .dflt = "yes" },
-	{ FR_CONF_OFFSET("timeout", FR_TYPE_UINT32, fr_tls_ocsp_conf_t, timeout), .dflt = "yes" },
+	{ FR_CONF_OFFSET("timeout", FR_TYPE_UINT32, fr_tls_ocsp_conf_t, timeout), .dflt = "0" },
 	{ FR_CONF_OFFSET("softfail", FR_TYPE_BOOL, fr_tls_ocsp_conf_t, softfail), .dflt = "no" },
+	{ FR_CONF_OFFSET("cache_size", FR_TYPE_UINT32, fr_tls_ocsp_conf_t, cache_size), .dflt = "1024" },
 
 	CONF_PARSER_TERMINATOR
 };
@@ -121,6 +127,9 @@ static CONF_PARSER tls_chain_config[] = {
 
 CONF_PARSER fr_tls_server_config[] = {
 	{ FR_CONF_OFFSET("auto_chain", FR_TYPE_BOOL, fr_tls_conf_t, auto_chain), .dflt = "yes" },
+#ifdef SSL_MODE_ASYNC
+	{ FR_CONF_OFFSET("async_handshake", FR_TYPE_BOOL, fr_tls_conf_t, async_handshake), .dflt = "no" },
+#endif
 
 	{ FR_CONF_OFFSET("chain", FR_TYPE_SUBSECTION | FR_TYPE_MULTI, fr_tls_conf_t, chains),
 	  .subcs_size = sizeof(fr_tls_chain_conf_t), .subcs_type = "fr_tls_chain_conf_t",
@@ -432,6 +441,37 @@ fr_tls_conf_t *fr_tls_conf_parse_server(CONF_SECTION *cs)
 	if (conf_cert_admin_password(conf) < 0) goto error;
 #endif
 
+	/*
+	 *	The key ring is shared by all the SSL_CTXs, so
+	 *	must exist before they do.
+	 */
+	if (conf->session_ticket) {
+		if (!conf->session_ticket_key_rotate) {
+			ERROR("ticket_key_rotate must be greater than zero");
+			goto error;
+		}
+
+		conf->ticket_keys = fr_tls_cache_ticket_keys_alloc(conf, conf->session_ticket_key_file,
+								   conf->session_ticket_key_rotate,
+								   conf->session_cache_lifetime);
+		if (!conf->ticket_keys) {
+			PERROR("Failed loading session ticket keys");
+			goto error;
+		}
+	}
+
+#ifdef SSL_MODE_ASYNC
+	/*
+	 *	We don't offload private key operations ourselves.
+	 *	Handshakes only yield for them if an engine performs
+	 *	them, and pauses the async job whilst it does.
+	 */
+	if (conf->async_handshake && !fr_tls_engine_pkey_default()) {
+		WARN("Ignoring async_handshake, no engine is configured for private key operations");
+		conf->async_handshake = false;
+	}
+#endif
+
 	conf->ctx_count = fr_tls_max_threads * 2; /* Reduce contention */
 	if (!conf->ctx_count) conf->ctx_count = 1;
 
@@ -458,11 +498,21 @@ fr_tls_conf_t *fr_tls_conf_parse_server(CONF_SECTION *cs)
 	if (conf->ocsp.enable) {
 		conf->ocsp.store = conf_ocsp_revocation_store(conf);
 		if (conf->ocsp.store == NULL) goto error;
+
+		if (conf->ocsp.cache_size) {
+			conf->ocsp.resp_cache = fr_tls_ocsp_cache_alloc(conf, conf->ocsp.cache_size);
+			if (!conf->ocsp.resp_cache) goto error;
+		}
 	}
 
 	if (conf->staple.enable) {
 		conf->staple.store = conf_ocsp_revocation_store(conf);
 		if (conf->staple.store == NULL) goto error;
+
+		if (conf->staple.cache_size) {
+			conf->staple.resp_cache = fr_tls_ocsp_cache_alloc(conf, conf->staple.cache_size);
+			if (!conf->staple.resp_cache) goto error;
+		}
 	}
 #endif /*HAVE_OPENSSL_OCSP_H*/
 
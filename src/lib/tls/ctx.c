@@ -432,6 +432,20 @@ SSL_CTX *fr_tls_ctx_alloc(fr_tls_conf_t const *conf, bool client)
 		 */
 		if (!conf->auto_chain) mode |= SSL_MODE_NO_AUTO_CHAIN;
 
+#ifdef SSL_MODE_ASYNC
+		/*
+		 *	Allows an async capable engine to pause the
+		 *	handshake whilst it performs private key
+		 *	operations, instead of blocking the worker.
+		 *
+		 *	OCSP lookups are made from the verify callback,
+		 *	and they can only yield if the handshake is
+		 *	running as an async job, so always run server
+		 *	handshakes that way if OCSP is enabled.
+		 */
+		if (conf->async_handshake || (!client && conf->ocsp.enable)) mode |= SSL_MODE_ASYNC;
+#endif
+
 		if (client) {
 			mode |= SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER;
 			mode |= SSL_MODE_AUTO_RETRY;
@@ -699,7 +713,7 @@ post_ca:
 #endif
 
 #ifdef SSL_OP_NO_TICKET
-	ctx_options |= SSL_OP_NO_TICKET;
+	if (!conf->ticket_keys) ctx_options |= SSL_OP_NO_TICKET;
 #endif
 
 	if (!conf->disable_single_dh_use) {
@@ -874,7 +888,8 @@ post_ca:
 	/*
 	 *	Setup session caching
 	 */
-	fr_tls_cache_init(ctx, conf->session_cache_server ? true : false, conf->session_cache_lifetime);
+	fr_tls_cache_init(ctx, conf->session_cache_server ? true : false, conf->ticket_keys ? true : false,
+			  conf->session_cache_lifetime);
 
 	return ctx;
 }
@@ -474,6 +474,30 @@ void fr_tls_engine_load_builtin(void)
 	ENGINE_register_all_complete();
 }
 
+/** Whether an engine performs private key operations by default
+ *
+ * Engines can be set as the default for RSA and EC operations with the
+ * OpenSSL configuration file.  This is the only way private key operations
+ * are performed outside of the worker, as we don't load keys through
+ * engines ourselves.
+ *
+ * @return
+ *	- true if an engine is the default for RSA or EC operations.
+ *	- false if OpenSSL's built-in implementations are used.
+ */
+bool fr_tls_engine_pkey_default(void)
+{
+	ENGINE *e;
+
+	e = ENGINE_get_default_RSA();
+	if (!e) e = ENGINE_get_default_EC();
+	if (!e) return false;
+
+	ENGINE_finish(e);	/* Release the functional reference */
+
+	return true;
+}
+
 /** Free any engines we've loaded
  *
  */
@@ -53,6 +53,8 @@ int fr_tls_engine(ENGINE **e_out, char const *id, char const *instance, bool aut
 
 void fr_tls_engine_load_builtin(void);
 
+bool fr_tls_engine_pkey_default(void);
+
 void fr_tls_engine_free_all(void);
 
 #ifdef __cplusplus
@@ -33,7 +33,9 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #include <freeradius-devel/server/pair.h>
 #include <freeradius-devel/util/debug.h>
 
+#include <freeradius-devel/util/dlist.h>
 #include <freeradius-devel/util/misc.h>
+#include <freeradius-devel/util/rb.h>
 
 #include <freeradius-devel/unlang/compile.h>
 
@@ -43,6 +45,10 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #include "base.h"
 #include "missing.h"
 
+#ifdef SSL_MODE_ASYNC
+#  include <openssl/async.h>
+#endif
+
 /** Rcodes returned by the OCSP check function
  */
 typedef enum {
@@ -57,6 +63,174 @@ typedef enum {
  */
 #define OCSP_MAX_VALIDITY_PERIOD (5 * 60)
 
+/** Maximum length of a DER encoded OCSP_CERTID we'll use as a cache key
+ *
+ */
+#define OCSP_CERTID_MAX_LEN	256
+
+/** A cached OCSP response
+ *
+ */
+typedef struct {
+	fr_rb_node_t		node;				//!< Entry in the cache tree.
+	fr_dlist_t		entry;				//!< Entry in the eviction list.
+
+	uint8_t const		*id;				//!< DER encoded OCSP_CERTID the response is for.
+	size_t			id_len;				//!< Length of the OCSP_CERTID.
+
+	uint8_t			*resp;				//!< DER encoded OCSP response.
+	size_t			resp_len;			//!< Length of the OCSP response.
+
+	fr_time_t		expires;			//!< When the responder told us to check again.
+} ocsp_cache_entry_t;
+
+/** OCSP responses shared between all workers using an OCSP configuration
+ *
+ */
+struct fr_tls_ocsp_cache_s {
+	fr_rb_tree_t		*tree;				//!< Cached responses keyed by OCSP_CERTID.
+	fr_dlist_head_t		list;				//!< Cached responses, oldest first.
+	pthread_mutex_t		mutex;				//!< Synchronisation mutex.
+	uint32_t		max_entries;			//!< Maximum number of responses to cache.
+};
+
+/** Compare two cache entries by the DER encoded OCSP_CERTID
+ *
+ */
+static int8_t ocsp_cache_entry_cmp(void const *one, void const *two)
+{
+	ocsp_cache_entry_t const *a = one, *b = two;
+	int ret;
+
+	ret = CMP(a->id_len, b->id_len);
+	if (ret != 0) return ret;
+
+	ret = memcmp(a->id, b->id, a->id_len);
+	return CMP(ret, 0);
+}
+
+static int _ocsp_cache_free(fr_tls_ocsp_cache_t *cache)
+{
+	pthread_mutex_destroy(&cache->mutex);
+
+	return 0;
+}
+
+/** Allocate a cache for OCSP responses
+ *
+ * @param[in] ctx		to allocate the cache in.
+ * @param[in] max_entries	Maximum number of responses to keep.
+ * @return
+ *	- A new OCSP response cache.
+ *	- NULL on failure.
+ */
+fr_tls_ocsp_cache_t *fr_tls_ocsp_cache_alloc(TALLOC_CTX *ctx, uint32_t max_entries)
+{
+	fr_tls_ocsp_cache_t *cache;
+
+	MEM(cache = talloc_zero(ctx, fr_tls_ocsp_cache_t));
+
+	if (pthread_mutex_init(&cache->mutex, NULL) != 0) {
+		ERROR("Failed initialising OCSP response cache mutex");
+		talloc_free(cache);
+		return NULL;
+	}
+	talloc_set_destructor(cache, _ocsp_cache_free);
+
+	MEM(cache->tree = fr_rb_inline_alloc(cache, ocsp_cache_entry_t, node, ocsp_cache_entry_cmp, NULL));
+	fr_dlist_talloc_init(&cache->list, ocsp_cache_entry_t, entry);
+	cache->max_entries = max_entries;
+
+	return cache;
+}
+
+/** Unlink and free a cache entry
+ *
+ * @note Called with the mutex held.
+ */
+static inline CC_HINT(always_inline) void ocsp_cache_entry_free(fr_tls_ocsp_cache_t *cache, ocsp_cache_entry_t *entry)
+{
+	fr_dlist_remove(&cache->list, entry);
+	fr_rb_delete(cache->tree, entry);
+	talloc_free(entry);
+}
+
+/** Retrieve a response for a certificate from the cache
+ *
+ * @param[in] cache	to search in.
+ * @param[in] id	DER encoded OCSP_CERTID of the certificate.
+ * @param[in] id_len	Length of the OCSP_CERTID.
+ * @return
+ *	- A copy of the cached response.  Must be freed with OCSP_RESPONSE_free().
+ *	- NULL if there was no unexpired response.
+ */
+static OCSP_RESPONSE *ocsp_cache_find(fr_tls_ocsp_cache_t *cache, uint8_t const *id, size_t id_len)
+{
+	ocsp_cache_entry_t	*entry, find = { .id = id, .id_len = id_len };
+	OCSP_RESPONSE		*resp = NULL;
+	uint8_t const		*p;
+
+	pthread_mutex_lock(&cache->mutex);
+	entry = fr_rb_find(cache->tree, &find);
+	if (entry) {
+		if (entry->expires <= fr_time()) {
+			ocsp_cache_entry_free(cache, entry);
+		} else {
+			p = entry->resp;
+			resp = d2i_OCSP_RESPONSE(NULL, &p, entry->resp_len);
+		}
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return resp;
+}
+
+/** Add a response for a certificate to the cache
+ *
+ * Replaces any existing response for the certificate, and evicts the
+ * oldest response if the cache is full.
+ *
+ * @param[in] cache	to insert into.
+ * @param[in] id	DER encoded OCSP_CERTID of the certificate.
+ * @param[in] id_len	Length of the OCSP_CERTID.
+ * @param[in] resp	to cache.
+ * @param[in] expires	When the response should no longer be used.
+ */
+static void ocsp_cache_insert(fr_tls_ocsp_cache_t *cache, uint8_t const *id, size_t id_len,
+			      OCSP_RESPONSE *resp, fr_time_t expires)
+{
+	ocsp_cache_entry_t	*entry, *old, find = { .id = id, .id_len = id_len };
+	uint8_t			*p;
+	int			len;
+
+	len = i2d_OCSP_RESPONSE(resp, NULL);
+	if (len <= 0) return;
+
+	/*
+	 *	Serialise outside of the mutex, so other workers
+	 *	only wait for the tree operations.
+	 */
+	MEM(entry = talloc_zero(NULL, ocsp_cache_entry_t));
+	MEM(entry->id = talloc_memdup(entry, id, id_len));
+	entry->id_len = id_len;
+	MEM(entry->resp = p = talloc_array(entry, uint8_t, len));
+	entry->resp_len = i2d_OCSP_RESPONSE(resp, &p);
+	entry->expires = expires;
+
+	pthread_mutex_lock(&cache->mutex);
+	old = fr_rb_find(cache->tree, &find);
+	if (old) ocsp_cache_entry_free(cache, old);
+
+	while (fr_rb_num_elements(cache->tree) >= cache->max_entries) {
+		ocsp_cache_entry_free(cache, fr_dlist_head(&cache->list));
+	}
+
+	talloc_steal(cache, entry);
+	fr_rb_insert(cache->tree, entry);
+	fr_dlist_insert_tail(&cache->list, entry);
+	pthread_mutex_unlock(&cache->mutex);
+}
+
 DIAG_OFF(DIAG_UNKNOWN_PRAGMAS)
 DIAG_OFF(used-but-marked-unused)	/* fix spurious warnings for sk macros */
 /** Extract components of OCSP responser URL from a certificate
@@ -334,7 +508,129 @@ int fr_tls_ocsp_staple_cb(SSL *ssl, void *data)
 DIAG_ON(used-but-marked-unused)
 DIAG_ON(DIAG_UNKNOWN_PRAGMAS)
 
+#ifdef SSL_MODE_ASYNC
+/** Suspend the async job running the handshake until the OCSP responder is ready
+ *
+ * The fd is registered with the job's wait context, so the caller of
+ * the handshake sees SSL_ERROR_WANT_ASYNC, and can return to the event
+ * loop until the fd becomes ready or the deadline passes.
+ *
+ * @param[in] request	The current request.
+ * @param[in] ssl	the handshake is being performed on.
+ * @param[in] job	the handshake is running in.
+ * @param[in] fd	of the connection to the OCSP responder.
+ * @param[in] want_write	whether we're waiting for the fd to become writable.
+ * @param[in] deadline	after which we give up.  0 means wait indefinitely.
+ * @return
+ *	- 0 if the connection is ready for the next operation.
+ *	- -1 on timeout or error.
+ */
+static int ocsp_async_wait(request_t *request, SSL *ssl, ASYNC_JOB *job,
+			   int fd, bool want_write, fr_time_t deadline)
+{
+	ASYNC_WAIT_CTX		*wait_ctx = ASYNC_get_wait_ctx(job);
+	fr_tls_session_t	*tls_session;
+	int			ret = 0;
+
+	tls_session = talloc_get_type_abort(SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_TLS_SESSION), fr_tls_session_t);
+
+	if (ASYNC_WAIT_CTX_set_wait_fd(wait_ctx, tls_session, fd, NULL, NULL) != 1) {
+		REDEBUG("Failed adding OCSP responder fd to async wait context");
+		return -1;
+	}
+	tls_session->async_deadline = deadline;
+	tls_session->async_want_write = want_write;
+
+	RDEBUG3("Suspending handshake whilst waiting for OCSP responder");
+	if (ASYNC_pause_job() != 1) ret = -1;
+
+	tls_session->async_deadline = 0;
+	tls_session->async_want_write = false;
+	ASYNC_WAIT_CTX_clear_fd(wait_ctx, tls_session);
+
+	/*
+	 *	We're resumed either because the fd became ready,
+	 *	or because the deadline passed.
+	 */
+	if (deadline && (fr_time() >= deadline)) return -1;
+
+	return ret;
+}
+#endif
+
+/** Wait for the connection to the OCSP responder to become usable
+ *
+ * If the handshake is running as an OpenSSL async job the job is paused,
+ * and the request yields until the connection is ready.  Otherwise we
+ * block in select().  That only happens if OpenSSL wasn't built with
+ * async support, as server contexts with OCSP enabled always run
+ * handshakes as async jobs.
+ *
+ * @param[in] request	The current request.
+ * @param[in] ssl	the handshake is being performed on.
+ * @param[in] conn	to wait on.
+ * @param[in] deadline	after which we give up.  0 means wait indefinitely.
+ * @return
+ *	- 0 if the connection is ready for the next operation.
+ *	- -1 on timeout or error.
+ */
+static int ocsp_bio_wait(request_t *request, SSL *ssl, BIO *conn, fr_time_t deadline)
+{
+	fd_set		fds;
+	int		fd;
+	int		ret;
+	fr_time_t	now;
+	bool		want_write;
+#ifdef SSL_MODE_ASYNC
+	ASYNC_JOB	*job;
+#endif
+
+	fd = BIO_get_fd(conn, NULL);
+	if (fd < 0) return -1;
+
+	/*
+	 *	Anything other than a read (i.e. a write, or a
+	 *	connect in progress) needs the socket to be writable.
+	 */
+	want_write = !BIO_should_read(conn);
+
+#ifdef SSL_MODE_ASYNC
+	job = ASYNC_get_current_job();
+	if (job) return ocsp_async_wait(request, ssl, job, fd, want_write, deadline);
+#endif
+
+	if (fd >= FD_SETSIZE) return -1;
+
+	/*
+	 *	Signals interrupt select() before the socket is
+	 *	ready, or the deadline passes, so try again with
+	 *	whatever time is left.
+	 */
+	do {
+		FD_ZERO(&fds);
+		FD_SET(fd, &fds);
+
+		if (!deadline) {
+			ret = select(fd + 1, want_write ? NULL : &fds,
+				     want_write ? &fds : NULL, NULL, NULL);
+			continue;
+		}
+
+		now = fr_time();
+		if (now >= deadline) return -1;
+
+		ret = select(fd + 1, want_write ? NULL : &fds,
+			     want_write ? &fds : NULL, NULL,
+			     &fr_time_delta_to_timeval(deadline - now));
+	} while ((ret < 0) && (errno == EINTR));
+
+	return (ret > 0) ? 0 : -1;
+}
+
 /** Sends a OCSP request to a defined OCSP responder
+ *
+ * If the configuration has a response cache, and it holds an unexpired
+ * response for the certificate, that response is used instead.
  *
  */
 int fr_tls_ocsp_check(request_t *request, SSL *ssl,
@@ -356,10 +652,15 @@ int fr_tls_ocsp_check(request_t *request, SSL *ssl,
 	ocsp_status_t	status;
 	ASN1_GENERALIZEDTIME *rev, *this_update, *next_update;
 	int		reason;
-	OCSP_REQ_CTX	*ctx;
+	OCSP_REQ_CTX	*ctx = NULL;
 	int		rc;
 
-	fr_time_t	start;
+	uint8_t		id[OCSP_CERTID_MAX_LEN];
+	int		id_len = 0;
+	bool		cached = false;
+	fr_time_t	expires = 0;
+
+	fr_time_t	deadline = 0;
 	fr_pair_t	*vp;
 
 	if (conf->cache_server) {
@@ -449,6 +750,27 @@ int fr_tls_ocsp_check(request_t *request, SSL *ssl,
 	OCSP_request_add0_id(req, certid);
 	if (conf->use_nonce) OCSP_request_add1_nonce(req, NULL, 8);
 
+	/*
+	 *	Check for a response another request already
+	 *	retrieved for this certificate.
+	 */
+	if (conf->resp_cache) {
+		id_len = i2d_OCSP_CERTID(certid, NULL);
+		if ((id_len > 0) && (id_len <= (int)sizeof(id))) {
+			uint8_t *p = id;
+
+			id_len = i2d_OCSP_CERTID(certid, &p);
+			resp = ocsp_cache_find(conf->resp_cache, id, id_len);
+			if (resp) {
+				RDEBUG2("Using cached OCSP response");
+				cached = true;
+				goto verify;
+			}
+		} else {
+			id_len = 0;
+		}
+	}
+
 	/*
 	 *	Send OCSP Request and get OCSP Response
 	 */
@@ -501,10 +823,17 @@ int fr_tls_ocsp_check(request_t *request, SSL *ssl,
 	conn = BIO_new_connect(host);
 	BIO_set_conn_port(conn, port);
 
-	if (conf->timeout) BIO_set_nbio(conn, 1);
+	/*
+	 *	Always use non-blocking I/O so the timeout also
+	 *	covers connecting, and so we sleep in select()
+	 *	whilst waiting for the responder, instead of
+	 *	spinning on the BIO.
+	 */
+	BIO_set_nbio(conn, 1);
+	if (conf->timeout) deadline = fr_time() + fr_time_delta_from_sec(conf->timeout);
 
 	rc = BIO_do_connect(conn);
-	if ((rc <= 0) && ((!conf->timeout) || !BIO_should_retry(conn))) {
+	if ((rc <= 0) && !BIO_should_retry(conn)) {
 		REDEBUG("Couldn't connect to OCSP responder");
 		ocsp_status = OCSP_STATUS_SKIPPED;
 		goto finish;
@@ -529,29 +858,25 @@ int fr_tls_ocsp_check(request_t *request, SSL *ssl,
 		goto finish;
 	}
 
-	start = fr_time();
-	do {
+	for (;;) {
 		rc = OCSP_sendreq_nbio(&resp, ctx);
-		if (conf->timeout) {
-			if (conf->timeout > (fr_time() - start)) break;
-		}
-	} while ((rc == -1) && BIO_should_retry(conn));
+		if ((rc != -1) || !BIO_should_retry(conn)) break;
 
-	if (conf->timeout && (rc == -1) && BIO_should_retry(conn)) {
-		REDEBUG("Response timed out");
-		ocsp_status = OCSP_STATUS_SKIPPED;
-		goto finish;
+		if (ocsp_bio_wait(request, ssl, conn, deadline) < 0) {
+			REDEBUG("Response timed out");
+			ocsp_status = OCSP_STATUS_SKIPPED;
+			goto finish;
+		}
 	}
 
-	OCSP_REQ_CTX_free(ctx);
-
-	if (rc == 0) {
+	if (rc != 1) {
 		REDEBUG("Couldn't get OCSP response");
 		FR_OPENSSL_DRAIN_ERROR_QUEUE(REDEBUG, "", ssl_log);
 		ocsp_status = OCSP_STATUS_SKIPPED;
 		goto finish;
 	}
 
+verify:
 	/* Verify OCSP response status */
 	status = OCSP_response_status(resp);
 	if (status != OCSP_RESPONSE_STATUS_SUCCESSFUL) {
@@ -559,7 +884,7 @@ int fr_tls_ocsp_check(request_t *request, SSL *ssl,
 		goto finish;
 	}
 	bresp = OCSP_response_get1_basic(resp);
-	if (conf->use_nonce && OCSP_check_nonce(req, bresp) != 1) {
+	if (conf->use_nonce && !cached && OCSP_check_nonce(req, bresp) != 1) {
 		REDEBUG("Response has wrong nonce value");
 		goto finish;
 	}
@@ -635,6 +960,8 @@ int fr_tls_ocsp_check(request_t *request, SSL *ssl,
 			goto finish;
 		}
 		if (fr_time_to_sec(now) < next){
+			expires = now + fr_time_delta_from_sec(next - fr_time_to_sec(now));
+
 			RDEBUG2("Adding OCSP TTL attribute");
 
 			MEM(pair_update_request(&vp, attr_tls_ocsp_next_update) >= 0);
@@ -649,6 +976,12 @@ int fr_tls_ocsp_check(request_t *request, SSL *ssl,
 		RDEBUG2("Update time not provided.  Not adding &TLS-OCSP-Next-Update");
 	}
 
+	/*
+	 *	Only responses which tell us when to check again
+	 *	are cached, so we never hold on to one forever.
+	 */
+	if (id_len && !cached && expires) ocsp_cache_insert(conf->resp_cache, id, id_len, resp, expires);
+
 	switch (status) {
 	case V_OCSP_CERTSTATUS_GOOD:
 		RDEBUG2("Cert status: good");
@@ -744,6 +1077,7 @@ finish:
 		}
 	}
 	/* Free OCSP Stuff */
+	OCSP_REQ_CTX_free(ctx);
 	OCSP_REQUEST_free(req);
 	OCSP_BASICRESP_free(bresp);
 	OCSP_RESPONSE_free(resp);
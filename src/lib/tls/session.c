@@ -1331,6 +1331,9 @@ static void fr_tls_session_alert_send(request_t *request, fr_tls_session_t *sess
  * @return
  *	- -1 on error.
  *	- 0 on success.
+ *	- 2 if an async private key operation is in progress.  The handshake
+ *	  should be continued when the fd returned by #fr_tls_session_async_fd
+ *	  becomes readable.
  */
 int fr_tls_session_handshake(request_t *request, fr_tls_session_t *session)
 {
@@ -1400,6 +1403,20 @@ int fr_tls_session_handshake(request_t *request, fr_tls_session_t *session)
 		goto finish;
 	}
 
+#ifdef SSL_MODE_ASYNC
+	/*
+	 *	The engine is still working on a private key
+	 *	operation.  The caller should wait for the job's
+	 *	fd to become readable, then call us again to pick
+	 *	up where OpenSSL left off.
+	 */
+	if (SSL_get_error(session->ssl, ret) == SSL_ERROR_WANT_ASYNC) {
+		RDEBUG2("Waiting for async TLS operation to complete");
+		ret = 2;
+		goto finish;
+	}
+#endif
+
 	/*
 	 *	Returns 0 if we can continue processing the handshake
 	 *	Returns -1 if we encountered a fatal error.
@@ -1549,6 +1566,34 @@ finish:
 	return ret;
 }
 
+/** Return the fd to wait on for an in progress async operation
+ *
+ * @param session The current TLS session.
+ * @return
+ *	- The fd which will become readable when the async job can continue.
+ *	- -1 if there's no async job, or async jobs aren't supported.
+ */
+int fr_tls_session_async_fd(fr_tls_session_t *session)
+{
+#ifdef SSL_MODE_ASYNC
+	OSSL_ASYNC_FD	fds[1];
+	size_t		num_fds = 0;
+
+	/*
+	 *	Engines use a single fd per job, so
+	 *	that's all we wait for.
+	 */
+	if ((SSL_get_all_async_fds(session->ssl, NULL, &num_fds) != 1) ||
+	    (num_fds != 1)) return -1;
+
+	if (SSL_get_all_async_fds(session->ssl, fds, &num_fds) != 1) return -1;
+
+	return fds[0];
+#else
+	return -1;
+#endif
+}
+
 /** Free a TLS session and any associated OpenSSL data
  *
  * @param session to free.
@@ -1852,7 +1897,11 @@ fr_tls_session_t *fr_tls_session_init_server(TALLOC_CTX *ctx, fr_tls_conf_t *con
 		session->mtu = vp->vp_uint32;
 	}
 
-	if (conf->session_cache_server) session->allow_session_resumption = true; /* otherwise it's false */
+	/*
+	 *	Tickets don't need a cache server, but are still
+	 *	subject to the checks in fr_tls_cache_disable_cb.
+	 */
+	if (conf->session_cache_server || conf->ticket_keys) session->allow_session_resumption = true; /* otherwise it's false */
 
 	fr_tls_session_request_unbind(session->ssl);
 
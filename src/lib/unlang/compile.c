@@ -484,6 +484,7 @@ static bool pass2_cond_callback(fr_cond_t *c, void *uctx)
 	case COND_TYPE_RCODE:
 	case COND_TYPE_AND:
 	case COND_TYPE_OR:
+	case COND_TYPE_SET:
 		return true;
 
 	/*
@@ -1623,6 +1624,61 @@ static bool compile_action_subsection(unlang_t *c, CONF_SECTION *cs, CONF_SECTIO
 }
 
 
+/** Check whether the children of a group can be evaluated without pushing a frame
+ *
+ * This is true when none of the children can yield, push a frame, or
+ * unwind the stack, and they all have the same actions as the group.
+ * See unlang_interpret_flat().
+ */
+static bool compile_flat(unlang_group_t const *g)
+{
+	unlang_t const	*c;
+
+	if (!g->children) return false;
+
+	for (c = g->children; c; c = c->next) {
+		if (memcmp(c->actions, g->self.actions, sizeof(c->actions)) != 0) return false;
+
+		switch (c->type) {
+		/*
+		 *	Updates only push frames to expand xlats and
+		 *	execs.
+		 */
+		case UNLANG_TYPE_UPDATE:
+		case UNLANG_TYPE_FILTER:
+		{
+			unlang_map_t	*gext = unlang_group_to_map(unlang_generic_to_group(c));
+			map_t const	*map = NULL;
+
+			while ((map = fr_dlist_next(&gext->map, map))) {
+				if (tmpl_is_xlat(map->lhs) || tmpl_is_exec(map->lhs)) return false;
+				if (map->rhs && (tmpl_is_xlat(map->rhs) || tmpl_is_exec(map->rhs))) return false;
+			}
+		}
+			break;
+
+		case UNLANG_TYPE_IF:
+		case UNLANG_TYPE_ELSIF:
+			if (unlang_group_to_cond(unlang_generic_to_group(c))->cond->async_required) return false;
+			FALL_THROUGH;
+
+		case UNLANG_TYPE_ELSE:
+		case UNLANG_TYPE_GROUP:
+		{
+			unlang_group_t const *child = unlang_generic_to_group(c);
+
+			if (child->children && !child->flat) return false;
+		}
+			break;
+
+		default:
+			return false;
+		}
+	}
+
+	return true;
+}
+
 static unlang_t *compile_children(unlang_group_t *g, unlang_compile_t *unlang_ctx)
 {
 	CONF_ITEM	*ci = NULL;
@@ -1814,6 +1870,8 @@ static unlang_t *compile_children(unlang_group_t *g, unlang_compile_t *unlang_ct
 	 */
 	compile_action_defaults(c, unlang_ctx);
 
+	g->flat = compile_flat(g);
+
 	return c;
 }
 
@@ -2505,11 +2563,7 @@ static unlang_t *compile_if_subsection(unlang_t *parent, unlang_compile_t *unlan
 	cond = cf_data_value(cf_data_find(cs, fr_cond_t, NULL));
 	fr_assert(cond != NULL);
 
-	if (cond->type == COND_TYPE_FALSE) {
-		cf_log_debug_prefix(cs, "Skipping contents of '%s' as it is always 'false'",
-				    unlang_ops[ext->type].name);
-		c = compile_empty(parent, unlang_ctx, cs, ext);
-	} else {
+	if (cond->type != COND_TYPE_FALSE) {
 		/*
 		 *	The condition may refer to attributes, xlats, or
 		 *	Auth-Types which didn't exist when it was first
@@ -2517,7 +2571,21 @@ static unlang_t *compile_if_subsection(unlang_t *parent, unlang_compile_t *unlan
 		 *	them up.
 		 */
 		if (!fr_cond_walk(cond, pass2_cond_callback, cs)) return NULL;
+
+		/*
+		 *	Fixing up the condition may have resolved
+		 *	operands to constants, so fold those, and
+		 *	simplify what's left.
+		 */
+		fr_cond_optimise(cond);
 		fr_cond_async_update(cond);
+	}
+
+	if ((cond->type == COND_TYPE_FALSE) && !cond->next) {
+		cf_log_debug_prefix(cs, "Skipping contents of '%s' as it is always 'false'",
+				    unlang_ops[ext->type].name);
+		c = compile_empty(parent, unlang_ctx, cs, ext);
+	} else {
 		c = compile_section(parent, unlang_ctx, cs, ext);
 	}
 	if (!c) return NULL;
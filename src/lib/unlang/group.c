@@ -41,6 +41,8 @@ unlang_action_t unlang_group(rlm_rcode_t *p_result, request_t *request, unlang_s
 		return UNLANG_ACTION_EXECUTE_NEXT;
 	}
 
+	if (g->flat) return unlang_interpret_flat(p_result, request, frame);
+
 	if (unlang_interpret_push(request, g->children, frame->result, UNLANG_NEXT_SIBLING, UNLANG_SUB_FRAME) < 0) {
 		*p_result = RLM_MODULE_FAIL;
 		return UNLANG_ACTION_STOP_PROCESSING;
@@ -38,6 +38,170 @@ RCSID("$Id$")
  */
 static _Thread_local unlang_interpret_t *intp_thread_default;
 
+/*
+ *	Approximate overhead of each talloc chunk (from samba talloc.c)
+ */
+#define STACK_CHUNK_OVERHEAD	(20 + 68 + 15)
+
+/*
+ *	Default size of the pool used for mutable stack data.  Enough
+ *	for a quarter of the maximum number of stack frames.
+ */
+#define STACK_POOL_SIZE_DEFAULT	((UNLANG_STACK_MAX / 4) * UNLANG_FRAME_PRE_ALLOC)
+
+/*
+ *	The request pool only reserves this much for the stack,
+ *	anything larger would just come from the heap.
+ */
+#define STACK_POOL_SIZE_MAX	(UNLANG_STACK_MAX * UNLANG_FRAME_PRE_ALLOC)
+
+/*
+ *	Measure the stack memory in use on one in every
+ *	STACK_POOL_SAMPLE_INTERVAL yields.
+ */
+#define STACK_POOL_SAMPLE_INTERVAL	(32)
+
+/*
+ *	Each sample which uses less than the current pool size
+ *	moves the pool size 1/2^STACK_POOL_DECAY_SHIFT of the way
+ *	towards it.
+ */
+#define STACK_POOL_DECAY_SHIFT	(3)
+
+/** Size of the pool used for mutable stack data on this thread
+ *
+ * Frame state, and everything allocated beneath it (xlat arguments,
+ * value boxes from expansions, module resume contexts) is carved out
+ * of this pool, and it's all released in one operation when the stack
+ * is freed.
+ *
+ * We start with #STACK_POOL_SIZE_DEFAULT, grow to the most memory we've
+ * seen in use by a yielded request on this thread, and shrink again
+ * slowly if requests stop using it.
+ */
+static _Thread_local size_t stack_pool_size = STACK_POOL_SIZE_DEFAULT;
+
+/** Yields remaining until we next measure the stack memory in use
+ *
+ */
+static _Thread_local uint32_t stack_pool_sample;
+
+/** Record how much of the stack pool is in use, and resize the pool for new stacks
+ *
+ * Called when the request yields, which is usually when it has the most
+ * frames, and the most frame state, live.  Walking the talloc hierarchy
+ * isn't free, so only one in every #STACK_POOL_SAMPLE_INTERVAL yields is
+ * measured.  Stacks which are already allocated are unaffected.
+ *
+ * @param[in] stack	to check.
+ */
+static inline CC_HINT(always_inline) void stack_pool_size_update(unlang_stack_t *stack)
+{
+	size_t used;
+
+	if (stack_pool_sample > 0) {
+		stack_pool_sample--;
+		return;
+	}
+	stack_pool_sample = STACK_POOL_SAMPLE_INTERVAL - 1;
+
+	used = (talloc_total_size(stack) - sizeof(*stack)) +
+	       ((talloc_total_blocks(stack) - 1) * STACK_CHUNK_OVERHEAD);
+
+	if (used > stack_pool_size) {
+		stack_pool_size = (used < STACK_POOL_SIZE_MAX) ? used : STACK_POOL_SIZE_MAX;
+		return;
+	}
+
+	/*
+	 *	Decay, so that one unusually large request
+	 *	doesn't inflate every stack we allocate
+	 *	afterwards.
+	 */
+	stack_pool_size -= (stack_pool_size - used) >> STACK_POOL_DECAY_SHIFT;
+	if (stack_pool_size < STACK_POOL_SIZE_DEFAULT) stack_pool_size = STACK_POOL_SIZE_DEFAULT;
+}
+
+/** Reset the size of the pool used for new stacks on this thread
+ *
+ * Discards the usage recorded by previous requests, so the next stack
+ * is allocated with #STACK_POOL_SIZE_DEFAULT.  Called when a worker
+ * starts and stops, and may be called when the configuration changes
+ * in a way that affects how much memory requests need.
+ */
+void unlang_interpret_stack_pool_reset(void)
+{
+	stack_pool_size = STACK_POOL_SIZE_DEFAULT;
+	stack_pool_sample = 0;
+}
+
+/** Name sections in traces by their name2, e.g. "Access-Request"
+ *
+ */
+static inline char const *section_trace_name(CONF_SECTION const *cs)
+{
+	char const *name = cf_section_name2(cs);
+
+	return name ? name : cf_section_name1(cs);
+}
+
+/** Record how long a section took, as its frame is popped
+ *
+ */
+static void frame_section_done(request_t *request, unlang_stack_frame_t *frame)
+{
+	unlang_stack_t		*stack = request->stack;
+	unlang_interpret_t	*intp = stack->intp;
+	unlang_section_stats_t	*ss;
+	CONF_SECTION const	*cs = frame->section;
+
+	frame->section = NULL;
+
+	FR_TRACE(request, FR_TRACE_SECTION, FR_TRACE_END, section_trace_name(cs));
+
+	for (ss = intp->sections; ss; ss = ss->next) {
+		if (ss->cs == cs) goto found;
+	}
+
+	/*
+	 *	Only happens the first time this
+	 *	interpreter runs the section.  The entry
+	 *	is complete before it's added, so it can
+	 *	be read by radmin.
+	 */
+	MEM(ss = talloc_zero(intp, unlang_section_stats_t));
+	ss->cs = cs;
+	ss->next = intp->sections;
+	intp->sections = ss;
+
+found:
+	fr_time_elapsed_update(&ss->wall_clock, frame->section_start, fr_time());
+}
+
+/** Print the latency of the sections an interpreter has run
+ *
+ * Sections are named "time.<server>.<name1>.<name2>".
+ */
+void unlang_interpret_section_stats_fprint(FILE *fp, unlang_interpret_t const *intp)
+{
+	unlang_section_stats_t const	*ss;
+
+	for (ss = intp->sections; ss; ss = ss->next) {
+		CONF_SECTION const	*server;
+		char const		*name2 = cf_section_name2(ss->cs);
+		char			prefix[256];
+
+		for (server = ss->cs;
+		     server && (strcmp(cf_section_name1(server), "server") != 0);
+		     server = cf_item_to_section(cf_parent(server)));
+
+		snprintf(prefix, sizeof(prefix), "time.%s%s%s%s%s",
+			 server ? cf_section_name2(server) : "", server ? "." : "",
+			 cf_section_name1(ss->cs), name2 ? "." : "", name2 ? name2 : "");
+		fr_time_elapsed_fprint(fp, &ss->wall_clock, prefix, 4);
+	}
+}
+
 static fr_table_num_ordered_t const unlang_action_table[] = {
 	{ L("unwind"), 		UNLANG_ACTION_UNWIND },
 	{ L("calculate-result"),	UNLANG_ACTION_CALCULATE_RESULT },
@@ -503,6 +667,107 @@ unlang_frame_action_t frame_eval(request_t *request, unlang_stack_frame_t *frame
 	return UNLANG_FRAME_ACTION_POP;
 }
 
+/** Evaluate the children of a group which can't yield, without pushing a frame for them
+ *
+ * The compiler sets #unlang_group_t.flat when every child returns either
+ * #UNLANG_ACTION_CALCULATE_RESULT or #UNLANG_ACTION_EXECUTE_NEXT, has the
+ * same actions as the group, and any child groups are themselves flat.
+ *
+ * The children are evaluated using a frame on the C stack, in exactly
+ * the same way frame_eval() would, and the result of the group is passed
+ * back as if the group were a single instruction.  As the actions match,
+ * the priority the caller calculates is the same as if we'd popped a frame.
+ *
+ * @param[out] p_result		the result of evaluating the group.
+ * @param[in] request		The current request.
+ * @param[in] frame		containing the group to evaluate.
+ * @return
+ *	- UNLANG_ACTION_CALCULATE_RESULT	the group produced a result.
+ *	- UNLANG_ACTION_EXECUTE_NEXT		nothing in the group produced a result.
+ *	- UNLANG_ACTION_STOP_PROCESSING		the request was stopped.
+ */
+unlang_action_t unlang_interpret_flat(rlm_rcode_t *p_result, request_t *request, unlang_stack_frame_t *frame)
+{
+	unlang_stack_t		*stack = request->stack;
+	unlang_group_t		*g = unlang_generic_to_group(frame->instruction);
+	unlang_stack_frame_t	child = {
+					.instruction = g->children,
+					.next = g->children->next,
+					.result = frame->result,
+					.priority = -1
+				};
+	rlm_rcode_t		result = frame->result;
+
+	fr_assert(g->flat);
+
+	frame_state_init(stack, &child);
+
+	while (child.instruction) {
+		unlang_t const		*instruction = child.instruction;
+		unlang_action_t		action;
+		int			priority;
+
+		if (request->master_state == REQUEST_STOP_PROCESSING) {
+			frame_cleanup(&child);
+			*p_result = RLM_MODULE_FAIL;
+			return UNLANG_ACTION_STOP_PROCESSING;
+		}
+
+		if (unlang_ops[instruction->type].debug_braces) {
+			RDEBUG2("%s {", instruction->debug_name);
+			RINDENT();
+		}
+
+		action = child.process(&result, request, &child);
+		switch (action) {
+		case UNLANG_ACTION_CALCULATE_RESULT:
+			fr_assert(result != RLM_MODULE_UNKNOWN);
+
+			if (unlang_ops[instruction->type].debug_braces) {
+				REXDENT();
+
+				if (RDEBUG_ENABLED && !RDEBUG_ENABLED2) {
+					RDEBUG("# %s (%s)", instruction->debug_name,
+					       fr_table_str_by_value(mod_rcode_table, result, "<invalid>"));
+				} else {
+					RDEBUG2("} # %s (%s)", instruction->debug_name,
+						fr_table_str_by_value(mod_rcode_table, result, "<invalid>"));
+				}
+			}
+
+			priority = instruction->actions[result];
+			if (result_calculate(request, &child, &result, &priority) == UNLANG_FRAME_ACTION_POP) {
+				child.next = NULL;
+			}
+			break;
+
+		case UNLANG_ACTION_EXECUTE_NEXT:
+			if (unlang_ops[instruction->type].debug_braces) {
+				REXDENT();
+				RDEBUG2("}");
+			}
+			break;
+
+		/*
+		 *	The compiler should have made sure nothing
+		 *	else gets here.
+		 */
+		default:
+			fr_assert(0);
+			frame_cleanup(&child);
+			*p_result = RLM_MODULE_FAIL;
+			return UNLANG_ACTION_STOP_PROCESSING;
+		}
+
+		frame_next(stack, &child);
+	}
+
+	*p_result = child.result;
+	if (child.result == RLM_MODULE_UNKNOWN) return UNLANG_ACTION_EXECUTE_NEXT;
+
+	return UNLANG_ACTION_CALCULATE_RESULT;
+}
+
 /** Run the interpreter for a current request
  *
  * @param[in] request		to run.  If this is an internal request
@@ -571,6 +836,8 @@ CC_HINT(hot) rlm_rcode_t unlang_interpret(request_t *request)
 			stack->result = frame->result;
 			stack->priority = frame->priority;
 
+			if (frame->section) frame_section_done(request, frame);
+
 			/*
 			 *	Head on back up the stack
 			 */
@@ -639,6 +906,7 @@ CC_HINT(hot) rlm_rcode_t unlang_interpret(request_t *request)
 
 		case UNLANG_FRAME_ACTION_YIELD:
 			RDEBUG4("** [%i] %s - interpret yielding", stack->depth, __FUNCTION__);
+			stack_pool_size_update(stack);
 			intp->funcs.yield(request, intp->uctx);
 			return stack->result;
 		}
@@ -674,6 +942,8 @@ CC_HINT(hot) rlm_rcode_t unlang_interpret(request_t *request)
 
 	stack->result = frame->result;
 
+	if (frame->section) frame_section_done(request, frame);
+
 	stack->depth--;
 	DUMP_STACK;
 
@@ -716,7 +986,9 @@ static unlang_group_t empty_group = {
  */
 int unlang_interpret_push_section(request_t *request, CONF_SECTION *cs, rlm_rcode_t default_rcode, bool top_frame)
 {
-	unlang_t	*instruction = NULL;
+	unlang_stack_t		*stack = request->stack;
+	unlang_stack_frame_t	*frame;
+	unlang_t		*instruction = NULL;
 
 	/*
 	 *	Interpretable unlang instructions are stored as CONF_DATA
@@ -731,7 +1003,20 @@ int unlang_interpret_push_section(request_t *request, CONF_SECTION *cs, rlm_rcod
 		}
 	}
 
-	return unlang_interpret_push_instruction(request, instruction, default_rcode, top_frame);
+	if (unlang_interpret_push_instruction(request, instruction, default_rcode, top_frame) < 0) return -1;
+
+	/*
+	 *	Time the section, so it's clear which part of
+	 *	a virtual server requests are spending their time in.
+	 */
+	if (cs) {
+		frame = &stack->frame[stack->depth];
+		frame->section = cs;
+		frame->section_start = fr_time();
+		FR_TRACE(request, FR_TRACE_SECTION, FR_TRACE_BEGIN, section_trace_name(cs));
+	}
+
+	return 0;
 }
 
 /** Push an instruction onto the request stack for later interpretation.
@@ -775,17 +1060,14 @@ void *unlang_interpret_stack_alloc(TALLOC_CTX *ctx)
 	/*
 	 *	If we have talloc_pooled_object allocate the
 	 *	stack as a combined chunk/pool, with memory
-	 *	to hold at mutable data for at least a quarter
-	 *	of the maximum number of stack frames.
+	 *	to hold the mutable data for the requests we've
+	 *	seen on this thread.  See stack_pool_size.
 	 *
 	 *	Having a dedicated pool for mutable stack data
 	 *	means we don't have memory fragmentations issues
 	 *	as we would if request were used as the pool.
-	 *
-	 *	This number is pretty arbitrary, but it seems
-	 *	like too low level to make into a tuneable.
 	 */
-	stack = talloc_zero_pooled_object(ctx, unlang_stack_t, UNLANG_STACK_MAX, 128);	/* 128 bytes per state */
+	stack = talloc_zero_pooled_object(ctx, unlang_stack_t, UNLANG_STACK_MAX, stack_pool_size);
 	stack->result = RLM_MODULE_UNKNOWN;
 
 	return stack;
@@ -145,6 +145,11 @@ rlm_rcode_t		unlang_interpret_synchronous(request_t *request);
 
 void			*unlang_interpret_stack_alloc(TALLOC_CTX *ctx);
 
+void			unlang_interpret_stack_pool_reset(void);
+
+void			unlang_interpret_section_stats_fprint(FILE *fp, unlang_interpret_t const *intp)
+							      CC_HINT(nonnull);
+
 bool			unlang_request_is_scheduled(request_t const *request);
 
 void			unlang_interpret_request_done(request_t *request);
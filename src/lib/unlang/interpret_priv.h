@@ -32,10 +32,23 @@
 extern "C" {
 #endif
 
+/** Latency of a section run by an interpreter
+ *
+ */
+typedef struct unlang_section_stats_s unlang_section_stats_t;
+struct unlang_section_stats_s {
+	unlang_section_stats_t	*next;			//!< Next section run by this interpreter.
+	CONF_SECTION const	*cs;			//!< Section which was run.
+	fr_time_elapsed_t	wall_clock;		//!< Histogram of time taken to run the section.
+};
+
 struct unlang_interpret_s {
 	fr_event_list_t		*el;
 	unlang_request_func_t	funcs;
 	void			*uctx;
+
+	unlang_section_stats_t	*sections;		//!< Sections run by this interpreter.  Only written
+							///< by the thread which owns the interpreter.
 };
 
 static inline void interpret_child_init(request_t *request)
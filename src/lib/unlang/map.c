@@ -67,17 +67,16 @@ typedef struct {
 
 /** Apply a list of modifications on one or more fr_pair_t lists.
  *
- * @param[in] request	The current request.
  * @param[out] p_result	The rcode indicating what the result
  *      		of the operation was.
+ * @param[in] request	The current request.
+ * @param[in] frame	Current stack frame.
  * @return
  *	- UNLANG_ACTION_CALCULATE_RESULT changes were applied.
  *	- UNLANG_ACTION_PUSHED_CHILD async execution of an expansion is required.
  */
-static unlang_action_t list_mod_apply(rlm_rcode_t *p_result, request_t *request)
+static unlang_action_t list_mod_apply(rlm_rcode_t *p_result, request_t *request, unlang_stack_frame_t *frame)
 {
-	unlang_stack_t			*stack = request->stack;
-	unlang_stack_frame_t		*frame = &stack->frame[stack->depth];
 	unlang_frame_state_update_t	*update_state = frame->state;
 	vp_list_mod_t const		*vlm = NULL;
 
@@ -240,7 +239,7 @@ static unlang_action_t list_mod_create(rlm_rcode_t *p_result, request_t *request
 		}
 	};
 
-	return list_mod_apply(p_result, request);
+	return list_mod_apply(p_result, request, frame);
 }
 
 
@@ -30,6 +30,7 @@ RCSID("$Id$")
 #include <freeradius-devel/server/modpriv.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/request_data.h>
+#include <freeradius-devel/server/trace.h>
 #include <freeradius-devel/unlang/base.h>
 
 #include "module_priv.h"
@@ -549,6 +550,15 @@ unlang_action_t unlang_module_yield_to_section(rlm_rcode_t *p_result,
 	return UNLANG_ACTION_PUSHED_CHILD;
 }
 
+/** Record the latency of a completed module call
+ *
+ */
+static inline void module_latency_update(unlang_frame_state_module_t *state)
+{
+	fr_time_elapsed_update(&state->thread->run_time, 0, state->run_time);
+	fr_time_elapsed_update(&state->thread->yield_time, 0, state->yield_time);
+}
+
 /*
  *	Lock the mutex for the module
  */
@@ -609,11 +619,15 @@ static unlang_action_t unlang_module_resume(rlm_rcode_t *p_result, request_t *re
 	unlang_module_t			*mc = unlang_generic_to_module(frame->instruction);
 	char const 			*caller;
 	rlm_rcode_t			rcode = *p_result;
+	fr_time_t			start, end;
 
 	unlang_action_t			ua;
 
 	fr_assert(state->resume != NULL);
 
+	start = fr_time();
+	state->yield_time += start - state->yielded;
+
 	/*
 	 *	Lock is noop unless instance->mutex is set.
 	 */
@@ -628,6 +642,10 @@ static unlang_action_t unlang_module_resume(rlm_rcode_t *p_result, request_t *re
 			   }, request, state->rctx);
 	safe_unlock(mc->instance);
 
+	end = fr_time();
+	state->run_time += end - start;
+	state->yielded = end;
+
 	request->rcode = rcode;
 	request->module = caller;
 
@@ -669,6 +687,8 @@ static unlang_action_t unlang_module_resume(rlm_rcode_t *p_result, request_t *re
 		fr_table_str_by_value(mod_rcode_table, rcode, "<invalid>"));
 
 	state->thread->active_callers--;
+	module_latency_update(state);
+	FR_TRACE(request, FR_TRACE_MODULE, FR_TRACE_END, mc->instance->name);
 
 	request->rcode = rcode;
 	if (state->p_result) *state->p_result = rcode;
@@ -730,6 +750,7 @@ static unlang_action_t unlang_module(rlm_rcode_t *p_result, request_t *request,
 	char const 			*caller;
 	rlm_rcode_t			rcode = RLM_MODULE_NOOP;
 	unlang_action_t			ua;
+	fr_time_t			start;
 
 #ifndef NDEBUG
 	int unlang_indent		= request->log.unlang_indent;
@@ -771,6 +792,11 @@ static unlang_action_t unlang_module(rlm_rcode_t *p_result, request_t *request,
 	 */
 	state->thread->total_calls++;
 
+	state->yield_time = 0;
+	start = fr_time();
+
+	FR_TRACE(request, FR_TRACE_MODULE, FR_TRACE_BEGIN, mc->instance->name);
+
 	caller = request->module;
 	request->module = mc->instance->name;
 	safe_lock(mc->instance);	/* Noop unless instance->mutex set */
@@ -783,6 +809,9 @@ static unlang_action_t unlang_module(rlm_rcode_t *p_result, request_t *request,
 	safe_unlock(mc->instance);
 	request->module = caller;
 
+	state->yielded = fr_time();
+	state->run_time = state->yielded - start;
+
 	if (request->master_state == REQUEST_STOP_PROCESSING) ua = UNLANG_ACTION_STOP_PROCESSING;
 
 	switch (ua) {
@@ -829,6 +858,9 @@ static unlang_action_t unlang_module(rlm_rcode_t *p_result, request_t *request,
 	RDEBUG("%s (%s)", frame->instruction->name ? frame->instruction->name : "",
 	       fr_table_str_by_value(mod_rcode_table, rcode, "<invalid>"));
 
+	module_latency_update(state);
+	FR_TRACE(request, FR_TRACE_MODULE, FR_TRACE_END, mc->instance->name);
+
 done:
 	fr_assert(unlang_indent == request->log.unlang_indent);
 	fr_assert(rcode >= RLM_MODULE_REJECT);
@@ -63,6 +63,15 @@ typedef struct {
 	unlang_module_resume_t		resume;			//!< resumption handler
 	unlang_module_signal_t		signal;			//!< for signal handlers
 	/** @} */
+
+	/** @name Latency tracking
+	 * @{
+ 	 */
+	fr_time_t			yielded;		//!< when the module last yielded.
+	fr_time_delta_t			run_time;		//!< wall clock time spent running the module's
+								///< functions so far.
+	fr_time_delta_t			yield_time;		//!< time spent yielded so far.
+	/** @} */
 } unlang_frame_state_module_t;
 
 static inline unlang_module_t *unlang_generic_to_module(unlang_t const *p)
@@ -145,6 +145,9 @@ typedef struct {
 	unlang_t		**tail;		//!< pointer to the tail which gets updated
 	CONF_SECTION		*cs;
 	int			num_children;
+	bool			flat;		//!< None of the children can yield or push frames,
+						///< so they're evaluated without pushing a frame
+						///< for the group.
 } unlang_group_t;
 
 /** A naked xlat
@@ -244,6 +247,9 @@ struct unlang_stack_frame_s {
 								///< result stored in the lower stack frame should
 								///< be replaced.
 	uint8_t			uflags;				//!< Unwind markers
+
+	CONF_SECTION const	*section;			//!< Section being timed, if this frame runs one.
+	fr_time_t		section_start;			//!< When the section was pushed.
 };
 
 /** An unlang stack associated with a request
@@ -457,6 +463,8 @@ int		unlang_interpret_push(request_t *request, unlang_t const *instruction,
 				      rlm_rcode_t default_rcode, bool do_next_sibling, bool top_frame)
 				      CC_HINT(warn_unused_result);
 
+unlang_action_t	unlang_interpret_flat(rlm_rcode_t *p_result, request_t *request, unlang_stack_frame_t *frame);
+
 int		unlang_op_init(void);
 
 void		unlang_op_free(void);
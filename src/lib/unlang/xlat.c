@@ -222,6 +222,204 @@ int unlang_xlat_push(TALLOC_CTX *ctx, fr_value_box_list_t *out,
 	return 0;
 }
 
+/** Synchronously evaluate a pre-compiled xlat to a list of value boxes
+ *
+ * Attribute references produce boxes of the attribute's native type, so
+ * nothing is printed to a string unless the caller asks for one.
+ *
+ * Expansions containing only literals, attribute references, one letter
+ * expansions, virtual attributes and regex captures are evaluated directly
+ * without involving the interpreter.  Anything which may need to evaluate
+ * nested expansions or yield (function calls, alternations, groups) is
+ * pushed onto the request's stack and run with #unlang_interpret_synchronous.
+ *
+ * @param[in] ctx		To allocate value boxes and values in.
+ * @param[out] out		Where to write the result of the expansion.
+ *				Must be empty.
+ * @param[in] request		to evaluate the xlat in.
+ * @param[in] xlat		to evaluate.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int unlang_xlat_eval(TALLOC_CTX *ctx, fr_value_box_list_t *out, request_t *request, xlat_exp_t const *xlat)
+{
+	xlat_exp_t const	*node, *child = NULL;
+	fr_dcursor_t		cursor;
+	rlm_rcode_t		rcode;
+
+	fr_assert(fr_dlist_empty(out));
+
+	if (!xlat) return 0;
+
+	for (node = xlat; node; node = node->next) {
+		switch (node->type) {
+		case XLAT_FUNC:
+		case XLAT_ALTERNATE:
+		case XLAT_GROUP:
+			goto interpret;
+
+		default:
+			continue;
+		}
+	}
+
+	/*
+	 *	Flat expansion, can't push children or yield.
+	 */
+	fr_dcursor_talloc_init(&cursor, out, fr_value_box_t);
+	node = xlat;
+	if (xlat_frame_eval(ctx, &cursor, &child, request, &node) != XLAT_ACTION_DONE) return -1;
+	fr_assert(!child);
+
+	return 0;
+
+interpret:
+	if (unlang_xlat_push(ctx, out, request, xlat, UNLANG_TOP_FRAME) < 0) return -1;
+
+	rcode = unlang_interpret_synchronous(request);
+	switch (rcode) {
+	case RLM_MODULE_REJECT:
+	case RLM_MODULE_FAIL:
+		RPEDEBUG("xlat evaluation failed");
+		fr_dlist_talloc_free(out);
+		return -1;
+
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+/** Whether an expansion can be evaluated directly to a value of a specific type
+ *
+ * Only expansions being cast to a non-string type are evaluated with
+ * #unlang_xlat_eval_type.  String outputs must keep the semantics of
+ * #xlat_aeval_compiled.
+ *
+ * Expansions may contain literals, one letter expansions, attribute
+ * references, virtual attributes, regex captures and calls to functions
+ * using the value box API.  "%{Attr[*]}" is excluded as the string
+ * expansion joins the values with ",", and legacy functions and
+ * alternations are excluded as their arguments and results are
+ * escaped differently by the string expansion.
+ *
+ * @param[in] xlat	to check.
+ * @param[in] type	the expansion will be cast to.
+ * @return
+ *	- true if the expansion can be evaluated to a typed value box.
+ *	- false if the caller should use the string expansion.
+ */
+bool unlang_xlat_eval_type_ok(xlat_exp_t const *xlat, fr_type_t type)
+{
+	xlat_exp_t const *node;
+
+	if (!xlat) return false;
+
+	switch (type) {
+	case FR_TYPE_STRING:
+	case FR_TYPE_OCTETS:
+	case FR_TYPE_VALUE_BOX:
+		return false;
+
+	default:
+		break;
+	}
+
+	for (node = xlat; node; node = node->next) {
+		switch (node->type) {
+		case XLAT_LITERAL:
+		case XLAT_ONE_LETTER:
+		case XLAT_VIRTUAL:
+		case XLAT_REGEX:
+			continue;
+
+		case XLAT_ATTRIBUTE:
+			if (tmpl_num(node->attr) == NUM_ALL) return false;
+			continue;
+
+		case XLAT_FUNC:
+			if (node->call.func->type != XLAT_FUNC_NORMAL) return false;
+			continue;
+
+		default:
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/** Synchronously evaluate a pre-compiled xlat to a single value box of a specific type
+ *
+ * If the expansion produces a single box, it's cast directly to the requested
+ * type, e.g. an IP address attribute reference produces an IP address box without
+ * being printed and re-parsed.
+ *
+ * If the expansion produces multiple boxes, e.g. "1%{Tmp-Integer-0}", they're
+ * printed without escaping, and the resulting string is cast to the requested type.
+ *
+ * @note Callers should check the expansion with #unlang_xlat_eval_type_ok first.
+ *
+ * @param[in] ctx		To allocate any buffers in.
+ * @param[out] vb		Where to write the result.
+ * @param[in] type		to cast the result to.
+ * @param[in] enumv		enumeration values of the output type.  May be NULL.
+ * @param[in] request		to evaluate the xlat in.
+ * @param[in] xlat		to evaluate.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int unlang_xlat_eval_type(TALLOC_CTX *ctx, fr_value_box_t *vb, fr_type_t type, fr_dict_attr_t const *enumv,
+			  request_t *request, xlat_exp_t const *xlat)
+{
+	TALLOC_CTX		*pool;
+	fr_value_box_list_t	head;
+	fr_value_box_t		*first;
+	fr_value_box_t		str;
+	char			*buff;
+	int			ret;
+
+	MEM(pool = talloc_new(NULL));
+	fr_value_box_list_init(&head);
+
+	if (unlang_xlat_eval(pool, &head, request, xlat) < 0) {
+		talloc_free(pool);
+		return -1;
+	}
+
+	first = fr_dlist_head(&head);
+	if (!first) {
+		fr_strerror_printf("Expansion produced no value to cast to %s",
+				   fr_table_str_by_value(fr_value_box_type_table, type, "<INVALID>"));
+		talloc_free(pool);
+		return -1;
+	}
+
+	/*
+	 *	Single value, no printing needed.
+	 */
+	if (!fr_dlist_next(&head, first)) {
+		ret = fr_value_box_cast(ctx, vb, type, enumv, first);
+		talloc_free(pool);
+		return ret;
+	}
+
+	buff = fr_value_box_list_aprint(pool, &head, NULL, NULL);
+	if (!buff) {
+		talloc_free(pool);
+		return -1;
+	}
+
+	fr_value_box_bstrndup_shallow(&str, NULL, buff, talloc_array_length(buff) - 1, first->tainted);
+	ret = fr_value_box_cast(ctx, vb, type, enumv, &str);
+	talloc_free(pool);
+
+	return ret;
+}
+
 /** Stub function for calling the xlat interpreter
  *
  * Calls the xlat interpreter and translates its wants and needs into
@@ -445,6 +445,16 @@ int		unlang_xlat_push(TALLOC_CTX *ctx, fr_value_box_list_t *out,
 				 request_t *request, xlat_exp_t const *exp, bool top_frame)
 				 CC_HINT(warn_unused_result);
 
+int		unlang_xlat_eval(TALLOC_CTX *ctx, fr_value_box_list_t *out,
+				 request_t *request, xlat_exp_t const *xlat)
+				 CC_HINT(nonnull(2, 3));
+
+bool		unlang_xlat_eval_type_ok(xlat_exp_t const *xlat, fr_type_t type);
+
+int		unlang_xlat_eval_type(TALLOC_CTX *ctx, fr_value_box_t *vb, fr_type_t type, fr_dict_attr_t const *enumv,
+				      request_t *request, xlat_exp_t const *xlat)
+				      CC_HINT(nonnull(2, 5));
+
 xlat_action_t	unlang_xlat_yield(request_t *request,
 				  xlat_func_resume_t callback, xlat_func_signal_t signal,
 				  void *rctx);
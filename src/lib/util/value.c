@@ -5102,6 +5102,46 @@ int fr_value_box_list_concat(TALLOC_CTX *ctx,
 	}
 
 	head_vb = fr_dlist_head(list);
+
+	/*
+	 *	Fast path.  If all the boxes are already of the
+	 *	output type, size the output buffer once and copy
+	 *	the values in, instead of growing it for each box.
+	 */
+	if (out != head_vb) {
+		size_t	len = 0;
+		bool	tainted = false;
+
+		for (vb = head_vb; vb; vb = fr_dlist_next(list, vb)) {
+			if (vb->type != type) break;
+			len += vb->vb_length;
+			if (vb->tainted) tainted = true;
+		}
+
+		if (!vb) {
+			uint8_t	*p;
+
+			if (type == FR_TYPE_STRING) {
+				char *str;
+
+				if (fr_value_box_bstr_alloc(ctx, &str, out, NULL, len, tainted) < 0) return -1;
+				p = (uint8_t *)str;
+			} else {
+				if (fr_value_box_mem_alloc(ctx, &p, out, NULL, len, tainted) < 0) return -1;
+			}
+
+			for (vb = head_vb; vb; vb = fr_dlist_next(list, vb)) {
+				if (!vb->vb_length) continue;
+				memcpy(p, vb->datum.ptr, vb->vb_length);
+				p += vb->vb_length;
+			}
+
+			if (free_input) fr_dlist_talloc_free(list);
+
+			return 0;
+		}
+	}
+
 	fr_dcursor_init(&cursor, list);
 
 	/*
@@ -0,0 +1,484 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file detail_reader.c
+ * @brief Functions shared by the detail work file readers.
+ *
+ * proto_detail_work reads text files, and proto_detail_spool reads
+ * binary files.  Both can map the work file, mark entries as done in
+ * the mapping, and retransmit entries which fail.  Only finding and
+ * copying the entries differs, which the readers pass in as
+ * callbacks.
+ *
+ * This file is compiled into each reader.
+ *
+ * @copyright 2021 The FreeRADIUS server project.
+ */
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/util/debug.h>
+#include "detail_reader.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#ifndef NDEBUG
+#if 0
+/*
+ *	When we want detailed debugging here, without detailed server
+ *	debugging.
+ */
+#define MPRINT DEBUG
+#else
+#define MPRINT DEBUG3
+#endif
+#else
+// No debugging, just remove the mprint entirely
+#define MPRINT(_x, ...)
+#endif
+
+CONF_PARSER detail_reader_limit_config[] = {
+	{ FR_CONF_OFFSET("initial_rtx_time", FR_TYPE_TIME_DELTA, proto_detail_work_t, retry_config.irt), .dflt = STRINGIFY(2) },
+	{ FR_CONF_OFFSET("max_rtx_time", FR_TYPE_TIME_DELTA, proto_detail_work_t, retry_config.mrt), .dflt = STRINGIFY(16) },
+
+	/*
+	 *	Retransmit indefinitely, as v2 and v3 did.
+	 */
+	{ FR_CONF_OFFSET("max_rtx_count", FR_TYPE_UINT32, proto_detail_work_t, retry_config.mrc), .dflt = STRINGIFY(0) },
+	/*
+	 *	...again same as v2 and v3.
+	 */
+	{ FR_CONF_OFFSET("max_rtx_duration", FR_TYPE_TIME_DELTA, proto_detail_work_t, retry_config.mrd), .dflt = STRINGIFY(0) },
+	{ FR_CONF_OFFSET("maximum_outstanding", FR_TYPE_UINT32, proto_detail_work_t, max_outstanding), .dflt = STRINGIFY(1) },
+	CONF_PARSER_TERMINATOR
+};
+
+static fr_event_update_t pause_read[] = {
+	FR_EVENT_SUSPEND(fr_event_io_func_t, read),
+	{ 0 }
+};
+
+static fr_event_update_t resume_read[] = {
+	FR_EVENT_RESUME(fr_event_io_func_t, read),
+	{ 0 }
+};
+
+/** Bootstrap the configuration which is common to all of the readers
+ *
+ */
+int detail_reader_bootstrap(proto_detail_work_t *inst, CONF_SECTION *cs)
+{
+	dl_module_inst_t const	*dl_inst;
+
+	/*
+	 *	Find the dl_module_inst_t holding our instance data
+	 *	so we can find out what the parent of our instance
+	 *	was.
+	 */
+	dl_inst = dl_module_instance_by_data(inst);
+	fr_assert(dl_inst);
+
+	inst->parent = talloc_get_type_abort(dl_inst->parent->data, proto_detail_t);
+	inst->cs = cs;
+
+	if (inst->track_progress) {
+		inst->mode = O_RDWR;
+	} else {
+		inst->mode = O_RDONLY;
+	}
+
+	if (inst->retransmit) {
+		FR_TIME_DELTA_BOUND_CHECK("limit.initial_rtx_time", inst->retry_config.irt, >=, fr_time_delta_from_sec(1));
+		FR_TIME_DELTA_BOUND_CHECK("limit.initial_rtx_time", inst->retry_config.irt, <=, fr_time_delta_from_sec(60));
+
+		/*
+		 *	If you need more than this, just set it to
+		 *	"0", and check Packet-Transmit-Count manually.
+		 */
+		FR_INTEGER_BOUND_CHECK("limit.max_rtx_count", inst->retry_config.mrc, <=, 20);
+		FR_TIME_DELTA_BOUND_CHECK("limit.max_rtx_duration", inst->retry_config.mrd, <=, fr_time_delta_from_sec(600));
+
+		/*
+		 *	This is a reasonable value.
+		 */
+		FR_TIME_DELTA_BOUND_CHECK("limit.max_rtx_timer", inst->retry_config.mrt, <=, fr_time_delta_from_sec(30));
+	}
+
+	FR_INTEGER_BOUND_CHECK("limit.maximum_outstanding", inst->max_outstanding, >=, 1);
+
+	return 0;
+}
+
+/** Stop the network side from reading the work file
+ *
+ */
+void detail_reader_pause(proto_detail_work_thread_t *thread)
+{
+	if (thread->paused) return;
+
+	(void) fr_event_filter_update(thread->el, thread->fd, FR_EVENT_FILTER_IO, pause_read);
+	thread->paused = true;
+}
+
+/** Let the network side read the work file again
+ *
+ * The text reader will lseek() to wherever it was reading from, so
+ * we seek to the start of the file, so that the reader gets
+ * activated again.
+ */
+static void detail_reader_resume(proto_detail_work_thread_t *thread)
+{
+	if (!thread->paused) return;
+
+	(void) fr_event_filter_update(thread->el, thread->fd, FR_EVENT_FILTER_IO, resume_read);
+	thread->paused = false;
+
+	(void) lseek(thread->fd, 0, SEEK_SET);
+}
+
+/** Map all of a work file
+ *
+ * The work file isn't written to once it's been renamed, so we can
+ * map all of it.  Progress is tracked by writing to the mapping.
+ *
+ * @param[in] inst	of the reader.
+ * @param[in] thread	which has opened the work file.
+ * @param[in] size	of the work file.  Empty files can't be mapped.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+int detail_reader_mmap_open(proto_detail_work_t const *inst, proto_detail_work_thread_t *thread, size_t size)
+{
+	void *map;
+
+	fr_assert(size > 0);
+
+	map = mmap(NULL, size, inst->track_progress ? (PROT_READ | PROT_WRITE) : PROT_READ,
+		   MAP_SHARED, thread->fd, 0);
+	if (map == MAP_FAILED) {
+		cf_log_err(inst->cs, "Failed mapping %s: %s", thread->filename_work, fr_syserror(errno));
+		return -1;
+	}
+	(void) madvise(map, size, MADV_SEQUENTIAL);
+
+	thread->map = map;
+	thread->map_len = size;
+	thread->map_offset = 0;
+	MEM(thread->entries = talloc_array(thread, proto_detail_work_entry_t, DETAIL_READER_SCAN_BATCH));
+
+	return 0;
+}
+
+/** Unmap a work file
+ *
+ * Any entries which were marked as done are written to the file by
+ * the kernel, even if they weren't flushed by a checkpoint.
+ */
+void detail_reader_mmap_close(proto_detail_work_thread_t *thread)
+{
+	if (!thread->map) return;
+
+	munmap(thread->map, thread->map_len);
+	thread->map = NULL;
+	TALLOC_FREE(thread->entries);
+}
+
+/** Read the next entry from a mapped work file
+ *
+ * Entries are copied directly from the mapping, so there are no
+ * partial reads, and nothing is ever left over in the buffer.
+ * Retransmissions copy the entry from the mapping again, so there's
+ * no need to keep a copy of it.
+ */
+ssize_t detail_reader_mmap_read(proto_detail_work_t const *inst, proto_detail_work_thread_t *thread,
+				detail_reader_funcs_t const *funcs,
+				void **packet_ctx, fr_time_t *recv_time_p, uint8_t *buffer, size_t buffer_len,
+				uint32_t *priority)
+{
+	proto_detail_work_entry_t const	*entry;
+	fr_detail_entry_t		*track;
+
+	/*
+	 *	Process retransmissions before anything else in the
+	 *	file.
+	 */
+	track = fr_dlist_head(&thread->list);
+	if (track) {
+		fr_dlist_remove(&thread->list, track);
+
+		funcs->copy(buffer, thread->map + track->offset, track->len);
+
+		DEBUG("Retrying packet %d (retransmission %u)", track->id, track->retry.count);
+		*packet_ctx = track;
+		*recv_time_p = track->timestamp;
+		*priority = inst->parent->priority;
+		return track->len;
+	}
+
+	if (thread->closing || (thread->outstanding >= inst->max_outstanding)) goto pause;
+
+	do {
+		if (thread->next_entry == thread->num_entries) {
+			int ret;
+
+			ret = funcs->scan(thread);
+			if (ret < 0) return -1;
+
+			/*
+			 *	No more entries.  Close the file once
+			 *	all of the outstanding ones are done.
+			 */
+			if (ret == 0) {
+				thread->closing = true;
+				if (!thread->outstanding) return -1;
+				goto pause;
+			}
+		}
+
+		entry = &thread->entries[thread->next_entry++];
+
+		if ((entry->len > inst->parent->max_packet_size) || (entry->len > buffer_len)) {
+			DEBUG("Ignoring 'too large' entry at offset %zu of %s",
+			      (size_t) entry->offset, thread->filename_work);
+			DEBUG("Entry size %zu is greater than allowed maximum %u",
+			      entry->len, inst->parent->max_packet_size);
+			entry = NULL;
+			continue;
+		}
+
+		if (funcs->check && !funcs->check(inst, thread, entry)) entry = NULL;
+	} while (!entry);
+
+	track = talloc_zero(thread, fr_detail_entry_t);
+	track->parent = thread;
+	track->timestamp = fr_time();
+	track->id = thread->count++;
+	track->done_offset = entry->done_offset;
+	track->offset = entry->offset;
+	track->len = entry->len;
+
+	funcs->copy(buffer, thread->map + entry->offset, entry->len);
+
+	*packet_ctx = track;
+	*recv_time_p = track->timestamp;
+	*priority = inst->parent->priority;
+
+	thread->outstanding++;
+	if (thread->outstanding >= inst->max_outstanding) detail_reader_pause(thread);
+
+	MPRINT("Returning NUM %u - entry at offset %zu", thread->outstanding, (size_t) track->offset);
+	return track->len;
+
+pause:
+	detail_reader_pause(thread);
+	return 0;
+}
+
+/** Flush entries which have been marked as done
+ *
+ */
+static void detail_reader_mmap_checkpoint(proto_detail_work_thread_t *thread)
+{
+	off_t	start;
+
+	if (!thread->num_dirty) return;
+
+	start = thread->dirty_start - (thread->dirty_start % sysconf(_SC_PAGESIZE));
+	if (msync(thread->map + start, thread->dirty_end - start, MS_ASYNC) < 0) {
+		ERROR("%s - Failed flushing progress: %s", thread->name, fr_syserror(errno));
+	}
+
+	thread->num_dirty = 0;
+}
+
+/** Record that the reader has marked an entry as done in the mapping
+ *
+ * The mapping is flushed every checkpoint_interval entries, rather
+ * than writing to the file for every entry.
+ *
+ * @param[in] inst	of the reader.
+ * @param[in] thread	which read the entry.
+ * @param[in] offset	of the bytes which were changed.
+ * @param[in] len	of the bytes which were changed.
+ */
+void detail_reader_mmap_dirty(proto_detail_work_t const *inst, proto_detail_work_thread_t *thread,
+			      off_t offset, size_t len)
+{
+	if (!thread->num_dirty || (offset < thread->dirty_start)) thread->dirty_start = offset;
+	if (!thread->num_dirty || ((offset + (off_t) len) > thread->dirty_end)) thread->dirty_end = offset + len;
+
+	if (++thread->num_dirty < inst->checkpoint_interval) return;
+
+	detail_reader_mmap_checkpoint(thread);
+}
+
+static void detail_reader_retransmit(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
+{
+	fr_detail_entry_t		*track = talloc_get_type_abort(uctx, fr_detail_entry_t);
+	proto_detail_work_thread_t     	*thread = track->parent;
+
+	DEBUG("%s - retransmitting packet %d", thread->name, track->id);
+	track->retry.count++;
+
+	fr_dlist_insert_tail(&thread->list, track);
+
+	if (thread->outstanding < thread->inst->max_outstanding) detail_reader_resume(thread);
+
+	fr_assert(thread->fd >= 0);
+
+	/*
+	 *	Seek to the START of the file, so that the FD will
+	 *	always return ready.
+	 *
+	 *	The reader will take care of seeking to the correct
+	 *	read offset.
+	 */
+	(void) lseek(thread->fd, 0, SEEK_SET);
+
+#ifdef __linux__
+	fr_network_listen_read(thread->nr, thread->listen);
+#endif
+}
+
+/** Schedule the retransmission of an entry which failed
+ *
+ * @param[in] inst	of the reader.
+ * @param[in] thread	which read the entry.
+ * @param[in] track	the entry which failed.
+ * @return
+ *	- 0 if the entry will be retransmitted.
+ *	- -1 if we've given up on the entry.
+ */
+int detail_reader_retry(proto_detail_work_t const *inst, proto_detail_work_thread_t *thread,
+			fr_detail_entry_t *track)
+{
+	if (!inst->retransmit) return -1;
+
+	if (track->retry.start == 0) {
+		fr_retry_init(&track->retry, fr_time(), &inst->retry_config);
+	} else {
+		fr_retry_state_t state;
+
+		state = fr_retry_next(&track->retry, fr_time());
+		if (state == FR_RETRY_MRC) {
+			DEBUG("%s - packet %d failed after %u retransmissions",
+			      thread->name, track->id, track->retry.count);
+			return -1;
+		}
+
+		if (state == FR_RETRY_MRD) {
+			DEBUG("%s - packet %d failed after %u seconds",
+			      thread->name, track->id,
+			      (unsigned int) fr_time_delta_to_sec(inst->retry_config.mrd));
+			return -1;
+		}
+	}
+
+	DEBUG("%s - packet %d failed during processing.  Will retransmit in %d.%06ds",
+	      thread->name, track->id, (int) (track->retry.rt / NSEC), (int) ((track->retry.rt % NSEC) / 1000));
+
+	if (fr_event_timer_at(thread, thread->el, &track->ev,
+			      track->retry.next, detail_reader_retransmit, track) < 0) {
+		ERROR("%s - Failed inserting retransmission timeout", thread->name);
+		return -1;
+	}
+
+	if (thread->outstanding >= inst->max_outstanding) detail_reader_pause(thread);
+
+	return 0;
+}
+
+/** Finish with an entry
+ *
+ * @param[in] inst		of the reader.
+ * @param[in] thread		which read the entry.
+ * @param[in] track		the entry, which is freed.
+ * @param[in] buffer_len	of the reply.
+ * @return
+ *	- 0 if the work file should be closed.
+ *	- buffer_len otherwise.
+ */
+ssize_t detail_reader_release(proto_detail_work_t const *inst, proto_detail_work_thread_t *thread,
+			      fr_detail_entry_t *track, size_t buffer_len)
+{
+	thread->outstanding--;
+
+	/*
+	 *	If we need to read some more packets, let's do so.
+	 *	A mapped file has nothing more to read once we're
+	 *	closing.
+	 */
+	if ((thread->outstanding < inst->max_outstanding) && (!thread->map || !thread->closing)) {
+		detail_reader_resume(thread);
+	}
+
+	/*
+	 *	@todo - add a used / free pool for these
+	 */
+	talloc_free(track);
+
+	/*
+	 *	Close the socket if we're at EOF, and there are no
+	 *	outstanding replies to deal with.
+	 */
+	if (thread->closing && !thread->outstanding) {
+		MPRINT("WRITE ASKED TO CLOSE");
+		return 0;
+	}
+
+	return buffer_len;
+}
+
+/** Close and delete a work file
+ *
+ */
+int detail_reader_close(proto_detail_work_thread_t *thread)
+{
+	/*
+	 *	One less worker...  we check for "0" because of the
+	 *	hacks in proto_detail which let us start up with
+	 *	"transport = work" for debugging purposes.
+	 */
+	if (thread->file_parent) {
+		pthread_mutex_lock(&thread->file_parent->worker_mutex);
+		if (thread->file_parent->num_workers > 0) thread->file_parent->num_workers--;
+		pthread_mutex_unlock(&thread->file_parent->worker_mutex);
+	}
+
+	DEBUG("Closing and deleting detail worker file %s", thread->name);
+
+	fr_event_fd_delete(thread->el, thread->fd, FR_EVENT_FILTER_IO);
+
+	detail_reader_mmap_close(thread);
+
+	unlink(thread->filename_work);
+
+	close(thread->fd);
+	thread->fd = -1;
+
+	/*
+	 *	If we've been spawned from proto_detail_file, clean
+	 *	ourselves up, including our listener.
+	 */
+	if (thread->listen) {
+		talloc_free(thread->listen);
+	}
+
+	return 0;
+}
@@ -0,0 +1,102 @@
+#pragma once
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file detail_reader.h
+ * @brief Functions shared by the detail work file readers.
+ *
+ * @copyright 2021 The FreeRADIUS server project.
+ */
+RCSIDH(detail_reader_h, "$Id$")
+
+#include "proto_detail.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ *	How many entries we find in each scan of a mapped work file.
+ */
+#define DETAIL_READER_SCAN_BATCH	(1024)
+
+/** Find the next batch of entries in a mapped work file
+ *
+ * Fills thread->entries with entries which haven't been marked as
+ * done, starting from thread->map_offset.
+ *
+ * @return
+ *	- >0 the number of entries found.
+ *	- 0 at EOF.
+ *	- <0 on error.
+ */
+typedef int (*detail_reader_scan_t)(proto_detail_work_thread_t *thread);
+
+/** Check whether an entry can be processed
+ *
+ * @return
+ *	- true if the entry should be read.
+ *	- false if it should be skipped.
+ */
+typedef bool (*detail_reader_check_t)(proto_detail_work_t const *inst, proto_detail_work_thread_t *thread,
+				      proto_detail_work_entry_t const *entry);
+
+/** Copy an entry from the mapping into the network side's buffer
+ *
+ */
+typedef void (*detail_reader_copy_t)(uint8_t *buffer, uint8_t const *entry, size_t len);
+
+/** How a reader finds and copies the entries in a mapped work file
+ *
+ */
+typedef struct {
+	detail_reader_scan_t		scan;			//!< find the next batch of entries
+	detail_reader_check_t		check;			//!< optional, called after the size checks
+	detail_reader_copy_t		copy;			//!< copy an entry for reading or retransmission
+} detail_reader_funcs_t;
+
+extern CONF_PARSER detail_reader_limit_config[];
+
+int		detail_reader_bootstrap(proto_detail_work_t *inst, CONF_SECTION *cs);
+
+void		detail_reader_pause(proto_detail_work_thread_t *thread);
+
+int		detail_reader_mmap_open(proto_detail_work_t const *inst, proto_detail_work_thread_t *thread, size_t size);
+
+void		detail_reader_mmap_close(proto_detail_work_thread_t *thread);
+
+ssize_t		detail_reader_mmap_read(proto_detail_work_t const *inst, proto_detail_work_thread_t *thread,
+					detail_reader_funcs_t const *funcs,
+					void **packet_ctx, fr_time_t *recv_time_p, uint8_t *buffer, size_t buffer_len,
+					uint32_t *priority);
+
+void		detail_reader_mmap_dirty(proto_detail_work_t const *inst, proto_detail_work_thread_t *thread,
+					 off_t offset, size_t len);
+
+int		detail_reader_retry(proto_detail_work_t const *inst, proto_detail_work_thread_t *thread,
+				    fr_detail_entry_t *track);
+
+ssize_t		detail_reader_release(proto_detail_work_t const *inst, proto_detail_work_thread_t *thread,
+				      fr_detail_entry_t *track, size_t buffer_len);
+
+int		detail_reader_close(proto_detail_work_thread_t *thread);
+
+#ifdef __cplusplus
+}
+#endif
@@ -55,6 +55,8 @@ static CONF_PARSER const proto_detail_config[] = {
 	{ FR_CONF_OFFSET("transport", FR_TYPE_VOID, proto_detail_t, io_submodule),
 	  .func = transport_parse, .dflt = "file" },
 
+	{ FR_CONF_OFFSET("format", FR_TYPE_STRING, proto_detail_t, format), .dflt = "text" },
+
 	/*
 	 *	Add this as a synonym so normal humans can understand it.
 	 */
@@ -183,6 +185,18 @@ static int transport_parse(TALLOC_CTX *ctx, void *out, UNUSED void *parent,
 	return dl_module_instance(ctx, out, transport_cs, parent_inst, name, DL_MODULE_TYPE_SUBMODULE);
 }
 
+/** Whether the transport reads a work file directly
+ *
+ * Testing: allow it to read a "detail.work" file directly, instead
+ * of watching a directory.
+ */
+static bool transport_is_reader(proto_detail_t const *inst)
+{
+	char const *name = inst->io_submodule->module->dl->name;
+
+	return (strcmp(name, "proto_detail_work") == 0) || (strcmp(name, "proto_detail_spool") == 0);
+}
+
 /** Decode the packet, and set the request->process function
  *
  */
@@ -212,6 +226,12 @@ static int mod_decode(void const *instance, request_t *request, uint8_t *const d
 	request->reply->socket.inet.src_ipaddr = request->packet->socket.inet.src_ipaddr;
 	request->reply->socket.inet.dst_ipaddr = request->packet->socket.inet.src_ipaddr;
 
+	/*
+	 *	Binary entries contain the original packet, which
+	 *	the app_io decodes with the protocol library.
+	 */
+	if (inst->binary) return inst->app_io->decode(inst->app_io_instance, request, data, data_len);
+
 	end = data + data_len;
 
 	MPRINT("HEADER %s", data);
@@ -398,7 +418,7 @@ static int mod_open(void *instance, fr_schedule_t *sc, CONF_SECTION *conf)
 	 *	Testing: allow it to read a "detail.work" file
 	 *	directly.
 	 */
-	if (strcmp(inst->io_submodule->module->dl->name, "proto_detail_work") == 0) {
+	if (transport_is_reader(inst)) {
 		if (!fr_schedule_listen_add(sc, li)) {
 			talloc_free(li);
 			return -1;
@@ -467,7 +487,7 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	/*
 	 *	If the IO is "file" and not the worker, instantiate the worker now.
 	 */
-	if (strcmp(inst->io_submodule->module->dl->name, "proto_detail_work") != 0) {
+	if (!transport_is_reader(inst)) {
 		if (inst->work_io->instantiate && (inst->work_io->instantiate(inst->work_io_instance,
 									      inst->work_io_conf) < 0)) {
 			cf_log_err(inst->work_io_conf, "Instantiation failed for \"%s\"", inst->work_io->name);
@@ -510,6 +530,19 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	if (strcmp(inst->format, "binary") == 0) {
+		inst->binary = true;
+
+	} else if (strcmp(inst->format, "text") != 0) {
+		cf_log_err(conf, "Invalid format \"%s\"", inst->format);
+		return -1;
+	}
+
+	/*
+	 *	Reading a binary work file directly.
+	 */
+	if (strcmp(inst->io_submodule->module->dl->name, "proto_detail_spool") == 0) inst->binary = true;
+
 	/*
 	 *	Bootstrap the I/O module
 	 */
@@ -526,12 +559,17 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	/*
 	 *	If we're not loading the work submodule directly, then try to load it here.
 	 */
-	if (strcmp(inst->io_submodule->module->dl->name, "proto_detail_work") != 0) {
+	if (!transport_is_reader(inst)) {
 		CONF_SECTION *transport_cs;
 		dl_module_inst_t *parent_inst;
+		char const *work_name = inst->binary ? "spool" : "work";
 
 		inst->work_submodule = NULL;
 
+		/*
+		 *	Binary files use the same "work" configuration,
+		 *	but are read by proto_detail_spool.
+		 */
 		transport_cs = cf_section_find(inst->cs, "work", NULL);
 		parent_inst = cf_data_value(cf_data_find(inst->cs, dl_module_inst_t, "proto_detail"));
 		fr_assert(parent_inst);
@@ -546,8 +584,8 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 		}
 
 		if (dl_module_instance(inst->cs, &inst->work_submodule, transport_cs,
-				parent_inst, "work", DL_MODULE_TYPE_SUBMODULE) < 0) {
-			cf_log_perr(inst->cs, "Failed to load proto_detail_work");
+				parent_inst, work_name, DL_MODULE_TYPE_SUBMODULE) < 0) {
+			cf_log_perr(inst->cs, "Failed to load proto_detail_%s", work_name);
 			return -1;
 		}
 
@@ -54,6 +54,9 @@ typedef struct {
 	void				*work_io_instance;		//!< Easy access to the app_io instance.
 	CONF_SECTION			*work_io_conf;			//!< Easy access to the app_io's config secti
 
+	char const			*format;			//!< "text" or "binary"
+	bool				binary;				//!< read binary files with proto_detail_spool
+
 	fr_dict_t const			*dict;				//!< root dictionary
 	fr_dict_attr_t const		*attr_packet_type;
 
@@ -89,12 +92,27 @@ struct proto_detail_work_s {
 	bool				track_progress;		//!< do we track progress by writing?
 	bool				retransmit;		//!< are we retransmitting on error?
 	bool				immediate;		//!< start reading the detail files immediately
+	bool				use_mmap;		//!< map the work file instead of reading it
+
+	uint32_t			checkpoint_interval;	//!< how many entries are marked done between
+								//!< flushes of the mapping
 
 	int				mode;			//!< O_RDWR or O_RDONLY
 
+	char const			*secret;		//!< for decoding binary entries from unknown clients
+
 	RADCLIENT			*client;		//!< so the rest of the server doesn't complain
 };
 
+/*
+ *	An entry found when scanning a mapped work file.
+ */
+typedef struct {
+	off_t				offset;			//!< of the entry in the work file
+	size_t				len;			//!< including the end of record marker
+	off_t				done_offset;		//!< where the entry is marked as done, or 0
+} proto_detail_work_entry_t;
+
 typedef struct proto_detail_work_thread_s proto_detail_work_thread_t;
 
 struct proto_detail_work_thread_s {
@@ -131,12 +149,45 @@ struct proto_detail_work_thread_s {
 	off_t				header_offset;		//!< offset of the current header we're reading
 	off_t				read_offset;		//!< where we're reading from in filename_work
 
+	uint8_t				*map;			//!< filename_work, if it's mapped
+	size_t				map_len;		//!< length of the mapping
+	off_t				map_offset;		//!< where the next scan of the mapping starts
+
+	proto_detail_work_entry_t	*entries;		//!< found by the last scan of the mapping
+	uint32_t			num_entries;		//!< number of entries found by the last scan
+	uint32_t			next_entry;		//!< next entry to read
+
+	uint32_t			num_dirty;		//!< entries marked done since the last checkpoint
+	off_t				dirty_start;		//!< start of the range marked done
+	off_t				dirty_end;		//!< end of the range marked done
+
 	fr_event_timer_t const		*ev;			//!< for detail file timers.
 
 	pthread_mutex_t			worker_mutex;		//!< for the workers
 	int				num_workers;		//!< number of workers
 };
 
+/*
+ *	An entry which has been read, and is being processed.
+ */
+typedef struct {
+	proto_detail_work_thread_t	*parent;		//!< talloc_parent is SLOW!
+	fr_time_t			timestamp;		//!< when we read the entry.
+	off_t				done_offset;		//!< where we're tracking the status
+
+	int				id;			//!< for retransmission counters
+
+	uint8_t				*packet;		//!< for retransmissions, when the work file isn't mapped
+	size_t				packet_len;		//!< for retransmissions, when the work file isn't mapped
+
+	off_t				offset;			//!< of the entry, when the work file is mapped
+	size_t				len;			//!< of the entry, when the work file is mapped
+
+	fr_retry_t			retry;			//!< our retry timers
+	fr_event_timer_t const		*ev;			//!< retransmission timer
+	fr_dlist_t			entry;			//!< for the retransmission list
+} fr_detail_entry_t;
+
 #include <pthread.h>
 
 #ifdef __cplusplus
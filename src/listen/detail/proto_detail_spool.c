@@ -0,0 +1,472 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file proto_detail_spool.c
+ * @brief Detail handler for binary files
+ *
+ * Reads files written by rlm_detail with "format = binary".  Each
+ * entry contains the packet as it was originally received, which is
+ * decoded directly by the protocol library.
+ *
+ * @copyright 2021 The FreeRADIUS server project.
+ */
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/detail_spool.h>
+#include <freeradius-devel/server/protocol.h>
+#include <freeradius-devel/io/base.h>
+#include <freeradius-devel/io/application.h>
+#include <freeradius-devel/io/listen.h>
+#include <freeradius-devel/radius/radius.h>
+#include <freeradius-devel/util/dlist.h>
+#include <freeradius-devel/util/time.h>
+#include <freeradius-devel/util/debug.h>
+#include "detail_reader.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+typedef struct proto_detail_work_s proto_detail_spool_t;
+
+typedef struct proto_detail_work_thread_s proto_detail_spool_thread_t;
+
+static const CONF_PARSER spool_listen_config[] = {
+	{ FR_CONF_OFFSET("filename", FR_TYPE_STRING | FR_TYPE_REQUIRED, proto_detail_spool_t, filename_work ) },
+
+	{ FR_CONF_OFFSET("track", FR_TYPE_BOOL, proto_detail_spool_t, track_progress ) },
+
+	{ FR_CONF_OFFSET("retransmit", FR_TYPE_BOOL, proto_detail_spool_t, retransmit ), .dflt = "yes" },
+
+	{ FR_CONF_OFFSET("checkpoint_interval", FR_TYPE_UINT32, proto_detail_spool_t, checkpoint_interval ), .dflt = "1024" },
+
+	{ FR_CONF_OFFSET("secret", FR_TYPE_STRING | FR_TYPE_SECRET, proto_detail_spool_t, secret ) },
+
+	{ FR_CONF_POINTER("limit", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) detail_reader_limit_config },
+	CONF_PARSER_TERMINATOR
+};
+
+static fr_dict_t const *dict_freeradius;
+static fr_dict_t const *dict_radius;
+
+extern fr_dict_autoload_t proto_detail_spool_dict[];
+fr_dict_autoload_t proto_detail_spool_dict[] = {
+	{ .out = &dict_freeradius, .proto = "freeradius" },
+	{ .out = &dict_radius, .proto = "radius" },
+
+	{ NULL }
+};
+
+static fr_dict_attr_t const *attr_packet_original_timestamp;
+static fr_dict_attr_t const *attr_packet_transmit_counter;
+
+extern fr_dict_attr_autoload_t proto_detail_spool_dict_attr[];
+fr_dict_attr_autoload_t proto_detail_spool_dict_attr[] = {
+	{ .out = &attr_packet_original_timestamp, .name = "Packet-Original-Timestamp", .type = FR_TYPE_DATE, .dict = &dict_freeradius },
+	{ .out = &attr_packet_transmit_counter, .name = "Packet-Transmit-Counter", .type = FR_TYPE_UINT32, .dict = &dict_freeradius },
+	{ NULL }
+};
+
+/** Decode an entry
+ *
+ * proto_detail only sets the defaults, so all of the work is done
+ * here.  The packet is decoded by the protocol library, exactly as
+ * if it had just been received from the network.
+ */
+static int mod_decode(void const *instance, request_t *request, uint8_t *const data, size_t data_len)
+{
+	proto_detail_spool_t const	*inst = talloc_get_type_abort_const(instance, proto_detail_spool_t);
+	fr_detail_entry_t const		*track = request->async->packet_ctx;
+	fr_detail_spool_header_t	header;
+	RADCLIENT const			*client;
+	char const			*secret;
+	uint8_t const			*packet;
+	fr_dcursor_t			cursor;
+	fr_pair_t			*vp;
+
+	/*
+	 *	mod_read() has already checked the entry.
+	 */
+	if (fr_detail_spool_header_decode(&header, data, data_len) != (ssize_t) data_len) {
+		REDEBUG("Malformed entry");
+		return -1;
+	}
+	packet = data + header.header_len;
+
+	request->dict = dict_radius;
+
+	request->packet->code = packet[0];
+	request->packet->id = packet[1];
+	memcpy(request->packet->vector, packet + 4, sizeof(request->packet->vector));
+
+	request->packet->data = talloc_memdup(request->packet, packet, header.packet_len);
+	request->packet->data_len = header.packet_len;
+
+	request->packet->socket.inet.src_ipaddr = header.src_ipaddr;
+	request->packet->socket.inet.src_port = header.src_port;
+	request->packet->socket.inet.dst_ipaddr = header.dst_ipaddr;
+	request->packet->socket.inet.dst_port = header.dst_port;
+	fr_socket_addr_swap(&request->reply->socket, &request->packet->socket);
+
+	/*
+	 *	Encrypted attributes need the secret of the client
+	 *	which originally sent the packet.  Guessing the
+	 *	secret would silently corrupt them, so entries which
+	 *	have no secret are rejected.
+	 */
+	client = client_find(NULL, &header.src_ipaddr, IPPROTO_UDP);
+	if (client) {
+		secret = client->secret;
+	} else if (inst->secret) {
+		secret = inst->secret;
+	} else {
+		REDEBUG("No client %pV, and no 'secret' is configured - cannot decode packet",
+			fr_box_ipaddr(header.src_ipaddr));
+		return -1;
+	}
+
+	fr_dcursor_init(&cursor, &request->request_pairs);
+	if (fr_radius_decode(request->request_ctx, request->packet->data, request->packet->data_len,
+			     NULL, secret, strlen(secret), &cursor) < 0) {
+		RPEDEBUG("Failed decoding packet");
+		return -1;
+	}
+
+	/*
+	 *	The original time at which we received the packet.
+	 *	We need this to properly calculate Acct-Delay-Time.
+	 */
+	MEM(pair_update_request(&vp, attr_packet_original_timestamp) >= 0);
+	vp->vp_date = header.timestamp;
+
+	request->client = inst->client;
+
+	request->packet->id = track->id;
+	request->reply->id = track->id;
+	REQUEST_VERIFY(request);
+
+	MEM(pair_update_request(&vp, attr_packet_transmit_counter) >= 0);
+	vp->vp_uint32 = track->retry.count;
+
+	return 0;
+}
+
+/** Find the next batch of entries in the file
+ *
+ * Entries which have already been marked as done are skipped.
+ *
+ * @return
+ *	- >0 the number of entries found.
+ *	- 0 at EOF.
+ *	- <0 on error.
+ */
+static int spool_scan(proto_detail_spool_thread_t *thread)
+{
+	fr_detail_spool_header_t	header;
+
+	thread->num_entries = 0;
+	thread->next_entry = 0;
+
+	while ((thread->num_entries < DETAIL_READER_SCAN_BATCH) && (thread->map_offset < (off_t) thread->map_len)) {
+		off_t	offset = thread->map_offset;
+		ssize_t	slen;
+
+		slen = fr_detail_spool_header_decode(&header, thread->map + offset, thread->map_len - offset);
+		if (slen < 0) {
+			ERROR("proto_detail (%s): Malformed entry found at offset %zu in file %s",
+			      thread->name, (size_t) offset, thread->filename_work);
+			return -1;
+		}
+
+		/*
+		 *	The writer died part way through the last
+		 *	entry.  There's nothing after it.
+		 */
+		if (slen == 0) {
+			WARN("proto_detail (%s): Ignoring truncated entry at offset %zu in file %s",
+			     thread->name, (size_t) offset, thread->filename_work);
+			thread->map_offset = thread->map_len;
+			break;
+		}
+
+		thread->map_offset += slen;
+
+		if (header.flags & FR_DETAIL_SPOOL_FLAG_DONE) continue;
+
+		thread->entries[thread->num_entries++] = (proto_detail_work_entry_t) {
+			.offset = offset,
+			.len = slen,
+			.done_offset = offset + FR_DETAIL_SPOOL_FLAGS_OFFSET
+		};
+	}
+
+	return thread->num_entries;
+}
+
+/** Check that an entry holds something we can decode
+ *
+ */
+static bool spool_entry_ok(proto_detail_spool_t const *inst, proto_detail_spool_thread_t *thread,
+			   proto_detail_work_entry_t const *entry)
+{
+	fr_detail_spool_header_t	header;
+	size_t				packet_len;
+	decode_fail_t			reason;
+
+	(void) fr_detail_spool_header_decode(&header, thread->map + entry->offset, entry->len);
+
+	if (header.protocol != fr_dict_root(dict_radius)->attr) {
+		DEBUG("Ignoring entry at offset %zu of %s - unsupported protocol %u",
+		      (size_t) entry->offset, thread->filename_work, header.protocol);
+		return false;
+	}
+
+	packet_len = header.packet_len;
+	if (!fr_radius_ok(thread->map + entry->offset + header.header_len, &packet_len,
+			  RADIUS_MAX_ATTRIBUTES, false, &reason)) {
+		DEBUG("Ignoring entry at offset %zu of %s - packet is not RADIUS",
+		      (size_t) entry->offset, thread->filename_work);
+		return false;
+	}
+
+	/*
+	 *	mod_decode() would reject the entry.
+	 */
+	if (!inst->secret && !client_find(NULL, &header.src_ipaddr, IPPROTO_UDP)) {
+		ERROR("proto_detail (%s): Ignoring entry at offset %zu of %s - no client %pV, and no 'secret' is configured",
+		      thread->name, (size_t) entry->offset, thread->filename_work, fr_box_ipaddr(header.src_ipaddr));
+		return false;
+	}
+
+	return true;
+}
+
+static void spool_copy(uint8_t *buffer, uint8_t const *entry, size_t len)
+{
+	memcpy(buffer, entry, len);
+}
+
+static detail_reader_funcs_t const spool_funcs = {
+	.scan = spool_scan,
+	.check = spool_entry_ok,
+	.copy = spool_copy,
+};
+
+/** Read the next entry
+ *
+ */
+static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time_p, uint8_t *buffer, size_t buffer_len,
+			UNUSED size_t *leftover, uint32_t *priority, UNUSED bool *is_dup)
+{
+	proto_detail_spool_t const		*inst = talloc_get_type_abort_const(li->app_io_instance, proto_detail_spool_t);
+	proto_detail_spool_thread_t		*thread = talloc_get_type_abort(li->thread_instance, proto_detail_spool_thread_t);
+
+	fr_assert(thread->fd >= 0);
+
+	/*
+	 *	Empty files can't be mapped, and have nothing to read.
+	 */
+	if (!thread->map) return -1;
+
+	return detail_reader_mmap_read(inst, thread, &spool_funcs, packet_ctx, recv_time_p, buffer, buffer_len, priority);
+}
+
+/** Mark an entry as done
+ *
+ * Only the flags byte in the header changes.
+ */
+static void spool_done(proto_detail_spool_t const *inst, proto_detail_spool_thread_t *thread,
+		       fr_detail_entry_t const *track)
+{
+	thread->map[track->done_offset] |= FR_DETAIL_SPOOL_FLAG_DONE;
+
+	detail_reader_mmap_dirty(inst, thread, track->done_offset, 1);
+}
+
+static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t request_time,
+			 uint8_t *buffer, size_t buffer_len, UNUSED size_t written)
+{
+	proto_detail_spool_t const	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_detail_spool_t);
+	proto_detail_spool_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_detail_spool_thread_t);
+	fr_detail_entry_t		*track = packet_ctx;
+
+	if (buffer_len < 1) return -1;
+
+	fr_assert(thread->outstanding > 0);
+	fr_assert(thread->fd >= 0);
+
+	/*
+	 *	Failed entries are retransmitted.  Entries which
+	 *	succeed, or which we've given up on, are done.
+	 */
+	if (!buffer[0] && (detail_reader_retry(inst, thread, track) == 0)) return 1;
+
+	if (inst->track_progress) spool_done(inst, thread, track);
+
+	return detail_reader_release(inst, thread, track, buffer_len);
+}
+
+/** Open a binary detail listener
+ *
+ */
+static int mod_open(fr_listen_t *li)
+{
+	proto_detail_spool_t const	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_detail_spool_t);
+	proto_detail_spool_thread_t	*thread = talloc_get_type_abort(li->thread_instance, proto_detail_spool_thread_t);
+	struct stat			buf;
+
+	fr_dlist_init(&thread->list, fr_detail_entry_t, entry);
+
+	/*
+	 *	Open the file if we haven't already been given one.
+	 */
+	if (thread->fd < 0) {
+		thread->filename_work = talloc_strdup(inst, inst->filename_work);
+
+		li->fd = thread->fd = open(thread->filename_work, inst->mode);
+		if (thread->fd < 0) {
+			cf_log_err(inst->cs, "Failed opening %s: %s", thread->filename_work, fr_syserror(errno));
+			return -1;
+		}
+	}
+
+	if (fstat(thread->fd, &buf) < 0) {
+		cf_log_err(inst->cs, "Failed examining %s: %s", thread->filename_work, fr_syserror(errno));
+		return -1;
+	}
+
+	thread->file_size = buf.st_size;
+
+	/*
+	 *	Empty files can't be mapped.  mod_read() closes
+	 *	them.
+	 */
+	if ((buf.st_size > 0) && (detail_reader_mmap_open(inst, thread, buf.st_size) < 0)) return -1;
+
+	fr_assert(thread->name == NULL);
+	fr_assert(thread->filename_work != NULL);
+	thread->name = talloc_typed_asprintf(thread, "detail_spool from filename %s", thread->filename_work);
+
+	return 0;
+}
+
+/** Close a binary detail listener
+ *
+ */
+static int mod_close(fr_listen_t *li)
+{
+	proto_detail_spool_thread_t *thread = talloc_get_type_abort(li->thread_instance, proto_detail_spool_thread_t);
+
+	return detail_reader_close(thread);
+}
+
+/** Set the event list for a new IO instance
+ *
+ * @param[in] li the listener
+ * @param[in] el the event list
+ * @param[in] nr context from the network side
+ */
+static void mod_event_list_set(fr_listen_t *li, fr_event_list_t *el, void *nr)
+{
+	proto_detail_spool_thread_t *thread = talloc_get_type_abort(li->thread_instance, proto_detail_spool_thread_t);
+
+	thread->el = el;
+	thread->nr = nr;
+}
+
+static char const *mod_name(fr_listen_t *li)
+{
+	proto_detail_spool_thread_t *thread = talloc_get_type_abort(li->thread_instance, proto_detail_spool_thread_t);
+
+	return thread->name;
+}
+
+static int mod_instantiate(void *instance, UNUSED CONF_SECTION *cs)
+{
+	proto_detail_spool_t *inst = talloc_get_type_abort(instance, proto_detail_spool_t);
+	RADCLIENT *client;
+
+	client = inst->client = talloc_zero(inst, RADCLIENT);
+	if (!inst->client) return 0;
+
+	client->ipaddr.af = AF_INET;
+	client->ipaddr.addr.v4.s_addr = htonl(INADDR_NONE);
+	client->src_ipaddr = client->ipaddr;
+
+	client->longname = client->shortname = inst->filename_work;
+	client->secret = talloc_strdup(client, inst->secret ? inst->secret : "");
+	client->nas_type = talloc_strdup(client, "other");
+
+	return 0;
+}
+
+static int mod_bootstrap(void *instance, CONF_SECTION *cs)
+{
+	proto_detail_spool_t	*inst = talloc_get_type_abort(instance, proto_detail_spool_t);
+
+	if (detail_reader_bootstrap(inst, cs) < 0) return -1;
+
+	/*
+	 *	Entries are copied from the mapping for
+	 *	retransmissions, so we can have many in flight.
+	 */
+	FR_INTEGER_BOUND_CHECK("limit.maximum_outstanding", inst->max_outstanding, <=, 8192);
+
+	FR_INTEGER_BOUND_CHECK("checkpoint_interval", inst->checkpoint_interval, >=, 1);
+
+	return 0;
+}
+
+static int mod_load(void)
+{
+	if (fr_radius_init() < 0) {
+		PERROR("Failed initialising protocol library");
+		return -1;
+	}
+	return 0;
+}
+
+static void mod_unload(void)
+{
+	fr_radius_free();
+}
+
+/** Private interface for use by proto_detail_file
+ *
+ */
+extern fr_app_io_t proto_detail_spool;
+fr_app_io_t proto_detail_spool = {
+	.magic			= RLM_MODULE_INIT,
+	.name			= "detail_spool",
+	.config			= spool_listen_config,
+	.inst_size		= sizeof(proto_detail_spool_t),
+	.thread_inst_size	= sizeof(proto_detail_spool_thread_t),
+	.onload			= mod_load,
+	.unload			= mod_unload,
+	.bootstrap		= mod_bootstrap,
+	.instantiate		= mod_instantiate,
+
+	.default_message_size	= 65536,
+	.default_reply_size	= 32,
+
+	.open			= mod_open,
+	.close			= mod_close,
+	.read			= mod_read,
+	.decode			= mod_decode,
+	.write			= mod_write,
+	.event_list_set		= mod_event_list_set,
+	.get_name		= mod_name,
+};
@@ -0,0 +1,9 @@
+TARGETNAME	:= proto_detail_spool
+
+ifneq "$(TARGETNAME)" ""
+TARGET		:= $(TARGETNAME).a
+endif
+
+SOURCES		:= proto_detail_spool.c detail_reader.c
+
+TGT_PREREQS	:= $(LIBFREERADIUS_SERVER) libfreeradius-util.a libfreeradius-radius.a
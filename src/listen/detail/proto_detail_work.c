@@ -31,7 +31,7 @@
 #include <freeradius-devel/util/dlist.h>
 #include <freeradius-devel/util/time.h>
 #include <freeradius-devel/util/debug.h>
-#include "proto_detail.h"
+#include "detail_reader.h"
 
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -51,37 +51,6 @@
 #define MPRINT(_x, ...)
 #endif
 
-typedef struct {
-	proto_detail_work_thread_t	*parent;		//!< talloc_parent is SLOW!
-	fr_time_t			timestamp;		//!< when we read the entry.
-	off_t				done_offset;		//!< where we're tracking the status
-
-	int				id;			//!< for retransmission counters
-
-	uint8_t				*packet;		//!< for retransmissions
-	size_t				packet_len;		//!< for retransmissions
-
-	fr_retry_t			retry;			//!< our retry timers
-	fr_event_timer_t const		*ev;			//!< retransmission timer
-	fr_dlist_t			entry;			//!< for the retransmission list
-} fr_detail_entry_t;
-
-static CONF_PARSER limit_config[] = {
-	{ FR_CONF_OFFSET("initial_rtx_time", FR_TYPE_TIME_DELTA, proto_detail_work_t, retry_config.irt), .dflt = STRINGIFY(2) },
-	{ FR_CONF_OFFSET("max_rtx_time", FR_TYPE_TIME_DELTA, proto_detail_work_t, retry_config.mrt), .dflt = STRINGIFY(16) },
-
-	/*
-	 *	Retransmit indefinitely, as v2 and v3 did.
-	 */
-	{ FR_CONF_OFFSET("max_rtx_count", FR_TYPE_UINT32, proto_detail_work_t, retry_config.mrc), .dflt = STRINGIFY(0) },
-	/*
-	 *	...again same as v2 and v3.
-	 */
-	{ FR_CONF_OFFSET("max_rtx_duration", FR_TYPE_TIME_DELTA, proto_detail_work_t, retry_config.mrd), .dflt = STRINGIFY(0) },
-	{ FR_CONF_OFFSET("maximum_outstanding", FR_TYPE_UINT32, proto_detail_work_t, max_outstanding), .dflt = STRINGIFY(1) },
-	CONF_PARSER_TERMINATOR
-};
-
 
 static const CONF_PARSER file_listen_config[] = {
 	{ FR_CONF_OFFSET("filename", FR_TYPE_STRING | FR_TYPE_REQUIRED, proto_detail_work_t, filename_work ) },
@@ -90,7 +59,11 @@ static const CONF_PARSER file_listen_config[] = {
 
 	{ FR_CONF_OFFSET("retransmit", FR_TYPE_BOOL, proto_detail_work_t, retransmit ), .dflt = "yes" },
 
-	{ FR_CONF_POINTER("limit", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) limit_config },
+	{ FR_CONF_OFFSET("mmap", FR_TYPE_BOOL, proto_detail_work_t, use_mmap ), .dflt = "no" },
+
+	{ FR_CONF_OFFSET("checkpoint_interval", FR_TYPE_UINT32, proto_detail_work_t, checkpoint_interval ), .dflt = "1024" },
+
+	{ FR_CONF_POINTER("limit", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) detail_reader_limit_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -133,16 +106,121 @@ static int mod_decode(void const *instance, request_t *request, UNUSED uint8_t *
 	return 0;
 }
 
-static fr_event_update_t pause_read[] = {
-	FR_EVENT_SUSPEND(fr_event_io_func_t, read),
-	{ 0 }
-};
+/** Find the next batch of entries in a mapped work file
+ *
+ * Entries which have already been marked as done are skipped.
+ *
+ * @return
+ *	- >0 the number of entries found.
+ *	- 0 at EOF.
+ *	- <0 on error.
+ */
+static int work_mmap_scan(proto_detail_work_thread_t *thread)
+{
+	uint8_t const	*end = thread->map + thread->map_len;
+
+	thread->num_entries = 0;
+	thread->next_entry = 0;
+
+	while ((thread->num_entries < DETAIL_READER_SCAN_BATCH) && (thread->map_offset < (off_t) thread->map_len)) {
+		uint8_t const	*start, *p;
+		off_t		done_offset = 0;
+		bool		done = false;
+
+		start = p = thread->map + thread->map_offset;
+
+		/*
+		 *	Skip stray blank lines between entries.
+		 */
+		if (*start == '\n') {
+			thread->map_offset++;
+			continue;
+		}
+
+		/*
+		 *	Look for the "end of record" marker.  Every
+		 *	other line MUST have a leading tab.
+		 */
+		while ((p = memchr(p, '\n', end - p)) != NULL) {
+			p++;
+			if (p == end) break;
+
+			if (*p == '\n') {
+				p++;
+				break;
+			}
+
+			if (*p != '\t') {
+				ERROR("proto_detail (%s): Malformed line found at offset %zu in file %s",
+				      thread->name, (size_t) (p - thread->map), thread->filename_work);
+				return -1;
+			}
+
+			if (((end - p) >= 5) && (memcmp(p, "\tDone", 5) == 0)) {
+				done = true;
 
-static fr_event_update_t resume_read[] = {
-	FR_EVENT_RESUME(fr_event_io_func_t, read),
-	{ 0 }
+			} else if (((end - p) > 10) && (memcmp(p, "\tTimestamp", 10) == 0)) {
+				done_offset = (p + 1) - thread->map;
+			}
+		}
+		if (!p) p = end;
+
+		thread->map_offset = p - thread->map;
+
+		if (done) continue;
+
+		thread->entries[thread->num_entries++] = (proto_detail_work_entry_t) {
+			.offset = start - thread->map,
+			.len = p - start,
+			.done_offset = done_offset
+		};
+	}
+
+	return thread->num_entries;
+}
+
+/** Copy an entry from the mapping, in the format proto_detail expects
+ *
+ * i.e. each LF is replaced with a zero byte, as mod_read() does.
+ */
+static void work_mmap_copy(uint8_t *buffer, uint8_t const *entry, size_t len)
+{
+	uint8_t *p, *end = buffer + len;
+
+	memcpy(buffer, entry, len);
+
+	for (p = buffer; (p = memchr(p, '\n', end - p)) != NULL; p++) *p = '\0';
+}
+
+static detail_reader_funcs_t const work_mmap_funcs = {
+	.scan = work_mmap_scan,
+	.copy = work_mmap_copy,
 };
 
+/** Mark an entry as done
+ *
+ * The "Timestamp" attribute is overwritten with "Donestamp".
+ */
+static void work_done(proto_detail_work_t const *inst, proto_detail_work_thread_t *thread,
+		      fr_detail_entry_t const *track)
+{
+	if (thread->map) {
+		memcpy(thread->map + track->done_offset, "Done", 4);
+		detail_reader_mmap_dirty(inst, thread, track->done_offset, 4);
+		return;
+	}
+
+	/*
+	 *	Seek to the entry, mark it as done, and then seek to
+	 *	the point in the file where we were reading from.
+	 */
+	(void) lseek(thread->fd, track->done_offset, SEEK_SET);
+	if (write(thread->fd, "Done", 4) < 0) {
+		ERROR("%s - Failed marking entry as done: %s", thread->name, fr_syserror(errno));
+	}
+	(void) lseek(thread->fd, thread->read_offset, SEEK_SET);
+}
+
 static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time_p, uint8_t *buffer, size_t buffer_len, size_t *leftover, uint32_t *priority, UNUSED bool *is_dup)
 {
 	proto_detail_work_t const	*inst = talloc_get_type_abort_const(li->app_io_instance, proto_detail_work_t);
@@ -158,6 +236,11 @@ static ssize_t mod_read(fr_listen_t *li, void **packet_ctx, fr_time_t *recv_time
 	fr_assert(*leftover < buffer_len);
 	fr_assert(thread->fd >= 0);
 
+	if (thread->map) {
+		return detail_reader_mmap_read(inst, thread, &work_mmap_funcs,
+					       packet_ctx, recv_time_p, buffer, buffer_len, priority);
+	}
+
 	MPRINT("AT COUNT %d offset %ld", thread->count, (long) thread->read_offset);
 
 	/*
@@ -520,8 +603,7 @@ done:
 	 *	Pause reading until such time as we need more packets.
 	 */
 	if (!thread->paused && (thread->outstanding >= inst->max_outstanding)) {
-		(void) fr_event_filter_update(thread->el, thread->fd, FR_EVENT_FILTER_IO, pause_read);
-		thread->paused = true;
+		detail_reader_pause(thread);
 
 		/*
 		 *	Back up so that read() knows there's more data.
@@ -540,37 +622,6 @@ done:
 }
 
 
-static void work_retransmit(UNUSED fr_event_list_t *el, UNUSED fr_time_t now, void *uctx)
-{
-	fr_detail_entry_t		*track = talloc_get_type_abort(uctx, fr_detail_entry_t);
-	proto_detail_work_thread_t     	*thread = track->parent;
-
-	DEBUG("%s - retransmitting packet %d", thread->name, track->id);
-	track->retry.count++;
-
-	fr_dlist_insert_tail(&thread->list, track);
-
-	if (thread->paused && (thread->outstanding < thread->inst->max_outstanding)) {
-		(void) fr_event_filter_update(thread->el, thread->fd, FR_EVENT_FILTER_IO, resume_read);
-		thread->paused = false;
-	}
-
-	fr_assert(thread->fd >= 0);
-
-	/*
-	 *	Seek to the START of the file, so that the FD will
-	 *	always return ready.
-	 *
-	 *	The mod_read() function will take care of seeking to
-	 *	the correct read offset.
-	 */
-	(void) lseek(thread->fd, 0, SEEK_SET);
-
-#ifdef __linux__
-	fr_network_listen_read(thread->nr, thread->listen);
-#endif
-}
-
 static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t request_time,
 			 uint8_t *buffer, size_t buffer_len, UNUSED size_t written)
 {
@@ -583,93 +634,15 @@ static ssize_t mod_write(fr_listen_t *li, void *packet_ctx, UNUSED fr_time_t req
 	fr_assert(thread->outstanding > 0);
 	fr_assert(thread->fd >= 0);
 
-	if (!buffer[0]) {
-		if (track->retry.start == 0) {
-			fr_retry_init(&track->retry, fr_time(), &inst->retry_config);
-		} else {
-			fr_retry_state_t state;
-
-			state = fr_retry_next(&track->retry, fr_time());
-			if (state == FR_RETRY_MRC) {
-				DEBUG("%s - packet %d failed after %u retransmissions",
-				      thread->name, track->id, track->retry.count);
-				goto fail;
-
-			}
-
-			if (state == FR_RETRY_MRD) {
-				DEBUG("%s - packet %d failed after %u seconds",
-				      thread->name, track->id,
-				      (unsigned int) fr_time_delta_to_sec(inst->retry_config.mrd));
-				goto fail;
-			}
-		}
-
-		DEBUG("%s - packet %d failed during processing.  Will retransmit in %d.%06ds",
-			      thread->name, track->id, (int) (track->retry.rt / NSEC), (int) ((track->retry.rt % NSEC) / 1000));
-
-		if (fr_event_timer_at(thread, thread->el, &track->ev,
-				      track->retry.next, work_retransmit, track) < 0) {
-			ERROR("%s - Failed inserting retransmission timeout", thread->name);
-		fail:
-			if (inst->track_progress && (track->done_offset > 0)) goto mark_done;
-			goto free_track;
-		}
-
-		if (!thread->paused && (thread->outstanding >= inst->max_outstanding)) {
-			(void) fr_event_filter_update(thread->el, thread->fd, FR_EVENT_FILTER_IO, pause_read);
-			thread->paused = true;
-		}
-
-		return 1;
-
-	} else if (inst->track_progress && (track->done_offset > 0)) {
-	mark_done:
-		/*
-		 *	Seek to the entry, mark it as done, and then seek to
-		 *	the point in the file where we were reading from.
-		 */
-		(void) lseek(thread->fd, track->done_offset, SEEK_SET);
-		if (write(thread->fd, "Done", 4) < 0) {
-			ERROR("%s - Failed marking entry as done: %s", thread->name, fr_syserror(errno));
-		}
-		(void) lseek(thread->fd, thread->read_offset, SEEK_SET);
-	}
-
-free_track:
-	thread->outstanding--;
-
-	/*
-	 *	If we need to read some more packet, let's do so.
-	 */
-	if (thread->paused && (thread->outstanding < inst->max_outstanding)) {
-		(void) fr_event_filter_update(thread->el, thread->fd, FR_EVENT_FILTER_IO, resume_read);
-		thread->paused = false;
-
-		/*
-		 *	And seek to the start of the file, so that the
-		 *	reader gets activated again.  The reader will
-		 *	lseek() to the read offset, so this seek is fine.
-		 */
-		(void) lseek(thread->fd, 0, SEEK_SET);
-	}
-
 	/*
-	 *	@todo - add a used / free pool for these
+	 *	Failed entries are retransmitted.  Entries which
+	 *	succeed, or which we've given up on, are done.
 	 */
-	talloc_free(track);
+	if (!buffer[0] && (detail_reader_retry(inst, thread, track) == 0)) return 1;
 
-	/*
-	 *	Close the socket if we're at EOF, and there are no
-	 *	outstanding replies to deal with.
-	 */
-	if (thread->closing && !thread->outstanding) {
-		MPRINT("WRITE ASKED TO CLOSE");
-		return 0;
-	}
+	if (inst->track_progress && (track->done_offset > 0)) work_done(inst, thread, track);
 
-	MPRINT("WRITE RETURN B %ld", buffer_len);
-	return buffer_len;
+	return detail_reader_release(inst, thread, track, buffer_len);
 }
 
 /** Open a detail listener
@@ -698,7 +671,7 @@ static int mod_open(fr_listen_t *li)
 	/*
 	 *	If we're tracking progress, learn where the EOF is.
 	 */
-	if (inst->track_progress) {
+	if (inst->track_progress || inst->use_mmap) {
 		struct stat buf;
 
 		if (fstat(thread->fd, &buf) < 0) {
@@ -707,7 +680,16 @@ static int mod_open(fr_listen_t *li)
 		}
 
 		thread->file_size = buf.st_size;
-	} else {
+
+		/*
+		 *	Empty files can't be mapped, but are handled
+		 *	just fine by the normal reader.
+		 */
+		if (inst->use_mmap && (buf.st_size > 0) &&
+		    (detail_reader_mmap_open(inst, thread, buf.st_size) < 0)) return -1;
+	}
+
+	if (!inst->track_progress) {
 		/*
 		 *	Avoid triggering erroneous EOF.
 		 */
@@ -724,38 +706,11 @@ static int mod_open(fr_listen_t *li)
 
 static int mod_close_internal(proto_detail_work_thread_t *thread)
 {
-	/*
-	 *	One less worker...  we check for "0" because of the
-	 *	hacks in proto_detail which let us start up with
-	 *	"transport = work" for debugging purposes.
-	 */
-	if (thread->file_parent) {
-		pthread_mutex_lock(&thread->file_parent->worker_mutex);
-		if (thread->file_parent->num_workers > 0) thread->file_parent->num_workers--;
-		pthread_mutex_unlock(&thread->file_parent->worker_mutex);
-	}
-
-	DEBUG("Closing and deleting detail worker file %s", thread->name);
-
 #ifdef NOTE_REVOKE
 	fr_event_fd_delete(thread->el, thread->fd, FR_EVENT_FILTER_VNODE);
 #endif
-	fr_event_fd_delete(thread->el, thread->fd, FR_EVENT_FILTER_IO);
-
-	unlink(thread->filename_work);
 
-	close(thread->fd);
-	thread->fd = -1;
-
-	/*
-	 *	If we've been spawned from proto_detail_file, clean
-	 *	ourselves up, including our listener.
-	 */
-	if (thread->listen) {
-		talloc_free(thread->listen);
-	}
-
-	return 0;
+	return detail_reader_close(thread);
 }
 
 
@@ -838,45 +793,20 @@ static int mod_instantiate(void *instance, UNUSED CONF_SECTION *cs)
 static int mod_bootstrap(void *instance, CONF_SECTION *cs)
 {
 	proto_detail_work_t	*inst = talloc_get_type_abort(instance, proto_detail_work_t);
-	dl_module_inst_t const	*dl_inst;
+
+	if (detail_reader_bootstrap(inst, cs) < 0) return -1;
 
 	/*
-	 *	Find the dl_module_inst_t holding our instance data
-	 *	so we can find out what the parent of our instance
-	 *	was.
+	 *	Mapped files don't need a copy of each entry for
+	 *	retransmissions, so we can have many more in flight.
 	 */
-	dl_inst = dl_module_instance_by_data(instance);
-	fr_assert(dl_inst);
-
-	inst->parent = talloc_get_type_abort(dl_inst->parent->data, proto_detail_t);
-	inst->cs = cs;
-
-	if (inst->track_progress) {
-		inst->mode = O_RDWR;
+	if (inst->use_mmap) {
+		FR_INTEGER_BOUND_CHECK("limit.maximum_outstanding", inst->max_outstanding, <=, 8192);
+		FR_INTEGER_BOUND_CHECK("checkpoint_interval", inst->checkpoint_interval, >=, 1);
 	} else {
-		inst->mode = O_RDONLY;
+		FR_INTEGER_BOUND_CHECK("limit.maximum_outstanding", inst->max_outstanding, <=, 256);
 	}
 
-	if (inst->retransmit) {
-		FR_TIME_DELTA_BOUND_CHECK("limit.initial_rtx_time", inst->retry_config.irt, >=, fr_time_delta_from_sec(1));
-		FR_TIME_DELTA_BOUND_CHECK("limit.initial_rtx_time", inst->retry_config.irt, <=, fr_time_delta_from_sec(60));
-
-		/*
-		 *	If you need more than this, just set it to
-		 *	"0", and check Packet-Transmit-Count manually.
-		 */
-		FR_INTEGER_BOUND_CHECK("limit.max_rtx_count", inst->retry_config.mrc, <=, 20);
-		FR_TIME_DELTA_BOUND_CHECK("limit.max_rtx_duration", inst->retry_config.mrd, <=, fr_time_delta_from_sec(600));
-
-		/*
-		 *	This is a reasonable value.
-		 */
-		FR_TIME_DELTA_BOUND_CHECK("limit.max_rtx_timer", inst->retry_config.mrt, <=, fr_time_delta_from_sec(30));
-	}
-
-	FR_INTEGER_BOUND_CHECK("limit.maximum_outstanding", inst->max_outstanding, >=, 1);
-	FR_INTEGER_BOUND_CHECK("limit.maximum_outstanding", inst->max_outstanding, <=, 256);
-
 	return 0;
 }
 
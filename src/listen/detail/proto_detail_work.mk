@@ -4,6 +4,6 @@ ifneq "$(TARGETNAME)" ""
 TARGET		:= $(TARGETNAME).a
 endif
 
-SOURCES		:= proto_detail_work.c
+SOURCES		:= proto_detail_work.c detail_reader.c
 
 TGT_PREREQS	:= libfreeradius-util.a
@@ -30,10 +30,12 @@ RCSID("$Id$")
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/server/exfile.h>
+#include <freeradius-devel/server/detail_spool.h>
 
 #include <ctype.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #ifdef HAVE_UNISTD_H
 #  include <unistd.h>
@@ -45,6 +47,18 @@ RCSID("$Id$")
 
 #define DIRLEN	8192		//!< Maximum path length.
 
+typedef enum {
+	DETAIL_FORMAT_INVALID = 0,
+	DETAIL_FORMAT_TEXT,		//!< One "attribute = value" line per attribute.
+	DETAIL_FORMAT_BINARY,		//!< The packet as received, see detail_spool.h.
+} detail_format_t;
+
+static fr_table_num_sorted_t const detail_format_table[] = {
+	{ L("binary"),	DETAIL_FORMAT_BINARY	},
+	{ L("text"),	DETAIL_FORMAT_TEXT	}
+};
+static size_t detail_format_table_len = NUM_ELEMENTS(detail_format_table);
+
 /** Instance configuration for rlm_detail
  *
  * Holds the configuration and preparsed data for a instance of rlm_detail.
@@ -52,6 +66,8 @@ RCSID("$Id$")
 typedef struct {
 	char const	*name;		//!< Instance name.
 	char const	*filename;	//!< File/path to write to.
+	char const	*format_str;	//!< Format of the entries, "text" or "binary".
+	detail_format_t	format;		//!< Parsed version of the above.
 	uint32_t	perm;		//!< Permissions to use for new files.
 	char const	*group;		//!< Group to use for new files.
 
@@ -71,6 +87,7 @@ typedef struct {
 
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("filename", FR_TYPE_FILE_OUTPUT | FR_TYPE_REQUIRED | FR_TYPE_XLAT, rlm_detail_t, filename), .dflt = "%A/%{Packet-Src-IP-Address}/detail" },
+	{ FR_CONF_OFFSET("format", FR_TYPE_STRING, rlm_detail_t, format_str), .dflt = "text" },
 	{ FR_CONF_OFFSET("header", FR_TYPE_TMPL | FR_TYPE_XLAT | FR_TYPE_NON_BLOCKING, rlm_detail_t, header),
 	  .dflt = "%t", .quote = T_DOUBLE_QUOTED_STRING },
 	{ FR_CONF_OFFSET("permissions", FR_TYPE_UINT32, rlm_detail_t, perm), .dflt = "0600" },
@@ -147,6 +164,12 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		inst->escape_func = rad_filename_make_safe;
 	}
 
+	inst->format = fr_table_value_by_str(detail_format_table, inst->format_str, DETAIL_FORMAT_INVALID);
+	if (inst->format == DETAIL_FORMAT_INVALID) {
+		cf_log_err(conf, "Invalid format \"%s\"", inst->format_str);
+		return -1;
+	}
+
 	inst->ef = module_exfile_init(inst, conf, 256, 30, inst->locking, NULL, NULL);
 	if (!inst->ef) {
 		cf_log_err(conf, "Failed creating log file context");
@@ -357,6 +380,71 @@ static int detail_write(FILE *out, rlm_detail_t const *inst, request_t *request,
 	return 0;
 }
 
+/** Write a single binary entry to a file descriptor
+ *
+ * The header and packet are written with one call, so that a reader
+ * never sees a header without its packet.  If the write fails part
+ * way through, the file is truncated back to where the entry started,
+ * so that later entries can still be found.
+ *
+ * @param[in] fd	Where to write the entry.
+ * @param[in] request	The current request.
+ * @param[in] packet	associated with the request (request, reply...).
+ * @return
+ *	- 1 if the entry was written.
+ *	- 0 if there was nothing to write.
+ *	- -1 on error.
+ */
+static int detail_write_binary(int fd, request_t *request, fr_radius_packet_t *packet)
+{
+	uint8_t				header[FR_DETAIL_SPOOL_HEADER_LEN];
+	struct iovec			vector[2];
+	ssize_t				slen;
+	off_t				offset;
+
+	/*
+	 *	We can only spool packets which were received from
+	 *	the network.  Replies haven't been encoded yet.
+	 */
+	if (!packet->data || !packet->data_len) {
+		RWDEBUG("Skipping packet which has no encoded form");
+		return 0;
+	}
+
+	fr_detail_spool_header_encode(header, &(fr_detail_spool_header_t) {
+			.packet_len = packet->data_len,
+			.protocol = fr_dict_root(request->dict)->attr,
+			.timestamp = fr_time_to_unix_time(request->packet->timestamp),
+			.src_ipaddr = packet->socket.inet.src_ipaddr,
+			.dst_ipaddr = packet->socket.inet.dst_ipaddr,
+			.src_port = packet->socket.inet.src_port,
+			.dst_port = packet->socket.inet.dst_port,
+		});
+
+	vector[0].iov_base = header;
+	vector[0].iov_len = sizeof(header);
+	vector[1].iov_base = packet->data;
+	vector[1].iov_len = packet->data_len;
+
+	offset = lseek(fd, 0, SEEK_CUR);
+
+	slen = writev(fd, vector, NUM_ELEMENTS(vector));
+	if (slen < 0) {
+		RERROR("Failed writing to detail file: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	if ((size_t) slen != (sizeof(header) + packet->data_len)) {
+		RERROR("Short write to detail file (%zd of %zu bytes)", slen, sizeof(header) + packet->data_len);
+		if ((offset >= 0) && (ftruncate(fd, offset) < 0)) {
+			RERROR("Failed removing partial entry from detail file: %s", fr_syserror(errno));
+		}
+		return -1;
+	}
+
+	return 1;
+}
+
 /*
  *	Do detail, compatible with old accounting
  */
@@ -409,6 +497,18 @@ static unlang_action_t CC_HINT(nonnull) detail_do(rlm_rcode_t *p_result, module_
 	}
 
 skip_group:
+	if (inst->format == DETAIL_FORMAT_BINARY) {
+		int ret;
+
+		ret = detail_write_binary(outfd, request, packet);
+		exfile_close(inst->ef, request, outfd);
+
+		if (ret < 0) RETURN_MODULE_FAIL;
+		if (ret == 0) RETURN_MODULE_NOOP;
+
+		RETURN_MODULE_OK;
+	}
+
 	outfp = NULL;
 	dupfd = dup(outfd);
 	if (dupfd < 0) {
@@ -122,6 +122,29 @@ static peap_tunnel_t *peap_alloc(TALLOC_CTX *ctx, rlm_eap_peap_t *inst)
 	return t;
 }
 
+static unlang_action_t CC_HINT(nonnull) mod_process(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request);
+
+/** Continue the handshake once an async TLS operation has completed
+ *
+ */
+static unlang_action_t mod_handshake_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+					    request_t *request, void *rctx)
+{
+	eap_tls_yield_done(request, rctx);
+
+	return mod_process(p_result, mctx, request);
+}
+
+static void mod_handshake_signal(UNUSED module_ctx_t const *mctx, request_t *request,
+				 void *rctx, fr_state_signal_t action)
+{
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	RDEBUG2("Cancelling async TLS operation");
+
+	eap_tls_yield_done(request, rctx);
+}
+
 /*
  *	Do authentication, by letting EAP-TLS do most of the work.
  */
@@ -166,6 +189,13 @@ static unlang_action_t CC_HINT(nonnull) mod_process(rlm_rcode_t *p_result, modul
 		peap->status = PEAP_STATUS_TUNNEL_ESTABLISHED;
 		break;
 
+	/*
+	 *	The handshake is waiting for an async
+	 *	TLS operation to complete.
+	 */
+	case EAP_TLS_YIELD:
+		return eap_tls_yield(p_result, request, eap_session, mod_handshake_resume, mod_handshake_signal);
+
 	/*
 	 *	The TLS code is still working on the TLS
 	 *	exchange, and it's a valid TLS request.
@@ -191,6 +191,29 @@ static unlang_action_t eap_tls_virtual_server(rlm_rcode_t *p_result, rlm_eap_tls
 	return UNLANG_ACTION_YIELD;
 }
 
+static unlang_action_t mod_process(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request);
+
+/** Continue the handshake once an async TLS operation has completed
+ *
+ */
+static unlang_action_t mod_handshake_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+					    request_t *request, void *rctx)
+{
+	eap_tls_yield_done(request, rctx);
+
+	return mod_process(p_result, mctx, request);
+}
+
+static void mod_handshake_signal(UNUSED module_ctx_t const *mctx, request_t *request,
+				 void *rctx, fr_state_signal_t action)
+{
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	RDEBUG2("Cancelling async TLS operation");
+
+	eap_tls_yield_done(request, rctx);
+}
+
 static unlang_action_t mod_process(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_eap_tls_t		*inst = talloc_get_type_abort(mctx->instance, rlm_eap_tls_t);
@@ -220,6 +243,13 @@ static unlang_action_t mod_process(rlm_rcode_t *p_result, module_ctx_t const *mc
 		return eap_tls_success_with_prf(p_result, request, eap_session);
 
 
+	/*
+	 *	The handshake is waiting for an async
+	 *	TLS operation to complete.
+	 */
+	case EAP_TLS_YIELD:
+		return eap_tls_yield(p_result, request, eap_session, mod_handshake_resume, mod_handshake_signal);
+
 	/*
 	 *	The TLS code is still working on the TLS
 	 *	exchange, and it's a valid TLS request.
@@ -32,6 +32,8 @@ RCSID("$Id$")
 #include <freeradius-devel/unlang/interpret.h>
 #include <freeradius-devel/util/debug.h>
 
+#include <ctype.h>
+
 /*
  *	Define a structure for our module configuration.
  */
@@ -47,9 +49,31 @@ typedef struct {
 	fr_time_delta_t		timeout;
 	bool			timeout_is_set;
 
+	bool			coproc_enable;		//!< Pass requests to long running copies of program.
+	uint32_t		coproc_num;		//!< Number of coprocesses per thread.
+
 	tmpl_t	*tmpl;
 } rlm_exec_t;
 
+/** A request being processed by a coprocess
+ *
+ */
+typedef struct {
+	fr_helper_exchange_t	ex;		//!< Frame passed to the coprocess.
+	char			*reply;		//!< Output pairs, one per line.
+	int			status;		//!< From the reply.
+} rlm_exec_coproc_req_t;
+
+typedef struct {
+	fr_helper_pool_t	*coprocs;	//!< Coprocesses for this thread.  NULL if disabled.
+} rlm_exec_thread_t;
+
+static const CONF_PARSER coprocess_config[] = {
+	{ FR_CONF_OFFSET("enable", FR_TYPE_BOOL, rlm_exec_t, coproc_enable), .dflt = "no" },
+	{ FR_CONF_OFFSET("num", FR_TYPE_UINT32, rlm_exec_t, coproc_num), .dflt = "1" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("wait", FR_TYPE_BOOL, rlm_exec_t, wait), .dflt = "yes" },
 	{ FR_CONF_OFFSET("program", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_exec_t, program) },
@@ -57,6 +81,7 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("output_pairs", FR_TYPE_STRING, rlm_exec_t, output) },
 	{ FR_CONF_OFFSET("shell_escape", FR_TYPE_BOOL, rlm_exec_t, shell_escape), .dflt = "yes" },
 	{ FR_CONF_OFFSET_IS_SET("timeout", FR_TYPE_TIME_DELTA, rlm_exec_t, timeout) },
+	{ FR_CONF_POINTER("coprocess", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) coprocess_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -184,6 +209,23 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	if (inst->coproc_enable) {
+		if (!inst->wait) {
+			cf_log_err(conf, "Cannot use coprocess if wait = no");
+			return -1;
+		}
+
+		if (!inst->program) {
+			cf_log_err(conf, "'program' must be set to use coprocess");
+			return -1;
+		}
+
+		if (inst->coproc_num < 1) {
+			cf_log_err(conf, "'coprocess.num' must be at least 1");
+			return -1;
+		}
+	}
+
 	if (inst->timeout_is_set || !inst->timeout) {
 		/*
 		 *	Pick the shorter one
@@ -389,6 +431,148 @@ static unlang_action_t mod_exec_wait_resume(rlm_rcode_t *p_result, module_ctx_t
 	RETURN_MODULE_RCODE(rlm_exec_status2rcode(request, fr_dlist_head(&m->box), status));
 }
 
+/** Process a line of the coprocess' reply
+ *
+ * @return
+ *	- 1 if the reply is complete.
+ *	- 0 if more lines are expected.
+ */
+static int coproc_reply_line(fr_helper_exchange_t *ex, char *line, size_t len)
+{
+	rlm_exec_coproc_req_t	*creq = ex ? ex->uctx : NULL;
+	char const		*p;
+	int			status = 0;
+
+	/*
+	 *	A line containing only digits is the status,
+	 *	and ends the reply.
+	 */
+	for (p = line; p < (line + len); p++) {
+		if (!isdigit((uint8_t) *p)) break;
+		if (status < 256) status = (status * 10) + (*p - '0');
+	}
+
+	if ((len > 0) && (p == (line + len))) {
+		if (creq) creq->status = status;
+		return 1;
+	}
+
+	/*
+	 *	Request was cancelled, throw away the reply.
+	 */
+	if (!creq || (len == 0)) return 0;
+
+	if (!creq->reply) {
+		MEM(creq->reply = talloc_strndup(creq, line, len));
+	} else {
+		MEM(creq->reply = talloc_asprintf_append_buffer(creq->reply, "\n%.*s", (int) len, line));
+	}
+
+	return 0;
+}
+
+static unlang_action_t mod_exec_coproc_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+					      request_t *request, void *rctx)
+{
+	rlm_exec_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_exec_t);
+	rlm_exec_coproc_req_t	*creq = talloc_get_type_abort(rctx, rlm_exec_coproc_req_t);
+
+	if (creq->ex.error) {
+		REDEBUG("%s", creq->ex.error);
+		RETURN_MODULE_FAIL;
+	}
+
+	if (inst->output && creq->reply) {
+		TALLOC_CTX	*ctx;
+		fr_pair_list_t	vps, *output_pairs;
+
+		RDEBUG("COPROCESS GOT -- %s", creq->reply);
+
+		fr_pair_list_init(&vps);
+		output_pairs = tmpl_list_head(request, inst->output_list);
+		fr_assert(output_pairs != NULL);
+
+		ctx = tmpl_list_ctx(request, inst->output_list);
+
+		if (fr_pair_list_afrom_str(ctx, request->dict, creq->reply, talloc_array_length(creq->reply) - 1,
+					   &vps) == T_INVALID) {
+			RPEDEBUG("Failed parsing output from coprocess");
+			fr_pair_list_free(&vps);
+			RETURN_MODULE_FAIL;
+		}
+		fr_pair_list_tainted(&vps);
+		fr_pair_list_move(output_pairs, &vps);
+	}
+
+	RETURN_MODULE_RCODE(rlm_exec_status2rcode(request, NULL, creq->status));
+}
+
+static void mod_exec_coproc_signal(module_ctx_t const *mctx, UNUSED request_t *request,
+				   void *rctx, fr_state_signal_t action)
+{
+	rlm_exec_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_exec_thread_t);
+	rlm_exec_coproc_req_t	*creq = talloc_get_type_abort(rctx, rlm_exec_coproc_req_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	fr_helper_pool_cancel(t->coprocs, &creq->ex);
+}
+
+/** Pass the request to a coprocess
+ *
+ * The request frame is the input pairs, one per line, followed by an
+ * empty line.
+ */
+static unlang_action_t mod_exec_coproc_dispatch(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_exec_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_exec_t);
+	rlm_exec_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_exec_thread_t);
+	rlm_exec_coproc_req_t	*creq;
+	fr_sbuff_t		sbuff;
+	fr_sbuff_uctx_talloc_t	tctx;
+
+	if (inst->output && !tmpl_list_head(request, inst->output_list)) RETURN_MODULE_INVALID;
+
+	MEM(creq = talloc_zero(unlang_interpret_frame_talloc_ctx(request), rlm_exec_coproc_req_t));
+	creq->ex.request = request;
+	creq->ex.uctx = creq;
+
+	MEM(fr_sbuff_init_talloc(creq, &sbuff, &tctx, 256, SIZE_MAX));
+	if (inst->input) {
+		fr_pair_list_t	*input_pairs;
+		fr_pair_t	*vp;
+
+		input_pairs = tmpl_list_head(request, inst->input_list);
+		if (!input_pairs) {
+			talloc_free(creq);
+			RETURN_MODULE_INVALID;
+		}
+
+		for (vp = fr_pair_list_head(input_pairs);
+		     vp;
+		     vp = fr_pair_list_next(input_pairs, vp)) {
+			if ((fr_pair_print(&sbuff, NULL, vp) < 0) || (fr_sbuff_in_char(&sbuff, '\n') <= 0)) {
+			oom:
+				REDEBUG("Failed encoding request for coprocess");
+				talloc_free(creq);
+				RETURN_MODULE_FAIL;
+			}
+		}
+	}
+	if (fr_sbuff_in_char(&sbuff, '\n') <= 0) goto oom;
+	fr_sbuff_trim_talloc(&sbuff, SIZE_MAX);
+	creq->ex.frame = fr_sbuff_buff(&sbuff);
+	creq->ex.frame_len = fr_sbuff_used(&sbuff);
+
+	if (fr_helper_pool_send(t->coprocs, &creq->ex) < 0) {
+		REDEBUG("%s", creq->ex.error);
+		talloc_free(creq);
+		RETURN_MODULE_FAIL;
+	}
+
+	return unlang_module_yield(request, mod_exec_coproc_resume, mod_exec_coproc_signal, creq);
+}
+
 /*
  *  Dispatch an async exec method
  */
@@ -405,6 +589,8 @@ static unlang_action_t CC_HINT(nonnull) mod_exec_dispatch(rlm_rcode_t *p_result,
 		RETURN_MODULE_FAIL;
 	}
 
+	if (inst->coproc_enable) return mod_exec_coproc_dispatch(p_result, mctx, request);
+
 	/*
 	 *	Get frame-local talloc ctx
 	 */
@@ -446,6 +632,36 @@ static unlang_action_t CC_HINT(nonnull) mod_exec_dispatch(rlm_rcode_t *p_result,
 }
 
 
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_exec_t const	*inst = talloc_get_type_abort(instance, rlm_exec_t);
+	rlm_exec_thread_t	*t = talloc_get_type_abort(thread, rlm_exec_thread_t);
+
+	if (!inst->coproc_enable) return 0;
+
+	t->coprocs = fr_helper_pool_alloc(t, el, &(fr_helper_pool_conf_t){
+						.name = "coprocess",
+						.program = inst->program,
+						.min = inst->coproc_num,
+						.max = inst->coproc_num,
+						.timeout = inst->timeout,
+						.restart_delay = fr_time_delta_from_sec(1),
+						.reply = coproc_reply_line
+					  });
+	if (!t->coprocs) return -1;
+
+	return 0;
+}
+
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_exec_thread_t	*t = talloc_get_type_abort(thread, rlm_exec_thread_t);
+
+	TALLOC_FREE(t->coprocs);
+
+	return 0;
+}
+
 /*
  *	The module name should be the only globally exported symbol.
  *	That is, everything else should be 'static'.
@@ -464,6 +680,10 @@ module_t rlm_exec = {
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
+	.thread_inst_size	= sizeof(rlm_exec_thread_t),
+	.thread_inst_type	= "rlm_exec_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach	= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_exec_dispatch,
 		[MOD_AUTHORIZE]		= mod_exec_dispatch,
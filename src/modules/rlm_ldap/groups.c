@@ -267,13 +267,16 @@ finish:
  * @param[out] p_result		The result of trying to resolve a dn to a group name.
  * @param[in] inst		rlm_ldap configuration.
  * @param[in] request		Current request.
- * @param[in,out] pconn		to use. May change as this function calls functions which auto re-connect.
+ * @param[in] conn		which received the entry.
+ * @param[in,out] pconn		to use to resolve group names and DNs. May change as this function
+ *				calls functions which auto re-connect.
  * @param[in] entry		retrieved by rlm_ldap_find_user or fr_ldap_search.
  * @param[in] attr		membership attribute to look for in the entry.
  * @return One of the RLM_MODULE_* values.
  */
 unlang_action_t rlm_ldap_cacheable_userobj(rlm_rcode_t *p_result, rlm_ldap_t const *inst,
-					   request_t *request, fr_ldap_connection_t **pconn,
+					   request_t *request, fr_ldap_connection_t const *conn,
+					   fr_ldap_connection_t **pconn,
 					   LDAPMessage *entry, char const *attr)
 {
 	rlm_rcode_t rcode = RLM_MODULE_OK;
@@ -300,7 +303,7 @@ unlang_action_t rlm_ldap_cacheable_userobj(rlm_rcode_t *p_result, rlm_ldap_t con
 	/*
 	 *	Parse the membership information we got in the initial user query.
 	 */
-	values = ldap_get_values_len((*pconn)->handle, entry, attr);
+	values = ldap_get_values_len(conn->handle, entry, attr);
 	if (!values) {
 		RDEBUG2("No cacheable group memberships found in user object");
 
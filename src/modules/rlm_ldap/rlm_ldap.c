@@ -227,6 +227,8 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_POINTER("global", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) global_config },
 
 	{ FR_CONF_OFFSET("tls", FR_TYPE_SUBSECTION, rlm_ldap_t, handle_config), .subcs = (void const *) tls_config },
+
+	{ FR_CONF_OFFSET("trunk", FR_TYPE_SUBSECTION, rlm_ldap_t, trunk_conf), .subcs = (void const *) fr_trunk_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -943,54 +945,90 @@ free_result:
 	RETURN_MODULE_RCODE(rcode);
 }
 
-static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+/** Holds state of in progress async authorization
+ *
+ */
+typedef struct {
+	fr_ldap_map_exp_t	expanded;		//!< Attributes to retrieve, and the maps to apply.
+	fr_ldap_query_t		*query;			//!< User object search.
+} ldap_autz_ctx_t;
+
+/** Stop waiting for the user object search if the request is cancelled
+ *
+ */
+static void mod_authorize_signal(UNUSED module_ctx_t const *mctx, UNUSED request_t *request,
+				 void *rctx, fr_state_signal_t action)
+{
+	ldap_autz_ctx_t	*autz_ctx = talloc_get_type_abort(rctx, ldap_autz_ctx_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	talloc_free(autz_ctx->expanded.ctx);
+	talloc_free(autz_ctx);	/* Cancels the search */
+}
+
+/** Process the result of the user object search, and perform the remaining authorization checks
+ *
+ * The result is parsed with the handle of the trunk connection which received
+ * it.  Group membership caching, eDirectory password retrieval and profiles
+ * need further operations, so a connection is only taken from the pool if
+ * they're configured.
+ */
+static unlang_action_t mod_authorize_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+					    request_t *request, void *rctx)
 {
 	rlm_ldap_t const 	*inst = talloc_get_type_abort_const(mctx->instance, rlm_ldap_t);
+	ldap_autz_ctx_t		*autz_ctx = talloc_get_type_abort(rctx, ldap_autz_ctx_t);
+	fr_ldap_map_exp_t	*expanded = &autz_ctx->expanded;
 	rlm_rcode_t		rcode = RLM_MODULE_OK;
 	int			ldap_errno;
 	int			i;
 	struct berval		**values;
-	fr_ldap_connection_t	*conn;
-	LDAPMessage		*result, *entry;
+	fr_ldap_connection_t	*conn = autz_ctx->query->ldap_conn;
+	fr_ldap_connection_t	*pool_conn = NULL;
+	LDAPMessage		*result = autz_ctx->query->result, *entry;
 	char const 		*dn = NULL;
-	fr_ldap_map_exp_t	expanded; /* faster than allocing every time */
 #ifdef WITH_EDIR
 	fr_ldap_rcode_t		status;
 #endif
 
-	/*
-	 *	Don't be tempted to add a check for User-Name or
-	 *	User-Password here.  LDAP authorization can be used
-	 *	for many things besides searching for users.
-	 */
+	switch (autz_ctx->query->ret) {
+	case LDAP_PROC_SUCCESS:
+		break;
 
-	if (fr_ldap_map_expand(&expanded, request, &inst->user_map) < 0) RETURN_MODULE_FAIL;
+	case LDAP_PROC_BAD_DN:
+	case LDAP_PROC_NO_RESULT:
+		rcode = RLM_MODULE_NOTFOUND;
+		goto finish;
 
-	conn = mod_conn_get(inst, request);
-	if (!conn) RETURN_MODULE_FAIL;
+	default:
+		rcode = RLM_MODULE_FAIL;
+		goto finish;
+	}
 
 	/*
-	 *	Add any additional attributes we need for checking access, memberships, and profiles
+	 *	The connection was closed between the result
+	 *	arriving and the request being resumed.
 	 */
-	if (inst->userobj_access_attr) {
-		expanded.attrs[expanded.count++] = inst->userobj_access_attr;
-	}
-
-	if (inst->userobj_membership_attr && (inst->cacheable_group_dn || inst->cacheable_group_name)) {
-		expanded.attrs[expanded.count++] = inst->userobj_membership_attr;
-	}
-
-	if (inst->profile_attr) {
-		expanded.attrs[expanded.count++] = inst->profile_attr;
+	if (!conn) {
+		REDEBUG("LDAP connection closed before the search result was processed");
+		rcode = RLM_MODULE_FAIL;
+		goto finish;
 	}
 
-	if (inst->valuepair_attr) {
-		expanded.attrs[expanded.count++] = inst->valuepair_attr;
+	if (inst->cacheable_group_dn || inst->cacheable_group_name ||
+#ifdef WITH_EDIR
+	    inst->edir ||
+#endif
+	    inst->default_profile || inst->profile_attr) {
+		pool_conn = mod_conn_get(inst, request);
+		if (!pool_conn) {
+			rcode = RLM_MODULE_FAIL;
+			goto finish;
+		}
 	}
 
-	expanded.attrs[expanded.count] = NULL;
-
-	dn = rlm_ldap_find_user(inst, request, &conn, expanded.attrs, true, &result, &rcode);
+	dn = rlm_ldap_find_user_result(inst, request, conn, result, &rcode);
 	if (!dn) {
 		goto finish;
 	}
@@ -1018,13 +1056,14 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
 	 */
 	if (inst->cacheable_group_dn || inst->cacheable_group_name) {
 		if (inst->userobj_membership_attr) {
-			rlm_ldap_cacheable_userobj(&rcode, inst, request, &conn, entry, inst->userobj_membership_attr);
+			rlm_ldap_cacheable_userobj(&rcode, inst, request, conn, &pool_conn, entry,
+						   inst->userobj_membership_attr);
 			if (rcode != RLM_MODULE_OK) {
 				goto finish;
 			}
 		}
 
-		rlm_ldap_cacheable_groupobj(&rcode, inst, request, &conn);
+		rlm_ldap_cacheable_groupobj(&rcode, inst, request, &pool_conn);
 		if (rcode != RLM_MODULE_OK) {
 			goto finish;
 		}
@@ -1048,7 +1087,7 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
 		/*
 		 *	Retrive universal password
 		 */
-		res = fr_ldap_edir_get_password(conn->handle, dn, password, &pass_size);
+		res = fr_ldap_edir_get_password(pool_conn->handle, dn, password, &pass_size);
 		if (res != 0) {
 			REDEBUG("Failed to retrieve eDirectory password: (%i) %s", res, fr_ldap_edir_errstr(res));
 			rcode = RLM_MODULE_FAIL;
@@ -1073,8 +1112,8 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
 			/*
 			 *	Bind as the user
 			 */
-			conn->rebound = true;
-			status = fr_ldap_bind(request, &conn, dn, vp->vp_strvalue, NULL, 0, NULL, NULL);
+			pool_conn->rebound = true;
+			status = fr_ldap_bind(request, &pool_conn, dn, vp->vp_strvalue, NULL, 0, NULL, NULL);
 			switch (status) {
 			case LDAP_PROC_SUCCESS:
 				rcode = RLM_MODULE_OK;
@@ -1123,7 +1162,7 @@ skip_edir:
 			goto finish;
 		}
 
-		rlm_ldap_map_profile(&ret, inst, request, &conn, profile, &expanded);
+		rlm_ldap_map_profile(&ret, inst, request, &pool_conn, profile, expanded);
 		switch (ret) {
 		case RLM_MODULE_INVALID:
 			rcode = RLM_MODULE_INVALID;
@@ -1152,7 +1191,7 @@ skip_edir:
 				char *value;
 
 				value = fr_ldap_berval_to_string(request, values[i]);
-				rlm_ldap_map_profile(&ret, inst, request, &conn, value, &expanded);
+				rlm_ldap_map_profile(&ret, inst, request, &pool_conn, value, expanded);
 				talloc_free(value);
 				if (ret == RLM_MODULE_FAIL) {
 					ldap_value_free_len(values);
@@ -1169,19 +1208,96 @@ skip_edir:
 		RDEBUG2("Processing user attributes");
 		RINDENT();
 		if (fr_ldap_map_do(request, conn, inst->valuepair_attr,
-				   &expanded, entry) > 0) rcode = RLM_MODULE_UPDATED;
+				   expanded, entry) > 0) rcode = RLM_MODULE_UPDATED;
 		REXDENT();
 		rlm_ldap_check_reply(inst, request, conn);
 	}
 
 finish:
-	talloc_free(expanded.ctx);
-	if (result) ldap_msgfree(result);
-	ldap_mod_conn_release(inst, request, conn);
+	talloc_free(expanded->ctx);
+	talloc_free(autz_ctx);	/* Frees the search result */
+	if (pool_conn) ldap_mod_conn_release(inst, request, pool_conn);
 
 	RETURN_MODULE_RCODE(rcode);
 }
 
+/** Search for the user object using the thread's trunk, and yield until the search completes
+ *
+ */
+static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
+{
+	rlm_ldap_t const 	*inst = talloc_get_type_abort_const(mctx->instance, rlm_ldap_t);
+	rlm_ldap_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_ldap_thread_t);
+	ldap_autz_ctx_t		*autz_ctx;
+	fr_ldap_map_exp_t	*expanded;
+	char const		*filter = NULL;
+	char			filter_buff[LDAP_MAX_FILTER_STR_LEN];
+	char const		*base_dn;
+	char			base_dn_buff[LDAP_MAX_DN_STR_LEN];
+	LDAPControl		*serverctrls[] = { inst->userobj_sort_ctrl, NULL };
+
+	/*
+	 *	Don't be tempted to add a check for User-Name or
+	 *	User-Password here.  LDAP authorization can be used
+	 *	for many things besides searching for users.
+	 */
+
+	MEM(autz_ctx = talloc_zero(request, ldap_autz_ctx_t));
+	expanded = &autz_ctx->expanded;
+
+	if (fr_ldap_map_expand(expanded, request, &inst->user_map) < 0) {
+	fail:
+		talloc_free(expanded->ctx);
+		talloc_free(autz_ctx);
+		RETURN_MODULE_FAIL;
+	}
+
+	/*
+	 *	Add any additional attributes we need for checking access, memberships, and profiles
+	 */
+	if (inst->userobj_access_attr) {
+		expanded->attrs[expanded->count++] = inst->userobj_access_attr;
+	}
+
+	if (inst->userobj_membership_attr && (inst->cacheable_group_dn || inst->cacheable_group_name)) {
+		expanded->attrs[expanded->count++] = inst->userobj_membership_attr;
+	}
+
+	if (inst->profile_attr) {
+		expanded->attrs[expanded->count++] = inst->profile_attr;
+	}
+
+	if (inst->valuepair_attr) {
+		expanded->attrs[expanded->count++] = inst->valuepair_attr;
+	}
+
+	expanded->attrs[expanded->count] = NULL;
+
+	if (inst->userobj_filter) {
+		if (tmpl_expand(&filter, filter_buff, sizeof(filter_buff), request, inst->userobj_filter,
+				fr_ldap_escape_func, NULL) < 0) {
+			REDEBUG("Unable to create filter");
+		invalid:
+			talloc_free(expanded->ctx);
+			talloc_free(autz_ctx);
+			RETURN_MODULE_INVALID;
+		}
+	}
+
+	if (tmpl_expand(&base_dn, base_dn_buff, sizeof(base_dn_buff), request,
+			inst->userobj_base_dn, fr_ldap_escape_func, NULL) < 0) {
+		REDEBUG("Unable to create base_dn");
+		goto invalid;
+	}
+
+	autz_ctx->query = fr_ldap_trunk_search(autz_ctx, request, t->ttrunk, base_dn, inst->userobj_scope,
+					       filter, expanded->attrs, serverctrls, NULL);
+	if (!autz_ctx->query) goto fail;
+
+	return unlang_module_yield(request, mod_authorize_resume, mod_authorize_signal, autz_ctx);
+}
+
+
 /** Modify user's object in LDAP
  *
  * Process a modifcation map to update a user object in the LDAP directory.
@@ -2042,6 +2158,33 @@ error:
 	return -1;
 }
 
+/** Allocate the trunk used for asynchronous user object searches
+ *
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_ldap_t		*inst = talloc_get_type_abort(instance, rlm_ldap_t);
+	rlm_ldap_thread_t	*t = talloc_get_type_abort(thread, rlm_ldap_thread_t);
+
+	t->inst = inst;
+	t->ttrunk = fr_ldap_trunk_alloc(t, el, &inst->handle_config, &inst->trunk_conf, inst->name);
+	if (!t->ttrunk) {
+		ERROR("Unable to allocate LDAP trunk");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_ldap_thread_t	*t = talloc_get_type_abort(thread, rlm_ldap_thread_t);
+
+	talloc_free(t->ttrunk);
+
+	return 0;
+}
+
 static int mod_load(void)
 {
 	fr_ldap_init();
@@ -2067,6 +2210,10 @@ module_t rlm_ldap = {
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
 	.detach		= mod_detach,
+	.thread_inst_size	= sizeof(rlm_ldap_thread_t),
+	.thread_inst_type	= "rlm_ldap_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize,
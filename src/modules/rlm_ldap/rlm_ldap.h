@@ -142,6 +142,9 @@ struct ldap_inst_s {
 	fr_pool_t	*pool;				//!< Connection pool instance.
 	fr_ldap_config_t handle_config;			//!< Connection configuration instance.
 
+	fr_trunk_conf_t	trunk_conf;			//!< Configuration for the per-thread trunk used for
+							//!< asynchronous user object searches.
+
 	/*
 	 *	Global config
 	 */
@@ -151,6 +154,14 @@ struct ldap_inst_s {
 	uint32_t	ldap_debug;			//!< Debug flag for the SDK.
 };
 
+/** Thread specific rlm_ldap instance data
+ *
+ */
+typedef struct {
+	rlm_ldap_t const	*inst;			//!< Instance of the module this thread is running.
+	fr_ldap_thread_trunk_t	*ttrunk;		//!< Trunk used for asynchronous searches.
+} rlm_ldap_thread_t;
+
 extern fr_dict_attr_t const *attr_cleartext_password;
 extern fr_dict_attr_t const *attr_crypt_password;
 extern fr_dict_attr_t const *attr_ldap_userdn;
@@ -166,6 +177,9 @@ extern fr_dict_attr_t const *attr_user_name;
 char const *rlm_ldap_find_user(rlm_ldap_t const *inst, request_t *request, fr_ldap_connection_t **pconn,
 			       char const *attrs[], bool force, LDAPMessage **result, rlm_rcode_t *rcode);
 
+char const *rlm_ldap_find_user_result(rlm_ldap_t const *inst, request_t *request, fr_ldap_connection_t const *conn,
+				      LDAPMessage *result, rlm_rcode_t *rcode);
+
 rlm_rcode_t rlm_ldap_check_access(rlm_ldap_t const *inst, request_t *request,
 				  fr_ldap_connection_t const *conn, LDAPMessage *entry);
 
@@ -175,7 +189,8 @@ void rlm_ldap_check_reply(rlm_ldap_t const *inst, request_t *request, fr_ldap_co
  *	groups.c - Group membership functions.
  */
 unlang_action_t rlm_ldap_cacheable_userobj(rlm_rcode_t *p_result, rlm_ldap_t const *inst,
-					   request_t *request, fr_ldap_connection_t **pconn,
+					   request_t *request, fr_ldap_connection_t const *conn,
+					   fr_ldap_connection_t **pconn,
 					   LDAPMessage *entry, char const *attr);
 
 unlang_action_t rlm_ldap_cacheable_groupobj(rlm_rcode_t *p_result,
@@ -61,10 +61,8 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, request_t *request, fr_ld
 
 	fr_ldap_rcode_t	status;
 	fr_pair_t	*vp = NULL;
-	LDAPMessage	*tmp_msg = NULL, *entry = NULL;
-	int		ldap_errno;
-	int		cnt;
-	char		*dn = NULL;
+	LDAPMessage	*tmp_msg = NULL;
+	char const	*dn;
 	char const	*filter = NULL;
 	char	    	filter_buff[LDAP_MAX_FILTER_STR_LEN];
 	char const	*base_dn;
@@ -151,46 +149,79 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, request_t *request, fr_ld
 
 	fr_assert(*pconn);
 
+	dn = rlm_ldap_find_user_result(inst, request, *pconn, *result, rcode);
+	if ((freeit || (*rcode != RLM_MODULE_OK)) && *result) {
+		ldap_msgfree(*result);
+		*result = NULL;
+	}
+
+	return dn;
+}
+
+/** Process the result of a user object search
+ *
+ * Checks the result is unambiguous, and adds the DN of the user object
+ * to the control list as LDAP-UserDN.  Shared between the synchronous
+ * and trunked search paths.
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] conn Any connection handle, used for parsing the result.
+ * @param[in] result of the user object search.  Not freed.
+ * @param[out] rcode The status of the operation, one of the RLM_MODULE_* codes.
+ * @return The user's DN or NULL on error.
+ */
+char const *rlm_ldap_find_user_result(rlm_ldap_t const *inst, request_t *request, fr_ldap_connection_t const *conn,
+				      LDAPMessage *result, rlm_rcode_t *rcode)
+{
+	fr_pair_t	*vp = NULL;
+	LDAPMessage	*entry;
+	int		ldap_errno;
+	int		cnt;
+	char		*dn;
+
+	*rcode = RLM_MODULE_FAIL;
+
 	/*
 	 *	Forbid the use of unsorted search results that
 	 *	contain multiple entries, as it's a potential
 	 *	security issue, and likely non deterministic.
 	 */
 	if (!inst->userobj_sort_ctrl) {
-		cnt = ldap_count_entries((*pconn)->handle, *result);
+		cnt = ldap_count_entries(conn->handle, result);
 		if (cnt > 1) {
 			REDEBUG("Ambiguous search result, returned %i unsorted entries (should return 1 or 0).  "
 				"Enable sorting, or specify a more restrictive base_dn, filter or scope", cnt);
 			REDEBUG("The following entries were returned:");
 			RINDENT();
-			for (entry = ldap_first_entry((*pconn)->handle, *result);
+			for (entry = ldap_first_entry(conn->handle, result);
 			     entry;
-			     entry = ldap_next_entry((*pconn)->handle, entry)) {
-				dn = ldap_get_dn((*pconn)->handle, entry);
+			     entry = ldap_next_entry(conn->handle, entry)) {
+				dn = ldap_get_dn(conn->handle, entry);
 				REDEBUG("%s", dn);
 				ldap_memfree(dn);
 			}
 			REXDENT();
 			*rcode = RLM_MODULE_INVALID;
-			goto finish;
+			return NULL;
 		}
 	}
 
-	entry = ldap_first_entry((*pconn)->handle, *result);
+	entry = ldap_first_entry(conn->handle, result);
 	if (!entry) {
-		ldap_get_option((*pconn)->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+		ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
 		REDEBUG("Failed retrieving entry: %s",
 			ldap_err2string(ldap_errno));
 
-		goto finish;
+		return NULL;
 	}
 
-	dn = ldap_get_dn((*pconn)->handle, entry);
+	dn = ldap_get_dn(conn->handle, entry);
 	if (!dn) {
-		ldap_get_option((*pconn)->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
+		ldap_get_option(conn->handle, LDAP_OPT_RESULT_CODE, &ldap_errno);
 		REDEBUG("Retrieving object DN from entry failed: %s", ldap_err2string(ldap_errno));
 
-		goto finish;
+		return NULL;
 	}
 	fr_ldap_util_normalise_dn(dn, dn);
 
@@ -202,13 +233,7 @@ char const *rlm_ldap_find_user(rlm_ldap_t const *inst, request_t *request, fr_ld
 
 	ldap_memfree(dn);
 
-finish:
-	if ((freeit || (*rcode != RLM_MODULE_OK)) && *result) {
-		ldap_msgfree(*result);
-		*result = NULL;
-	}
-
-	return vp ? vp->vp_strvalue : NULL;
+	return vp->vp_strvalue;
 }
 
 /** Check for presence of access attribute in result
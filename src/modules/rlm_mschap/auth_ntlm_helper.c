@@ -0,0 +1,186 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or (at
+ *   your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file auth_ntlm_helper.c
+ * @brief NTLM authentication using persistent ntlm_auth helper processes
+ *
+ * Each worker thread keeps a small pool of
+ * `ntlm_auth --helper-protocol=ntlm-server-1` processes, see
+ * src/lib/server/helper.c.  This file formats the authentications
+ * passed to the helpers, and parses their replies.
+ *
+ * Helpers are started on demand, up to ntlm_auth_helper.max per thread.
+ *
+ * @copyright 2021 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#define LOG_PREFIX "rlm_mschap (%s) - "
+#define LOG_PREFIX_ARGS dl_module_instance_name_by_data(inst)
+
+#include <freeradius-devel/server/base.h>
+#include <freeradius-devel/server/exec.h>
+#include <freeradius-devel/server/module.h>
+#include <freeradius-devel/unlang/base.h>
+#include <freeradius-devel/util/base64.h>
+#include <freeradius-devel/util/debug.h>
+#include <freeradius-devel/util/hex.h>
+
+#include "rlm_mschap.h"
+#include "mschap.h"
+#include "auth_ntlm_helper.h"
+
+/** Process a line of the helper's reply
+ *
+ * The reply is a sequence of "Key: Value" lines, terminated by a line
+ * containing a single '.'.
+ */
+static int ntlm_helper_reply_line(fr_helper_exchange_t *ex, char *line, size_t len)
+{
+	mschap_ntlm_helper_request_t	*hreq;
+	request_t			*request;
+	char				*value;
+
+	if ((len == 1) && (line[0] == '.')) return 1;
+
+	/*
+	 *	Request was cancelled, throw away the reply.
+	 */
+	if (!ex) return 0;
+
+	hreq = ex->uctx;
+	request = ex->request;
+
+	value = strchr(line, ':');
+	if (!value) return 0;
+	*value++ = '\0';
+	while (*value == ' ') value++;
+
+	RDEBUG3("ntlm_auth helper said %s: %s", line, value);
+
+	if (strcmp(line, "Authenticated") == 0) {
+		hreq->authenticated = (strcmp(value, "Yes") == 0);
+
+	} else if (strcmp(line, "User-Session-Key") == 0) {
+		if (fr_hex2bin(NULL, &FR_DBUFF_TMP(hreq->nthashhash, NT_DIGEST_LENGTH),
+			       &FR_SBUFF_IN(value, strlen(value)), false) == NT_DIGEST_LENGTH) {
+			hreq->have_key = true;
+		}
+
+	} else if ((strcmp(line, "Authentication-Error") == 0) || (strcmp(line, "Error") == 0)) {
+		strlcpy(hreq->error, value, sizeof(hreq->error));
+	}
+
+	return 0;
+}
+
+/** Pass an authentication to a helper
+ *
+ * The request should yield if this function succeeds.  It will be marked
+ * as runnable once hreq contains the helper's reply, or the helper fails.
+ *
+ * @param[in] ctx	to allocate the frame in.  Must remain valid until
+ *			the request resumes.
+ * @param[in] t		Thread the request is being processed by.
+ * @param[in] hreq	Authentication to perform.  hreq->ex.request must be set.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure, hreq->error describes the failure.
+ */
+int mschap_ntlm_helper_send(TALLOC_CTX *ctx, rlm_mschap_thread_t *t, mschap_ntlm_helper_request_t *hreq)
+{
+	char	username[FR_BASE64_ENC_LENGTH(256) + 1], domain[FR_BASE64_ENC_LENGTH(256) + 1];
+	char	challenge[(sizeof(hreq->challenge) * 2) + 1], response[(sizeof(hreq->response) * 2) + 1];
+	size_t	username_len, domain_len;
+	char	*frame;
+
+	hreq->authenticated = false;
+	hreq->have_key = false;
+	hreq->error[0] = '\0';
+
+	username_len = strlen(hreq->username);
+	domain_len = strlen(hreq->domain);
+	if ((username_len > 256) || (domain_len > 256)) {
+		strlcpy(hreq->error, "Username or domain too long for ntlm_auth helper", sizeof(hreq->error));
+		return -1;
+	}
+
+	/*
+	 *	Usernames and domains are base64 encoded
+	 *	(indicated by '::') so they can contain
+	 *	anything.
+	 */
+	fr_base64_encode(username, sizeof(username), (uint8_t const *) hreq->username, username_len);
+	fr_base64_encode(domain, sizeof(domain), (uint8_t const *) hreq->domain, domain_len);
+	fr_bin2hex(&FR_SBUFF_OUT(challenge, sizeof(challenge)),
+		   &FR_DBUFF_TMP(hreq->challenge, sizeof(hreq->challenge)), SIZE_MAX);
+	fr_bin2hex(&FR_SBUFF_OUT(response, sizeof(response)),
+		   &FR_DBUFF_TMP(hreq->response, sizeof(hreq->response)), SIZE_MAX);
+
+	MEM(frame = talloc_asprintf(ctx,
+				    "Username:: %s\n"
+				    "NT-Domain:: %s\n"
+				    "LANMAN-Challenge: %s\n"
+				    "NT-Response: %s\n"
+				    "Request-User-Session-Key: Yes\n"
+				    ".\n", username, domain, challenge, response));
+
+	hreq->ex.frame = frame;
+	hreq->ex.frame_len = talloc_array_length(frame) - 1;
+	hreq->ex.uctx = hreq;
+
+	if (fr_helper_pool_send(t->helpers, &hreq->ex) < 0) {
+		strlcpy(hreq->error, hreq->ex.error, sizeof(hreq->error));
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Stop waiting for the result of an authentication
+ *
+ */
+void mschap_ntlm_helper_cancel(rlm_mschap_thread_t *t, mschap_ntlm_helper_request_t *hreq)
+{
+	fr_helper_pool_cancel(t->helpers, &hreq->ex);
+}
+
+/** Allocate the thread's pool of helpers, if they're being used
+ *
+ */
+int mschap_ntlm_helper_thread_init(rlm_mschap_thread_t *t, fr_event_list_t *el)
+{
+	rlm_mschap_t const *inst = t->inst;
+
+	if (inst->method != AUTH_NTLMAUTH_HELPER) return 0;
+
+	t->helpers = fr_helper_pool_alloc(t, el, &(fr_helper_pool_conf_t){
+						.name = "ntlm_auth helper",
+						.program = inst->ntlm_helper,
+						.min = 0,
+						.max = inst->ntlm_helper_max,
+						.timeout = inst->ntlm_auth_timeout,
+						.reply = ntlm_helper_reply_line
+					  });
+	if (!t->helpers) {
+		ERROR("Failed allocating ntlm_auth helper pool");
+		return -1;
+	}
+
+	return 0;
+}
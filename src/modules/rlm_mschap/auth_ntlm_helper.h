@@ -0,0 +1,26 @@
+#pragma once
+/* @copyright 2021 The FreeRADIUS server project */
+RCSIDH(auth_ntlm_helper_h, "$Id$")
+
+/** An authentication to be performed by an ntlm_auth helper
+ *
+ */
+typedef struct {
+	fr_helper_exchange_t	ex;			//!< Frame passed to the helper.
+
+	char			*username;		//!< Expansion of ntlm_auth_helper.username.
+	char			*domain;		//!< Expansion of ntlm_auth_helper.domain.
+	uint8_t			challenge[8];		//!< MS-CHAPv1 challenge.
+	uint8_t			response[24];		//!< NT-Response.
+
+	bool			authenticated;		//!< Whether the helper accepted the response.
+	bool			have_key;		//!< Whether nthashhash was provided.
+	uint8_t			nthashhash[NT_DIGEST_LENGTH];	//!< User-Session-Key returned by the helper.
+	char			error[256];		//!< Error returned by the helper, or describing its failure.
+} mschap_ntlm_helper_request_t;
+
+int	mschap_ntlm_helper_thread_init(rlm_mschap_thread_t *t, fr_event_list_t *el);
+
+int	mschap_ntlm_helper_send(TALLOC_CTX *ctx, rlm_mschap_thread_t *t, mschap_ntlm_helper_request_t *hreq);
+
+void	mschap_ntlm_helper_cancel(rlm_mschap_thread_t *t, mschap_ntlm_helper_request_t *hreq);
@@ -31,6 +31,7 @@ RCSID("$Id$")
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/password.h>
+#include <freeradius-devel/unlang/interpret.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/radius/defs.h>
 
@@ -47,6 +48,8 @@ RCSID("$Id$")
 #include "mschap.h"
 #include "smbdes.h"
 
+#include "auth_ntlm_helper.h"
+
 #ifdef WITH_AUTH_WINBIND
 #include "auth_wbclient.h"
 #endif
@@ -91,6 +94,14 @@ static const CONF_PARSER winbind_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static const CONF_PARSER ntlm_auth_helper_config[] = {
+	{ FR_CONF_OFFSET("program", FR_TYPE_STRING, rlm_mschap_t, ntlm_helper) },
+	{ FR_CONF_OFFSET("username", FR_TYPE_TMPL, rlm_mschap_t, ntlm_helper_username) },
+	{ FR_CONF_OFFSET("domain", FR_TYPE_TMPL, rlm_mschap_t, ntlm_helper_domain) },
+	{ FR_CONF_OFFSET("max", FR_TYPE_UINT32, rlm_mschap_t, ntlm_helper_max), .dflt = "4" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("normalise", FR_TYPE_BOOL, rlm_mschap_t, normify), .dflt = "yes" },
 
@@ -103,6 +114,8 @@ static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("with_ntdomain_hack", FR_TYPE_BOOL, rlm_mschap_t, with_ntdomain_hack), .dflt = "yes" },
 	{ FR_CONF_OFFSET("ntlm_auth", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_mschap_t, ntlm_auth) },
 	{ FR_CONF_OFFSET("ntlm_auth_timeout", FR_TYPE_TIME_DELTA, rlm_mschap_t, ntlm_auth_timeout) },
+	{ FR_CONF_POINTER("ntlm_auth_helper", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) ntlm_auth_helper_config },
+	{ FR_CONF_OFFSET("cache", FR_TYPE_SUBSECTION, rlm_mschap_t, cache_conf), .subcs = (void const *) fr_cred_cache_config },
 
 	{ FR_CONF_POINTER("passchange", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) passchange_config },
 	{ FR_CONF_OFFSET("allow_retry", FR_TYPE_BOOL, rlm_mschap_t, allow_retry), .dflt = "yes" },
@@ -1061,6 +1074,103 @@ ntlm_auth_err:
 	return -1;
 }
 
+/** Map an error from ntlm_auth to an MS-CHAP error
+ *
+ * @param[in] request	The current request.
+ * @param[in] buffer	Output from ntlm_auth, may be modified.
+ * @return
+ *	- -648 password expired.
+ *	- -647 account locked out.
+ *	- -691 account disabled.
+ *	- -2 no logon servers, or winbind failure.
+ *	- -1 any other failure.
+ */
+static int mschap_ntlm_auth_error(request_t *request, char *buffer)
+{
+	char	*p;
+	int	result;
+
+	/*
+	 *	Do checks for numbers, which are
+	 *	language neutral.  They're also
+	 *	faster.
+	 */
+	p = strcasestr(buffer, "0xC0000");
+	if (p) {
+		result = 0;
+
+		p += 7;
+		if (strcmp(p, "224") == 0) {
+			result = -648;
+
+		} else if (strcmp(p, "234") == 0) {
+			result = -647;
+
+		} else if (strcmp(p, "072") == 0) {
+			result = -691;
+
+		} else if (strcasecmp(p, "05E") == 0) {
+			result = -2;
+		}
+
+		if (result != 0) {
+			REDEBUG2("%s", buffer);
+			return result;
+		}
+
+		/*
+		 *	Else fall through to more ridiculous checks.
+		 */
+	}
+
+	/*
+	 *	Look for variants of expire password.
+	 */
+	if (strcasestr(buffer, "0xC0000224") ||
+	    strcasestr(buffer, "Password expired") ||
+	    strcasestr(buffer, "Password has expired") ||
+	    strcasestr(buffer, "Password must be changed") ||
+	    strcasestr(buffer, "Must change password") ||
+	    strcasestr(buffer, "NT_STATUS_PASSWORD_EXPIRED") ||
+	    strcasestr(buffer, "NT_STATUS_PASSWORD_MUST_CHANGE")) {
+		return -648;
+	}
+
+	if (strcasestr(buffer, "0xC0000234") ||
+	    strcasestr(buffer, "Account locked out") ||
+	    strcasestr(buffer, "NT_STATUS_ACCOUNT_LOCKED_OUT")) {
+		REDEBUG2("%s", buffer);
+		return -647;
+	}
+
+	if (strcasestr(buffer, "0xC0000072") ||
+	    strcasestr(buffer, "Account disabled") ||
+	    strcasestr(buffer, "NT_STATUS_ACCOUNT_DISABLED")) {
+		REDEBUG2("%s", buffer);
+		return -691;
+	}
+
+	if (strcasestr(buffer, "0xC000005E") ||
+	    strcasestr(buffer, "No logon servers") ||
+	    strcasestr(buffer, "NT_STATUS_NO_LOGON_SERVERS")) {
+		REDEBUG2("%s", buffer);
+		return -2;
+	}
+
+	if (strcasestr(buffer, "could not obtain winbind separator") ||
+	    strcasestr(buffer, "Reading winbind reply failed")) {
+		REDEBUG2("%s", buffer);
+		return -2;
+	}
+
+	RDEBUG2("External script failed");
+	p = strchr(buffer, '\n');
+	if (p) *p = '\0';
+
+	REDEBUG("External script says: %s", buffer);
+	return -1;
+}
+
 /*
  *	Do the MS-CHAP stuff.
  *
@@ -1121,84 +1231,7 @@ static int CC_HINT(nonnull (1, 2, 4, 5, 6)) do_mschap(rlm_mschap_t const *inst,
 		 */
 		result = radius_exec_program(request, buffer, sizeof(buffer), NULL, request, inst->ntlm_auth, NULL,
 					     true, true, inst->ntlm_auth_timeout);
-		if (result != 0) {
-			char *p;
-
-			/*
-			 *	Do checks for numbers, which are
-			 *	language neutral.  They're also
-			 *	faster.
-			 */
-			p = strcasestr(buffer, "0xC0000");
-			if (p) {
-				result = 0;
-
-				p += 7;
-				if (strcmp(p, "224") == 0) {
-					result = -648;
-
-				} else if (strcmp(p, "234") == 0) {
-					result = -647;
-
-				} else if (strcmp(p, "072") == 0) {
-					result = -691;
-
-				} else if (strcasecmp(p, "05E") == 0) {
-					result = -2;
-				}
-
-				if (result != 0) {
-					REDEBUG2("%s", buffer);
-					return result;
-				}
-
-				/*
-				 *	Else fall through to more ridiculous checks.
-				 */
-			}
-
-			/*
-			 *	Look for variants of expire password.
-			 */
-			if (strcasestr(buffer, "0xC0000224") ||
-			    strcasestr(buffer, "Password expired") ||
-			    strcasestr(buffer, "Password has expired") ||
-			    strcasestr(buffer, "Password must be changed") ||
-			    strcasestr(buffer, "Must change password")) {
-				return -648;
-			}
-
-			if (strcasestr(buffer, "0xC0000234") ||
-			    strcasestr(buffer, "Account locked out")) {
-				REDEBUG2("%s", buffer);
-				return -647;
-			}
-
-			if (strcasestr(buffer, "0xC0000072") ||
-			    strcasestr(buffer, "Account disabled")) {
-				REDEBUG2("%s", buffer);
-				return -691;
-			}
-
-			if (strcasestr(buffer, "0xC000005E") ||
-			    strcasestr(buffer, "No logon servers")) {
-				REDEBUG2("%s", buffer);
-				return -2;
-			}
-
-			if (strcasestr(buffer, "could not obtain winbind separator") ||
-			    strcasestr(buffer, "Reading winbind reply failed")) {
-				REDEBUG2("%s", buffer);
-				return -2;
-			}
-
-			RDEBUG2("External script failed");
-			p = strchr(buffer, '\n');
-			if (p) *p = '\0';
-
-			REDEBUG("External script says: %s", buffer);
-			return -1;
-		}
+		if (result != 0) return mschap_ntlm_auth_error(request, buffer);
 
 		/*
 		 *	Parse the answer as an nthashhash.
@@ -1707,21 +1740,290 @@ static unlang_action_t CC_HINT(nonnull) mschap_process_cpw_request(rlm_rcode_t *
 	RETURN_MODULE_OK;
 }
 
-static CC_HINT(nonnull(1,2,3,4,5,8,9)) unlang_action_t mschap_process_response(rlm_rcode_t *p_result,
-									       int *mschap_version,
-									       uint8_t nthashhash[static NT_DIGEST_LENGTH],
-									       rlm_mschap_t const *inst,
-									       request_t *request,
-									       fr_pair_t *smb_ctrl,
-									       fr_pair_t *nt_password,
-									       fr_pair_t *challenge,
-									       fr_pair_t *response,
-									       MSCHAP_AUTH_METHOD method)
+/** State for an MS-CHAP authentication
+ *
+ * Lives in the frame's talloc ctx, so the authentication can continue
+ * after yielding to an ntlm_auth helper.
+ */
+typedef struct {
+	rlm_mschap_t const		*inst;			//!< Module instance.
+	rlm_mschap_thread_t		*thread;		//!< Thread instance.
+	MSCHAP_AUTH_METHOD		method;			//!< How the response is being checked.
+	int				mschap_version;		//!< 1 or 2.
+	uint8_t				nthashhash[NT_DIGEST_LENGTH];	//!< Used to generate MPPE keys.
+
+	fr_pair_t			*smb_ctrl;		//!< SMB-Account-Ctrl, may be NULL.
+	fr_pair_t			*nt_password;		//!< Known good NT-Password, may be NULL.
+	bool				ephemeral;		//!< Whether we created nt_password, and must free it.
+	fr_pair_t			*challenge;		//!< MS-CHAP-Challenge.
+	fr_pair_t			*response;		//!< MS-CHAP-Response or MS-CHAP2-Response.
+
+	char const			*username_str;		//!< MS-CHAPv2 username, without the domain.
+	size_t				username_len;		//!< Length of username_str.
+	uint8_t const			*peer_challenge;	//!< MS-CHAPv2 peer challenge.
+
+	mschap_ntlm_helper_request_t	hreq;			//!< Authentication passed to an ntlm_auth helper.
+
+	bool				cache;			//!< Whether the result should be cached.
+	fr_cred_cache_key_t		cache_key;		//!< Key for caching the result.
+} mschap_auth_ctx_t;
+
+/** Add MS-CHAP2-Success and the MPPE keys, once the response has been checked
+ *
+ */
+static unlang_action_t mschap_auth_finish(rlm_rcode_t *p_result, mschap_auth_ctx_t *auth_ctx,
+					  request_t *request, int mschap_result)
 {
-	int			offset;
-	rlm_rcode_t		mschap_result;
+	rlm_mschap_t const	*inst = auth_ctx->inst;
+	fr_pair_t		*response = auth_ctx->response;
+	rlm_rcode_t		rcode;
+
+	/*
+	 *	Remember the nthashhash of valid responses, and
+	 *	which responses were simply wrong.  Account
+	 *	state errors and failures to contact the domain
+	 *	controller are not cached.
+	 */
+	if (auth_ctx->cache) {
+		switch (mschap_result) {
+		case 0:
+			fr_cred_cache_insert(auth_ctx->thread->cache, &auth_ctx->cache_key, true,
+					     auth_ctx->nthashhash, NT_DIGEST_LENGTH);
+			break;
+
+		case -1:
+			fr_cred_cache_insert(auth_ctx->thread->cache, &auth_ctx->cache_key, false, NULL, 0);
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	/*
+	 *	Check for errors, and add MSCHAP-Error if necessary.
+	 */
+	mschap_error(&rcode, inst, request, *response->vp_octets,
+		     mschap_result, auth_ctx->mschap_version, auth_ctx->smb_ctrl);
+	if (rcode != RLM_MODULE_OK) goto finish;
+
+	if (auth_ctx->mschap_version == 2) {
+		char const	*username_str = auth_ctx->username_str;
+		size_t		username_len = auth_ctx->username_len;
+		char		msch2resp[42];
+
+#ifdef WITH_AUTH_WINBIND
+		if (inst->wb_retry_with_normalised_username) {
+			fr_pair_t *response_name;
+
+			response_name = fr_pair_find_by_da(&request->request_pairs, attr_ms_chap_user_name, 0);
+			if (response_name) {
+				if (strcmp(username_str, response_name->vp_strvalue)) {
+					RDEBUG2("Normalising username %pV -> %pV",
+						fr_box_strvalue_len(username_str, username_len),
+						&response_name->data);
+					username_str = response_name->vp_strvalue;
+				}
+			}
+		}
+#endif
+
+		mschap_auth_response(username_str,		/* without the domain */
+				     username_len,		/* Length of username str */
+				     auth_ctx->nthashhash,	/* nt-hash-hash */
+				     response->vp_octets + 26,	/* peer response */
+				     auth_ctx->peer_challenge,	/* peer challenge */
+				     auth_ctx->challenge->vp_octets,	/* our challenge */
+				     msch2resp);		/* calculated MPPE key */
+		mschap_add_reply(request, *response->vp_octets, attr_ms_chap2_success, msch2resp, 42);
+	}
+
+	/* now create MPPE attributes */
+	if (inst->use_mppe) {
+		fr_pair_t	*vp;
+		uint8_t		mppe_sendkey[34];
+		uint8_t		mppe_recvkey[34];
 
-	*mschap_version = 1;
+		switch (auth_ctx->mschap_version) {
+		case 1:
+			RDEBUG2("Generating MS-CHAPv1 MPPE keys");
+			memset(mppe_sendkey, 0, 32);
+
+			/*
+			 *	According to RFC 2548 we
+			 *	should send NT hash.  But in
+			 *	practice it doesn't work.
+			 *	Instead, we should send nthashhash
+			 *
+			 *	This is an error in RFC 2548.
+			 */
+			/*
+			 *	do_mschap cares to zero nthashhash if NT hash
+			 *	is not available.
+			 */
+			memcpy(mppe_sendkey + 8, auth_ctx->nthashhash, NT_DIGEST_LENGTH);
+			mppe_add_reply(inst, request, attr_ms_chap_mppe_keys, mppe_sendkey, 24);	//-V666
+			break;
+
+		case 2:
+			RDEBUG2("Generating MS-CHAPv2 MPPE keys");
+			mppe_chap2_gen_keys128(auth_ctx->nthashhash, response->vp_octets + 26, mppe_sendkey, mppe_recvkey);
+
+			mppe_add_reply(inst, request, attr_ms_mppe_recv_key, mppe_recvkey, 16);
+			mppe_add_reply(inst, request, attr_ms_mppe_send_key, mppe_sendkey, 16);
+			break;
+
+		default:
+			fr_assert(0);
+			break;
+		}
+
+		MEM(pair_update_reply(&vp, attr_ms_mppe_encryption_policy) >= 0);
+		vp->vp_uint32 = inst->require_encryption ? 2 : 1;
+
+		MEM(pair_update_reply(&vp, attr_ms_mppe_encryption_types) >= 0);
+		vp->vp_uint32 = inst->require_strong ? 4 : 6;
+	} /* else we weren't asked to use MPPE */
+
+finish:
+	if (auth_ctx->ephemeral) TALLOC_FREE(auth_ctx->nt_password);
+
+	RETURN_MODULE_RCODE(rcode);
+}
+
+/** Continue an authentication once an ntlm_auth helper has replied
+ *
+ */
+static unlang_action_t mod_authenticate_resume(rlm_rcode_t *p_result, UNUSED module_ctx_t const *mctx,
+					       request_t *request, void *rctx)
+{
+	mschap_auth_ctx_t		*auth_ctx = talloc_get_type_abort(rctx, mschap_auth_ctx_t);
+	mschap_ntlm_helper_request_t	*hreq = &auth_ctx->hreq;
+
+	if (hreq->ex.error) {
+		strlcpy(hreq->error, hreq->ex.error, sizeof(hreq->error));
+		return mschap_auth_finish(p_result, auth_ctx, request, mschap_ntlm_auth_error(request, hreq->error));
+	}
+
+	if (!hreq->authenticated) {
+		if (!hreq->error[0]) strlcpy(hreq->error, "Authentication failed", sizeof(hreq->error));
+		return mschap_auth_finish(p_result, auth_ctx, request, mschap_ntlm_auth_error(request, hreq->error));
+	}
+
+	if (hreq->have_key) memcpy(auth_ctx->nthashhash, hreq->nthashhash, NT_DIGEST_LENGTH);
+
+	return mschap_auth_finish(p_result, auth_ctx, request, 0);
+}
+
+/** Stop waiting for an ntlm_auth helper if the request is cancelled
+ *
+ */
+static void mod_authenticate_signal(UNUSED module_ctx_t const *mctx, UNUSED request_t *request,
+				    void *rctx, fr_state_signal_t action)
+{
+	mschap_auth_ctx_t	*auth_ctx = talloc_get_type_abort(rctx, mschap_auth_ctx_t);
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	mschap_ntlm_helper_cancel(auth_ctx->thread, &auth_ctx->hreq);
+}
+
+/** Check a response, either directly, or by passing it to an ntlm_auth helper
+ *
+ * @param[out] p_result		The result of the authentication.
+ * @param[in] auth_ctx		State of the authentication.
+ * @param[in] request		The current request.
+ * @param[in] challenge		8 octet MS-CHAPv1 challenge.
+ * @param[in] response		24 octet NT-Response.
+ */
+static unlang_action_t mschap_do_mschap(rlm_rcode_t *p_result, mschap_auth_ctx_t *auth_ctx, request_t *request,
+					uint8_t const *challenge, uint8_t const *response)
+{
+	rlm_mschap_t const		*inst = auth_ctx->inst;
+	mschap_ntlm_helper_request_t	*hreq = &auth_ctx->hreq;
+	fr_cred_cache_t			*cache = auth_ctx->thread->cache;
+
+	/*
+	 *	If the same response to the same challenge was
+	 *	recently checked, reuse the result.
+	 *
+	 *	The response can't be checked without the challenge
+	 *	it was calculated from, so the key has to include
+	 *	both.  Only repeated responses (i.e. retransmits,
+	 *	and clients retrying in a loop) are found.
+	 */
+	if (cache) {
+		fr_pair_t	*user_name = fr_pair_find_by_da(&request->request_pairs, attr_user_name, 0);
+		uint8_t		cred[8 + 24];
+		uint8_t const	*data;
+		size_t		data_len;
+
+		memcpy(cred, challenge, 8);
+		memcpy(cred + 8, response, 24);
+
+		fr_cred_cache_key(&auth_ctx->cache_key, cache, auth_ctx->mschap_version,
+				  user_name ? (uint8_t const *)user_name->vp_strvalue : NULL,
+				  user_name ? user_name->vp_length : 0,
+				  cred, sizeof(cred),
+				  auth_ctx->nt_password ? auth_ctx->nt_password->vp_octets : NULL,
+				  auth_ctx->nt_password ? auth_ctx->nt_password->vp_length : 0);
+
+		switch (fr_cred_cache_find(&data, &data_len, cache, &auth_ctx->cache_key)) {
+		case FR_CRED_CACHE_VALID:
+			RDEBUG2("Response was recently verified, using cached result");
+			memset(auth_ctx->nthashhash, 0, NT_DIGEST_LENGTH);
+			if (data_len == NT_DIGEST_LENGTH) memcpy(auth_ctx->nthashhash, data, NT_DIGEST_LENGTH);
+			return mschap_auth_finish(p_result, auth_ctx, request, 0);
+
+		case FR_CRED_CACHE_INVALID:
+			REDEBUG("Response was recently rejected, using cached result");
+			return mschap_auth_finish(p_result, auth_ctx, request, -1);
+
+		case FR_CRED_CACHE_MISS:
+			auth_ctx->cache = true;
+			break;
+		}
+	}
+
+	if (auth_ctx->method != AUTH_NTLMAUTH_HELPER) {
+		return mschap_auth_finish(p_result, auth_ctx, request,
+					  do_mschap(inst, request, auth_ctx->nt_password, challenge,
+						    response, auth_ctx->nthashhash, auth_ctx->method));
+	}
+
+	memset(auth_ctx->nthashhash, 0, NT_DIGEST_LENGTH);
+
+	hreq->ex.request = request;
+	memcpy(hreq->challenge, challenge, sizeof(hreq->challenge));
+	memcpy(hreq->response, response, sizeof(hreq->response));
+
+	if (tmpl_aexpand(auth_ctx, &hreq->username, request, inst->ntlm_helper_username, NULL, NULL) < 0) {
+		RPEDEBUG("Failed expanding ntlm_auth_helper.username");
+		return mschap_auth_finish(p_result, auth_ctx, request, -1);
+	}
+
+	if (!inst->ntlm_helper_domain) {
+		MEM(hreq->domain = talloc_strdup(auth_ctx, ""));
+	} else if (tmpl_aexpand(auth_ctx, &hreq->domain, request, inst->ntlm_helper_domain, NULL, NULL) < 0) {
+		RPEDEBUG("Failed expanding ntlm_auth_helper.domain");
+		return mschap_auth_finish(p_result, auth_ctx, request, -1);
+	}
+
+	if (mschap_ntlm_helper_send(auth_ctx, auth_ctx->thread, hreq) < 0) {
+		return mschap_auth_finish(p_result, auth_ctx, request, mschap_ntlm_auth_error(request, hreq->error));
+	}
+
+	return unlang_module_yield(request, mod_authenticate_resume, mod_authenticate_signal, auth_ctx);
+}
+
+static unlang_action_t CC_HINT(nonnull) mschap_process_response(rlm_rcode_t *p_result,
+								mschap_auth_ctx_t *auth_ctx,
+								request_t *request)
+{
+	fr_pair_t		*challenge = auth_ctx->challenge;
+	fr_pair_t		*response = auth_ctx->response;
+
+	auth_ctx->mschap_version = 1;
 
 	RDEBUG2("Processing MS-CHAPv1 response");
 
@@ -1750,41 +2052,28 @@ static CC_HINT(nonnull(1,2,3,4,5,8,9)) unlang_action_t mschap_process_response(r
 		RETURN_MODULE_FAIL;
 	}
 
-	offset = 26;
-
 	/*
 	 *	Do the MS-CHAP authentication.
 	 */
-	mschap_result = do_mschap(inst, request, nt_password, challenge->vp_octets,
-				  response->vp_octets + offset, nthashhash, method);
-
-	/*
-	 *	Check for errors, and add MSCHAP-Error if necessary.
-	 */
-	return mschap_error(p_result, inst, request, *response->vp_octets, mschap_result, *mschap_version, smb_ctrl);
+	return mschap_do_mschap(p_result, auth_ctx, request, challenge->vp_octets, response->vp_octets + 26);
 }
 
-static unlang_action_t CC_HINT(nonnull(1,2,3,4,5,8,9)) mschap_process_v2_response(rlm_rcode_t *p_result,
-										  int *mschap_version,
-									    	  uint8_t nthashhash[static NT_DIGEST_LENGTH],
-									    	  rlm_mschap_t const *inst,
-									    	  request_t *request,
-									    	  fr_pair_t *smb_ctrl,
-									   	  fr_pair_t *nt_password,
-									    	  fr_pair_t *challenge,
-									    	  fr_pair_t *response,
-									    	  MSCHAP_AUTH_METHOD method)
+static unlang_action_t CC_HINT(nonnull) mschap_process_v2_response(rlm_rcode_t *p_result,
+								   mschap_auth_ctx_t *auth_ctx,
+								   request_t *request)
 {
-		uint8_t		mschap_challenge[16];
-		fr_pair_t	*user_name, *name_vp, *response_name, *peer_challenge_attr;
-		uint8_t const	*peer_challenge;
-		char const	*username_str;
-		size_t		username_len;
-		int		mschap_result;
-		rlm_rcode_t	rcode;
-		char		msch2resp[42];
+		rlm_mschap_t const	*inst = auth_ctx->inst;
+		fr_pair_t		*challenge = auth_ctx->challenge;
+		fr_pair_t		*response = auth_ctx->response;
+		uint8_t			mschap_challenge[16];
+		fr_pair_t		*user_name, *name_vp, *response_name, *peer_challenge_attr;
+		char const		*username_str;
+		size_t			username_len;
+#ifdef __APPLE__
+		rlm_rcode_t		rcode;
+#endif
 
-		*mschap_version = 2;
+		auth_ctx->mschap_version = 2;
 
 		RDEBUG2("Processing MS-CHAPv2 response");
 
@@ -1851,18 +2140,18 @@ static unlang_action_t CC_HINT(nonnull(1,2,3,4,5,8,9)) mschap_process_v2_respons
 		 *  indicates the auth process should continue directly to AD.
 		 *  Otherwise OD will determine auth success/fail.
 		 */
-		if (!nt_password && inst->open_directory) {
+		if (!auth_ctx->nt_password && inst->open_directory) {
 			RDEBUG2("No NT-Password available. Trying OpenDirectory Authentication");
 			rcode = od_mschap_auth(request, challenge, user_name);
 			if (rcode != RLM_MODULE_NOOP) RETURN_MODULE_RCODE(rcode);
 		}
 #endif
-		peer_challenge = response->vp_octets + 2;
+		auth_ctx->peer_challenge = response->vp_octets + 2;
 
 		peer_challenge_attr = fr_pair_find_by_da(&request->control_pairs, attr_ms_chap_peer_challenge, 0);
 		if (peer_challenge_attr) {
 			RDEBUG2("Overriding peer challenge");
-			peer_challenge = peer_challenge_attr->vp_octets;
+			auth_ctx->peer_challenge = peer_challenge_attr->vp_octets;
 		}
 
 		/*
@@ -1875,44 +2164,14 @@ static unlang_action_t CC_HINT(nonnull(1,2,3,4,5,8,9)) mschap_process_v2_respons
 		RDEBUG2("Creating challenge with username \"%pV\"",
 			fr_box_strvalue_len(username_str, username_len));
 		mschap_challenge_hash(mschap_challenge,		/* resulting challenge */
-				      peer_challenge,			/* peer challenge */
+				      auth_ctx->peer_challenge,	/* peer challenge */
 				      challenge->vp_octets,		/* our challenge */
 				      username_str, username_len);	/* user name */
 
-		mschap_result = do_mschap(inst, request, nt_password, mschap_challenge,
-					  response->vp_octets + 26, nthashhash, method);
+		auth_ctx->username_str = username_str;
+		auth_ctx->username_len = username_len;
 
-		/*
-		 *	Check for errors, and add MSCHAP-Error if necessary.
-		 */
-		mschap_error(&rcode, inst, request, *response->vp_octets,
-			     mschap_result, *mschap_version, smb_ctrl);
-		if (rcode != RLM_MODULE_OK) RETURN_MODULE_RCODE(rcode);
-
-#ifdef WITH_AUTH_WINBIND
-		if (inst->wb_retry_with_normalised_username) {
-			response_name = fr_pair_find_by_da(&request->request_pairs, attr_ms_chap_user_name, 0);
-			if (response_name) {
-				if (strcmp(username_str, response_name->vp_strvalue)) {
-					RDEBUG2("Normalising username %pV -> %pV",
-						fr_box_strvalue_len(username_str, username_len),
-						&response_name->data);
-					username_str = response_name->vp_strvalue;
-				}
-			}
-		}
-#endif
-
-		mschap_auth_response(username_str,		/* without the domain */
-				     username_len,		/* Length of username str */
-				     nthashhash,		/* nt-hash-hash */
-				     response->vp_octets + 26,	/* peer response */
-				     peer_challenge,		/* peer challenge */
-				     challenge->vp_octets,	/* our challenge */
-				     msch2resp);		/* calculated MPPE key */
-		mschap_add_reply(request, *response->vp_octets, attr_ms_chap2_success, msch2resp, 42);
-
-		RETURN_MODULE_OK;
+		return mschap_do_mschap(p_result, auth_ctx, request, mschap_challenge, response->vp_octets + 26);
 }
 
 /*
@@ -1938,12 +2197,12 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 	fr_pair_t		*response = NULL;
 	fr_pair_t		*cpw = NULL;
 	fr_pair_t		*nt_password = NULL, *smb_ctrl;
-	uint8_t			nthashhash[NT_DIGEST_LENGTH];
-	int			mschap_version = 0;
+	mschap_auth_ctx_t	*auth_ctx;
 
 	MSCHAP_AUTH_METHOD	method;
 	bool			ephemeral = false;
 	rlm_rcode_t		rcode = RLM_MODULE_OK;
+	unlang_action_t		ua;
 
 	/*
 	 *	If we have ntlm_auth configured, use it unless told
@@ -2042,78 +2301,42 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 		goto finish;
 	}
 
+	MEM(auth_ctx = talloc_zero(unlang_interpret_frame_talloc_ctx(request), mschap_auth_ctx_t));
+	auth_ctx->inst = inst;
+	auth_ctx->thread = talloc_get_type_abort(mctx->thread, rlm_mschap_thread_t);
+	auth_ctx->method = method;
+	auth_ctx->smb_ctrl = smb_ctrl;
+	auth_ctx->nt_password = nt_password;
+	auth_ctx->ephemeral = ephemeral;
+	auth_ctx->challenge = challenge;
+
 	/*
 	 *	We also require an MS-CHAP-Response.
 	 */
 	if ((response = fr_pair_find_by_da(&request->request_pairs, attr_ms_chap_response, 0))) {
-		mschap_process_response(&rcode,
-					&mschap_version, nthashhash,
-					inst, request,
-					smb_ctrl, nt_password,
-					challenge, response,
-					method);
-		if (rcode != RLM_MODULE_OK) goto finish;
+		auth_ctx->response = response;
+		ua = mschap_process_response(&rcode, auth_ctx, request);
 	} else if ((response = fr_pair_find_by_da(&request->request_pairs, attr_ms_chap2_response, 0))) {
-		mschap_process_v2_response(&rcode,
-					   &mschap_version, nthashhash,
-					   inst, request,
-					   smb_ctrl, nt_password,
-					   challenge, response,
-					   method);
-		if (rcode != RLM_MODULE_OK) goto finish;
+		auth_ctx->response = response;
+		ua = mschap_process_v2_response(&rcode, auth_ctx, request);
 	} else {		/* Neither CHAPv1 or CHAPv2 response: die */
 		REDEBUG("&control.Auth-Type = %s set for a request that does not contain &%s or &%s attributes",
 			inst->name, attr_ms_chap_response->name, attr_ms_chap2_response->name);
+		talloc_free(auth_ctx);
 		rcode = RLM_MODULE_INVALID;
 		goto finish;
 	}
 
-	/* now create MPPE attributes */
-	if (inst->use_mppe) {
-		fr_pair_t	*vp;
-		uint8_t		mppe_sendkey[34];
-		uint8_t		mppe_recvkey[34];
-
-		switch (mschap_version) {
-		case 1:
-			RDEBUG2("Generating MS-CHAPv1 MPPE keys");
-			memset(mppe_sendkey, 0, 32);
-
-			/*
-			 *	According to RFC 2548 we
-			 *	should send NT hash.  But in
-			 *	practice it doesn't work.
-			 *	Instead, we should send nthashhash
-			 *
-			 *	This is an error in RFC 2548.
-			 */
-			/*
-			 *	do_mschap cares to zero nthashhash if NT hash
-			 *	is not available.
-			 */
-			memcpy(mppe_sendkey + 8, nthashhash, NT_DIGEST_LENGTH);
-			mppe_add_reply(inst, request, attr_ms_chap_mppe_keys, mppe_sendkey, 24);	//-V666
-			break;
-
-		case 2:
-			RDEBUG2("Generating MS-CHAPv2 MPPE keys");
-			mppe_chap2_gen_keys128(nthashhash, response->vp_octets + 26, mppe_sendkey, mppe_recvkey);
-
-			mppe_add_reply(inst, request, attr_ms_mppe_recv_key, mppe_recvkey, 16);
-			mppe_add_reply(inst, request, attr_ms_mppe_send_key, mppe_sendkey, 16);
-			break;
-
-		default:
-			fr_assert(0);
-			break;
-		}
+	/*
+	 *	Waiting for an ntlm_auth helper, the rest
+	 *	is done by mod_authenticate_resume().
+	 */
+	if (ua == UNLANG_ACTION_YIELD) return ua;
 
-		MEM(pair_update_reply(&vp, attr_ms_mppe_encryption_policy) >= 0);
-		vp->vp_uint32 = inst->require_encryption ? 2 : 1;
+	if (auth_ctx->ephemeral) TALLOC_FREE(auth_ctx->nt_password);
+	talloc_free(auth_ctx);
 
-		MEM(pair_update_reply(&vp, attr_ms_mppe_encryption_types) >= 0);
-		vp->vp_uint32 = inst->require_strong ? 4 : 6;
-	} /* else we weren't asked to use MPPE */
+	RETURN_MODULE_RCODE(rcode);
 
 finish:
 	if (ephemeral) TALLOC_FREE(nt_password);
@@ -2160,6 +2383,21 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		inst->method = AUTH_NTLMAUTH_EXEC;
 	}
 
+	/* ...unless we have persistent helpers */
+	if (inst->ntlm_helper) {
+		if (!inst->ntlm_helper_username) {
+			cf_log_err(conf, "'ntlm_auth_helper.username' must be set when using 'ntlm_auth_helper.program'");
+			return -1;
+		}
+
+		if (inst->ntlm_helper_max < 1) {
+			cf_log_err(conf, "'ntlm_auth_helper.max' must be at least 1");
+			return -1;
+		}
+
+		inst->method = AUTH_NTLMAUTH_HELPER;
+	}
+
 	switch (inst->method) {
 	case AUTH_INTERNAL:
 		DEBUG("Using internal authentication");
@@ -2167,6 +2405,9 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	case AUTH_NTLMAUTH_EXEC:
 		DEBUG("Authenticating by calling 'ntlm_auth'");
 		break;
+	case AUTH_NTLMAUTH_HELPER:
+		DEBUG("Authenticating with up to %u 'ntlm_auth' helpers per thread", inst->ntlm_helper_max);
+		break;
 #ifdef WITH_AUTH_WINBIND
 	case AUTH_WBCLIENT:
 		DEBUG("Authenticating directly to winbind");
@@ -2194,6 +2435,35 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	return 0;
 }
 
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_mschap_t const	*inst = talloc_get_type_abort(instance, rlm_mschap_t);
+	rlm_mschap_thread_t	*t = talloc_get_type_abort(thread, rlm_mschap_thread_t);
+
+	t->inst = inst;
+	t->el = el;
+	if (mschap_ntlm_helper_thread_init(t, el) < 0) return -1;
+
+	if (fr_cred_cache_enabled(&inst->cache_conf)) {
+		t->cache = fr_cred_cache_alloc(t, &inst->cache_conf);
+		if (!t->cache) {
+			ERROR("Failed allocating response cache");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_mschap_thread_t	*t = talloc_get_type_abort(thread, rlm_mschap_thread_t);
+
+	TALLOC_FREE(t->helpers);
+
+	return 0;
+}
+
 static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 {
 	char const		*name;
@@ -2240,6 +2510,10 @@ module_t rlm_mschap = {
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
 	.detach		= mod_detach,
+	.thread_inst_size	= sizeof(rlm_mschap_thread_t),
+	.thread_inst_type	= "rlm_mschap_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach	= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize
@@ -13,9 +13,10 @@ RCSIDH(rlm_mschap_h, "$Id$")
 /* Method of authentication we are going to use */
 typedef enum {
 	AUTH_INTERNAL		= 0,
-	AUTH_NTLMAUTH_EXEC	= 1
+	AUTH_NTLMAUTH_EXEC	= 1,
+	AUTH_NTLMAUTH_HELPER	= 2
 #ifdef WITH_AUTH_WINBIND
-	,AUTH_WBCLIENT       	= 2
+	,AUTH_WBCLIENT       	= 3
 #endif
 } MSCHAP_AUTH_METHOD;
 
@@ -62,6 +63,11 @@ typedef struct {
 
 	char const		*ntlm_auth;
 	fr_time_delta_t		ntlm_auth_timeout;
+	char const		*ntlm_helper;		//!< Command to start a persistent ntlm_auth helper.
+	tmpl_t			*ntlm_helper_username;	//!< Username to pass to the helper.
+	tmpl_t			*ntlm_helper_domain;	//!< Domain to pass to the helper.
+	uint32_t		ntlm_helper_max;	//!< Maximum number of helpers per thread.
+	fr_cred_cache_conf_t	cache_conf;		//!< Verified response cache configuration.
 	char const		*ntlm_cpw;
 	char const		*ntlm_cpw_username;
 	char const		*ntlm_cpw_domain;
@@ -80,3 +86,12 @@ typedef struct {
 	bool			open_directory;
 #endif
 } rlm_mschap_t;
+
+typedef struct {
+	rlm_mschap_t const	*inst;			//!< Instance of rlm_mschap.
+	fr_event_list_t		*el;			//!< This thread's event list.
+
+	fr_helper_pool_t	*helpers;		//!< ntlm_auth helpers.  NULL if not in use.
+
+	fr_cred_cache_t		*cache;			//!< Recently verified responses.  NULL if disabled.
+} rlm_mschap_thread_t;
@@ -26,21 +26,25 @@
 RCSID("$Id$")
 USES_APPLE_DEPRECATED_API
 
+#include <freeradius-devel/io/schedule.h>
 #include <freeradius-devel/server/base.h>
 #include <freeradius-devel/server/crypt.h>
 #include <freeradius-devel/server/module.h>
 #include <freeradius-devel/server/password.h>
 #include <freeradius-devel/tls/base.h>
+#include <freeradius-devel/unlang/interpret.h>
 
 #include <freeradius-devel/util/base64.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/util/hex.h>
 #include <freeradius-devel/util/md5.h>
+#include <freeradius-devel/util/misc.h>
 #include <freeradius-devel/util/sha1.h>
 
 #include <freeradius-devel/protocol/freeradius/freeradius.internal.password.h>
 
 #include <ctype.h>
+#include <pthread.h>
 
 #ifdef HAVE_OPENSSL_EVP_H
 #  include <openssl/evp.h>
@@ -53,16 +57,61 @@ USES_APPLE_DEPRECATED_API
  *      a lot cleaner to do so, and a pointer to the structure can
  *      be used as the instance handle.
  */
+typedef struct pap_hash_pool_s pap_hash_pool_t;
+
 typedef struct {
 	char const		*name;
 	fr_dict_enum_t		*auth_type;
 	bool			normify;
+
+	uint32_t		hash_threads;		//!< Number of threads in the hash pool.
+	uint32_t		hash_max_pending;	//!< Maximum number of jobs waiting for a hashing thread.
+	pap_hash_pool_t		*pool;			//!< Hash pool.  NULL if passwords are verified by the worker.
+
+	fr_cred_cache_conf_t	cache_conf;		//!< Verified password cache configuration.
 } rlm_pap_t;
 
+/** Per-worker data used to collect results from the hash pool
+ *
+ */
+typedef struct {
+	rlm_pap_t const		*inst;			//!< Instance of rlm_pap.
+	fr_event_list_t		*el;			//!< Event list of the worker.
+	int			pipe[2];		//!< Written to by hashing threads to wake the worker.
+	fr_dlist_head_t		done;			//!< Completed jobs.  Protected by the pool mutex.
+	uint32_t		num_running;		//!< Jobs queued or being hashed.  Protected by the pool mutex.
+	bool			detaching;		//!< Worker is waiting for its jobs to complete.
+
+	fr_cred_cache_t		*cache;			//!< Recently verified passwords.  NULL if disabled.
+} rlm_pap_thread_t;
+
+/** Threads used to verify expensive password hashes
+ *
+ */
+struct pap_hash_pool_s {
+	pthread_mutex_t		mutex;			//!< Protects the queue, and the completed lists of the workers.
+	pthread_cond_t		cond;			//!< Signalled when a job is queued, or the pool is stopped.
+	pthread_cond_t		idle;			//!< Signalled when a detaching worker's last job completes.
+	fr_dlist_head_t		queue;			//!< Jobs waiting for a hashing thread.
+	uint32_t		num_queued;		//!< Number of jobs in the queue.
+	bool			stop;			//!< Hashing threads should exit.
+
+	pthread_t		*pthreads;		//!< Hashing threads.
+	uint32_t		num_pthreads;		//!< Number of hashing threads started.
+};
+
 typedef unlang_action_t (*pap_auth_func_t)(rlm_rcode_t *p_result, rlm_pap_t const *inst, request_t *request, fr_pair_t const *, fr_pair_t const *);
 
+static const CONF_PARSER hash_pool_config[] = {
+	{ FR_CONF_OFFSET("threads", FR_TYPE_UINT32, rlm_pap_t, hash_threads), .dflt = "0" },
+	{ FR_CONF_OFFSET("max_pending", FR_TYPE_UINT32, rlm_pap_t, hash_max_pending), .dflt = "1024" },
+	CONF_PARSER_TERMINATOR
+};
+
 static const CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("normalise", FR_TYPE_BOOL, rlm_pap_t, normify), .dflt = "yes" },
+	{ FR_CONF_POINTER("hash_pool", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) hash_pool_config },
+	{ FR_CONF_OFFSET("cache", FR_TYPE_SUBSECTION, rlm_pap_t, cache_conf), .subcs = (void const *) fr_cred_cache_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -79,12 +128,14 @@ static fr_dict_attr_t const *attr_auth_type;
 static fr_dict_attr_t const *attr_root;
 
 static fr_dict_attr_t const *attr_user;
+static fr_dict_attr_t const *attr_user_name;
 
 static fr_dict_attr_autoload_t rlm_pap_dict_attr[] = {
 	{ .out = &attr_auth_type, .name = "Auth-Type", .type = FR_TYPE_UINT32, .dict = &dict_freeradius },
 	{ .out = &attr_root, .name = "Password", .type = FR_TYPE_TLV, .dict = &dict_freeradius },
 
 	{ .out = &attr_user, .name = "User-Password", .type = FR_TYPE_STRING, .dict = &dict_radius },
+	{ .out = &attr_user_name, .name = "User-Name", .type = FR_TYPE_STRING, .dict = &dict_radius },
 
 	{ NULL }
 };
@@ -111,6 +162,19 @@ static fr_table_num_sorted_t const pbkdf2_passlib_names[] = {
 	{ L("sha512"),		FR_SSHA2_512 }
 };
 static size_t pbkdf2_passlib_names_len = NUM_ELEMENTS(pbkdf2_passlib_names);
+
+/** A parsed PBKDF2-Password
+ *
+ */
+typedef struct {
+	EVP_MD const		*evp_md;		//!< Digest used for the HMAC.
+	int			digest_type;		//!< Password attribute number of the digest.
+	size_t			digest_len;		//!< Length of the digest.
+	uint32_t		iterations;		//!< Number of PBKDF2 iterations.
+	uint8_t			*salt;			//!< Decoded salt.
+	size_t			salt_len;		//!< Length of the salt.
+	uint8_t			hash[EVP_MAX_MD_SIZE];	//!< Decoded "known good" hash.
+} pap_pbkdf2_t;
 #endif
 
 static fr_dict_attr_t const **pap_alloweds;
@@ -167,16 +231,24 @@ static unlang_action_t CC_HINT(nonnull) pap_auth_clear(rlm_rcode_t *p_result,
 }
 
 #ifdef HAVE_CRYPT
-static unlang_action_t CC_HINT(nonnull) pap_auth_crypt(rlm_rcode_t *p_result,
-						       UNUSED rlm_pap_t const *inst, request_t *request,
-						       fr_pair_t const *known_good, fr_pair_t const *password)
+/** Convert the result of fr_crypt_check into a module rcode
+ *
+ */
+static unlang_action_t CC_HINT(nonnull) pap_crypt_result(rlm_rcode_t *p_result, request_t *request, int ret)
 {
-	if (fr_crypt_check(password->vp_strvalue, known_good->vp_strvalue) != 0) {
+	if (ret != 0) {
 		REDEBUG("Crypt digest does not match \"known good\" digest");
 		RETURN_MODULE_REJECT;
 	}
 	RETURN_MODULE_OK;
 }
+
+static unlang_action_t CC_HINT(nonnull) pap_auth_crypt(rlm_rcode_t *p_result,
+						       UNUSED rlm_pap_t const *inst, request_t *request,
+						       fr_pair_t const *known_good, fr_pair_t const *password)
+{
+	return pap_crypt_result(p_result, request, fr_crypt_check(password->vp_strvalue, known_good->vp_strvalue));
+}
 #endif
 
 static unlang_action_t CC_HINT(nonnull) pap_auth_md5(rlm_rcode_t *p_result,
@@ -389,9 +461,10 @@ PAP_AUTH_EVP_MD(pap_auth_evp_md_salted, pap_auth_ssha3_384, "SSHA3-384", EVP_sha
 PAP_AUTH_EVP_MD(pap_auth_evp_md_salted, pap_auth_ssha3_512, "SSHA3-512", EVP_sha3_512())
 #  endif
 
-/** Validates Crypt::PBKDF2 LDAP format strings
+/** Parse Crypt::PBKDF2 LDAP format strings
  *
- * @param[out] p_result		The result of comparing the pbkdf2 hash with the password.
+ * @param[in] ctx		to allocate the salt in.
+ * @param[out] out		Where to write the parsed digest, iterations, salt and hash.
  * @param[in] request		The current request.
  * @param[in] str		Raw PBKDF2 string.
  * @param[in] len		Length of string.
@@ -401,38 +474,24 @@ PAP_AUTH_EVP_MD(pap_auth_evp_md_salted, pap_auth_ssha3_512, "SSHA3-512", EVP_sha
  * @param[in] iter_sep		Separation character between the iterations and the next component.
  * @param[in] salt_sep		Separation character between the salt and the next component.
  * @param[in] iter_is_base64	Whether the iterations is are encoded as base64.
- * @param[in] password		to validate.
  * @return
- *	- RLM_MODULE_REJECT
- *	- RLM_MODULE_OK
+ *	- 0 on success.
+ *	- -1 if the string is malformed.
  */
-static inline CC_HINT(nonnull) unlang_action_t pap_auth_pbkdf2_parse(rlm_rcode_t *p_result,
-								     request_t *request, const uint8_t *str, size_t len,
-								     fr_table_num_sorted_t const hash_names[], size_t hash_names_len,
-								     char scheme_sep, char iter_sep, char salt_sep,
-								     bool iter_is_base64, fr_pair_t const *password)
+static inline CC_HINT(nonnull) int pap_pbkdf2_parse(TALLOC_CTX *ctx, pap_pbkdf2_t *out,
+						     request_t *request, const uint8_t *str, size_t len,
+						     fr_table_num_sorted_t const hash_names[], size_t hash_names_len,
+						     char scheme_sep, char iter_sep, char salt_sep,
+						     bool iter_is_base64)
 {
-	rlm_rcode_t		rcode = RLM_MODULE_INVALID;
-
 	uint8_t const		*p, *q, *end;
 	ssize_t			slen;
 
-	EVP_MD const		*evp_md;
-	int			digest_type;
-	size_t			digest_len;
-
-	uint32_t		iterations;
-
-	uint8_t			*salt = NULL;
-	size_t			salt_len;
-	uint8_t			hash[EVP_MAX_MD_SIZE];
-	uint8_t			digest[EVP_MAX_MD_SIZE];
-
 	RDEBUG2("Comparing with \"known-good\" PBKDF2-Password");
 
 	if (len <= 1) {
 		REDEBUG("PBKDF2-Password is too short");
-		goto finish;
+		return -1;
 	}
 
 	/*
@@ -444,73 +503,73 @@ static inline CC_HINT(nonnull) unlang_action_t pap_auth_pbkdf2_parse(rlm_rcode_t
 	q = memchr(p, scheme_sep, end - p);
 	if (!q) {
 		REDEBUG("PBKDF2-Password has no component separators");
-		goto finish;
+		return -1;
 	}
 
-	digest_type = fr_table_value_by_substr(hash_names, (char const *)p, q - p, -1);
-	switch (digest_type) {
+	out->digest_type = fr_table_value_by_substr(hash_names, (char const *)p, q - p, -1);
+	switch (out->digest_type) {
 	case FR_SSHA1:
-		evp_md = EVP_sha1();
-		digest_len = SHA1_DIGEST_LENGTH;
+		out->evp_md = EVP_sha1();
+		out->digest_len = SHA1_DIGEST_LENGTH;
 		break;
 
 	case FR_SSHA2_224:
-		evp_md = EVP_sha224();
-		digest_len = SHA224_DIGEST_LENGTH;
+		out->evp_md = EVP_sha224();
+		out->digest_len = SHA224_DIGEST_LENGTH;
 		break;
 
 	case FR_SSHA2_256:
-		evp_md = EVP_sha256();
-		digest_len = SHA256_DIGEST_LENGTH;
+		out->evp_md = EVP_sha256();
+		out->digest_len = SHA256_DIGEST_LENGTH;
 		break;
 
 	case FR_SSHA2_384:
-		evp_md = EVP_sha384();
-		digest_len = SHA384_DIGEST_LENGTH;
+		out->evp_md = EVP_sha384();
+		out->digest_len = SHA384_DIGEST_LENGTH;
 		break;
 
 	case FR_SSHA2_512:
-		evp_md = EVP_sha512();
-		digest_len = SHA512_DIGEST_LENGTH;
+		out->evp_md = EVP_sha512();
+		out->digest_len = SHA512_DIGEST_LENGTH;
 		break;
 
 #  if OPENSSL_VERSION_NUMBER >= 0x10101000L
 	case FR_SSHA3_224:
-		evp_md = EVP_sha3_224();
-		digest_len = SHA224_DIGEST_LENGTH;
+		out->evp_md = EVP_sha3_224();
+		out->digest_len = SHA224_DIGEST_LENGTH;
 		break;
 
 	case FR_SSHA3_256:
-		evp_md = EVP_sha3_256();
-		digest_len = SHA256_DIGEST_LENGTH;
+		out->evp_md = EVP_sha3_256();
+		out->digest_len = SHA256_DIGEST_LENGTH;
 		break;
 
 	case FR_SSHA3_384:
-		evp_md = EVP_sha3_384();
-		digest_len = SHA384_DIGEST_LENGTH;
+		out->evp_md = EVP_sha3_384();
+		out->digest_len = SHA384_DIGEST_LENGTH;
 		break;
 
 	case FR_SSHA3_512:
-		evp_md = EVP_sha3_512();
-		digest_len = SHA512_DIGEST_LENGTH;
+		out->evp_md = EVP_sha3_512();
+		out->digest_len = SHA512_DIGEST_LENGTH;
 		break;
 #  endif
 
 	default:
 		REDEBUG("Unknown PBKDF2 hash method \"%.*s\"", (int)(q - p), p);
-		goto finish;
+		return -1;
 	}
 
 	p = q + 1;
 
 	if (((end - p) < 1) || !(q = memchr(p, iter_sep, end - p))) {
 		REDEBUG("PBKDF2-Password missing iterations component");
-		goto finish;
+		return -1;
 	}
 
 	if ((q - p) == 0) {
 		REDEBUG("PBKDF2-Password iterations component too short");
-		goto finish;
+		return -1;
 	}
 
 	/*
@@ -522,12 +581,12 @@ static inline CC_HINT(nonnull) unlang_action_t pap_auth_pbkdf2_parse(rlm_rcode_t
 
 		strlcpy(iterations_buff, (char const *)p, (q - p) + 1);
 
-		iterations = strtoul(iterations_buff, &qq, 10);
+		out->iterations = strtoul(iterations_buff, &qq, 10);
 		if (*qq != '\0') {
 			REMARKER(iterations_buff, qq - iterations_buff,
 				 "PBKDF2-Password iterations field contains an invalid character");
 
-			goto finish;
+			return -1;
 		}
 		p = q + 1;
 	/*
@@ -535,102 +594,85 @@ static inline CC_HINT(nonnull) unlang_action_t pap_auth_pbkdf2_parse(rlm_rcode_t
 	 */
 	} else {
 		fr_strerror_clear();
-		slen = fr_base64_decode((uint8_t *)&iterations, sizeof(iterations), (char const *)p, q - p);
+		slen = fr_base64_decode((uint8_t *)&out->iterations, sizeof(out->iterations), (char const *)p, q - p);
 		if (slen < 0) {
 			RPEDEBUG("Failed decoding PBKDF2-Password iterations component (%.*s)", (int)(q - p), p);
-			goto finish;
+			return -1;
 		}
-		if (slen != sizeof(iterations)) {
+		if (slen != sizeof(out->iterations)) {
 			REDEBUG("Decoded PBKDF2-Password iterations component is wrong size");
 		}
 
-		iterations = ntohl(iterations);
+		out->iterations = ntohl(out->iterations);
 
 		p = q + 1;
 	}
 
 	if (((end - p) < 1) || !(q = memchr(p, salt_sep, end - p))) {
 		REDEBUG("PBKDF2-Password missing salt component");
-		goto finish;
+		return -1;
 	}
 
 	if ((q - p) == 0) {
 		REDEBUG("PBKDF2-Password salt component too short");
-		goto finish;
+		return -1;
 	}
 
-	MEM(salt = talloc_array(request, uint8_t, FR_BASE64_DEC_LENGTH(q - p)));
-	slen = fr_base64_decode(salt, talloc_array_length(salt), (char const *) p, q - p);
+	MEM(out->salt = talloc_array(ctx, uint8_t, FR_BASE64_DEC_LENGTH(q - p)));
+	slen = fr_base64_decode(out->salt, talloc_array_length(out->salt), (char const *) p, q - p);
 	if (slen < 0) {
 		RPEDEBUG("Failed decoding PBKDF2-Password salt component");
-		goto finish;
+		return -1;
 	}
-	salt_len = (size_t)slen;
+	out->salt_len = (size_t)slen;
 
 	p = q + 1;
 
 	if ((q - p) == 0) {
 		REDEBUG("PBKDF2-Password hash component too short");
-		goto finish;
+		return -1;
 	}
 
-	slen = fr_base64_decode(hash, sizeof(hash), (char const *)p, end - p);
+	slen = fr_base64_decode(out->hash, sizeof(out->hash), (char const *)p, end - p);
 	if (slen < 0) {
 		RPEDEBUG("Failed decoding PBKDF2-Password hash component");
-		goto finish;
+		return -1;
 	}
 
-	if ((size_t)slen != digest_len) {
+	if ((size_t)slen != out->digest_len) {
 		REDEBUG("PBKDF2-Password hash component length is incorrect for hash type, expected %zu, got %zd",
-			digest_len, slen);
+			out->digest_len, slen);
 
-		RHEXDUMP2(hash, slen, "hash component");
+		RHEXDUMP2(out->hash, slen, "hash component");
 
-		goto finish;
+		return -1;
 	}
 
 	RDEBUG2("PBKDF2 %s: Iterations %u, salt length %zu, hash length %zd",
-		fr_table_str_by_value(pbkdf2_crypt_names, digest_type, "<UNKNOWN>"),
-		iterations, salt_len, slen);
-
-	/*
-	 *	Hash and compare
-	 */
-	if (PKCS5_PBKDF2_HMAC((char const *)password->vp_octets, (int)password->vp_length,
-			      (unsigned char const *)salt, (int)salt_len,
-			      (int)iterations,
-			      evp_md,
-			      (int)digest_len, (unsigned char *)digest) == 0) {
-		REDEBUG("PBKDF2 digest failure");
-		goto finish;
-	}
-
-	if (fr_digest_cmp(digest, hash, (size_t)digest_len) != 0) {
-		REDEBUG("PBKDF2 digest does not match \"known good\" digest");
-		REDEBUG3("Salt       : %pH", fr_box_octets(salt, salt_len));
-		REDEBUG3("Calculated : %pH", fr_box_octets(digest, digest_len));
-		REDEBUG3("Expected   : %pH", fr_box_octets(hash, slen));
-		rcode = RLM_MODULE_REJECT;
-	} else {
-		rcode = RLM_MODULE_OK;
-	}
+		fr_table_str_by_value(pbkdf2_crypt_names, out->digest_type, "<UNKNOWN>"),
+		out->iterations, out->salt_len, slen);
 
-finish:
-	talloc_free(salt);
-
-	RETURN_MODULE_RCODE(rcode);
+	return 0;
 }
 
-static inline unlang_action_t CC_HINT(nonnull) pap_auth_pbkdf2(rlm_rcode_t *p_result,
-							       UNUSED rlm_pap_t const *inst,
-							       request_t *request,
-							       fr_pair_t const *known_good, fr_pair_t const *password)
+/** Determine the format of a PBKDF2-Password, and parse it
+ *
+ * @param[in] ctx		to allocate the salt in.
+ * @param[out] out		Where to write the parsed digest, iterations, salt and hash.
+ * @param[in] request		The current request.
+ * @param[in] known_good	PBKDF2-Password to parse.
+ * @return
+ *	- 0 on success.
+ *	- -1 if the format is unknown, or the string is malformed.
+ */
+static int CC_HINT(nonnull) pap_pbkdf2_decode(TALLOC_CTX *ctx, pap_pbkdf2_t *out,
+					      request_t *request, fr_pair_t const *known_good)
 {
 	uint8_t const *p = known_good->vp_octets, *q, *end = p + known_good->vp_length;
 
 	if (end - p < 2) {
 		REDEBUG("PBKDF2-Password too short");
-		RETURN_MODULE_INVALID;
+		return -1;
 	}
 
 	/*
@@ -647,9 +689,9 @@ static inline unlang_action_t CC_HINT(nonnull) pap_auth_pbkdf2(rlm_rcode_t *p_re
 			q = memchr(p, '}', end - p);
 			p = q + 1;
 		}
-		return pap_auth_pbkdf2_parse(p_result, request, p, end - p,
-					     pbkdf2_crypt_names, pbkdf2_crypt_names_len,
-					     ':', ':', ':', true, password);
+		return pap_pbkdf2_parse(ctx, out, request, p, end - p,
+					pbkdf2_crypt_names, pbkdf2_crypt_names_len,
+					':', ':', ':', true);
 	}
 
 	/*
@@ -659,9 +701,9 @@ static inline unlang_action_t CC_HINT(nonnull) pap_auth_pbkdf2(rlm_rcode_t *p_re
 	 */
 	if ((size_t)(end - p) >= sizeof("$PBKDF2$") && (memcmp(p, "$PBKDF2$", sizeof("$PBKDF2$") - 1) == 0)) {
 		p += sizeof("$PBKDF2$") - 1;
-		return pap_auth_pbkdf2_parse(p_result, request, p, end - p,
-					     pbkdf2_crypt_names, pbkdf2_crypt_names_len,
-					     ':', ':', '$', false, password);
+		return pap_pbkdf2_parse(ctx, out, request, p, end - p,
+					pbkdf2_crypt_names, pbkdf2_crypt_names_len,
+					':', ':', '$', false);
 	}
 
 	/*
@@ -673,14 +715,83 @@ static inline unlang_action_t CC_HINT(nonnull) pap_auth_pbkdf2(rlm_rcode_t *p_re
 	 */
 	if ((size_t)(end - p) >= sizeof("$pbkdf2-") && (memcmp(p, "$pbkdf2-", sizeof("$pbkdf2-") - 1) == 0)) {
 		p += sizeof("$pbkdf2-") - 1;
-		return pap_auth_pbkdf2_parse(p_result, request, p, end - p,
-					     pbkdf2_passlib_names, pbkdf2_passlib_names_len,
-					     '$', '$', '$', false, password);
+		return pap_pbkdf2_parse(ctx, out, request, p, end - p,
+					pbkdf2_passlib_names, pbkdf2_passlib_names_len,
+					'$', '$', '$', false);
 	}
 
 	REDEBUG("Can't determine format of PBKDF2-Password");
 
-	RETURN_MODULE_INVALID;
+	return -1;
+}
+
+/** Hash the password using a parsed PBKDF2-Password, and compare the result
+ *
+ * Does no logging, and touches no request data, so may be called from the hash pool.
+ *
+ * @param[in] pbkdf2		Parsed PBKDF2-Password.
+ * @param[out] digest		Where to write the calculated digest.
+ * @param[in] password		to validate.
+ * @param[in] password_len	Length of the password.
+ * @return
+ *	- 0 if the password matches.
+ *	- 1 if the password does not match.
+ *	- -1 if the digest could not be calculated.
+ */
+static int pap_pbkdf2_hash(pap_pbkdf2_t const *pbkdf2, uint8_t digest[EVP_MAX_MD_SIZE],
+			   uint8_t const *password, size_t password_len)
+{
+	if (PKCS5_PBKDF2_HMAC((char const *)password, (int)password_len,
+			      (unsigned char const *)pbkdf2->salt, (int)pbkdf2->salt_len,
+			      (int)pbkdf2->iterations,
+			      pbkdf2->evp_md,
+			      (int)pbkdf2->digest_len, (unsigned char *)digest) == 0) return -1;
+
+	return (fr_digest_cmp(digest, pbkdf2->hash, pbkdf2->digest_len) != 0);
+}
+
+/** Convert the result of pap_pbkdf2_hash into a module rcode
+ *
+ */
+static unlang_action_t CC_HINT(nonnull) pap_pbkdf2_result(rlm_rcode_t *p_result, request_t *request,
+							  pap_pbkdf2_t const *pbkdf2, uint8_t const *digest, int ret)
+{
+	switch (ret) {
+	case 0:
+		RETURN_MODULE_OK;
+
+	case 1:
+		REDEBUG("PBKDF2 digest does not match \"known good\" digest");
+		REDEBUG3("Salt       : %pH", fr_box_octets(pbkdf2->salt, pbkdf2->salt_len));
+		REDEBUG3("Calculated : %pH", fr_box_octets(digest, pbkdf2->digest_len));
+		REDEBUG3("Expected   : %pH", fr_box_octets(pbkdf2->hash, pbkdf2->digest_len));
+		RETURN_MODULE_REJECT;
+
+	default:
+		REDEBUG("PBKDF2 digest failure");
+		RETURN_MODULE_INVALID;
+	}
+}
+
+static inline unlang_action_t CC_HINT(nonnull) pap_auth_pbkdf2(rlm_rcode_t *p_result,
+							       UNUSED rlm_pap_t const *inst,
+							       request_t *request,
+							       fr_pair_t const *known_good, fr_pair_t const *password)
+{
+	pap_pbkdf2_t		pbkdf2 = { .salt = NULL };
+	uint8_t			digest[EVP_MAX_MD_SIZE];
+	unlang_action_t		ua;
+
+	if (pap_pbkdf2_decode(request, &pbkdf2, request, known_good) < 0) {
+		talloc_free(pbkdf2.salt);
+		RETURN_MODULE_INVALID;
+	}
+
+	ua = pap_pbkdf2_result(p_result, request, &pbkdf2, digest,
+			       pap_pbkdf2_hash(&pbkdf2, digest, password->vp_octets, password->vp_length));
+	talloc_free(pbkdf2.salt);
+
+	return ua;
 }
 #endif
 
@@ -865,17 +976,412 @@ static const pap_auth_func_t auth_func_table[] = {
 #endif	/* HAVE_OPENSSL_EVP_H */
 };
 
+/** Log the result of the authentication
+ *
+ */
+static void pap_auth_log(request_t *request, rlm_rcode_t rcode)
+{
+	switch (rcode) {
+	case RLM_MODULE_REJECT:
+		REDEBUG("Password incorrect");
+		break;
+
+	case RLM_MODULE_OK:
+		RDEBUG2("User authenticated successfully");
+		break;
+
+	default:
+		break;
+	}
+}
+
+/** Calculate the cache key for a User-Password and "known good" password
+ *
+ */
+static void pap_cache_key(fr_cred_cache_key_t *key, rlm_pap_thread_t *t, request_t *request,
+			  fr_pair_t const *known_good, fr_pair_t const *password)
+{
+	fr_pair_t	*user_name;
+
+	user_name = fr_pair_find_by_da(&request->request_pairs, attr_user_name, 0);
+
+	fr_cred_cache_key(key, t->cache, known_good->da->attr,
+			  user_name ? (uint8_t const *)user_name->vp_strvalue : NULL,
+			  user_name ? user_name->vp_length : 0,
+			  password->vp_octets, password->vp_length,
+			  known_good->vp_octets, known_good->vp_length);
+}
+
+/** Remember the result of verifying a password
+ *
+ * Only definite results are cached, not failures to verify.
+ */
+static void pap_cache_insert(rlm_pap_thread_t *t, fr_cred_cache_key_t const *key, rlm_rcode_t rcode)
+{
+	switch (rcode) {
+	case RLM_MODULE_OK:
+		fr_cred_cache_insert(t->cache, key, true, NULL, 0);
+		break;
+
+	case RLM_MODULE_REJECT:
+		fr_cred_cache_insert(t->cache, key, false, NULL, 0);
+		break;
+
+	default:
+		break;
+	}
+}
+
+/*
+ *	Hash pool
+ *
+ *	PBKDF2 with a large number of iterations, and the more
+ *	expensive crypt schemes (bcrypt, sha512-crypt) can take
+ *	tens or hundreds of milliseconds to verify.  When a hash
+ *	pool is configured, those verifications are performed by a
+ *	small set of dedicated threads, and the request yields until
+ *	the result is posted back to the worker.
+ *
+ *	The pool, and the list of completed jobs for each worker are
+ *	protected by pool->mutex.  Hashing threads wake the worker by
+ *	writing to a pipe which is serviced by the worker's event loop.
+ */
+typedef enum {
+	PAP_HASH_JOB_QUEUED = 0,			//!< Waiting for a hashing thread.
+	PAP_HASH_JOB_RUNNING,				//!< Being hashed.
+	PAP_HASH_JOB_COMPLETE,				//!< In the worker's list of completed jobs.
+	PAP_HASH_JOB_DONE				//!< Collected by the worker.
+} pap_hash_job_state_t;
+
+/** Password verification to be performed by the hash pool
+ *
+ * Contains copies of everything needed to verify the password, as
+ * the request may be cancelled while the job is being hashed.
+ */
+typedef struct {
+	fr_dlist_t		entry;			//!< Entry in the pool queue, or the worker's completed list.
+	pap_hash_job_state_t	state;			//!< Where the job is.
+	rlm_pap_thread_t	*thread;		//!< Worker the job belongs to.
+	request_t		*request;		//!< Request to resume.  NULL if it was cancelled.
+
+	unsigned int		attr;			//!< Type of "known good" password.
+	char			*password;		//!< Copy of the User-Password.
+	size_t			password_len;		//!< Length of the User-Password.
+#ifdef HAVE_CRYPT
+	char			*known_good;		//!< Copy of the Crypt-Password.
+#endif
+#ifdef HAVE_OPENSSL_EVP_H
+	pap_pbkdf2_t		pbkdf2;			//!< Parsed PBKDF2-Password.
+	uint8_t			digest[EVP_MAX_MD_SIZE];	//!< Calculated PBKDF2 digest.
+#endif
+	int			ret;			//!< 0 on match, 1 on mismatch, -1 on error.
+
+	bool			cache;			//!< Whether the result should be cached.
+	fr_cred_cache_key_t	cache_key;		//!< Key for caching the result.
+} pap_hash_job_t;
+
+/** Whether verification of a password type is worth passing to the hash pool
+ *
+ */
+static inline bool pap_hash_offload_attr(unsigned int attr)
+{
+	switch (attr) {
+#ifdef HAVE_CRYPT
+	case FR_CRYPT:
+		return true;
+#endif
+#ifdef HAVE_OPENSSL_EVP_H
+	case FR_PBKDF2:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+/** Verify the password
+ *
+ * Called from a hashing thread, or from the worker if the queue is full.
+ */
+static void pap_hash_job_run(pap_hash_job_t *job)
+{
+	switch (job->attr) {
+#ifdef HAVE_CRYPT
+	case FR_CRYPT:
+		job->ret = (fr_crypt_check(job->password, job->known_good) != 0);
+		break;
+#endif
+#ifdef HAVE_OPENSSL_EVP_H
+	case FR_PBKDF2:
+		job->ret = pap_pbkdf2_hash(&job->pbkdf2, job->digest,
+					   (uint8_t const *)job->password, job->password_len);
+		break;
+#endif
+	default:
+		job->ret = -1;
+		break;
+	}
+}
+
+/** Convert the result of a job into a module rcode
+ *
+ */
+static unlang_action_t CC_HINT(nonnull) pap_hash_job_result(rlm_rcode_t *p_result, request_t *request,
+							    pap_hash_job_t const *job)
+{
+	switch (job->attr) {
+#ifdef HAVE_CRYPT
+	case FR_CRYPT:
+		return pap_crypt_result(p_result, request, job->ret);
+#endif
+#ifdef HAVE_OPENSSL_EVP_H
+	case FR_PBKDF2:
+		return pap_pbkdf2_result(p_result, request, &job->pbkdf2, job->digest, job->ret);
+#endif
+	default:
+		fr_assert(0);
+		RETURN_MODULE_FAIL;
+	}
+}
+
+/** Main loop of a hashing thread
+ *
+ */
+static void *pap_hash_pool_thread(void *arg)
+{
+	pap_hash_pool_t		*pool = arg;
+	pap_hash_job_t		*job;
+	rlm_pap_thread_t	*t;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (;;) {
+		while (!pool->stop && !(job = fr_dlist_head(&pool->queue))) pthread_cond_wait(&pool->cond, &pool->mutex);
+		if (pool->stop) break;
+
+		fr_dlist_remove(&pool->queue, job);
+		pool->num_queued--;
+		job->state = PAP_HASH_JOB_RUNNING;
+		pthread_mutex_unlock(&pool->mutex);
+
+		pap_hash_job_run(job);
+
+		pthread_mutex_lock(&pool->mutex);
+		t = job->thread;
+
+		/*
+		 *	Only wake the worker if it doesn't already
+		 *	have completed jobs to collect.  If the pipe
+		 *	is full, a wakeup is already pending.
+		 */
+		if (fr_dlist_empty(&t->done) && (write(t->pipe[1], "", 1) < 0)) {
+			fr_assert(errno == EAGAIN);
+		}
+		job->state = PAP_HASH_JOB_COMPLETE;
+		fr_dlist_insert_tail(&t->done, job);
+
+		if ((--t->num_running == 0) && t->detaching) pthread_cond_broadcast(&pool->idle);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+/** Stop the hashing threads and wait for them to exit
+ *
+ */
+static void pap_hash_pool_stop(pap_hash_pool_t *pool)
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->num_pthreads; i++) pthread_join(pool->pthreads[i], NULL);
+
+	pthread_cond_destroy(&pool->idle);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->mutex);
+}
+
+/** Collect completed jobs, and resume their requests
+ *
+ */
+static void pap_hash_pool_read(UNUSED fr_event_list_t *el, int fd, UNUSED int flags, void *uctx)
+{
+	rlm_pap_thread_t	*t = talloc_get_type_abort(uctx, rlm_pap_thread_t);
+	pap_hash_pool_t		*pool = t->inst->pool;
+	fr_dlist_head_t		done;
+	pap_hash_job_t		*job;
+	uint8_t			buff[64];
+
+	/*
+	 *	Drain the pipe before collecting the jobs, so
+	 *	that a job completed after we collect them
+	 *	always results in another wakeup.
+	 */
+	while (read(fd, buff, sizeof(buff)) > 0);
+
+	fr_dlist_talloc_init(&done, pap_hash_job_t, entry);
+
+	pthread_mutex_lock(&pool->mutex);
+	fr_dlist_move(&done, &t->done);
+	pthread_mutex_unlock(&pool->mutex);
+
+	while ((job = fr_dlist_pop_head(&done))) {
+		job->state = PAP_HASH_JOB_DONE;
+
+		if (!job->request) {
+			talloc_free(job);
+			continue;
+		}
+
+		unlang_interpret_mark_runnable(job->request);
+	}
+}
+
+static unlang_action_t mod_authenticate_resume(rlm_rcode_t *p_result, UNUSED module_ctx_t const *mctx,
+					       request_t *request, void *rctx)
+{
+	pap_hash_job_t		*job = talloc_get_type_abort(rctx, pap_hash_job_t);
+	rlm_rcode_t		rcode = RLM_MODULE_FAIL;
+
+	pap_hash_job_result(&rcode, request, job);
+	if (job->cache) pap_cache_insert(job->thread, &job->cache_key, rcode);
+	talloc_free(job);
+
+	pap_auth_log(request, rcode);
+
+	RETURN_MODULE_RCODE(rcode);
+}
+
+static void mod_authenticate_signal(module_ctx_t const *mctx, UNUSED request_t *request, void *rctx,
+				    fr_state_signal_t action)
+{
+	rlm_pap_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_pap_thread_t);
+	pap_hash_job_t		*job = talloc_get_type_abort(rctx, pap_hash_job_t);
+	pap_hash_pool_t		*pool = t->inst->pool;
+
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	pthread_mutex_lock(&pool->mutex);
+	switch (job->state) {
+	case PAP_HASH_JOB_QUEUED:
+		fr_dlist_remove(&pool->queue, job);
+		pool->num_queued--;
+		t->num_running--;
+		FALL_THROUGH;
+
+	case PAP_HASH_JOB_DONE:
+		talloc_free(job);
+		break;
+
+	/*
+	 *	Can't stop the hashing thread, the job is
+	 *	freed when the worker collects it.
+	 */
+	case PAP_HASH_JOB_RUNNING:
+	case PAP_HASH_JOB_COMPLETE:
+		job->request = NULL;
+		break;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/** Pass verification of the password to the hash pool
+ *
+ * If the pool queue is full, the password is verified on the worker.
+ *
+ * @param[out] p_result		The result of the verification, if it was not offloaded.
+ * @param[in] t			Thread instance.
+ * @param[in] request		The current request.
+ * @param[in] known_good	"known good" password.
+ * @param[in] password		User-Password.
+ * @param[in] cache_key		Key to cache the result under.  NULL if caching is disabled.
+ */
+static unlang_action_t CC_HINT(nonnull(1,2,3,4,5)) pap_hash_offload(rlm_rcode_t *p_result, rlm_pap_thread_t *t,
+								    request_t *request,
+								    fr_pair_t const *known_good, fr_pair_t const *password,
+								    fr_cred_cache_key_t const *cache_key)
+{
+	pap_hash_pool_t		*pool = t->inst->pool;
+	pap_hash_job_t		*job;
+	unlang_action_t		ua;
+
+	/*
+	 *	Not parented by the request, the job must
+	 *	outlive it if the request is cancelled.
+	 */
+	MEM(job = talloc_zero(NULL, pap_hash_job_t));
+	job->thread = t;
+	job->request = request;
+	job->attr = known_good->da->attr;
+	MEM(job->password = talloc_bstrndup(job, password->vp_strvalue, password->vp_length));
+	job->password_len = password->vp_length;
+	if (cache_key) {
+		job->cache = true;
+		job->cache_key = *cache_key;
+	}
+
+	switch (job->attr) {
+#ifdef HAVE_CRYPT
+	case FR_CRYPT:
+		MEM(job->known_good = talloc_bstrndup(job, known_good->vp_strvalue, known_good->vp_length));
+		break;
+#endif
+#ifdef HAVE_OPENSSL_EVP_H
+	case FR_PBKDF2:
+		if (pap_pbkdf2_decode(job, &job->pbkdf2, request, known_good) < 0) {
+			talloc_free(job);
+			RETURN_MODULE_INVALID;
+		}
+		break;
+#endif
+	default:
+		fr_assert(0);
+		talloc_free(job);
+		RETURN_MODULE_FAIL;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->num_queued >= t->inst->hash_max_pending) {
+		pthread_mutex_unlock(&pool->mutex);
+
+		RWDEBUG("Hash pool queue is full, verifying password in this thread");
+		pap_hash_job_run(job);
+		ua = pap_hash_job_result(p_result, request, job);
+		if (job->cache) pap_cache_insert(t, &job->cache_key, *p_result);
+		talloc_free(job);
+
+		return ua;
+	}
+
+	fr_dlist_insert_tail(&pool->queue, job);
+	pool->num_queued++;
+	t->num_running++;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	RDEBUG2("Verifying password in hash pool");
+
+	return unlang_module_yield(request, mod_authenticate_resume, mod_authenticate_signal, job);
+}
+
 /*
  *	Authenticate the user via one of any well-known password.
  */
 static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
 	rlm_pap_t const 	*inst = talloc_get_type_abort_const(mctx->instance, rlm_pap_t);
+	rlm_pap_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_pap_thread_t);
 	fr_pair_t		*known_good;
 	fr_pair_t		*password;
 	rlm_rcode_t		rcode = RLM_MODULE_INVALID;
 	pap_auth_func_t		auth_func;
 	bool			ephemeral;
+	unlang_action_t		ua;
+	fr_cred_cache_key_t	cache_key;
 
 	password = fr_pair_find_by_da(&request->request_pairs, attr_user, 0);
 	if (!password) {
@@ -922,23 +1428,50 @@ static unlang_action_t CC_HINT(nonnull) mod_authenticate(rlm_rcode_t *p_result,
 		RDEBUG2("Comparing with \"known-good\" %s (%zu)", known_good->da->name, known_good->vp_length);
 	}
 
+	/*
+	 *	If the same password was recently checked against
+	 *	the same "known good" password, reuse the result.
+	 */
+	if (t->cache) {
+		pap_cache_key(&cache_key, t, request, known_good, password);
+
+		switch (fr_cred_cache_find(NULL, NULL, t->cache, &cache_key)) {
+		case FR_CRED_CACHE_VALID:
+			RDEBUG2("Password was recently verified, using cached result");
+			rcode = RLM_MODULE_OK;
+			goto done;
+
+		case FR_CRED_CACHE_INVALID:
+			REDEBUG("Password was recently rejected, using cached result");
+			rcode = RLM_MODULE_REJECT;
+			goto done;
+
+		case FR_CRED_CACHE_MISS:
+			break;
+		}
+	}
+
 	/*
 	 *	Authenticate, and return.
+	 *
+	 *	Expensive hashes are verified by the hash
+	 *	pool, which has its own copy of the data.
 	 */
-	auth_func(&rcode, inst, request, known_good, password);
-	if (ephemeral) TALLOC_FREE(known_good);
-	switch (rcode) {
-	case RLM_MODULE_REJECT:
-		REDEBUG("Password incorrect");
-		break;
+	if (inst->pool && pap_hash_offload_attr(known_good->da->attr)) {
+		ua = pap_hash_offload(&rcode, t, request, known_good, password, t->cache ? &cache_key : NULL);
+		if (ua == UNLANG_ACTION_YIELD) {
+			if (ephemeral) TALLOC_FREE(known_good);
+			return ua;
+		}
+	} else {
+		auth_func(&rcode, inst, request, known_good, password);
+		if (t->cache) pap_cache_insert(t, &cache_key, rcode);
+	}
 
-	case RLM_MODULE_OK:
-		RDEBUG2("User authenticated successfully");
-		break;
+done:
+	if (ephemeral) TALLOC_FREE(known_good);
 
-	default:
-		break;
-	}
+	pap_auth_log(request, rcode);
 
 	RETURN_MODULE_RCODE(rcode);
 }
@@ -955,6 +1488,11 @@ static int mod_bootstrap(void *instance, CONF_SECTION *conf)
 	if (!name) name = cf_section_name1(conf);
 	inst->name = name;
 
+	if (inst->hash_threads > 0) {
+		FR_INTEGER_BOUND_CHECK("hash_pool.threads", inst->hash_threads, <=, 256);
+		FR_INTEGER_BOUND_CHECK("hash_pool.max_pending", inst->hash_max_pending, >=, 1);
+	}
+
 	return 0;
 }
 
@@ -968,6 +1506,119 @@ static int mod_instantiate(void *instance, UNUSED CONF_SECTION *cs)
 		     inst->name);
 	}
 
+	if (inst->hash_threads > 0) {
+		pap_hash_pool_t	*pool;
+		uint32_t	i;
+
+		MEM(pool = talloc_zero(inst, pap_hash_pool_t));
+		pthread_mutex_init(&pool->mutex, NULL);
+		pthread_cond_init(&pool->cond, NULL);
+		pthread_cond_init(&pool->idle, NULL);
+		fr_dlist_talloc_init(&pool->queue, pap_hash_job_t, entry);
+		MEM(pool->pthreads = talloc_array(pool, pthread_t, inst->hash_threads));
+
+		for (i = 0; i < inst->hash_threads; i++) {
+			if (fr_schedule_pthread_create(&pool->pthreads[i], pap_hash_pool_thread, pool) < 0) {
+				PERROR("Failed starting hash pool thread");
+				pap_hash_pool_stop(pool);
+				talloc_free(pool);
+				return -1;
+			}
+			pool->num_pthreads++;
+		}
+
+		inst->pool = pool;
+	}
+
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	rlm_pap_t	*inst = talloc_get_type_abort(instance, rlm_pap_t);
+
+	if (inst->pool) {
+		pap_hash_pool_stop(inst->pool);
+		TALLOC_FREE(inst->pool);
+	}
+
+	return 0;
+}
+
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance, fr_event_list_t *el, void *thread)
+{
+	rlm_pap_t		*inst = talloc_get_type_abort(instance, rlm_pap_t);
+	rlm_pap_thread_t	*t = talloc_get_type_abort(thread, rlm_pap_thread_t);
+
+	t->inst = inst;
+	t->el = el;
+	t->pipe[0] = t->pipe[1] = -1;
+	fr_dlist_talloc_init(&t->done, pap_hash_job_t, entry);
+
+	if (fr_cred_cache_enabled(&inst->cache_conf)) {
+		t->cache = fr_cred_cache_alloc(t, &inst->cache_conf);
+		if (!t->cache) {
+			ERROR("Failed allocating password cache");
+			return -1;
+		}
+	}
+
+	if (!inst->pool) return 0;
+
+	if (pipe(t->pipe) < 0) {
+		ERROR("Failed creating hash pool pipe: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	if ((fr_nonblock(t->pipe[0]) < 0) || (fr_nonblock(t->pipe[1]) < 0)) {
+		PERROR("Failed setting hash pool pipe to non-blocking");
+	error:
+		close(t->pipe[0]);
+		close(t->pipe[1]);
+		t->pipe[0] = t->pipe[1] = -1;
+		return -1;
+	}
+
+	if (fr_event_fd_insert(t, el, t->pipe[0], pap_hash_pool_read, NULL, NULL, t) < 0) {
+		PERROR("Failed inserting hash pool pipe into event loop");
+		goto error;
+	}
+
+	return 0;
+}
+
+static int mod_thread_detach(fr_event_list_t *el, void *thread)
+{
+	rlm_pap_thread_t	*t = talloc_get_type_abort(thread, rlm_pap_thread_t);
+	pap_hash_pool_t		*pool = t->inst->pool;
+	pap_hash_job_t		*job, *next;
+
+	if (!pool || (t->pipe[0] < 0)) return 0;
+
+	/*
+	 *	Remove our queued jobs, and wait for any which
+	 *	are being hashed, so no hashing thread can
+	 *	reference this thread after it's freed.
+	 */
+	pthread_mutex_lock(&pool->mutex);
+	t->detaching = true;
+	for (job = fr_dlist_head(&pool->queue); job; job = next) {
+		next = fr_dlist_next(&pool->queue, job);
+		if (job->thread != t) continue;
+
+		fr_dlist_remove(&pool->queue, job);
+		pool->num_queued--;
+		t->num_running--;
+		talloc_free(job);
+	}
+	while (t->num_running > 0) pthread_cond_wait(&pool->idle, &pool->mutex);
+	fr_dlist_talloc_free(&t->done);
+	pthread_mutex_unlock(&pool->mutex);
+
+	fr_event_fd_delete(el, t->pipe[0], FR_EVENT_FILTER_IO);
+	close(t->pipe[0]);
+	close(t->pipe[1]);
+
 	return 0;
 }
 
@@ -1046,6 +1697,11 @@ module_t rlm_pap = {
 	.config		= module_config,
 	.bootstrap	= mod_bootstrap,
 	.instantiate	= mod_instantiate,
+	.detach		= mod_detach,
+	.thread_inst_size	= sizeof(rlm_pap_thread_t),
+	.thread_inst_type	= "rlm_pap_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach	= mod_thread_detach,
 	.methods = {
 		[MOD_AUTHENTICATE]	= mod_authenticate,
 		[MOD_AUTHORIZE]		= mod_authorize
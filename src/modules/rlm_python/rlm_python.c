@@ -38,6 +38,7 @@ RCSID("$Id$")
 
 #include <Python.h>
 #include <frameobject.h> /* Python header not pulled in by default. */
+#include <structmember.h> /* Python header not pulled in by default. */
 #include <libgen.h>
 #include <dlfcn.h>
 
@@ -63,6 +64,10 @@ typedef struct {
 							///< rlm_python module config in the python path.
 	bool		python_path_include_default;	//!< Include the default python path
 							///< in the python path.
+	bool		per_thread_interpreter;	//!< Give each worker thread its own interpreter.
+	bool		pair_mapping;		//!< Pass a freeradius.Request instead of a tuple of pairs.
+	CONF_SECTION	*conf;			//!< Our configuration, used to initialise
+						///< per-thread interpreters.
 	PyObject	*module;		//!< Local, interpreter specific module.
 
 	python_func_def_t
@@ -82,25 +87,44 @@ typedef struct {
  *
  * Multiple instances of python create multiple interpreters and each
  * thread must have a PyThreadState per interpreter, to track execution.
+ *
+ * If per_thread_interpreter is set, state instead belongs to a
+ * subinterpreter private to this thread, and the module and functions
+ * below are that interpreter's copies.  Otherwise the functions are
+ * borrowed from the instance.
  */
 typedef struct {
+	rlm_python_t const *inst;		//!< Instance this thread state belongs to.
 	PyThreadState	*state;			//!< Module instance/thread specific state.
+	PyObject	*module;		//!< Thread specific "freeradius" module, or the
+						///< instance's when not using per_thread_interpreter.
+
+	python_func_def_t
+	instantiate,
+	authorize,
+	authenticate,
+	preacct,
+	accounting,
+	post_auth,
+	detach;
 } rlm_python_thread_t;
 
 static void		*python_dlhandle;
 static PyThreadState	*global_interpreter;	//!< Our first interpreter.
 
-static rlm_python_t	*current_inst;		//!< Used for communication with inittab functions.
-static CONF_SECTION	*current_conf;		//!< Used for communication with inittab functions.
 static char		*default_path;		//!< The default python path.
 
 /*
- *	As of Python 3.8 the GIL will be per-interpreter
- *	If there are still issues with CEXTs,
- *	multiple interpreters and the GIL at that point
- *	users can build rlm_python against Python 3.8
- *	and the horrible hack of using a single interpreter
- *	for all instances of rlm_python will no longer be
+ *	As of Python 3.12 the GIL can be per-interpreter.
+ *	When per_thread_interpreter is enabled each worker
+ *	thread gets its own subinterpreter, and on 3.12+
+ *	its own GIL, so python code in different workers
+ *	runs in parallel.  C extensions loaded into those
+ *	interpreters must support multi-phase initialisation
+ *	and declare per-interpreter GIL support.
+ *
+ *	The horrible hack of using a single interpreter
+ *	for all instances of rlm_python is no longer
  *	required.
  *
  *	As Python 3.x module initialisation is significantly
@@ -133,6 +157,8 @@ static CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("python_path", FR_TYPE_STRING, rlm_python_t, python_path) },
 	{ FR_CONF_OFFSET("python_path_include_conf_dir", FR_TYPE_BOOL, rlm_python_t, python_path_include_conf_dir), .dflt = "yes" },
 	{ FR_CONF_OFFSET("python_path_include_default", FR_TYPE_BOOL, rlm_python_t, python_path_include_default), .dflt = "yes" },
+	{ FR_CONF_OFFSET("per_thread_interpreter", FR_TYPE_BOOL, rlm_python_t, per_thread_interpreter), .dflt = "no" },
+	{ FR_CONF_OFFSET("pair_mapping", FR_TYPE_BOOL, rlm_python_t, pair_mapping), .dflt = "no" },
 
 	CONF_PARSER_TERMINATOR
 };
@@ -221,13 +247,21 @@ static void python_error_log(const rlm_python_t *inst, request_t *request)
 
 		while (ptb != NULL) {
 			PyFrameObject *cur_frame = ptb->tb_frame;
+#if PY_VERSION_HEX >= 0x03090000
+			PyCodeObject *code = PyFrame_GetCode(cur_frame);	/* Frames are opaque from 3.11 */
+#else
+			PyCodeObject *code = cur_frame->f_code;
+
+			Py_INCREF(code);
+#endif
 
 			ROPTIONAL(RERROR, ERROR, "[%ld] %s:%d at %s()",
 				fnum,
-				PyUnicode_AsUTF8(cur_frame->f_code->co_filename),
+				PyUnicode_AsUTF8(code->co_filename),
 				PyFrame_GetLineNumber(cur_frame),
-				PyUnicode_AsUTF8(cur_frame->f_code->co_name)
+				PyUnicode_AsUTF8(code->co_name)
 			);
+			Py_DECREF(code);
 
 			ptb = ptb->tb_next;
 			fnum++;
@@ -358,18 +392,16 @@ static void mod_vptuple(TALLOC_CTX *ctx, rlm_python_t const *inst, request_t *re
 }
 
 
-/*
- *	This is the core Python function that the others wrap around.
- *	Pass the value-pair print strings in a tuple.
+/** Convert the value of a pair to a native Python object
+ *
+ * @return
+ *	- A new reference to the Python value.
+ *	- NULL on error.
  */
-static int mod_populate_vptuple(rlm_python_t const *inst, request_t *request, PyObject *pp, fr_pair_t *vp)
+static PyObject *python_value_from_pair(fr_pair_t const *vp)
 {
-	PyObject *attribute = NULL;
 	PyObject *value = NULL;
 
-	attribute = PyUnicode_FromString(vp->da->name);
-	if (!attribute) return -1;
-
 	switch (vp->vp_type) {
 	case FR_TYPE_STRING:
 		value = PyUnicode_FromStringAndSize(vp->vp_strvalue, vp->vp_length);
@@ -442,23 +474,39 @@ static int mod_populate_vptuple(rlm_python_t const *inst, request_t *request, Py
 		char buffer[256];
 
 		slen = fr_value_box_print(&FR_SBUFF_OUT(buffer, sizeof(buffer)), &vp->data, NULL);
-		if (slen < 0) {
-		error:
-			ROPTIONAL(REDEBUG, ERROR, "Failed marshalling %pP to Python value", vp);
-			python_error_log(inst, request);
-			Py_XDECREF(attribute);
-			return -1;
-		}
+		if (slen < 0) return NULL;
+
 		value = PyUnicode_FromStringAndSize(buffer, (size_t)slen);
 	}
 		break;
 
 	case FR_TYPE_NON_LEAF:
 		fr_assert(0);
-		return -1;
+		return NULL;
 	}
 
-	if (value == NULL) goto error;
+	return value;
+}
+
+/*
+ *	This is the core Python function that the others wrap around.
+ *	Pass the value-pair print strings in a tuple.
+ */
+static int mod_populate_vptuple(rlm_python_t const *inst, request_t *request, PyObject *pp, fr_pair_t *vp)
+{
+	PyObject *attribute = NULL;
+	PyObject *value = NULL;
+
+	attribute = PyUnicode_FromString(vp->da->name);
+	if (!attribute) return -1;
+
+	value = python_value_from_pair(vp);
+	if (!value) {
+		ROPTIONAL(REDEBUG, ERROR, "Failed marshalling %pP to Python value", vp);
+		python_error_log(inst, request);
+		Py_DECREF(attribute);
+		return -1;
+	}
 
 	PyTuple_SET_ITEM(pp, 0, attribute);
 	PyTuple_SET_ITEM(pp, 1, value);
@@ -466,8 +514,486 @@ static int mod_populate_vptuple(rlm_python_t const *inst, request_t *request, Py
 	return 0;
 }
 
-static unlang_action_t do_python_single(rlm_rcode_t *p_result,
-					rlm_python_t const *inst, request_t *request, PyObject *p_func, char const *funcname)
+/** A pair list exposed to python as a mapping of attribute names to values
+ *
+ * Values are only converted when they're read, and assignments are written
+ * straight back to the list.  The object is only valid for the duration of
+ * the call it was passed to, after which request is set to NULL.
+ */
+typedef struct {
+	PyObject_HEAD
+	request_t		*request;		//!< Request the list belongs to.  NULL once the call returns.
+	TALLOC_CTX		*ctx;			//!< To allocate new pairs in.
+	fr_pair_list_t		*list;			//!< The list being accessed.
+} python_pair_list_t;
+
+/** Passed to python functions instead of the request tuple when pair_mapping is enabled
+ *
+ */
+typedef struct {
+	PyObject_HEAD
+	PyObject		*request;		//!< Mapping of the request list.
+	PyObject		*reply;			//!< Mapping of the reply list.
+	PyObject		*control;		//!< Mapping of the control list.
+} python_request_t;
+
+/** Per-interpreter state of the "freeradius" module
+ *
+ */
+typedef struct {
+	PyTypeObject		*pair_list_type;	//!< freeradius.PairList.
+	PyTypeObject		*request_type;		//!< freeradius.Request.
+} python_module_state_t;
+
+/** Resolve a python key to an attribute
+ *
+ * Sets a python exception on error.
+ */
+static fr_dict_attr_t const *python_pair_list_attr(python_pair_list_t *pl, PyObject *key)
+{
+	char const		*name;
+	fr_dict_attr_t const	*da;
+
+	if (!pl->request) {
+		PyErr_SetString(PyExc_RuntimeError, "Pair list is only valid during the call it was passed to");
+		return NULL;
+	}
+
+	if (!PyUnicode_Check(key)) {
+		PyErr_SetString(PyExc_TypeError, "Attribute name must be a str");
+		return NULL;
+	}
+
+	name = PyUnicode_AsUTF8(key);
+	if (!name) return NULL;
+
+	da = fr_dict_attr_search_by_qualified_oid(NULL, pl->request->dict, name, true);
+	if (!da || !fr_type_is_leaf(da->type)) {
+		PyErr_Format(PyExc_KeyError, "Unknown attribute \"%s\"", name);
+		return NULL;
+	}
+
+	return da;
+}
+
+/** Resolve a python key to an attribute, and optionally an instance
+ *
+ * Keys are either an attribute name, or a (name, index) tuple selecting
+ * a single instance of the attribute, like `Class[1]` in unlang.
+ *
+ * Sets a python exception on error.
+ *
+ * @param[in] pl	the key is for.
+ * @param[in] key	to resolve.
+ * @param[out] idx	The instance selected, or -1 if the key is just a name.
+ * @return the attribute, or NULL on error.
+ */
+static fr_dict_attr_t const *python_pair_list_key(python_pair_list_t *pl, PyObject *key, Py_ssize_t *idx)
+{
+	*idx = -1;
+
+	if (!PyTuple_Check(key)) return python_pair_list_attr(pl, key);
+
+	if ((PyTuple_GET_SIZE(key) != 2) || !PyLong_Check(PyTuple_GET_ITEM(key, 1))) {
+		PyErr_SetString(PyExc_TypeError, "Key must be a str, or a (str, int) tuple");
+		return NULL;
+	}
+
+	*idx = PyLong_AsSsize_t(PyTuple_GET_ITEM(key, 1));
+	if ((*idx == -1) && PyErr_Occurred()) return NULL;
+	if ((*idx < 0) || (*idx > UINT_MAX)) {
+		PyErr_SetString(PyExc_IndexError, "Attribute index out of range");
+		return NULL;
+	}
+
+	return python_pair_list_attr(pl, PyTuple_GET_ITEM(key, 0));
+}
+
+/** Return a python list of the values of all instances of an attribute
+ *
+ */
+static PyObject *python_pair_list_values(python_pair_list_t *pl, fr_dict_attr_t const *da)
+{
+	PyObject	*values, *value;
+	fr_pair_t	*vp;
+
+	values = PyList_New(0);
+	if (!values) return NULL;
+
+	for (vp = fr_pair_list_head(pl->list);
+	     vp;
+	     vp = fr_pair_list_next(pl->list, vp)) {
+		if (vp->da != da) continue;
+
+		value = python_value_from_pair(vp);
+		if (!value) {
+			if (!PyErr_Occurred()) PyErr_Format(PyExc_ValueError, "Failed converting %s", da->name);
+		error:
+			Py_DECREF(values);
+			return NULL;
+		}
+
+		if (PyList_Append(values, value) < 0) {
+			Py_DECREF(value);
+			goto error;
+		}
+		Py_DECREF(value);
+	}
+
+	return values;
+}
+
+/** Set the value of a pair from a python object
+ *
+ * bytes are copied verbatim into octets attributes, anything else is
+ * converted to a string and parsed.
+ */
+static int python_pair_value_set(fr_pair_t *vp, PyObject *value)
+{
+	PyObject	*str;
+	char const	*p;
+	Py_ssize_t	len;
+	int		ret;
+
+	if (PyBytes_Check(value)) {
+		char *buff;
+
+		if (PyBytes_AsStringAndSize(value, &buff, &len) < 0) return -1;
+		if (vp->vp_type == FR_TYPE_OCTETS) return fr_pair_value_memdup(vp, (uint8_t *)buff, len, false);
+
+		return fr_pair_value_from_str(vp, buff, len, '\0', false);
+	}
+
+	if (PyBool_Check(value)) return fr_pair_value_from_str(vp, value == Py_True ? "yes" : "no", -1, '\0', false);
+
+	str = PyObject_Str(value);
+	if (!str) return -1;
+
+	p = PyUnicode_AsUTF8AndSize(str, &len);
+	if (!p) {
+		Py_DECREF(str);
+		return -1;
+	}
+	ret = fr_pair_value_from_str(vp, p, len, '\0', false);
+	Py_DECREF(str);
+
+	return ret;
+}
+
+static Py_ssize_t python_pair_list_len(PyObject *self)
+{
+	python_pair_list_t *pl = (python_pair_list_t *)self;
+
+	if (!pl->request) {
+		PyErr_SetString(PyExc_RuntimeError, "Pair list is only valid during the call it was passed to");
+		return -1;
+	}
+
+	return fr_pair_list_len(pl->list);
+}
+
+/** Return the value of the first, or a specific, instance of an attribute
+ *
+ */
+static PyObject *python_pair_list_subscript(PyObject *self, PyObject *key)
+{
+	python_pair_list_t	*pl = (python_pair_list_t *)self;
+	fr_dict_attr_t const	*da;
+	fr_pair_t		*vp;
+	PyObject		*value;
+	Py_ssize_t		idx;
+
+	da = python_pair_list_key(pl, key, &idx);
+	if (!da) return NULL;
+
+	vp = fr_pair_find_by_da(pl->list, da, idx < 0 ? 0 : (unsigned int)idx);
+	if (!vp) {
+		PyErr_SetObject(PyExc_KeyError, key);
+		return NULL;
+	}
+
+	value = python_value_from_pair(vp);
+	if (!value && !PyErr_Occurred()) PyErr_Format(PyExc_ValueError, "Failed converting %s", da->name);
+
+	return value;
+}
+
+/** Allocate a pair, and set its value from a python object
+ *
+ */
+static fr_pair_t *python_pair_alloc(python_pair_list_t *pl, fr_dict_attr_t const *da, PyObject *value)
+{
+	fr_pair_t *vp;
+
+	MEM(vp = fr_pair_afrom_da(pl->ctx, da));
+	if (python_pair_value_set(vp, value) < 0) {
+		talloc_free(vp);
+		if (!PyErr_Occurred()) PyErr_Format(PyExc_ValueError, "Failed setting %s: %s", da->name, fr_strerror());
+		return NULL;
+	}
+
+	return vp;
+}
+
+/** Replace or delete all instances of an attribute, or a specific instance
+ *
+ * Assigning a list to an attribute name replaces all instances of the
+ * attribute with one instance per list element.
+ */
+static int python_pair_list_ass_subscript(PyObject *self, PyObject *key, PyObject *value)
+{
+	python_pair_list_t	*pl = (python_pair_list_t *)self;
+	fr_dict_attr_t const	*da;
+	fr_pair_t		*vp, *old;
+	fr_pair_list_t		new;
+	Py_ssize_t		idx, i;
+
+	da = python_pair_list_key(pl, key, &idx);
+	if (!da) return -1;
+
+	/*
+	 *	A single instance
+	 */
+	if (idx >= 0) {
+		old = fr_pair_find_by_da(pl->list, da, (unsigned int)idx);
+		if (!old) {
+			PyErr_SetObject(PyExc_KeyError, key);
+			return -1;
+		}
+
+		if (!value) {
+			fr_pair_remove(pl->list, old);
+			talloc_free(old);
+			return 0;
+		}
+
+		/*
+		 *	Parse into a temporary pair, so a bad value
+		 *	leaves the existing one unchanged.
+		 */
+		vp = python_pair_alloc(pl, da, value);
+		if (!vp) return -1;
+
+		fr_value_box_clear_value(&old->data);
+		if (fr_value_box_steal(old, &old->data, &vp->data) < 0) {
+			talloc_free(vp);
+			PyErr_Format(PyExc_ValueError, "Failed setting %s: %s", da->name, fr_strerror());
+			return -1;
+		}
+		talloc_free(vp);
+
+		return 0;
+	}
+
+	if (!value) {
+		if (fr_pair_delete_by_da(pl->list, da) == 0) {
+			PyErr_SetObject(PyExc_KeyError, key);
+			return -1;
+		}
+		return 0;
+	}
+
+	/*
+	 *	Build all the new pairs before touching the list,
+	 *	so a bad value leaves it unchanged.
+	 */
+	fr_pair_list_init(&new);
+	if (PyList_Check(value)) {
+		for (i = 0; i < PyList_GET_SIZE(value); i++) {
+			vp = python_pair_alloc(pl, da, PyList_GET_ITEM(value, i));
+			if (!vp) {
+				fr_pair_list_free(&new);
+				return -1;
+			}
+			fr_pair_append(&new, vp);
+		}
+	} else {
+		vp = python_pair_alloc(pl, da, value);
+		if (!vp) return -1;
+		fr_pair_append(&new, vp);
+	}
+
+	fr_pair_delete_by_da(pl->list, da);
+	fr_pair_list_append(pl->list, &new);
+
+	return 0;
+}
+
+static int python_pair_list_contains(PyObject *self, PyObject *key)
+{
+	python_pair_list_t	*pl = (python_pair_list_t *)self;
+	fr_dict_attr_t const	*da;
+	Py_ssize_t		idx;
+
+	da = python_pair_list_key(pl, key, &idx);
+	if (!da) {
+		if (!PyErr_ExceptionMatches(PyExc_KeyError) && !PyErr_ExceptionMatches(PyExc_IndexError)) return -1;
+		PyErr_Clear();
+		return 0;
+	}
+
+	return (fr_pair_find_by_da(pl->list, da, idx < 0 ? 0 : (unsigned int)idx) != NULL);
+}
+
+static PyObject *python_pair_list_get(PyObject *self, PyObject *args)
+{
+	PyObject	*key, *dflt = Py_None, *value;
+
+	if (!PyArg_ParseTuple(args, "O|O", &key, &dflt)) return NULL;
+
+	value = python_pair_list_subscript(self, key);
+	if (value || !PyErr_ExceptionMatches(PyExc_KeyError)) return value;
+
+	PyErr_Clear();
+	Py_INCREF(dflt);
+	return dflt;
+}
+
+static PyObject *python_pair_list_getall(PyObject *self, PyObject *key)
+{
+	python_pair_list_t	*pl = (python_pair_list_t *)self;
+	fr_dict_attr_t const	*da;
+
+	da = python_pair_list_attr(pl, key);
+	if (!da) return NULL;
+
+	return python_pair_list_values(pl, da);
+}
+
+static void python_pair_list_dealloc(PyObject *self)
+{
+	PyTypeObject *tp = Py_TYPE(self);
+
+	tp->tp_free(self);
+	Py_DECREF(tp);
+}
+
+static PyMethodDef python_pair_list_methods[] = {
+	{ "get", &python_pair_list_get, METH_VARARGS,
+	  "get(name[, default])\n\n" \
+	  "Return the value of the first instance of attribute name, or default if it's not in the list.\n"
+	},
+	{ "getall", &python_pair_list_getall, METH_O,
+	  "getall(name)\n\n" \
+	  "Return a list of the values of all instances of attribute name, in list order.\n"
+	},
+	{ NULL, NULL, 0, NULL },
+};
+
+static PyType_Slot python_pair_list_slots[] = {
+	{ Py_tp_doc, "Mapping of attribute names to the values of pairs in a list" },
+	{ Py_tp_dealloc, python_pair_list_dealloc },
+	{ Py_tp_methods, python_pair_list_methods },
+	{ Py_mp_length, python_pair_list_len },
+	{ Py_mp_subscript, python_pair_list_subscript },
+	{ Py_mp_ass_subscript, python_pair_list_ass_subscript },
+	{ Py_sq_contains, python_pair_list_contains },
+	{ 0, NULL }
+};
+
+static PyType_Spec python_pair_list_spec = {
+	.name = "freeradius.PairList",
+	.basicsize = sizeof(python_pair_list_t),
+	.flags = Py_TPFLAGS_DEFAULT,
+	.slots = python_pair_list_slots
+};
+
+static void python_request_dealloc(PyObject *self)
+{
+	python_request_t	*pr = (python_request_t *)self;
+	PyTypeObject		*tp = Py_TYPE(self);
+
+	Py_XDECREF(pr->request);
+	Py_XDECREF(pr->reply);
+	Py_XDECREF(pr->control);
+
+	tp->tp_free(self);
+	Py_DECREF(tp);
+}
+
+static PyMemberDef python_request_members[] = {
+	{ "request", T_OBJECT, offsetof(python_request_t, request), READONLY, "Request attributes" },
+	{ "reply", T_OBJECT, offsetof(python_request_t, reply), READONLY, "Reply attributes" },
+	{ "control", T_OBJECT, offsetof(python_request_t, control), READONLY, "Control attributes" },
+	{ NULL, 0, 0, 0, NULL }
+};
+
+static PyType_Slot python_request_slots[] = {
+	{ Py_tp_doc, "The pair lists of the request being processed" },
+	{ Py_tp_dealloc, python_request_dealloc },
+	{ Py_tp_members, python_request_members },
+	{ 0, NULL }
+};
+
+static PyType_Spec python_request_spec = {
+	.name = "freeradius.Request",
+	.basicsize = sizeof(python_request_t),
+	.flags = Py_TPFLAGS_DEFAULT,
+	.slots = python_request_slots
+};
+
+static PyObject *python_pair_list_alloc(python_module_state_t const *state, request_t *request,
+					TALLOC_CTX *ctx, fr_pair_list_t *list)
+{
+	python_pair_list_t	*pl;
+
+	pl = (python_pair_list_t *)state->pair_list_type->tp_alloc(state->pair_list_type, 0);
+	if (!pl) return NULL;
+
+	pl->request = request;
+	pl->ctx = ctx;
+	pl->list = list;
+
+	return (PyObject *)pl;
+}
+
+/** Wrap the pair lists of a request, without converting any of the pairs
+ *
+ */
+static PyObject *python_request_alloc(python_module_state_t const *state, request_t *request)
+{
+	python_request_t	*pr;
+
+	pr = (python_request_t *)state->request_type->tp_alloc(state->request_type, 0);
+	if (!pr) return NULL;
+
+	pr->request = python_pair_list_alloc(state, request, request->request_ctx, &request->request_pairs);
+	pr->reply = python_pair_list_alloc(state, request, request->reply_ctx, &request->reply_pairs);
+	pr->control = python_pair_list_alloc(state, request, request->control_ctx, &request->control_pairs);
+	if (!pr->request || !pr->reply || !pr->control) {
+		Py_DECREF(pr);
+		return NULL;
+	}
+
+	return (PyObject *)pr;
+}
+
+/** Stop the script accessing the request if it kept a reference to the lists
+ *
+ */
+static void python_request_invalidate(PyObject *self)
+{
+	python_request_t *pr = (python_request_t *)self;
+
+	((python_pair_list_t *)pr->request)->request = NULL;
+	((python_pair_list_t *)pr->reply)->request = NULL;
+	((python_pair_list_t *)pr->control)->request = NULL;
+}
+
+/** Call a python function
+ *
+ * @param[out] p_result		The rcode returned by the function.
+ * @param[in] inst		rlm_python configuration.
+ * @param[in] request		to pass to the function. May be NULL.
+ * @param[in] state		of the "freeradius" module in the current interpreter.
+ *				If not NULL, the function is passed a freeradius.Request
+ *				wrapping the request's pair lists, instead of a tuple
+ *				containing a copy of every request pair.
+ * @param[in] p_func		to call.
+ * @param[in] funcname		for logging.
+ */
+static unlang_action_t do_python_single(rlm_rcode_t *p_result, rlm_python_t const *inst, request_t *request,
+					python_module_state_t const *state, PyObject *p_func, char const *funcname)
 {
 	fr_pair_t	*vp;
 	PyObject	*p_ret = NULL;
@@ -488,7 +1014,13 @@ static unlang_action_t do_python_single(rlm_rcode_t *p_result,
 		tuple_len = fr_pair_list_len(&request->request_pairs);
 	}
 
-	if (tuple_len == 0) {
+	if (request && state) {
+		p_arg = python_request_alloc(state, request);
+		if (!p_arg) {
+			rcode = RLM_MODULE_FAIL;
+			goto finish;
+		}
+	} else if (tuple_len == 0) {
 		Py_INCREF(Py_None);
 		p_arg = Py_None;
 	} else {
@@ -587,6 +1119,7 @@ static unlang_action_t do_python_single(rlm_rcode_t *p_result,
 
 finish:
 	if (rcode == RLM_MODULE_FAIL) python_error_log(inst, request);
+	if (request && state && p_arg) python_request_invalidate(p_arg);
 	Py_XDECREF(p_arg);
 	Py_XDECREF(p_ret);
 
@@ -610,7 +1143,8 @@ static unlang_action_t do_python(rlm_rcode_t *p_result, rlm_python_t const *inst
 	RDEBUG3("Using thread state %p/%p", inst, this_thread->state);
 
 	PyEval_RestoreThread(this_thread->state);	/* Swap in our local thread state */
-	do_python_single(&rcode, inst, request, p_func, funcname);
+	do_python_single(&rcode, inst, request,
+			 inst->pair_mapping ? PyModule_GetState(this_thread->module) : NULL, p_func, funcname);
 	(void)fr_cond_assert(PyEval_SaveThread() == this_thread->state);
 
 	RETURN_MODULE_RCODE(rcode);
@@ -621,7 +1155,7 @@ static unlang_action_t CC_HINT(nonnull) mod_##x(rlm_rcode_t *p_result, module_ct
 { \
 	rlm_python_t const *inst = talloc_get_type_abort_const(mctx->instance, rlm_python_t); \
 	rlm_python_thread_t *thread = talloc_get_type_abort(mctx->thread, rlm_python_thread_t); \
-	return do_python(p_result, inst, thread, request, inst->x.function, #x);\
+	return do_python(p_result, inst, thread, request, thread->x.function, #x);\
 }
 
 MOD_FUNC(authenticate)
@@ -767,7 +1301,8 @@ static int python_parse_config(rlm_python_t *inst, CONF_SECTION *cs, int lvl, Py
 /** Make the current instance's config available within the module we're initialising
  *
  */
-static int python_module_import_config(rlm_python_t *inst, CONF_SECTION *conf, PyObject *module)
+static int python_module_import_config(rlm_python_t *inst, CONF_SECTION *conf, PyObject *module,
+				       PyObject **dict_p)
 {
 	CONF_SECTION *cs;
 
@@ -775,12 +1310,12 @@ static int python_module_import_config(rlm_python_t *inst, CONF_SECTION *conf, P
 	 *	Convert a FreeRADIUS config structure into a python
 	 *	dictionary.
 	 */
-	inst->pythonconf_dict = PyDict_New();
-	if (!inst->pythonconf_dict) {
+	*dict_p = PyDict_New();
+	if (!*dict_p) {
 		ERROR("Unable to create python dict for config");
 	error:
-		Py_XDECREF(inst->pythonconf_dict);
-		inst->pythonconf_dict = NULL;
+		Py_XDECREF(*dict_p);
+		*dict_p = NULL;
 		python_error_log(inst, NULL);
 		return -1;
 	}
@@ -788,13 +1323,13 @@ static int python_module_import_config(rlm_python_t *inst, CONF_SECTION *conf, P
 	cs = cf_section_find(conf, "config", NULL);
 	if (cs) {
 		DEBUG("Inserting \"config\" section into python environment as radiusd.config");
-		if (python_parse_config(inst, cs, 0, inst->pythonconf_dict) < 0) goto error;
+		if (python_parse_config(inst, cs, 0, *dict_p) < 0) goto error;
 	}
 
 	/*
 	 *	Add module configuration as a dict
 	 */
-	if (PyModule_AddObject(module, "config", inst->pythonconf_dict) < 0) goto error;
+	if (PyModule_AddObject(module, "config", *dict_p) < 0) goto error;
 
 	return 0;
 }
@@ -840,57 +1375,79 @@ static char *python_path_build(TALLOC_CTX *ctx, rlm_python_t *inst, CONF_SECTION
 
 /*
  *	Python 3 interpreter initialisation and destruction
+ *
+ *	The "freeradius" module uses multi-phase initialisation
+ *	so that every interpreter gets its own instance of it,
+ *	which is a requirement for interpreters with their own GIL.
  */
-static PyObject *python_module_init(void)
+static int python_module_exec(PyObject *module)
 {
-	rlm_python_t	*inst = current_inst;
-	PyObject	*module;
+	python_module_state_t *state = PyModule_GetState(module);
+
+	state->pair_list_type = (PyTypeObject *)PyType_FromSpec(&python_pair_list_spec);
+	if (!state->pair_list_type) return -1;
+
+	state->request_type = (PyTypeObject *)PyType_FromSpec(&python_request_spec);
+	if (!state->request_type) return -1;
+
+	Py_INCREF(state->pair_list_type);
+	if (PyModule_AddObject(module, "PairList", (PyObject *)state->pair_list_type) < 0) {
+		Py_DECREF(state->pair_list_type);
+		return -1;
+	}
+
+	Py_INCREF(state->request_type);
+	if (PyModule_AddObject(module, "Request", (PyObject *)state->request_type) < 0) {
+		Py_DECREF(state->request_type);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void python_module_free(void *module)
+{
+	python_module_state_t *state = PyModule_GetState(module);
+
+	if (!state) return;
+
+	Py_CLEAR(state->pair_list_type);
+	Py_CLEAR(state->request_type);
+}
 
+static PyModuleDef_Slot py_module_slots[] = {
+	{ Py_mod_exec, python_module_exec },
+#if PY_VERSION_HEX >= 0x030C0000
+	{ Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED },
+#endif
+	{ 0, NULL }
+};
+
+static PyObject *python_module_init(void)
+{
 	static struct PyModuleDef py_module_def = {
 		PyModuleDef_HEAD_INIT,
 		.m_name = "freeradius",
 		.m_doc = "freeRADIUS python module",
-		.m_size = -1,
-		.m_methods = module_methods
+		.m_size = sizeof(python_module_state_t),
+		.m_methods = module_methods,
+		.m_slots = py_module_slots,
+		.m_free = python_module_free
 	};
 
-	fr_assert(inst);
-
-	module = PyModule_Create(&py_module_def);
-	if (!module) {
-		python_error_log(inst, NULL);
-		Py_RETURN_NONE;
-	}
-
-	return module;
+	return PyModuleDef_Init(&py_module_def);
 }
 
-static int python_interpreter_init(rlm_python_t *inst, CONF_SECTION *conf)
+/** Set the path and import the "freeradius" module into the current interpreter
+ *
+ * Must be called with the thread state of the interpreter being initialised swapped in.
+ */
+static int python_interpreter_setup(rlm_python_t *inst, CONF_SECTION *conf, PyObject **module_p, PyObject **dict_p)
 {
 	char		*path;
 	PyObject	*module;
 	wchar_t	        *wide_path;
 
-	/*
-	 *	python_module_init takes no args, so we need
-	 *	to set these globals so that when it's
-	 *	called during interpreter initialisation
-	 *	it can get at the current instance config.
-	 */
-	current_inst = inst;
-	current_conf = conf;
-
-	PyEval_RestoreThread(global_interpreter);
-	LSAN_DISABLE(inst->interpreter = Py_NewInterpreter());
-	if (!inst->interpreter) {
-		ERROR("Failed creating new interpreter");
-		return -1;
-	}
-	DEBUG3("Created new interpreter %p", inst->interpreter);
-	PyEval_SaveThread();		/* Unlock GIL */
-
-	PyEval_RestoreThread(inst->interpreter);
-
 	path = python_path_build(inst, inst, conf);
 	DEBUG3("Setting python path to \"%s\"", path);
 	wide_path = Py_DecodeLocale(path, NULL);
@@ -906,15 +1463,36 @@ static int python_interpreter_init(rlm_python_t *inst, CONF_SECTION *conf)
 	 */
  	module = PyImport_ImportModule("freeradius");
  	if (!module) {
- 		ERROR("Failed importing \"freeradius\" module into interpreter %p", inst->interpreter);
+ 		ERROR("Failed importing \"freeradius\" module into interpreter %p", PyThreadState_Get());
+		python_error_log(inst, NULL);
  		return -1;
  	}
-	if ((python_module_import_config(inst, conf, module) < 0) ||
+	if ((python_module_import_config(inst, conf, module, dict_p) < 0) ||
 	    (python_module_import_constants(inst, module) < 0)) {
 		Py_DECREF(module);
 		return -1;
 	}
-	inst->module = module;
+	*module_p = module;
+
+	return 0;
+}
+
+static int python_interpreter_init(rlm_python_t *inst, CONF_SECTION *conf)
+{
+	PyEval_RestoreThread(global_interpreter);
+	LSAN_DISABLE(inst->interpreter = Py_NewInterpreter());
+	if (!inst->interpreter) {
+		ERROR("Failed creating new interpreter");
+		return -1;
+	}
+	DEBUG3("Created new interpreter %p", inst->interpreter);
+	PyEval_SaveThread();		/* Unlock GIL */
+
+	PyEval_RestoreThread(inst->interpreter);
+	if (python_interpreter_setup(inst, conf, &inst->module, &inst->pythonconf_dict) < 0) {
+		PyEval_SaveThread();
+		return -1;
+	}
 	PyEval_SaveThread();
 
 	return 0;
@@ -951,6 +1529,14 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 
 	inst->name = cf_section_name2(conf);
 	if (!inst->name) inst->name = cf_section_name1(conf);
+	inst->conf = conf;
+
+#if PY_VERSION_HEX < 0x030C0000
+	if (inst->per_thread_interpreter) {
+		WARN("Python %s shares one GIL between all interpreters, per_thread_interpreter "
+		     "will not allow python code to run in parallel", PY_VERSION);
+	}
+#endif
 
 	if (python_interpreter_init(inst, conf) < 0) return -1;
 
@@ -977,7 +1563,7 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	if (inst->instantiate.function) {
 		rlm_rcode_t rcode;
 
-		do_python_single(&rcode, inst, NULL, inst->instantiate.function, "instantiate");
+		do_python_single(&rcode, inst, NULL, NULL, inst->instantiate.function, "instantiate");
 		switch (rcode) {
 		case RLM_MODULE_FAIL:
 		case RLM_MODULE_REJECT:
@@ -1021,7 +1607,7 @@ static int mod_detach(void *instance)
 	if (inst->detach.function) {
 		rlm_rcode_t rcode;
 
-		(void)do_python_single(&rcode, inst, NULL, inst->detach.function, "detach");
+		(void)do_python_single(&rcode, inst, NULL, NULL, inst->detach.function, "detach");
 	}
 
 #define PYTHON_FUNC_DESTROY(_x) python_function_destroy(&inst->_x)
@@ -1044,6 +1630,149 @@ static int mod_detach(void *instance)
 	return 0;
 }
 
+/** Create a subinterpreter private to the calling worker thread
+ *
+ * Creating an interpreter requires a thread state on the main interpreter,
+ * so a temporary one is created and discarded once the subinterpreter is
+ * set up.
+ */
+static int python_thread_interpreter_init(rlm_python_t *inst, rlm_python_thread_t *this_thread)
+{
+	PyThreadState	*main_state;
+	PyObject	*pythonconf_dict;
+	int		ret = -1;
+
+	main_state = PyThreadState_New(global_interpreter->interp);
+	if (!main_state) {
+		ERROR("Failed initialising local PyThreadState");
+		return -1;
+	}
+	PyEval_RestoreThread(main_state);
+
+#if PY_VERSION_HEX >= 0x030C0000
+	{
+		PyInterpreterConfig	config = {
+			.use_main_obmalloc = 0,
+			.allow_fork = 0,
+			.allow_exec = 0,
+			.allow_threads = 1,
+			.allow_daemon_threads = 0,
+			.check_multi_interp_extensions = 1,
+			.gil = PyInterpreterConfig_OWN_GIL,
+		};
+		PyStatus		status;
+
+		/*
+		 *	On success the GIL of the main interpreter is
+		 *	released, and we hold the new interpreter's GIL.
+		 */
+		LSAN_DISABLE(status = Py_NewInterpreterFromConfig(&this_thread->state, &config));
+		if (PyStatus_Exception(status)) this_thread->state = NULL;
+	}
+#else
+	LSAN_DISABLE(this_thread->state = Py_NewInterpreter());
+#endif
+	if (!this_thread->state) {
+		ERROR("Failed creating new interpreter");
+		PyEval_SaveThread();	/* Still on main_state, unlock GIL */
+		goto finish;
+	}
+	DEBUG3("Created new thread interpreter %p", this_thread->state);
+
+	if (python_interpreter_setup(inst, inst->conf, &this_thread->module, &pythonconf_dict) < 0) {
+	error:
+		PyEval_SaveThread();
+		goto finish;
+	}
+
+#define PYTHON_FUNC_THREAD_LOAD(_x) \
+	this_thread->_x.module_name = inst->_x.module_name; \
+	this_thread->_x.function_name = inst->_x.function_name; \
+	if (python_function_load(inst, &this_thread->_x) < 0) goto error
+	PYTHON_FUNC_THREAD_LOAD(instantiate);
+	PYTHON_FUNC_THREAD_LOAD(authenticate);
+	PYTHON_FUNC_THREAD_LOAD(authorize);
+	PYTHON_FUNC_THREAD_LOAD(preacct);
+	PYTHON_FUNC_THREAD_LOAD(accounting);
+	PYTHON_FUNC_THREAD_LOAD(post_auth);
+	PYTHON_FUNC_THREAD_LOAD(detach);
+
+	/*
+	 *	The script's globals are private to this
+	 *	interpreter, so it needs instantiating again.
+	 */
+	if (this_thread->instantiate.function) {
+		rlm_rcode_t rcode;
+
+		do_python_single(&rcode, inst, NULL, NULL, this_thread->instantiate.function, "instantiate");
+		switch (rcode) {
+		case RLM_MODULE_FAIL:
+		case RLM_MODULE_REJECT:
+			goto error;
+
+		default:
+			break;
+		}
+	}
+
+	PyEval_SaveThread();
+	ret = 0;
+
+finish:
+	PyEval_RestoreThread(main_state);
+	PyThreadState_Clear(main_state);
+	PyEval_SaveThread();
+	PyThreadState_Delete(main_state);
+
+	return ret;
+}
+
+/** Destroy a subinterpreter created by python_thread_interpreter_init
+ *
+ */
+static void python_thread_interpreter_free(rlm_python_thread_t *this_thread)
+{
+	PyEval_RestoreThread(this_thread->state);	/* Swap in our local thread state */
+
+	/*
+	 *	We don't care if this fails.
+	 */
+	if (this_thread->detach.function) {
+		rlm_rcode_t rcode;
+
+		(void)do_python_single(&rcode, this_thread->inst, NULL, NULL, this_thread->detach.function, "detach");
+	}
+
+#define PYTHON_FUNC_THREAD_DESTROY(_x) python_function_destroy(&this_thread->_x)
+	PYTHON_FUNC_THREAD_DESTROY(instantiate);
+	PYTHON_FUNC_THREAD_DESTROY(authenticate);
+	PYTHON_FUNC_THREAD_DESTROY(authorize);
+	PYTHON_FUNC_THREAD_DESTROY(preacct);
+	PYTHON_FUNC_THREAD_DESTROY(accounting);
+	PYTHON_FUNC_THREAD_DESTROY(post_auth);
+	PYTHON_FUNC_THREAD_DESTROY(detach);
+
+	Py_XDECREF(this_thread->module);
+
+	Py_EndInterpreter(this_thread->state);		/* Sets thread state to NULL */
+
+#if PY_VERSION_HEX < 0x030C0000
+	/*
+	 *	The shared GIL is still held, and we need a
+	 *	thread state to release it.
+	 */
+	{
+		PyThreadState *main_state;
+
+		main_state = PyThreadState_New(global_interpreter->interp);
+		PyThreadState_Swap(main_state);
+		PyThreadState_Clear(main_state);
+		PyEval_SaveThread();
+		PyThreadState_Delete(main_state);
+	}
+#endif
+}
+
 static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instance,
 				  UNUSED fr_event_list_t *el, void *thread)
 {
@@ -1051,6 +1780,10 @@ static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instanc
 	rlm_python_t		*inst = instance;
 	rlm_python_thread_t	*this_thread = thread;
 
+	this_thread->inst = inst;
+
+	if (inst->per_thread_interpreter) return python_thread_interpreter_init(inst, this_thread);
+
 	state = PyThreadState_New(inst->interpreter->interp);
 	if (!state) {
 		ERROR("Failed initialising local PyThreadState");
@@ -1059,6 +1792,16 @@ static int mod_thread_instantiate(UNUSED CONF_SECTION const *conf, void *instanc
 
 	DEBUG3("Initialised new thread state %p", state);
 	this_thread->state = state;
+	this_thread->module = inst->module;
+
+	/*
+	 *	Functions are borrowed from the instance's interpreter
+	 */
+	this_thread->authenticate = inst->authenticate;
+	this_thread->authorize = inst->authorize;
+	this_thread->preacct = inst->preacct;
+	this_thread->accounting = inst->accounting;
+	this_thread->post_auth = inst->post_auth;
 
 	return 0;
 }
@@ -1067,6 +1810,13 @@ static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
 {
 	rlm_python_thread_t	*this_thread = thread;
 
+	if (!this_thread->state) return 0;
+
+	if (this_thread->inst->per_thread_interpreter) {
+		python_thread_interpreter_free(this_thread);
+		return 0;
+	}
+
 	PyEval_RestoreThread(this_thread->state);	/* Swap in our local thread state */
 	PyThreadState_Clear(this_thread->state);
 	PyEval_SaveThread();
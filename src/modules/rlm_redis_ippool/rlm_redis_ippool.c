@@ -50,6 +50,7 @@ RCSID("$Id$")
 
 #include <freeradius-devel/redis/base.h>
 #include <freeradius-devel/redis/cluster.h>
+#include <freeradius-devel/redis/pipeline.h>
 #include "redis_ippool.h"
 
 #include <freeradius-devel/dhcpv4/dhcpv4.h>
@@ -97,9 +98,24 @@ typedef struct {
 	bool			copy_on_update; //!< Copy the address provided by ip_address to the
 						//!< allocated_address_attr if updates are successful.
 
+	bool			pipelined;	//!< Send scripts over a per-thread trunk, pipelining
+						//!< the commands from concurrent requests.
+
+	fr_trunk_conf_t		trunk_conf;	//!< Configuration for the per-thread trunk.
+
+	fr_redis_io_conf_t	io_conf;	//!< Server the per-thread trunk connects to.
+
 	fr_redis_cluster_t	*cluster;	//!< Redis cluster.
 } rlm_redis_ippool_t;
 
+/** rlm_redis_ippool thread specific data
+ *
+ */
+typedef struct {
+	fr_redis_cluster_thread_t	*cluster_thread;	//!< Thread specific cluster state.
+	fr_redis_trunk_t		*rtrunk;		//!< Trunk used for pipelined lease operations.
+} rlm_redis_ippool_thread_t;
+
 static CONF_PARSER redis_config[] = {
 	REDIS_COMMON_CONFIG,
 	CONF_PARSER_TERMINATOR
@@ -129,6 +145,9 @@ static CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("ipv4_integer", FR_TYPE_BOOL, rlm_redis_ippool_t, ipv4_integer) },
 	{ FR_CONF_OFFSET("copy_on_update", FR_TYPE_BOOL, rlm_redis_ippool_t, copy_on_update), .dflt = "yes", .quote = T_BARE_WORD },
 
+	{ FR_CONF_OFFSET("pipelined", FR_TYPE_BOOL, rlm_redis_ippool_t, pipelined), .dflt = "no" },
+	{ FR_CONF_OFFSET("trunk", FR_TYPE_SUBSECTION, rlm_redis_ippool_t, trunk_conf), .subcs = (void const *) fr_trunk_config },
+
 	/*
 	 *	Split out to allow conversion to universal ippool module with
 	 *	minimum of config changes.
@@ -607,58 +626,23 @@ finish:
 	return s_ret;
 }
 
-/** Allocate a new IP address from a pool
+/** Process the reply to an allocation script
  *
+ * Writes the allocated address, range and expiry to the request.
  */
-static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, request_t *request,
-					    uint8_t const *key_prefix, size_t key_prefix_len,
-					    uint8_t const *owner, size_t owner_len,
-					    uint8_t const *gateway_id, size_t gateway_id_len,
-					    uint32_t expires)
+static ippool_rcode_t ippool_allocate_process(rlm_redis_ippool_t const *inst, request_t *request, redisReply *reply)
 {
-	struct			timeval now;
-	redisReply		*reply = NULL;
+	ippool_rcode_t		ret;
 
-	fr_redis_rcode_t	status;
-	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
-
-	fr_assert(key_prefix);
-	fr_assert(owner);
-
-	now = fr_time_to_timeval(fr_time());
-
-	/*
-	 *	hiredis doesn't deal well with NULL string pointers
-	 */
-	if (!gateway_id) gateway_id = (uint8_t const *)"";
-
-	status = ippool_script(&reply, request, inst->cluster,
-			       key_prefix, key_prefix_len,
-			       inst->wait_num, inst->wait_timeout,
-			       lua_alloc_digest, lua_alloc_cmd,
-	 		       "EVALSHA %s 1 %b %u %u %b %b",
-	 		       lua_alloc_digest,
-			       key_prefix, key_prefix_len,
-			       (unsigned int)now.tv_sec, expires,
-			       owner, owner_len,
-			       gateway_id, gateway_id_len);
-	if (status != REDIS_RCODE_SUCCESS) {
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
-
-	fr_assert(reply);
 	if (reply->type != REDIS_REPLY_ARRAY) {
 		REDEBUG("Expected result to be array got \"%s\"",
 			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
+		return IPPOOL_RCODE_FAIL;
 	}
 
 	if (reply->elements == 0) {
 		REDEBUG("Got empty result array");
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
+		return IPPOOL_RCODE_FAIL;
 	}
 
 	/*
@@ -667,11 +651,10 @@ static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, requ
 	if (reply->element[0]->type != REDIS_REPLY_INTEGER) {
 		REDEBUG("Server returned unexpected type \"%s\" for rcode element (result[0])",
 			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
+		return IPPOOL_RCODE_FAIL;
 	}
 	ret = reply->element[0]->integer;
-	if (ret < 0) goto finish;
+	if (ret < 0) return ret;
 
 	/*
 	 *	Process IP address
@@ -702,8 +685,7 @@ static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, requ
 				if (fr_value_box_cast(NULL, tmpl_value(ip_map.rhs), FR_TYPE_IPV4_ADDR,
 						      NULL, &tmp)) {
 					RPEDEBUG("Failed converting integer to IPv4 address");
-					ret = IPPOOL_RCODE_FAIL;
-					goto finish;
+					return IPPOOL_RCODE_FAIL;
 				}
 			} else {
 				fr_value_box_shallow(&ip_map.rhs->data.literal,
@@ -717,16 +699,14 @@ static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, requ
 						      NULL, reply->element[1]->str, reply->element[1]->len, false);
 		do_ip_map:
 			if (map_to_request(request, &ip_map, map_to_vp, NULL) < 0) {
-				ret = IPPOOL_RCODE_FAIL;
-				goto finish;
+				return IPPOOL_RCODE_FAIL;
 			}
 			break;
 
 		default:
 			REDEBUG("Server returned unexpected type \"%s\" for IP element (result[1])",
 				fr_table_str_by_value(redis_reply_types, reply->element[1]->type, "<UNKNOWN>"));
-			ret = IPPOOL_RCODE_FAIL;
-			goto finish;
+			return IPPOOL_RCODE_FAIL;
 		}
 	}
 
@@ -751,8 +731,7 @@ static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, requ
 			fr_value_box_bstrndup_shallow(&range_map.rhs->data.literal,
 						      NULL, reply->element[2]->str, reply->element[2]->len, true);
 			if (map_to_request(request, &range_map, map_to_vp, NULL) < 0) {
-				ret = IPPOOL_RCODE_FAIL;
-				goto finish;
+				return IPPOOL_RCODE_FAIL;
 			}
 		}
 			break;
@@ -763,8 +742,7 @@ static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, requ
 		default:
 			REDEBUG("Server returned unexpected type \"%s\" for range element (result[2])",
 				fr_table_str_by_value(redis_reply_types, reply->element[2]->type, "<UNKNOWN>"));
-			ret = IPPOOL_RCODE_FAIL;
-			goto finish;
+			return IPPOOL_RCODE_FAIL;
 		}
 	}
 
@@ -783,30 +761,25 @@ static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, requ
 		if (reply->element[3]->type != REDIS_REPLY_INTEGER) {
 			REDEBUG("Server returned unexpected type \"%s\" for expiry element (result[3])",
 				fr_table_str_by_value(redis_reply_types, reply->element[3]->type, "<UNKNOWN>"));
-			ret = IPPOOL_RCODE_FAIL;
-			goto finish;
+			return IPPOOL_RCODE_FAIL;
 		}
 
 		fr_value_box_shallow(&expiry_map.rhs->data.literal, (uint32_t)reply->element[3]->integer, true);
 		if (map_to_request(request, &expiry_map, map_to_vp, NULL) < 0) {
-			ret = IPPOOL_RCODE_FAIL;
-			goto finish;
+			return IPPOOL_RCODE_FAIL;
 		}
 	}
-finish:
-	fr_redis_reply_free(&reply);
 	return ret;
 }
 
-/** Update an existing IP address in a pool
+/** Allocate a new IP address from a pool
  *
  */
-static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, request_t *request,
-					  uint8_t const *key_prefix, size_t key_prefix_len,
-					  fr_ipaddr_t *ip,
-					  uint8_t const *owner, size_t owner_len,
-					  uint8_t const *gateway_id, size_t gateway_id_len,
-					  uint32_t expires)
+static ippool_rcode_t redis_ippool_allocate(rlm_redis_ippool_t const *inst, request_t *request,
+					    uint8_t const *key_prefix, size_t key_prefix_len,
+					    uint8_t const *owner, size_t owner_len,
+					    uint8_t const *gateway_id, size_t gateway_id_len,
+					    uint32_t expires)
 {
 	struct			timeval now;
 	redisReply		*reply = NULL;
@@ -814,63 +787,58 @@ static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, reques
 	fr_redis_rcode_t	status;
 	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
 
-	tmpl_t		range_rhs;
-	map_t		range_map = { .lhs = inst->range_attr, .op = T_OP_SET, .rhs = &range_rhs };
-
-	tmpl_init_shallow(&range_rhs, TMPL_TYPE_DATA, T_DOUBLE_QUOTED_STRING, "", 0);
+	fr_assert(key_prefix);
+	fr_assert(owner);
 
 	now = fr_time_to_timeval(fr_time());
 
 	/*
 	 *	hiredis doesn't deal well with NULL string pointers
 	 */
-	if (!owner) owner = (uint8_t const *)"";
 	if (!gateway_id) gateway_id = (uint8_t const *)"";
 
-	if ((ip->af == AF_INET) && inst->ipv4_integer) {
-		status = ippool_script(&reply, request, inst->cluster,
-				       key_prefix, key_prefix_len,
-				       inst->wait_num, inst->wait_timeout,
-				       lua_update_digest, lua_update_cmd,
-				       "EVALSHA %s 1 %b %u %u %u %b %b",
-				       lua_update_digest,
-				       key_prefix, key_prefix_len,
-				       (unsigned int)now.tv_sec, expires,
-				       htonl(ip->addr.v4.s_addr),
-				       owner, owner_len,
-				       gateway_id, gateway_id_len);
-	} else {
-		char ip_buff[FR_IPADDR_PREFIX_STRLEN];
+	status = ippool_script(&reply, request, inst->cluster,
+			       key_prefix, key_prefix_len,
+			       inst->wait_num, inst->wait_timeout,
+			       lua_alloc_digest, lua_alloc_cmd,
+	 		       "EVALSHA %s 1 %b %u %u %b %b",
+	 		       lua_alloc_digest,
+			       key_prefix, key_prefix_len,
+			       (unsigned int)now.tv_sec, expires,
+			       owner, owner_len,
+			       gateway_id, gateway_id_len);
+	if (status != REDIS_RCODE_SUCCESS) return IPPOOL_RCODE_FAIL;
 
-		IPPOOL_SPRINT_IP(ip_buff, ip, ip->prefix);
-		status = ippool_script(&reply, request, inst->cluster,
-				       key_prefix, key_prefix_len,
-				       inst->wait_num, inst->wait_timeout,
-				       lua_update_digest, lua_update_cmd,
-				       "EVALSHA %s 1 %b %u %u %s %b %b",
-				       lua_update_digest,
-				       key_prefix, key_prefix_len,
-				       (unsigned int)now.tv_sec, expires,
-				       ip_buff,
-				       owner, owner_len,
-				       gateway_id, gateway_id_len);
-	}
-	if (status != REDIS_RCODE_SUCCESS) {
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
-	}
+	fr_assert(reply);
+	ret = ippool_allocate_process(inst, request, reply);
+	fr_redis_reply_free(&reply);
+
+	return ret;
+}
+
+/** Process the reply to an update script
+ *
+ * Writes the range and expiry to the request.
+ */
+static ippool_rcode_t ippool_update_process(rlm_redis_ippool_t const *inst, request_t *request, redisReply *reply,
+					    uint32_t expires)
+{
+	ippool_rcode_t		ret;
+
+	tmpl_t		range_rhs;
+	map_t		range_map = { .lhs = inst->range_attr, .op = T_OP_SET, .rhs = &range_rhs };
+
+	tmpl_init_shallow(&range_rhs, TMPL_TYPE_DATA, T_DOUBLE_QUOTED_STRING, "", 0);
 
 	if (reply->type != REDIS_REPLY_ARRAY) {
 		REDEBUG("Expected result to be array got \"%s\"",
 			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
+		return IPPOOL_RCODE_FAIL;
 	}
 
 	if (reply->elements == 0) {
 		REDEBUG("Got empty result array");
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
+		return IPPOOL_RCODE_FAIL;
 	}
 
 	/*
@@ -879,11 +847,10 @@ static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, reques
 	if (reply->element[0]->type != REDIS_REPLY_INTEGER) {
 		REDEBUG("Server returned unexpected type \"%s\" for rcode element (result[0])",
 			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
+		return IPPOOL_RCODE_FAIL;
 	}
 	ret = reply->element[0]->integer;
-	if (ret < 0) goto finish;
+	if (ret < 0) return ret;
 
 	/*
 	 *	Process Range identifier
@@ -897,8 +864,7 @@ static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, reques
 			fr_value_box_bstrndup_shallow(&range_map.rhs->data.literal, NULL,
 						      reply->element[1]->str, reply->element[1]->len, true);
 			if (map_to_request(request, &range_map, map_to_vp, NULL) < 0) {
-				ret = IPPOOL_RCODE_FAIL;
-				goto finish;
+				return IPPOOL_RCODE_FAIL;
 			}
 			break;
 
@@ -908,8 +874,7 @@ static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, reques
 		default:
 			REDEBUG("Server returned unexpected type \"%s\" for range element (result[1])",
 				fr_table_str_by_value(redis_reply_types, reply->element[0]->type, "<UNKNOWN>"));
-			ret = IPPOOL_RCODE_FAIL;
-			goto finish;
+			return IPPOOL_RCODE_FAIL;
 		}
 	}
 
@@ -929,24 +894,22 @@ static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, reques
 
 		fr_value_box_shallow(&expiry_map.rhs->data.literal, expires, false);
 		if (map_to_request(request, &expiry_map, map_to_vp, NULL) < 0) {
-			ret = IPPOOL_RCODE_FAIL;
-			goto finish;
+			return IPPOOL_RCODE_FAIL;
 		}
 	}
 
-finish:
-	fr_redis_reply_free(&reply);
-
 	return ret;
 }
 
-/** Release an existing IP address in a pool
+/** Update an existing IP address in a pool
  *
  */
-static ippool_rcode_t redis_ippool_release(rlm_redis_ippool_t const *inst, request_t *request,
-					   uint8_t const *key_prefix, size_t key_prefix_len,
-					   fr_ipaddr_t *ip,
-					   uint8_t const *owner, size_t owner_len)
+static ippool_rcode_t redis_ippool_update(rlm_redis_ippool_t const *inst, request_t *request,
+					  uint8_t const *key_prefix, size_t key_prefix_len,
+					  fr_ipaddr_t *ip,
+					  uint8_t const *owner, size_t owner_len,
+					  uint8_t const *gateway_id, size_t gateway_id_len,
+					  uint32_t expires)
 {
 	struct			timeval now;
 	redisReply		*reply = NULL;
@@ -960,18 +923,20 @@ static ippool_rcode_t redis_ippool_release(rlm_redis_ippool_t const *inst, reque
 	 *	hiredis doesn't deal well with NULL string pointers
 	 */
 	if (!owner) owner = (uint8_t const *)"";
+	if (!gateway_id) gateway_id = (uint8_t const *)"";
 
 	if ((ip->af == AF_INET) && inst->ipv4_integer) {
 		status = ippool_script(&reply, request, inst->cluster,
 				       key_prefix, key_prefix_len,
 				       inst->wait_num, inst->wait_timeout,
-				       lua_release_digest, lua_release_cmd,
-				       "EVALSHA %s 1 %b %u %u %b",
-				       lua_release_digest,
+				       lua_update_digest, lua_update_cmd,
+				       "EVALSHA %s 1 %b %u %u %u %b %b",
+				       lua_update_digest,
 				       key_prefix, key_prefix_len,
-				       (unsigned int)now.tv_sec,
+				       (unsigned int)now.tv_sec, expires,
 				       htonl(ip->addr.v4.s_addr),
-				       owner, owner_len);
+				       owner, owner_len,
+				       gateway_id, gateway_id_len);
 	} else {
 		char ip_buff[FR_IPADDR_PREFIX_STRLEN];
 
@@ -979,30 +944,39 @@ static ippool_rcode_t redis_ippool_release(rlm_redis_ippool_t const *inst, reque
 		status = ippool_script(&reply, request, inst->cluster,
 				       key_prefix, key_prefix_len,
 				       inst->wait_num, inst->wait_timeout,
-				       lua_release_digest, lua_release_cmd,
-				       "EVALSHA %s 1 %b %u %s %b",
-				       lua_release_digest,
+				       lua_update_digest, lua_update_cmd,
+				       "EVALSHA %s 1 %b %u %u %s %b %b",
+				       lua_update_digest,
 				       key_prefix, key_prefix_len,
-				       (unsigned int)now.tv_sec,
+				       (unsigned int)now.tv_sec, expires,
 				       ip_buff,
-				       owner, owner_len);
-	}
-	if (status != REDIS_RCODE_SUCCESS) {
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
+				       owner, owner_len,
+				       gateway_id, gateway_id_len);
 	}
+	if (status != REDIS_RCODE_SUCCESS) return IPPOOL_RCODE_FAIL;
+
+	ret = ippool_update_process(inst, request, reply, expires);
+	fr_redis_reply_free(&reply);
+
+	return ret;
+}
+
+/** Process the reply to a release script
+ *
+ */
+static ippool_rcode_t ippool_release_process(request_t *request, redisReply *reply)
+{
+	ippool_rcode_t		ret;
 
 	if (reply->type != REDIS_REPLY_ARRAY) {
 		REDEBUG("Expected result to be array got \"%s\"",
 			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
+		return IPPOOL_RCODE_FAIL;
 	}
 
 	if (reply->elements == 0) {
 		REDEBUG("Got empty result array");
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
+		return IPPOOL_RCODE_FAIL;
 	}
 
 	/*
@@ -1011,13 +985,64 @@ static ippool_rcode_t redis_ippool_release(rlm_redis_ippool_t const *inst, reque
 	if (reply->element[0]->type != REDIS_REPLY_INTEGER) {
 		REDEBUG("Server returned unexpected type \"%s\" for rcode element (result[0])",
 			fr_table_str_by_value(redis_reply_types, reply->type, "<UNKNOWN>"));
-		ret = IPPOOL_RCODE_FAIL;
-		goto finish;
+		return IPPOOL_RCODE_FAIL;
 	}
 	ret = reply->element[0]->integer;
-	if (ret < 0) goto finish;
+	if (ret < 0) return ret;
 
-finish:
+	return ret;
+}
+
+/** Release an existing IP address in a pool
+ *
+ */
+static ippool_rcode_t redis_ippool_release(rlm_redis_ippool_t const *inst, request_t *request,
+					   uint8_t const *key_prefix, size_t key_prefix_len,
+					   fr_ipaddr_t *ip,
+					   uint8_t const *owner, size_t owner_len)
+{
+	struct			timeval now;
+	redisReply		*reply = NULL;
+
+	fr_redis_rcode_t	status;
+	ippool_rcode_t		ret = IPPOOL_RCODE_SUCCESS;
+
+	now = fr_time_to_timeval(fr_time());
+
+	/*
+	 *	hiredis doesn't deal well with NULL string pointers
+	 */
+	if (!owner) owner = (uint8_t const *)"";
+
+	if ((ip->af == AF_INET) && inst->ipv4_integer) {
+		status = ippool_script(&reply, request, inst->cluster,
+				       key_prefix, key_prefix_len,
+				       inst->wait_num, inst->wait_timeout,
+				       lua_release_digest, lua_release_cmd,
+				       "EVALSHA %s 1 %b %u %u %b",
+				       lua_release_digest,
+				       key_prefix, key_prefix_len,
+				       (unsigned int)now.tv_sec,
+				       htonl(ip->addr.v4.s_addr),
+				       owner, owner_len);
+	} else {
+		char ip_buff[FR_IPADDR_PREFIX_STRLEN];
+
+		IPPOOL_SPRINT_IP(ip_buff, ip, ip->prefix);
+		status = ippool_script(&reply, request, inst->cluster,
+				       key_prefix, key_prefix_len,
+				       inst->wait_num, inst->wait_timeout,
+				       lua_release_digest, lua_release_cmd,
+				       "EVALSHA %s 1 %b %u %s %b",
+				       lua_release_digest,
+				       key_prefix, key_prefix_len,
+				       (unsigned int)now.tv_sec,
+				       ip_buff,
+				       owner, owner_len);
+	}
+	if (status != REDIS_RCODE_SUCCESS) return IPPOOL_RCODE_FAIL;
+
+	ret = ippool_release_process(request, reply);
 	fr_redis_reply_free(&reply);
 
 	return ret;
@@ -1062,109 +1087,169 @@ static inline ssize_t ippool_pool_name(uint8_t const **out, uint8_t buff[], size
 	return slen;
 }
 
-static unlang_action_t mod_action(rlm_rcode_t *p_result, rlm_redis_ippool_t const *inst, request_t *request, ippool_action_t action)
+/** Arguments and state for a lease operation
+ *
+ * Lives on the stack for synchronous operations.  Pipelined operations
+ * allocate it in the request, as the request yields until the reply arrives.
+ */
+typedef struct {
+	ippool_action_t		action;				//!< What we're doing.
+
+	uint8_t			key_prefix_buff[IPPOOL_MAX_KEY_PREFIX_SIZE];
+	uint8_t const		*key_prefix;			//!< Name of the pool.
+	size_t			key_prefix_len;
+
+	uint8_t			owner_buff[256];
+	uint8_t const		*owner;				//!< Lease owner.
+	size_t			owner_len;
+
+	uint8_t			gateway_id_buff[256];
+	uint8_t const		*gateway_id;			//!< Gateway the request came through.
+	size_t			gateway_id_len;
+
+	char			ip_buff[INET6_ADDRSTRLEN + 4];
+	char const		*ip_str;			//!< Address being updated or released.
+	fr_ipaddr_t		ip;				//!< Parsed version of ip_str.
+
+	uint32_t		expires;			//!< Offer or lease time.
+
+	fr_redis_command_set_t	*cmds;				//!< Pipelined command set in progress.
+	redisReply		*reply;				//!< Reply to the script.
+	redisReply		*wait_reply;			//!< Reply to WAIT.
+	bool			failed;				//!< Command set could not be executed.
+	bool			eval;				//!< Script was sent in full with EVAL.
+} ippool_action_ctx_t;
+
+/** Expand the arguments for a lease operation
+ *
+ * @param[in,out] actx	to write the expanded arguments to.  actx->action
+ *			must be set.
+ * @param[in] inst	This instance of the rlm_redis_ippool module.
+ * @param[in] request	The current request.
+ * @return
+ *	- -1 on error.
+ *	- 0 if there's nothing to do.
+ *	- 1 if the operation should be performed.
+ */
+static int ippool_action_expand(ippool_action_ctx_t *actx, rlm_redis_ippool_t const *inst, request_t *request)
 {
-	uint8_t		key_prefix_buff[IPPOOL_MAX_KEY_PREFIX_SIZE], owner_buff[256], gateway_id_buff[256];
-	uint8_t const	*key_prefix, *owner = NULL, *gateway_id = NULL;
-	size_t		key_prefix_len, owner_len = 0, gateway_id_len = 0;
 	ssize_t		slen;
-	fr_ipaddr_t	ip;
 	char		expires_buff[20];
 	char const	*expires_str;
 	unsigned long	expires = 0;
 	char		*q;
 
-	slen = ippool_pool_name(&key_prefix, (uint8_t *)&key_prefix_buff, sizeof(key_prefix_len), inst, request);
-	if (slen < 0) RETURN_MODULE_FAIL;
-	if (slen == 0) RETURN_MODULE_NOOP;
+	slen = ippool_pool_name(&actx->key_prefix, actx->key_prefix_buff, sizeof(actx->key_prefix_buff), inst, request);
+	if (slen <= 0) return slen;
 
-	key_prefix_len = (size_t)slen;
+	actx->key_prefix_len = (size_t)slen;
 
 	if (inst->owner) {
-		slen = tmpl_expand((char const **)&owner,
-				   (char *)&owner_buff, sizeof(owner_buff),
+		slen = tmpl_expand((char const **)&actx->owner,
+				   (char *)&actx->owner_buff, sizeof(actx->owner_buff),
 				   request, inst->owner, NULL, NULL);
 		if (slen < 0) {
 			REDEBUG("Failed expanding device (%s)", inst->owner->name);
-			RETURN_MODULE_FAIL;
+			return -1;
 		}
-		owner_len = (size_t)slen;
+		actx->owner_len = (size_t)slen;
 	}
 
 	if (inst->gateway_id) {
-		slen = tmpl_expand((char const **)&gateway_id,
-				   (char *)&gateway_id_buff, sizeof(gateway_id_buff),
+		slen = tmpl_expand((char const **)&actx->gateway_id,
+				   (char *)&actx->gateway_id_buff, sizeof(actx->gateway_id_buff),
 				   request, inst->gateway_id, NULL, NULL);
 		if (slen < 0) {
 			REDEBUG("Failed expanding gateway (%s)", inst->gateway_id->name);
-			RETURN_MODULE_FAIL;
+			return -1;
 		}
-		gateway_id_len = (size_t)slen;
+		actx->gateway_id_len = (size_t)slen;
 	}
 
-	switch (action) {
+	switch (actx->action) {
 	case POOL_ACTION_ALLOCATE:
 		if (tmpl_expand(&expires_str, expires_buff, sizeof(expires_buff),
 				request, inst->offer_time, NULL, NULL) < 0) {
 			REDEBUG("Failed expanding offer_time (%s)", inst->offer_time->name);
-			RETURN_MODULE_FAIL;
+			return -1;
 		}
 
 		expires = strtoul(expires_str, &q, 10);
 		if (q != (expires_str + strlen(expires_str))) {
 			REDEBUG("Invalid offer_time.  Must be an integer value");
-			RETURN_MODULE_FAIL;
-		}
-
-		ippool_action_print(request, action, L_DBG_LVL_2, key_prefix, key_prefix_len, NULL,
-				    owner, owner_len, gateway_id, gateway_id_len, expires);
-		switch (redis_ippool_allocate(inst, request, key_prefix, key_prefix_len,
-					      owner, owner_len,
-					      gateway_id, gateway_id_len, (uint32_t)expires)) {
-		case IPPOOL_RCODE_SUCCESS:
-			RDEBUG2("IP address lease allocated");
-			RETURN_MODULE_UPDATED;
-
-		case IPPOOL_RCODE_POOL_EMPTY:
-			RWDEBUG("Pool contains no free addresses");
-			RETURN_MODULE_NOTFOUND;
-
-		default:
-			RETURN_MODULE_FAIL;
+			return -1;
 		}
+		break;
 
 	case POOL_ACTION_UPDATE:
-	{
-		char		ip_buff[INET6_ADDRSTRLEN + 4];
-		char const	*ip_str;
-
 		if (tmpl_expand(&expires_str, expires_buff, sizeof(expires_buff),
 				request, inst->lease_time, NULL, NULL) < 0) {
 			REDEBUG("Failed expanding lease_time (%s)", inst->lease_time->name);
-			RETURN_MODULE_FAIL;
+			return -1;
 		}
 
 		expires = strtoul(expires_str, &q, 10);
 		if (q != (expires_str + strlen(expires_str))) {
 			REDEBUG("Invalid expires.  Must be an integer value");
-			RETURN_MODULE_FAIL;
+			return -1;
 		}
+		FALL_THROUGH;
 
-		if (tmpl_expand(&ip_str, ip_buff, sizeof(ip_buff), request, inst->requested_address, NULL, NULL) < 0) {
+	case POOL_ACTION_RELEASE:
+		if (tmpl_expand(&actx->ip_str, actx->ip_buff, sizeof(actx->ip_buff),
+				request, inst->requested_address, NULL, NULL) < 0) {
 			REDEBUG("Failed expanding requested_address (%s)", inst->requested_address->name);
-			RETURN_MODULE_FAIL;
+			return -1;
 		}
 
-		if (fr_inet_pton(&ip, ip_str, -1, AF_UNSPEC, false, true) < 0) {
+		if (fr_inet_pton(&actx->ip, actx->ip_str, -1, AF_UNSPEC, false, true) < 0) {
 			RPEDEBUG("Failed parsing address");
+			return -1;
+		}
+		break;
+
+	case POOL_ACTION_BULK_RELEASE:
+		RDEBUG2("Bulk release not yet implemented");
+		return 0;
+
+	default:
+		fr_assert(0);
+		return -1;
+	}
+
+	actx->expires = (uint32_t)expires;
+
+	ippool_action_print(request, actx->action, L_DBG_LVL_2, actx->key_prefix, actx->key_prefix_len, actx->ip_str,
+			    actx->owner, actx->owner_len, actx->gateway_id, actx->gateway_id_len, actx->expires);
+
+	return 1;
+}
+
+/** Convert the result of a lease operation to a module rcode
+ *
+ */
+static unlang_action_t ippool_action_rcode(rlm_rcode_t *p_result, rlm_redis_ippool_t const *inst, request_t *request,
+					   ippool_action_ctx_t const *actx, ippool_rcode_t ret)
+{
+	char const *ip_str = actx->ip_str;
+
+	switch (actx->action) {
+	case POOL_ACTION_ALLOCATE:
+		switch (ret) {
+		case IPPOOL_RCODE_SUCCESS:
+			RDEBUG2("IP address lease allocated");
+			RETURN_MODULE_UPDATED;
+
+		case IPPOOL_RCODE_POOL_EMPTY:
+			RWDEBUG("Pool contains no free addresses");
+			RETURN_MODULE_NOTFOUND;
+
+		default:
 			RETURN_MODULE_FAIL;
 		}
 
-		ippool_action_print(request, action, L_DBG_LVL_2, key_prefix, key_prefix_len,
-				    ip_str, owner, owner_len, gateway_id, gateway_id_len, expires);
-		switch (redis_ippool_update(inst, request, key_prefix, key_prefix_len,
-					    &ip, owner, owner_len,
-					    gateway_id, gateway_id_len, (uint32_t)expires)) {
+	case POOL_ACTION_UPDATE:
+		switch (ret) {
 		case IPPOOL_RCODE_SUCCESS:
 			RDEBUG2("Requested IP address' \"%s\" lease updated", ip_str);
 
@@ -1209,27 +1294,9 @@ static unlang_action_t mod_action(rlm_rcode_t *p_result, rlm_redis_ippool_t cons
 		default:
 			RETURN_MODULE_FAIL;
 		}
-	}
 
 	case POOL_ACTION_RELEASE:
-	{
-		char		ip_buff[INET6_ADDRSTRLEN + 4];
-		char const	*ip_str;
-
-		if (tmpl_expand(&ip_str, ip_buff, sizeof(ip_buff), request, inst->requested_address, NULL, NULL) < 0) {
-			REDEBUG("Failed expanding requested_address (%s)", inst->requested_address->name);
-			RETURN_MODULE_FAIL;
-		}
-
-		if (fr_inet_pton(&ip, ip_str, -1, AF_UNSPEC, false, true) < 0) {
-			RPEDEBUG("Failed parsing address");
-			RETURN_MODULE_FAIL;
-		}
-
-		ippool_action_print(request, action, L_DBG_LVL_2, key_prefix, key_prefix_len,
-				    ip_str, owner, owner_len, gateway_id, gateway_id_len, 0);
-		switch (redis_ippool_release(inst, request, key_prefix, key_prefix_len,
-					     &ip, owner, owner_len)) {
+		switch (ret) {
 		case IPPOOL_RCODE_SUCCESS:
 			RDEBUG2("IP address \"%s\" released", ip_str);
 			RETURN_MODULE_UPDATED;
@@ -1250,28 +1317,334 @@ static unlang_action_t mod_action(rlm_rcode_t *p_result, rlm_redis_ippool_t cons
 		default:
 			RETURN_MODULE_FAIL;
 		}
+
+	default:
+		fr_assert(0);
+		RETURN_MODULE_FAIL;
 	}
+}
 
-	case POOL_ACTION_BULK_RELEASE:
-		RDEBUG2("Bulk release not yet implemented");
+#ifdef WITH_REDIS_PIPELINE
+/** Free any replies we're holding, and cancel the command set if it's still in progress
+ *
+ */
+static int _ippool_action_ctx_free(ippool_action_ctx_t *actx)
+{
+	if (actx->cmds) fr_redis_command_set_signal_cancel(actx->cmds);
+	fr_redis_reply_free(&actx->reply);
+	fr_redis_reply_free(&actx->wait_reply);
+
+	return 0;
+}
+
+/** Take ownership of the script and WAIT replies
+ *
+ */
+static void ippool_script_complete(request_t *request, fr_dlist_head_t *completed, void *rctx)
+{
+	ippool_action_ctx_t	*actx = talloc_get_type_abort(rctx, ippool_action_ctx_t);
+	fr_redis_command_t	*cmd;
+
+	actx->cmds = NULL;	/* Freed by the trunk */
+
+	cmd = fr_dlist_head(completed);
+	if (cmd) {
+		actx->reply = fr_redis_command_steal_result(cmd);
+		cmd = fr_dlist_next(completed, cmd);
+		if (cmd) actx->wait_reply = fr_redis_command_steal_result(cmd);
+	}
+
+	unlang_interpret_mark_runnable(request);
+}
+
+/** Record that the command set couldn't be executed
+ *
+ */
+static void ippool_script_fail(request_t *request, UNUSED fr_dlist_head_t *completed, void *rctx)
+{
+	ippool_action_ctx_t	*actx = talloc_get_type_abort(rctx, ippool_action_ctx_t);
+
+	actx->cmds = NULL;	/* Freed by the trunk */
+	actx->failed = true;
+
+	unlang_interpret_mark_runnable(request);
+}
+
+/** Enqueue the script for a lease operation on this thread's trunk
+ *
+ * Scripts from all the requests being processed by a worker are written
+ * to the server in a single pipelined write.
+ *
+ * @param[in] t		Thread specific data, containing the trunk.
+ * @param[in] inst	This instance of the rlm_redis_ippool module.
+ * @param[in] request	The current request.
+ * @param[in] actx	Expanded arguments for the operation.  If actx->eval
+ *			is true, the script is sent in full with EVAL.
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.
+ */
+static int ippool_script_send(rlm_redis_ippool_thread_t *t, rlm_redis_ippool_t const *inst, request_t *request,
+			      ippool_action_ctx_t *actx)
+{
+	char const	*argv[9];
+	size_t		argvlen[NUM_ELEMENTS(argv)];
+	int		argc = 0;
+	char		now_buff[20], expires_buff[20], ip_buff[FR_IPADDR_PREFIX_STRLEN];
+	char		wait_num_buff[20], wait_timeout_buff[20];
+	char const	*digest, *script;
+	uint8_t const	*owner = actx->owner ? actx->owner : (uint8_t const *)"";
+	uint8_t const	*gateway_id = actx->gateway_id ? actx->gateway_id : (uint8_t const *)"";
+
+#define IPPOOL_ARG(_str, _len) \
+do { \
+	argv[argc] = (char const *)(_str); \
+	argvlen[argc++] = (_len); \
+} while (0)
+#define IPPOOL_ARG_STR(_str) IPPOOL_ARG(_str, strlen(_str))
+
+	switch (actx->action) {
+	case POOL_ACTION_ALLOCATE:
+		digest = lua_alloc_digest;
+		script = lua_alloc_cmd;
+		break;
+
+	case POOL_ACTION_UPDATE:
+		digest = lua_update_digest;
+		script = lua_update_cmd;
+		break;
+
+	case POOL_ACTION_RELEASE:
+		digest = lua_release_digest;
+		script = lua_release_cmd;
+		break;
+
+	default:
+		fr_assert(0);
+		return -1;
+	}
+
+	if (actx->eval) {
+		IPPOOL_ARG_STR("EVAL");
+		IPPOOL_ARG_STR(script);
+	} else {
+		IPPOOL_ARG_STR("EVALSHA");
+		IPPOOL_ARG_STR(digest);
+	}
+	IPPOOL_ARG_STR("1");
+	IPPOOL_ARG(actx->key_prefix, actx->key_prefix_len);
+
+	snprintf(now_buff, sizeof(now_buff), "%u", (unsigned int)fr_time_to_timeval(fr_time()).tv_sec);
+	IPPOOL_ARG_STR(now_buff);
+
+	if (actx->action != POOL_ACTION_RELEASE) {
+		snprintf(expires_buff, sizeof(expires_buff), "%u", actx->expires);
+		IPPOOL_ARG_STR(expires_buff);
+	}
+
+	if (actx->action != POOL_ACTION_ALLOCATE) {
+		if ((actx->ip.af == AF_INET) && inst->ipv4_integer) {
+			snprintf(ip_buff, sizeof(ip_buff), "%u", htonl(actx->ip.addr.v4.s_addr));
+		} else {
+			IPPOOL_SPRINT_IP(ip_buff, &actx->ip, actx->ip.prefix);
+		}
+		IPPOOL_ARG_STR(ip_buff);
+	}
+
+	IPPOOL_ARG(owner, actx->owner_len);
+	if (actx->action != POOL_ACTION_RELEASE) IPPOOL_ARG(gateway_id, actx->gateway_id_len);
+
+	RDEBUG3("Calling script 0x%s", digest);
+	actx->cmds = fr_redis_command_set_alloc(NULL, request, ippool_script_complete, ippool_script_fail, actx);
+	if (fr_redis_command_argv_add(actx->cmds, argc, argv, argvlen) != FR_REDIS_PIPELINE_OK) {
+	error:
+		REDEBUG("Failed enqueueing script");
+		talloc_free(actx->cmds);
+		actx->cmds = NULL;
+		return -1;
+	}
+
+	if (inst->wait_num) {
+		argc = 0;
+		snprintf(wait_num_buff, sizeof(wait_num_buff), "%u", inst->wait_num);
+		snprintf(wait_timeout_buff, sizeof(wait_timeout_buff), "%" PRIu64,
+			 (uint64_t)fr_time_delta_to_msec(inst->wait_timeout));
+		IPPOOL_ARG_STR("WAIT");
+		IPPOOL_ARG_STR(wait_num_buff);
+		IPPOOL_ARG_STR(wait_timeout_buff);
+		if (fr_redis_command_argv_add(actx->cmds, argc, argv, argvlen) != FR_REDIS_PIPELINE_OK) goto error;
+	}
+#undef IPPOOL_ARG_STR
+#undef IPPOOL_ARG
+
+	if (redis_command_set_enqueue(t->rtrunk, actx->cmds) != FR_REDIS_PIPELINE_OK) goto error;
+
+	return 0;
+}
+
+static void mod_action_signal(UNUSED module_ctx_t const *mctx, UNUSED request_t *request,
+			      void *rctx, fr_state_signal_t action)
+{
+	if (action != FR_SIGNAL_CANCEL) return;
+
+	talloc_free(rctx);	/* Cancels the command set */
+}
+
+/** Process the reply to a pipelined lease operation
+ *
+ */
+static unlang_action_t mod_action_resume(rlm_rcode_t *p_result, module_ctx_t const *mctx,
+					 request_t *request, void *rctx)
+{
+	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_redis_ippool_t);
+	rlm_redis_ippool_thread_t	*t = talloc_get_type_abort(mctx->thread, rlm_redis_ippool_thread_t);
+	ippool_action_ctx_t		*actx = talloc_get_type_abort(rctx, ippool_action_ctx_t);
+	redisReply			*reply = actx->reply;
+	ippool_rcode_t			ret;
+	unlang_action_t			ua;
+
+	if (actx->failed || !reply) {
+		REDEBUG("Failed executing script");
+	fail:
+		ret = IPPOOL_RCODE_FAIL;
+		goto finish;
+	}
+
+	if (RDEBUG_ENABLED3) fr_redis_reply_print(L_DBG_LVL_3, reply, request, 0);
+
+	if (reply->type == REDIS_REPLY_ERROR) {
+		/*
+		 *	The server doesn't have the script cached.
+		 *	Send it in full, which caches it for the
+		 *	EVALSHA calls that follow.
+		 */
+		if (!actx->eval && (strncmp(reply->str, "NOSCRIPT", sizeof("NOSCRIPT") - 1) == 0)) {
+			RDEBUG3("Loading script");
+			fr_redis_reply_free(&actx->reply);
+			fr_redis_reply_free(&actx->wait_reply);
+			actx->eval = true;
+			if (ippool_script_send(t, inst, request, actx) < 0) goto fail;
+
+			return unlang_module_yield(request, mod_action_resume, mod_action_signal, actx);
+		}
+
+		REDEBUG("Script failed: %s", reply->str);
+		goto fail;
+	}
+
+	if (inst->wait_num && (!actx->wait_reply || (ippool_wait_check(request, inst->wait_num, actx->wait_reply) < 0))) {
+		goto fail;
+	}
+
+	switch (actx->action) {
+	case POOL_ACTION_ALLOCATE:
+		ret = ippool_allocate_process(inst, request, reply);
+		break;
+
+	case POOL_ACTION_UPDATE:
+		ret = ippool_update_process(inst, request, reply, actx->expires);
+		break;
+
+	case POOL_ACTION_RELEASE:
+		ret = ippool_release_process(request, reply);
+		break;
+
+	default:
+		fr_assert(0);
+		goto fail;
+	}
+
+finish:
+	ua = ippool_action_rcode(p_result, inst, request, actx, ret);
+	talloc_free(actx);
+
+	return ua;
+}
+#endif
+
+static unlang_action_t mod_action(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request,
+				  ippool_action_t action)
+{
+	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_redis_ippool_t);
+	ippool_action_ctx_t		sync_actx, *actx;
+	ippool_rcode_t			ret;
+
+	/*
+	 *	Pipelined operations yield, so the arguments
+	 *	have to outlive this stack frame.
+	 */
+	if (inst->pipelined) {
+		MEM(actx = talloc_zero(request, ippool_action_ctx_t));
+#ifdef WITH_REDIS_PIPELINE
+		talloc_set_destructor(actx, _ippool_action_ctx_free);
+#endif
+	} else {
+		memset(&sync_actx, 0, sizeof(sync_actx));
+		actx = &sync_actx;
+	}
+	actx->action = action;
+
+	switch (ippool_action_expand(actx, inst, request)) {
+	case 1:
+		break;
+
+	case 0:
+		if (inst->pipelined) talloc_free(actx);
 		RETURN_MODULE_NOOP;
 
+	default:
+		if (inst->pipelined) talloc_free(actx);
+		RETURN_MODULE_FAIL;
+	}
+
+#ifdef WITH_REDIS_PIPELINE
+	if (inst->pipelined) {
+		rlm_redis_ippool_thread_t *t = talloc_get_type_abort(mctx->thread, rlm_redis_ippool_thread_t);
+
+		if (ippool_script_send(t, inst, request, actx) < 0) {
+			talloc_free(actx);
+			RETURN_MODULE_FAIL;
+		}
+
+		return unlang_module_yield(request, mod_action_resume, mod_action_signal, actx);
+	}
+#endif
+
+	switch (action) {
+	case POOL_ACTION_ALLOCATE:
+		ret = redis_ippool_allocate(inst, request, actx->key_prefix, actx->key_prefix_len,
+					    actx->owner, actx->owner_len,
+					    actx->gateway_id, actx->gateway_id_len, actx->expires);
+		break;
+
+	case POOL_ACTION_UPDATE:
+		ret = redis_ippool_update(inst, request, actx->key_prefix, actx->key_prefix_len,
+					  &actx->ip, actx->owner, actx->owner_len,
+					  actx->gateway_id, actx->gateway_id_len, actx->expires);
+		break;
+
+	case POOL_ACTION_RELEASE:
+		ret = redis_ippool_release(inst, request, actx->key_prefix, actx->key_prefix_len,
+					   &actx->ip, actx->owner, actx->owner_len);
+		break;
+
 	default:
 		fr_assert(0);
 		RETURN_MODULE_FAIL;
 	}
+
+	return ippool_action_rcode(p_result, inst, request, actx, ret);
 }
 
 static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_redis_ippool_t);
 	fr_pair_t			*vp;
 
 	/*
 	 *	IP-Pool.Action override
 	 */
 	vp = fr_pair_find_by_da(&request->control_pairs, attr_pool_action, 0);
-	if (vp) return mod_action(p_result, inst, request, vp->vp_uint32);
+	if (vp) return mod_action(p_result, mctx, request, vp->vp_uint32);
 
 	/*
 	 *	Otherwise, guess the action by Acct-Status-Type
@@ -1284,14 +1657,14 @@ static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, mo
 
 	if ((vp->vp_uint32 == enum_acct_status_type_start->vb_uint32) ||
 	    (vp->vp_uint32 == enum_acct_status_type_interim_update->vb_uint32)) {
-		return mod_action(p_result, inst, request, POOL_ACTION_UPDATE);
+		return mod_action(p_result, mctx, request, POOL_ACTION_UPDATE);
 
 	} else if (vp->vp_uint32 == enum_acct_status_type_stop->vb_uint32) {
-		return mod_action(p_result, inst, request, POOL_ACTION_RELEASE);
+		return mod_action(p_result, mctx, request, POOL_ACTION_RELEASE);
 
 	} else if ((vp->vp_uint32 == enum_acct_status_type_on->vb_uint32) ||
 		   (vp->vp_uint32 == enum_acct_status_type_off->vb_uint32)) {
-		return mod_action(p_result, inst, request, POOL_ACTION_BULK_RELEASE);
+		return mod_action(p_result, mctx, request, POOL_ACTION_BULK_RELEASE);
 
 	}
 
@@ -1300,7 +1673,6 @@ static unlang_action_t CC_HINT(nonnull) mod_accounting(rlm_rcode_t *p_result, mo
 
 static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_redis_ippool_t);
 	fr_pair_t			*vp;
 
 	/*
@@ -1308,12 +1680,11 @@ static unlang_action_t CC_HINT(nonnull) mod_authorize(rlm_rcode_t *p_result, mod
 	 *	when called in Post-Auth.
 	 */
 	vp = fr_pair_find_by_da(&request->control_pairs, attr_pool_action, 0);
-	return mod_action(p_result, inst, request, vp ? vp->vp_uint32 : POOL_ACTION_ALLOCATE);
+	return mod_action(p_result, mctx, request, vp ? vp->vp_uint32 : POOL_ACTION_ALLOCATE);
 }
 
 static unlang_action_t CC_HINT(nonnull) mod_post_auth(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_redis_ippool_t);
 	fr_pair_t			*vp;
 	ippool_action_t			action = POOL_ACTION_ALLOCATE;
 
@@ -1339,12 +1710,11 @@ static unlang_action_t CC_HINT(nonnull) mod_post_auth(rlm_rcode_t *p_result, mod
 	}
 
 run:
-	return mod_action(p_result, inst, request, action);
+	return mod_action(p_result, mctx, request, action);
 }
 
 static unlang_action_t CC_HINT(nonnull) mod_request(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_redis_ippool_t);
 	fr_pair_t			*vp;
 
 	/*
@@ -1353,12 +1723,11 @@ static unlang_action_t CC_HINT(nonnull) mod_request(rlm_rcode_t *p_result, modul
 	 */
 
 	vp = fr_pair_find_by_da(&request->control_pairs, attr_pool_action, 0);
-	return mod_action(p_result, inst, request, vp ? vp->vp_uint32 : POOL_ACTION_UPDATE);
+	return mod_action(p_result, mctx, request, vp ? vp->vp_uint32 : POOL_ACTION_UPDATE);
 }
 
 static unlang_action_t CC_HINT(nonnull) mod_release(rlm_rcode_t *p_result, module_ctx_t const *mctx, request_t *request)
 {
-	rlm_redis_ippool_t const	*inst = talloc_get_type_abort_const(mctx->instance, rlm_redis_ippool_t);
 	fr_pair_t			*vp;
 
 	/*
@@ -1367,7 +1736,7 @@ static unlang_action_t CC_HINT(nonnull) mod_release(rlm_rcode_t *p_result, modul
 	 */
 
 	vp = fr_pair_find_by_da(&request->control_pairs, attr_pool_action, 0);
-	return mod_action(p_result, inst, request, vp ? vp->vp_uint32 : POOL_ACTION_RELEASE);
+	return mod_action(p_result, mctx, request, vp ? vp->vp_uint32 : POOL_ACTION_RELEASE);
 }
 
 static int mod_instantiate(void *instance, CONF_SECTION *conf)
@@ -1388,6 +1757,29 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	/*
+	 *	The async I/O code doesn't follow cluster
+	 *	redirects, so pipelining is only available
+	 *	when talking to a single server.
+	 */
+	if (inst->pipelined) {
+#ifndef WITH_REDIS_PIPELINE
+		cf_log_err(conf, "'pipelined' requires a version of hiredis with async pipelining support "
+			   "(redisAsyncFormattedCommand and REDIS_NO_AUTO_FREE_REPLIES)");
+		return -1;
+#else
+		if (talloc_array_length(inst->conf.hostname) > 1) {
+			cf_log_err(conf, "'pipelined' requires a single 'server'");
+			return -1;
+		}
+
+		memcpy(&inst->io_conf.hostname, &inst->conf.hostname[0], sizeof(inst->io_conf.hostname));
+		inst->io_conf.port = inst->conf.port;
+		inst->io_conf.password = inst->conf.password;
+		inst->io_conf.database = inst->conf.database;
+#endif
+	}
+
 	/*
 	 *	Pre-Compute the SHA1 hashes of the Lua scripts
 	 */
@@ -1420,6 +1812,38 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 	return 0;
 }
 
+/** Allocate the trunk used for pipelined lease operations
+ *
+ */
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, UNUSED void *instance,
+				  UNUSED fr_event_list_t *el, UNUSED void *thread)
+{
+#ifdef WITH_REDIS_PIPELINE
+	rlm_redis_ippool_t		*inst = talloc_get_type_abort(instance, rlm_redis_ippool_t);
+	rlm_redis_ippool_thread_t	*t = talloc_get_type_abort(thread, rlm_redis_ippool_thread_t);
+
+	if (!inst->pipelined) return 0;
+
+	t->cluster_thread = fr_redis_cluster_thread_alloc(t, el, &inst->trunk_conf);
+	t->rtrunk = fr_redis_trunk_alloc(t->cluster_thread, &inst->io_conf);
+	if (!t->rtrunk) {
+		PERROR("Failed allocating trunk");
+		return -1;
+	}
+#endif
+
+	return 0;
+}
+
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_redis_ippool_thread_t	*t = talloc_get_type_abort(thread, rlm_redis_ippool_thread_t);
+
+	talloc_free(t->cluster_thread);
+
+	return 0;
+}
+
 static int mod_load(void)
 {
 	fr_redis_version_print();
@@ -1436,6 +1860,10 @@ module_t rlm_redis_ippool = {
 	.config		= module_config,
 	.onload		= mod_load,
 	.instantiate	= mod_instantiate,
+	.thread_inst_size	= sizeof(rlm_redis_ippool_thread_t),
+	.thread_inst_type	= "rlm_redis_ippool_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_ACCOUNTING]	= mod_accounting,
 		[MOD_AUTHORIZE]		= mod_authorize,
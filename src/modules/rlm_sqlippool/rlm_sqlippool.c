@@ -29,14 +29,20 @@ RCSID("$Id$")
 #define LOG_PREFIX_ARGS inst->sql_instance_name
 
 #include <rlm_sql.h>
+#include <freeradius-devel/io/schedule.h>
 #include <freeradius-devel/util/debug.h>
 #include <freeradius-devel/radius/radius.h>
 
+#include <freeradius-devel/util/heap.h>
+
 #include <ctype.h>
+#include <pthread.h>
 
 
 #define MAX_QUERY_LEN 4096
 
+typedef struct sqlippool_state_s sqlippool_state_t;
+
 /*
  *	Define a structure for our module configuration.
  */
@@ -51,6 +57,8 @@ typedef struct {
 	fr_dict_attr_t const *allocated_address_da; //!< the attribute for IP address allocation
 	char const	*allocated_address_attr;	//!< name of the IP address attribute
 	tmpl_t		*requested_address;	//!< name of the requested IP address attribute
+	tmpl_t		*owner;			//!< Identifies the owner of a lease.
+	tmpl_t		*gateway;		//!< Identifies the gateway a lease was allocated through.
 
 						/* Alloc sequence */
 	char const	*alloc_begin;		//!< SQL query to begin.
@@ -62,6 +70,8 @@ typedef struct {
 
 	char const	*pool_check;		//!< Query to check for the existence of the pool.
 
+	char const	*load_leases;		//!< SQL query to load every lease, for in_memory.
+
 						/* Update sequence */
 	char const	*update_begin;		//!< SQL query to begin.
 	char const	*update_free;		//!< SQL query to clear offered IPs
@@ -93,8 +103,86 @@ typedef struct {
 						/* Reserved to handle 255.255.255.254 Requests */
 	char const	*defaultpool;		//!< Default Pool-Name if there is none in the check items.
 
+						/* In-memory pool state */
+	bool		in_memory;		//!< Serve leases from memory, and write changes behind to SQL.
+	char const	*write_begin;		//!< SQL query to begin writing a batch of changes.
+	char const	*write_commit;		//!< SQL query to commit a batch of changes.
+	uint32_t	write_behind_batch;	//!< Write queued changes once there are this many.
+	fr_time_delta_t	write_behind_delay;	//!< Maximum time changes are queued for.
+	uint32_t	write_behind_max;	//!< Refuse changes once this many are waiting.
+
+	sqlippool_state_t *state;		//!< Leases and queued changes, shared by all threads.
 } rlm_sqlippool_t;
 
+/** A lease held in memory
+ *
+ */
+typedef struct {
+	fr_rb_node_t	address_node;		//!< Entry in the pool's address tree.
+	fr_rb_node_t	owner_node;		//!< Entry in the pool's owner tree.
+	int32_t		heap_id;		//!< Position in the pool's expiry heap.
+
+	char const	*address;		//!< Address, as stored in SQL.
+	char const	*owner;			//!< Current owner, or NULL if the lease has never been used.
+	char const	*gateway;		//!< Gateway the lease was allocated through.
+	time_t		expires;		//!< When the lease expires.
+
+	bool		is_static;		//!< Only ever allocated to its owner, and never expires.
+	bool		declined;		//!< Marked as bad, never allocated.
+} sqlippool_lease_t;
+
+/** A pool held in memory
+ *
+ * Dynamic leases live in the expiry heap for their whole life.  The lease at the
+ * top of the heap is the one which expired longest ago, so allocating a free
+ * address only means checking the top of the heap.
+ */
+typedef struct {
+	fr_rb_node_t	node;			//!< Entry in the tree of pools.
+	char const	*name;			//!< Pool name.
+
+	fr_rb_tree_t	*by_address;		//!< Every lease in the pool.
+	fr_rb_tree_t	*by_owner;		//!< Leases which have an owner.
+	fr_heap_t	*expiry;		//!< Dynamic leases, earliest expiry first.
+} sqlippool_pool_t;
+
+/** Stands in for a value in a queued statement, until it's escaped
+ *
+ */
+#define SQLIPPOOL_VALUE_MARKER	'\x1f'
+
+/** A change waiting to be written to SQL
+ *
+ */
+typedef struct {
+	fr_dlist_t	entry;			//!< Entry in the write-behind queue.
+	char		*query;			//!< Expanded SQL statement, with markers in place of values.
+	char		**values;		//!< Unescaped values, in the order of their markers.
+	unsigned int	num_values;		//!< How many values there are.
+} sqlippool_write_t;
+
+struct sqlippool_state_s {
+	pthread_mutex_t	mutex;			//!< Protects everything below.
+	pthread_cond_t	cond;			//!< Signalled when the writer has work, or must stop.
+
+	bool		loaded;			//!< Whether the pools have been read from SQL.
+	fr_rb_tree_t	*pools;			//!< Pools, indexed by name.
+
+	fr_dlist_head_t	queue;			//!< Statements waiting to be written.
+	fr_time_t	queued_at;		//!< When the oldest statement in the queue was added.
+	uint32_t	num_pending;		//!< Statements queued, or being written.
+
+	pthread_t	writer;			//!< Writes the queue to SQL.
+	bool		writer_running;		//!< Whether the writer has been started.
+	bool		stop;			//!< Tells the writer to write what's left, and exit.
+	uint32_t	num_threads;		//!< Worker threads using the pools.
+};
+
+typedef struct {
+	rlm_sqlippool_t const	*inst;		//!< Instance of rlm_sqlippool.
+	bool			started;	//!< Counted in the state's num_threads.
+} rlm_sqlippool_thread_t;
+
 static CONF_PARSER message_config[] = {
 	{ FR_CONF_OFFSET("exists", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, log_exists) },
 	{ FR_CONF_OFFSET("success", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, log_success) },
@@ -104,6 +192,16 @@ static CONF_PARSER message_config[] = {
 	CONF_PARSER_TERMINATOR
 };
 
+static CONF_PARSER in_memory_config[] = {
+	{ FR_CONF_OFFSET("enable", FR_TYPE_BOOL, rlm_sqlippool_t, in_memory), .dflt = "no" },
+	{ FR_CONF_OFFSET("begin", FR_TYPE_STRING, rlm_sqlippool_t, write_begin), .dflt = "BEGIN" },
+	{ FR_CONF_OFFSET("commit", FR_TYPE_STRING, rlm_sqlippool_t, write_commit), .dflt = "COMMIT" },
+	{ FR_CONF_OFFSET("write_behind_batch", FR_TYPE_UINT32, rlm_sqlippool_t, write_behind_batch), .dflt = "100" },
+	{ FR_CONF_OFFSET("write_behind_delay", FR_TYPE_TIME_DELTA, rlm_sqlippool_t, write_behind_delay), .dflt = "1.0" },
+	{ FR_CONF_OFFSET("write_behind_max", FR_TYPE_UINT32, rlm_sqlippool_t, write_behind_max), .dflt = "10000" },
+	CONF_PARSER_TERMINATOR
+};
+
 static CONF_PARSER module_config[] = {
 	{ FR_CONF_OFFSET("sql_module_instance", FR_TYPE_STRING | FR_TYPE_REQUIRED, rlm_sqlippool_t, sql_instance_name), .dflt = "sql" },
 
@@ -115,6 +213,10 @@ static CONF_PARSER module_config[] = {
 
 	{ FR_CONF_OFFSET("requested_address", FR_TYPE_TMPL, rlm_sqlippool_t, requested_address) },
 
+	{ FR_CONF_OFFSET("owner", FR_TYPE_TMPL, rlm_sqlippool_t, owner) },
+
+	{ FR_CONF_OFFSET("gateway", FR_TYPE_TMPL, rlm_sqlippool_t, gateway) },
+
 	{ FR_CONF_OFFSET("default_pool", FR_TYPE_STRING, rlm_sqlippool_t, defaultpool), .dflt = "main_pool" },
 
 
@@ -133,6 +235,8 @@ static CONF_PARSER module_config[] = {
 
 	{ FR_CONF_OFFSET("pool_check", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, pool_check) },
 
+	{ FR_CONF_OFFSET("load_leases", FR_TYPE_STRING, rlm_sqlippool_t, load_leases) },
+
 
 	{ FR_CONF_OFFSET("update_begin", FR_TYPE_STRING | FR_TYPE_XLAT, rlm_sqlippool_t, update_begin) },
 
@@ -165,6 +269,8 @@ static CONF_PARSER module_config[] = {
 
 
 	{ FR_CONF_POINTER("messages", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) message_config },
+
+	{ FR_CONF_POINTER("in_memory", FR_TYPE_SUBSECTION, NULL), .subcs = (void const *) in_memory_config },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -397,6 +503,605 @@ finish:
 	return retval;
 }
 
+/*
+ *	In-memory pool state
+ *
+ *	When in_memory.enable is set every lease is read into memory when the
+ *	server starts, and allocations, updates and releases are served from
+ *	there.  The normal SQL statements for each operation are expanded as
+ *	the request is processed, queued, and written to the database in
+ *	batches, inside a single transaction.
+ */
+static int8_t pool_cmp(void const *one, void const *two)
+{
+	sqlippool_pool_t const *a = one, *b = two;
+	int ret;
+
+	ret = strcmp(a->name, b->name);
+	return CMP(ret, 0);
+}
+
+static int8_t lease_address_cmp(void const *one, void const *two)
+{
+	sqlippool_lease_t const *a = one, *b = two;
+	int ret;
+
+	ret = strcmp(a->address, b->address);
+	return CMP(ret, 0);
+}
+
+static int8_t lease_owner_cmp(void const *one, void const *two)
+{
+	sqlippool_lease_t const *a = one, *b = two;
+	int ret;
+
+	ret = strcmp(a->owner, b->owner);
+	return CMP(ret, 0);
+}
+
+static int8_t lease_expiry_cmp(void const *one, void const *two)
+{
+	sqlippool_lease_t const *a = one, *b = two;
+
+	return CMP(a->expires, b->expires);
+}
+
+static int _sqlippool_state_free(sqlippool_state_t *state)
+{
+	fr_dlist_talloc_free(&state->queue);
+	pthread_cond_destroy(&state->cond);
+	pthread_mutex_destroy(&state->mutex);
+
+	return 0;
+}
+
+static sqlippool_state_t *sqlippool_state_alloc(TALLOC_CTX *ctx)
+{
+	sqlippool_state_t *state;
+
+	MEM(state = talloc_zero(ctx, sqlippool_state_t));
+
+	if (pthread_mutex_init(&state->mutex, NULL) != 0) {
+		talloc_free(state);
+		return NULL;
+	}
+
+	if (pthread_cond_init(&state->cond, NULL) != 0) {
+		pthread_mutex_destroy(&state->mutex);
+		talloc_free(state);
+		return NULL;
+	}
+	talloc_set_destructor(state, _sqlippool_state_free);
+
+	MEM(state->pools = fr_rb_inline_talloc_alloc(state, sqlippool_pool_t, node, pool_cmp, NULL));
+	fr_dlist_talloc_init(&state->queue, sqlippool_write_t, entry);
+
+	return state;
+}
+
+/** Find a pool, creating it if it doesn't exist
+ *
+ * @note Must be called with the state mutex held.
+ */
+static sqlippool_pool_t *sqlippool_pool_find_or_alloc(sqlippool_state_t *state, char const *name)
+{
+	sqlippool_pool_t *pool;
+
+	pool = fr_rb_find(state->pools, &(sqlippool_pool_t){ .name = name });
+	if (pool) return pool;
+
+	MEM(pool = talloc_zero(state, sqlippool_pool_t));
+	pool->name = talloc_typed_strdup(pool, name);
+	MEM(pool->by_address = fr_rb_inline_talloc_alloc(pool, sqlippool_lease_t, address_node,
+							 lease_address_cmp, NULL));
+	MEM(pool->by_owner = fr_rb_inline_talloc_alloc(pool, sqlippool_lease_t, owner_node,
+						       lease_owner_cmp, NULL));
+	MEM(pool->expiry = fr_heap_talloc_alloc(pool, lease_expiry_cmp, sqlippool_lease_t, heap_id));
+	fr_rb_insert(state->pools, pool);
+
+	return pool;
+}
+
+/** Give a lease to an owner, or extend the owner's existing lease
+ *
+ * @note Must be called with the state mutex held.
+ */
+static void sqlippool_lease_assign(sqlippool_pool_t *pool, sqlippool_lease_t *lease,
+				   char const *owner, char const *gateway, time_t expires)
+{
+	if (lease->is_static) return;
+
+	if (!lease->owner || (strcmp(lease->owner, owner) != 0)) {
+		if (lease->owner) {
+			fr_rb_remove(pool->by_owner, lease);
+			talloc_const_free(lease->owner);
+		}
+		lease->owner = talloc_typed_strdup(lease, owner);
+		fr_rb_insert(pool->by_owner, lease);
+	}
+
+	if (gateway && *gateway) {
+		talloc_const_free(lease->gateway);
+		lease->gateway = talloc_typed_strdup(lease, gateway);
+	}
+
+	fr_heap_extract(pool->expiry, lease);
+	lease->expires = expires;
+	fr_heap_insert(pool->expiry, lease);
+}
+
+/** Return a lease to the pool, making it the next to be allocated
+ *
+ * @note Must be called with the state mutex held.
+ */
+static void sqlippool_lease_clear(sqlippool_pool_t *pool, sqlippool_lease_t *lease, time_t now)
+{
+	if (lease->is_static) return;
+
+	if (lease->owner) {
+		fr_rb_remove(pool->by_owner, lease);
+		talloc_const_free(lease->owner);
+		lease->owner = NULL;
+	}
+
+	talloc_const_free(lease->gateway);
+	lease->gateway = NULL;
+
+	if (lease->declined) return;
+
+	fr_heap_extract(pool->expiry, lease);
+	lease->expires = now;
+	fr_heap_insert(pool->expiry, lease);
+}
+
+/** Read the state of every lease from SQL
+ *
+ * The load query must return rows of pool name, address, owner, and lease
+ * expiry as seconds since the epoch.  An optional fifth column, if non-zero,
+ * marks the lease as static.
+ */
+static int sqlippool_state_load(rlm_sqlippool_t const *inst)
+{
+	sqlippool_state_t	*state = inst->state;
+	rlm_sql_handle_t	*handle;
+	rlm_sql_row_t		row;
+	char			query[MAX_QUERY_LEN];
+	sql_rcode_t		rcode;
+	int			fields;
+	uint32_t		count = 0;
+	int			ret = -1;
+
+	handle = fr_pool_connection_get(inst->sql_inst->pool, NULL);
+	if (!handle) {
+		ERROR("Failed reserving SQL connection to load leases");
+		return -1;
+	}
+
+	sqlippool_expand(query, sizeof(query), inst->load_leases, inst, NULL, 0);
+
+	if ((inst->sql_inst->sql_select_query(inst->sql_inst, NULL, &handle, query) != RLM_SQL_OK) || !handle) {
+		ERROR("Failed loading leases");
+		goto release;
+	}
+
+	fields = (inst->sql_inst->driver->sql_num_fields)(handle, inst->sql_inst->config);
+	if (fields < 4) {
+		ERROR("Lease load query must return at least 4 columns, got %i", fields);
+		goto finish;
+	}
+
+	while ((rcode = inst->sql_inst->sql_fetch_row(&row, inst->sql_inst, NULL, &handle)) == RLM_SQL_OK) {
+		sqlippool_pool_t	*pool;
+		sqlippool_lease_t	*lease, *existing;
+
+		if (!row[0] || !row[1]) continue;
+
+		pool = sqlippool_pool_find_or_alloc(state, row[0]);
+
+		MEM(lease = talloc_zero(pool, sqlippool_lease_t));
+		lease->address = talloc_typed_strdup(lease, row[1]);
+		if (row[3]) lease->expires = (time_t)strtoll(row[3], NULL, 10);
+		if ((fields > 4) && row[4] && *row[4] && (strcmp(row[4], "0") != 0)) lease->is_static = true;
+
+		if (!fr_rb_insert(pool->by_address, lease)) {
+			WARN("Ignoring duplicate address %s in pool %s", lease->address, pool->name);
+			talloc_free(lease);
+			continue;
+		}
+
+		if (!lease->is_static) fr_heap_insert(pool->expiry, lease);
+		count++;
+
+		if (!row[2] || !*row[2]) continue;
+		lease->owner = talloc_typed_strdup(lease, row[2]);
+
+		/*
+		 *	An owner is given the lease which expires last,
+		 *	so that's the only one we need to index.
+		 */
+		existing = fr_rb_find(pool->by_owner, lease);
+		if (existing) {
+			if (existing->is_static || (!lease->is_static && (existing->expires >= lease->expires))) {
+				talloc_const_free(lease->owner);
+				lease->owner = NULL;
+				continue;
+			}
+			fr_rb_remove(pool->by_owner, existing);
+			talloc_const_free(existing->owner);
+			existing->owner = NULL;
+		}
+		fr_rb_insert(pool->by_owner, lease);
+	}
+
+	if (rcode != RLM_SQL_NO_MORE_ROWS) {
+		ERROR("Failed loading leases");
+		goto finish;
+	}
+
+	INFO("Loaded %u leases in %u pools", count, fr_rb_num_elements(state->pools));
+	ret = 0;
+
+finish:
+	if (handle) (inst->sql_inst->driver->sql_finish_select_query)(handle, inst->sql_inst->config);
+
+release:
+	if (handle) fr_pool_connection_release(inst->sql_inst->pool, NULL, handle);
+
+	return ret;
+}
+
+/** Run a single statement for the write-behind queue
+ *
+ */
+static int sqlippool_write_query(rlm_sqlippool_t const *inst, rlm_sql_handle_t **handle, char const *query)
+{
+	if (!query || !*query) return 0;
+
+	if (inst->sql_inst->sql_query(inst->sql_inst, NULL, handle, query) < 0) return -1;
+	if (!*handle) return -1;
+
+	(inst->sql_inst->driver->sql_finish_query)(*handle, inst->sql_inst->config);
+
+	return 0;
+}
+
+/** Build a queued statement, escaping its values with the connection it'll be written on
+ *
+ * @param[in] ctx	to allocate the statement in.
+ * @param[in] inst	Instance of rlm_sqlippool.
+ * @param[in] handle	the statement will be written on.
+ * @param[in] change	to build the statement for.
+ * @return
+ *	- The statement.
+ *	- NULL if a value couldn't be escaped.
+ */
+static char *sqlippool_write_build(TALLOC_CTX *ctx, rlm_sqlippool_t const *inst, rlm_sql_handle_t *handle,
+				   sqlippool_write_t const *change)
+{
+	char const	*p = change->query, *q;
+	char		*out, *escaped;
+	unsigned int	i = 0;
+	size_t		len;
+
+	MEM(out = talloc_typed_strdup(ctx, ""));
+
+	while ((q = strchr(p, SQLIPPOOL_VALUE_MARKER))) {
+		if (i >= change->num_values) {
+		error:
+			talloc_free(out);
+			return NULL;
+		}
+
+		/*
+		 *	Enough for every character to be
+		 *	replaced by a three byte sequence.
+		 */
+		len = (strlen(change->values[i]) * 3) + 1;
+		MEM(escaped = talloc_array(out, char, len));
+		if ((inst->sql_inst->sql_escape_func(NULL, escaped, len, change->values[i], handle) == 0) &&
+		    *change->values[i]) goto error;
+
+		MEM(out = talloc_strndup_append_buffer(out, p, q - p));
+		MEM(out = talloc_strdup_append_buffer(out, escaped));
+		talloc_free(escaped);
+
+		p = q + 1;
+		i++;
+	}
+
+	MEM(out = talloc_strdup_append_buffer(out, p));
+
+	return out;
+}
+
+/** Write a batch of changes to SQL, inside a single transaction
+ *
+ * @note Called by the writer thread, without the state mutex held.
+ *
+ * @return
+ *	- 0 on success.
+ *	- -1 on failure.  The transaction has been rolled back.
+ */
+static int sqlippool_write_batch(rlm_sqlippool_t const *inst, fr_dlist_head_t *batch)
+{
+	sqlippool_write_t	*change = NULL;
+	rlm_sql_handle_t	*handle;
+	char			*query;
+	int			ret;
+
+	handle = fr_pool_connection_get(inst->sql_inst->pool, NULL);
+	if (!handle) {
+		ERROR("Failed reserving SQL connection");
+		return -1;
+	}
+
+	DEBUG2("Writing %zu lease changes", fr_dlist_num_elements(batch));
+
+	if (sqlippool_write_query(inst, &handle, inst->write_begin) < 0) goto error;
+
+	while ((change = fr_dlist_next(batch, change))) {
+		query = sqlippool_write_build(NULL, inst, handle, change);
+		if (!query) {
+			ERROR("Failed escaping lease change");
+			goto error;
+		}
+
+		ret = sqlippool_write_query(inst, &handle, query);
+		talloc_free(query);
+		if (ret < 0) goto error;
+	}
+
+	if (sqlippool_write_query(inst, &handle, inst->write_commit) < 0) {
+	error:
+		if (handle && inst->write_begin && *inst->write_begin) {
+			(void) sqlippool_write_query(inst, &handle, "ROLLBACK");
+		}
+		if (handle) fr_pool_connection_release(inst->sql_inst->pool, NULL, handle);
+		return -1;
+	}
+
+	fr_pool_connection_release(inst->sql_inst->pool, NULL, handle);
+
+	return 0;
+}
+
+#define SQLIPPOOL_RETRY_DELAY_MAX	fr_time_delta_from_sec(60)
+
+/** Wait on the writer's condition until a given time
+ *
+ * @note Must be called with the state mutex held.
+ */
+static void sqlippool_writer_wait(sqlippool_state_t *state, fr_time_t when)
+{
+	struct timespec	ts;
+	fr_time_delta_t	delay = when - fr_time();
+
+	if (delay <= 0) return;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += fr_time_delta_to_sec(delay);
+	ts.tv_nsec += delay % NSEC;
+	if (ts.tv_nsec >= NSEC) {
+		ts.tv_sec++;
+		ts.tv_nsec -= NSEC;
+	}
+
+	(void) pthread_cond_timedwait(&state->cond, &state->mutex, &ts);
+}
+
+/** Write the queue to SQL, in the order changes were made in memory
+ *
+ * Runs in its own thread, so that workers never wait for the database.
+ * The queue is written once write_behind_batch changes are waiting, or
+ * write_behind_delay after the oldest was queued.  If a batch can't be
+ * written it's kept, and retried after a delay which doubles each time
+ * writing fails, up to SQLIPPOOL_RETRY_DELAY_MAX.
+ *
+ * When told to stop, everything still queued is written once more,
+ * and discarded if that fails.
+ */
+static void *sqlippool_writer(void *arg)
+{
+	rlm_sqlippool_t const	*inst = arg;
+	sqlippool_state_t	*state = inst->state;
+	fr_dlist_head_t		batch;
+	fr_time_t		retry_at = 0;
+	fr_time_delta_t		retry_delay = 0;
+	size_t			count;
+
+	fr_dlist_talloc_init(&batch, sqlippool_write_t, entry);
+
+	pthread_mutex_lock(&state->mutex);
+	for (;;) {
+		count = fr_dlist_num_elements(&state->queue);
+
+		if (!state->stop) {
+			if (count == 0) {
+				pthread_cond_wait(&state->cond, &state->mutex);
+				continue;
+			}
+
+			if (retry_at && (fr_time() < retry_at)) {
+				sqlippool_writer_wait(state, retry_at);
+				continue;
+			}
+
+			if (!retry_at && (count < inst->write_behind_batch) &&
+			    (fr_time() < (state->queued_at + inst->write_behind_delay))) {
+				sqlippool_writer_wait(state, state->queued_at + inst->write_behind_delay);
+				continue;
+			}
+		} else if (count == 0) {
+			break;
+		}
+
+		fr_dlist_move(&batch, &state->queue);
+		pthread_mutex_unlock(&state->mutex);
+
+		if (sqlippool_write_batch(inst, &batch) == 0) {
+			retry_at = 0;
+			retry_delay = 0;
+
+			pthread_mutex_lock(&state->mutex);
+			state->num_pending -= count;
+			fr_dlist_talloc_free(&batch);
+			continue;
+		}
+
+		pthread_mutex_lock(&state->mutex);
+		if (state->stop) {
+			ERROR("Failed writing %zu lease changes, discarding them", count);
+			state->num_pending -= count;
+			fr_dlist_talloc_free(&batch);
+			continue;
+		}
+
+		if (!retry_delay) {
+			retry_delay = inst->write_behind_delay;
+		} else {
+			retry_delay *= 2;
+			if (retry_delay > SQLIPPOOL_RETRY_DELAY_MAX) retry_delay = SQLIPPOOL_RETRY_DELAY_MAX;
+		}
+		retry_at = fr_time() + retry_delay;
+
+		ERROR("Failed writing %zu lease changes, will retry in %pVs", count, fr_box_time_delta(retry_delay));
+
+		/*
+		 *	The transaction was rolled back, so the
+		 *	whole batch can be written again, before
+		 *	anything queued while we were trying.
+		 */
+		fr_dlist_move(&batch, &state->queue);
+		fr_dlist_move(&state->queue, &batch);
+	}
+	pthread_mutex_unlock(&state->mutex);
+
+	return NULL;
+}
+
+/** Record a value which needs escaping, and leave a marker in its place
+ *
+ * Values are escaped when the change is written, with the connection it's
+ * written on, so that requests don't need a connection of their own.
+ */
+static size_t sqlippool_write_escape(UNUSED request_t *request, char *out, size_t outlen, char const *in, void *arg)
+{
+	sqlippool_write_t *change = talloc_get_type_abort(arg, sqlippool_write_t);
+
+	if (outlen < 2) return 0;
+
+	MEM(change->values = talloc_realloc(change, change->values, char *, change->num_values + 1));
+	MEM(change->values[change->num_values++] = talloc_typed_strdup(change, in));
+
+	out[0] = SQLIPPOOL_VALUE_MARKER;
+	out[1] = '\0';
+
+	return 1;
+}
+
+/** Expand a statement, and add it to a list of changes to write
+ *
+ * @param[out] out	List to add the expanded statement to.
+ * @param[in] inst	Instance of rlm_sqlippool.
+ * @param[in] request	Current request.
+ * @param[in] fmt	Statement to expand.
+ * @param[in] param	ip address string.
+ * @param[in] param_len	ip address string len.
+ * @return
+ *	- 0 on success.
+ *	- < 0 on error.
+ */
+static int sqlippool_write_expand(fr_dlist_head_t *out, rlm_sqlippool_t const *inst, request_t *request,
+				  char const *fmt, char *param, int param_len)
+{
+	char			query[MAX_QUERY_LEN];
+	sqlippool_write_t	*change;
+
+	if (!fmt || !*fmt) return 0;
+
+	sqlippool_expand(query, sizeof(query), fmt, inst, param, param_len);
+	if (strchr(query, SQLIPPOOL_VALUE_MARKER)) {
+		REDEBUG("Lease change statements must not contain control characters");
+		return -1;
+	}
+
+	/*
+	 *	Not parented by the state, as it's
+	 *	allocated without holding the mutex.
+	 */
+	MEM(change = talloc_zero(NULL, sqlippool_write_t));
+	if (xlat_aeval(change, &change->query, request, query, sqlippool_write_escape, change) < 0) {
+		talloc_free(change);
+		return -1;
+	}
+	fr_dlist_insert_tail(out, change);
+
+	return 0;
+}
+
+/** Check whether more lease changes can be queued
+ *
+ * @note Must be called with the state mutex held.
+ */
+static bool sqlippool_write_full(rlm_sqlippool_t const *inst, request_t *request)
+{
+	if (inst->state->num_pending < inst->write_behind_max) return false;
+
+	REDEBUG("%u lease changes are waiting to be written to SQL, refusing more until the database catches up",
+		inst->state->num_pending);
+
+	return true;
+}
+
+/** Queue a list of expanded statements for the writer thread
+ *
+ */
+static void sqlippool_write_queue(rlm_sqlippool_t const *inst, fr_dlist_head_t *writes)
+{
+	sqlippool_state_t	*state = inst->state;
+	size_t			count = fr_dlist_num_elements(writes);
+
+	if (count == 0) return;
+
+	pthread_mutex_lock(&state->mutex);
+	if (fr_dlist_empty(&state->queue)) state->queued_at = fr_time();
+	fr_dlist_move(&state->queue, writes);
+	state->num_pending += count;
+	if (fr_dlist_num_elements(&state->queue) >= inst->write_behind_batch) pthread_cond_signal(&state->cond);
+	pthread_mutex_unlock(&state->mutex);
+}
+
+/** Expand an optional tmpl into a buffer
+ *
+ * @return
+ *	- >= 0 the length of the expansion.
+ *	- < 0 on error.
+ */
+static ssize_t sqlippool_tmpl_expand(char **out, char *buff, size_t bufflen, request_t *request, tmpl_t const *vpt)
+{
+	if (!vpt) {
+		*buff = '\0';
+		*out = buff;
+		return 0;
+	}
+
+	return tmpl_expand(out, buff, bufflen, request, vpt, NULL, NULL);
+}
+
+/** Find the pool named by the request
+ *
+ * @note Must be called with the state mutex held.
+ */
+static sqlippool_pool_t *sqlippool_pool_find(sqlippool_state_t *state, request_t *request)
+{
+	fr_pair_t *vp;
+
+	vp = fr_pair_find_by_da(&request->control_pairs, attr_pool_name, 0);
+	if (!vp) return NULL;
+
+	return fr_rb_find(state->pools, &(sqlippool_pool_t){ .name = vp->vp_strvalue });
+}
+
 /*
  *	Do any per-module initialization that is separate to each
  *	configured instance of the module.  e.g. set up connections
@@ -460,6 +1165,98 @@ static int mod_instantiate(void *instance, CONF_SECTION *conf)
 		return -1;
 	}
 
+	if (inst->in_memory) {
+		if (!inst->owner) {
+			cf_log_err(conf, "'owner' must be set when 'in_memory' is enabled");
+			return -1;
+		}
+
+		if (!inst->load_leases || !*inst->load_leases) {
+			cf_log_err(conf, "'load_leases' must be set when 'in_memory' is enabled");
+			return -1;
+		}
+
+		if (inst->write_behind_batch == 0) inst->write_behind_batch = 1;
+		if (inst->write_behind_max < inst->write_behind_batch) inst->write_behind_max = inst->write_behind_batch;
+
+		inst->state = sqlippool_state_alloc(inst);
+		if (!inst->state) {
+			cf_log_err(conf, "Failed initialising in-memory pool state");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance, UNUSED fr_event_list_t *el,
+				  void *thread)
+{
+	rlm_sqlippool_t		*inst = talloc_get_type_abort(instance, rlm_sqlippool_t);
+	rlm_sqlippool_thread_t	*t = talloc_get_type_abort(thread, rlm_sqlippool_thread_t);
+	sqlippool_state_t	*state = inst->state;
+	int			ret = 0;
+
+	t->inst = inst;
+
+	if (!inst->in_memory) return 0;
+
+	/*
+	 *	Leases are loaded, and the writer started, by the
+	 *	first thread to start, once every module (including
+	 *	the SQL module) has been instantiated.
+	 */
+	pthread_mutex_lock(&state->mutex);
+	if (!state->loaded) {
+		ret = sqlippool_state_load(inst);
+		if (ret == 0) state->loaded = true;
+	}
+
+	if ((ret == 0) && !state->writer_running) {
+		state->stop = false;
+		if (fr_schedule_pthread_create(&state->writer, sqlippool_writer, inst) < 0) {
+			PERROR("Failed starting lease writer");
+			ret = -1;
+		} else {
+			state->writer_running = true;
+		}
+	}
+
+	if (ret == 0) {
+		state->num_threads++;
+		t->started = true;
+	}
+	pthread_mutex_unlock(&state->mutex);
+
+	return ret;
+}
+
+static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
+{
+	rlm_sqlippool_thread_t	*t = talloc_get_type_abort(thread, rlm_sqlippool_thread_t);
+	sqlippool_state_t	*state;
+
+	if (!t->started) return 0;
+	state = t->inst->state;
+
+	/*
+	 *	The last thread to stop waits for the writer, so
+	 *	changes aren't left queued when the server exits.
+	 *	This has to happen here, as the SQL module may
+	 *	already be gone by the time we're detached.
+	 */
+	pthread_mutex_lock(&state->mutex);
+	if ((--state->num_threads > 0) || !state->writer_running) {
+		pthread_mutex_unlock(&state->mutex);
+		return 0;
+	}
+	state->stop = true;
+	pthread_cond_signal(&state->cond);
+	pthread_mutex_unlock(&state->mutex);
+
+	pthread_join(state->writer, NULL);
+	state->writer_running = false;
+
 	return 0;
 }
 
@@ -487,6 +1284,230 @@ static unlang_action_t do_logging(rlm_rcode_t *p_result, UNUSED rlm_sqlippool_t
 }
 
 
+/*
+ *	Allocate an IP number from a pool held in memory.
+ */
+static unlang_action_t CC_HINT(nonnull) mod_alloc_in_memory(rlm_rcode_t *p_result, rlm_sqlippool_t const *inst,
+							     request_t *request)
+{
+	sqlippool_state_t	*state = inst->state;
+	sqlippool_pool_t	*pool;
+	sqlippool_lease_t	*lease;
+	char			owner_buff[FR_MAX_STRING_LEN], gateway_buff[FR_MAX_STRING_LEN], requested_buff[128];
+	char			*owner, *gateway, *requested;
+	char			allocation[FR_MAX_STRING_LEN];
+	int			allocation_len;
+	time_t			now;
+	fr_pair_t		*vp;
+	fr_dlist_head_t		writes;
+
+	if ((sqlippool_tmpl_expand(&owner, owner_buff, sizeof(owner_buff), request, inst->owner) < 0) ||
+	    (sqlippool_tmpl_expand(&gateway, gateway_buff, sizeof(gateway_buff), request, inst->gateway) < 0) ||
+	    (sqlippool_tmpl_expand(&requested, requested_buff, sizeof(requested_buff),
+				   request, inst->requested_address) < 0)) RETURN_MODULE_FAIL;
+
+	if (!*owner) {
+		REDEBUG("Lease owner expanded to an empty string");
+		RETURN_MODULE_INVALID;
+	}
+
+	now = time(NULL);
+
+	pthread_mutex_lock(&state->mutex);
+	if (sqlippool_write_full(inst, request)) {
+		pthread_mutex_unlock(&state->mutex);
+		RETURN_MODULE_FAIL;
+	}
+
+	pool = sqlippool_pool_find(state, request);
+	if (!pool) {
+		pthread_mutex_unlock(&state->mutex);
+
+		/*
+		 *	May be handled by some other
+		 *	instance of sqlippool.
+		 */
+		RDEBUG2("IP address could not be allocated as no pool exists with that name");
+		RETURN_MODULE_NOOP;
+	}
+
+	/*
+	 *	The same order as the alloc_existing,
+	 *	alloc_requested and alloc_find queries.
+	 */
+	lease = fr_rb_find(pool->by_owner, &(sqlippool_lease_t){ .owner = owner });
+	if (!lease && *requested) {
+		lease = fr_rb_find(pool->by_address, &(sqlippool_lease_t){ .address = requested });
+		if (lease && (lease->is_static || lease->declined || (lease->expires > now))) lease = NULL;
+	}
+	if (!lease) {
+		lease = fr_heap_peek(pool->expiry);
+		if (lease && (lease->expires > now)) lease = NULL;
+	}
+
+	if (!lease) {
+		pthread_mutex_unlock(&state->mutex);
+
+		RDEBUG2("pool appears to be full");
+		return do_logging(p_result, inst, request, inst->log_failed, RLM_MODULE_NOTFOUND);
+	}
+
+	sqlippool_lease_assign(pool, lease, owner, gateway, now + inst->lease_duration);
+	allocation_len = strlcpy(allocation, lease->address, sizeof(allocation));
+	pthread_mutex_unlock(&state->mutex);
+
+	MEM(vp = fr_pair_afrom_da(request->reply_ctx, inst->allocated_address_da));
+	if (fr_pair_value_from_str(vp, allocation, allocation_len, '\0', true) < 0) {
+		talloc_free(vp);
+
+		RDEBUG2("Invalid IP number [%s] held in memory", allocation);
+		return do_logging(p_result, inst, request, inst->log_failed, RLM_MODULE_NOOP);
+	}
+
+	RDEBUG2("Allocated IP %s", allocation);
+	fr_pair_append(&request->reply_pairs, vp);
+
+	fr_dlist_talloc_init(&writes, sqlippool_write_t, entry);
+	if (sqlippool_write_expand(&writes, inst, request, inst->alloc_update, allocation, allocation_len) < 0) {
+		REDEBUG("Failed expanding alloc_update, allocation will not be written to SQL");
+	}
+
+	sqlippool_write_queue(inst, &writes);
+
+	return do_logging(p_result, inst, request, inst->log_success, RLM_MODULE_OK);
+}
+
+/** The lease operations other than allocation
+ *
+ */
+typedef enum {
+	SQLIPPOOL_UPDATE = 0,
+	SQLIPPOOL_RELEASE,
+	SQLIPPOOL_BULK_RELEASE,
+	SQLIPPOOL_MARK
+} sqlippool_op_t;
+
+/*
+ *	Update, release or mark a lease held in memory.
+ */
+static unlang_action_t CC_HINT(nonnull) mod_lease_in_memory(rlm_rcode_t *p_result, rlm_sqlippool_t const *inst,
+							     request_t *request, sqlippool_op_t op)
+{
+	sqlippool_state_t	*state = inst->state;
+	sqlippool_pool_t	*pool;
+	sqlippool_lease_t	*lease = NULL;
+	char			owner_buff[FR_MAX_STRING_LEN], gateway_buff[FR_MAX_STRING_LEN], requested_buff[128];
+	char			*owner, *gateway, *requested;
+	time_t			now;
+	bool			changed = false;
+	fr_dlist_head_t		writes;
+	int			ret = 0;
+
+	if ((sqlippool_tmpl_expand(&owner, owner_buff, sizeof(owner_buff), request, inst->owner) < 0) ||
+	    (sqlippool_tmpl_expand(&gateway, gateway_buff, sizeof(gateway_buff), request, inst->gateway) < 0) ||
+	    (sqlippool_tmpl_expand(&requested, requested_buff, sizeof(requested_buff),
+				   request, inst->requested_address) < 0)) RETURN_MODULE_FAIL;
+
+	now = time(NULL);
+
+	pthread_mutex_lock(&state->mutex);
+	if (sqlippool_write_full(inst, request)) {
+		pthread_mutex_unlock(&state->mutex);
+		RETURN_MODULE_FAIL;
+	}
+
+	pool = sqlippool_pool_find(state, request);
+	if (pool && (op != SQLIPPOOL_BULK_RELEASE) && *requested) {
+		lease = fr_rb_find(pool->by_address, &(sqlippool_lease_t){ .address = requested });
+
+		/*
+		 *	Only the owner of a lease may modify it.
+		 */
+		if (lease && (!lease->owner || (strcmp(lease->owner, owner) != 0))) lease = NULL;
+	}
+
+	switch (op) {
+	case SQLIPPOOL_UPDATE:
+		if (!lease || lease->declined) break;
+
+		sqlippool_lease_assign(pool, lease, owner, NULL, now + inst->lease_duration);
+		changed = true;
+		break;
+
+	case SQLIPPOOL_RELEASE:
+		if (!lease) break;
+
+		sqlippool_lease_clear(pool, lease, now);
+		changed = true;
+		break;
+
+	case SQLIPPOOL_BULK_RELEASE:
+	{
+		fr_rb_iter_inorder_t	iter;
+
+		if (!pool || !*gateway) break;
+
+		for (lease = fr_rb_iter_init_inorder(&iter, pool->by_address);
+		     lease;
+		     lease = fr_rb_iter_next_inorder(&iter)) {
+			if (!lease->gateway || (strcmp(lease->gateway, gateway) != 0)) continue;
+
+			sqlippool_lease_clear(pool, lease, now);
+		}
+		changed = true;
+	}
+		break;
+
+	case SQLIPPOOL_MARK:
+		if (!lease || lease->is_static || lease->declined) break;
+
+		fr_heap_extract(pool->expiry, lease);
+		fr_rb_remove(pool->by_owner, lease);
+		talloc_const_free(lease->owner);
+		lease->owner = NULL;
+		lease->declined = true;
+		changed = true;
+		break;
+	}
+	pthread_mutex_unlock(&state->mutex);
+
+	fr_dlist_talloc_init(&writes, sqlippool_write_t, entry);
+	if (changed) {
+		switch (op) {
+		case SQLIPPOOL_UPDATE:
+			ret = sqlippool_write_expand(&writes, inst, request, inst->update_free, NULL, 0);
+			if (ret == 0) ret = sqlippool_write_expand(&writes, inst, request, inst->update_update, NULL, 0);
+			break;
+
+		case SQLIPPOOL_RELEASE:
+			ret = sqlippool_write_expand(&writes, inst, request, inst->release_clear, NULL, 0);
+			break;
+
+		case SQLIPPOOL_BULK_RELEASE:
+			ret = sqlippool_write_expand(&writes, inst, request, inst->bulk_release_clear, NULL, 0);
+			break;
+
+		case SQLIPPOOL_MARK:
+			ret = sqlippool_write_expand(&writes, inst, request, inst->mark_update, NULL, 0);
+			break;
+		}
+	}
+
+	if (ret < 0) {
+		REDEBUG("Failed expanding lease change, it will not be written to SQL");
+		fr_dlist_talloc_free(&writes);
+		RETURN_MODULE_FAIL;
+	}
+
+	sqlippool_write_queue(inst, &writes);
+
+	if (op != SQLIPPOOL_UPDATE) RETURN_MODULE_OK;
+
+	if (changed) return do_logging(p_result, inst, request, inst->log_success, RLM_MODULE_OK);
+
+	return do_logging(p_result, inst, request, inst->log_failed, RLM_MODULE_NOTFOUND);
+}
+
 /*
  *	Allocate an IP number from the pool.
  */
@@ -513,6 +1534,10 @@ static unlang_action_t CC_HINT(nonnull) mod_alloc(rlm_rcode_t *p_result, module_
 		return do_logging(p_result, inst, request, inst->log_nopool, RLM_MODULE_NOOP);
 	}
 
+	if (inst->in_memory) {
+		return mod_alloc_in_memory(p_result, inst, request);
+	}
+
 	handle = fr_pool_connection_get(inst->sql_inst->pool, request);
 	if (!handle) {
 		REDEBUG("Failed reserving SQL connection");
@@ -664,6 +1689,10 @@ static unlang_action_t CC_HINT(nonnull) mod_update(rlm_rcode_t *p_result, module
 	rlm_sql_handle_t	*handle;
 	int			affected;
 
+	if (inst->in_memory) {
+		return mod_lease_in_memory(p_result, inst, request, SQLIPPOOL_UPDATE);
+	}
+
 	handle = fr_pool_connection_get(inst->sql_inst->pool, request);
 	if (!handle) {
 		REDEBUG("Failed reserving SQL connection");
@@ -716,6 +1745,10 @@ static unlang_action_t CC_HINT(nonnull) mod_release(rlm_rcode_t *p_result, modul
 	rlm_sqlippool_t		*inst = talloc_get_type_abort(mctx->instance, rlm_sqlippool_t);
 	rlm_sql_handle_t	*handle;
 
+	if (inst->in_memory) {
+		return mod_lease_in_memory(p_result, inst, request, SQLIPPOOL_RELEASE);
+	}
+
 	handle = fr_pool_connection_get(inst->sql_inst->pool, request);
 	if (!handle) {
 		REDEBUG("Failed reserving SQL connection");
@@ -746,6 +1779,10 @@ static unlang_action_t CC_HINT(nonnull) mod_bulk_release(rlm_rcode_t *p_result,
 	rlm_sqlippool_t		*inst = talloc_get_type_abort(mctx->instance, rlm_sqlippool_t);
 	rlm_sql_handle_t	*handle;
 
+	if (inst->in_memory) {
+		return mod_lease_in_memory(p_result, inst, request, SQLIPPOOL_BULK_RELEASE);
+	}
+
 	handle = fr_pool_connection_get(inst->sql_inst->pool, request);
 	if (!handle) {
 		REDEBUG("Failed reserving SQL connection");
@@ -777,6 +1814,10 @@ static unlang_action_t CC_HINT(nonnull) mod_mark(rlm_rcode_t *p_result, module_c
 	rlm_sqlippool_t		*inst = talloc_get_type_abort(mctx->instance, rlm_sqlippool_t);
 	rlm_sql_handle_t	*handle;
 
+	if (inst->in_memory) {
+		return mod_lease_in_memory(p_result, inst, request, SQLIPPOOL_MARK);
+	}
+
 	handle = fr_pool_connection_get(inst->sql_inst->pool, request);
 	if (!handle) {
 		REDEBUG("Failed reserving SQL connection");
@@ -851,6 +1892,10 @@ module_t rlm_sqlippool = {
 	.inst_size	= sizeof(rlm_sqlippool_t),
 	.config		= module_config,
 	.instantiate	= mod_instantiate,
+	.thread_inst_size	= sizeof(rlm_sqlippool_thread_t),
+	.thread_inst_type	= "rlm_sqlippool_thread_t",
+	.thread_instantiate	= mod_thread_instantiate,
+	.thread_detach		= mod_thread_detach,
 	.methods = {
 		[MOD_ACCOUNTING]	= mod_accounting,
 		[MOD_POST_AUTH]		= mod_alloc
@@ -40,48 +40,110 @@ RCSID("$Id$")
  */
 
 #include <pthread.h>
+#include <stdalign.h>
+
+#ifdef HAVE_STDATOMIC_H
+#  include <stdatomic.h>
+#else
+#  include <freeradius-devel/util/stdatomic.h>
+#endif
 
 /*
  *	@todo - MULTI_PROTOCOL - make this protocol agnostic.
  *	Perhaps keep stats in a hash table by (request->dict, request->code) ?
  */
 
+/*
+ *	Workers never take a lock to update their counters, and
+ *	readers never take a worker's lock to read them.
+ *
+ *	Each thread owns a "slab" of counters, and is the only thing
+ *	which writes to it.  The slab has a sequence number which is
+ *	odd while the thread is updating its counters.  Readers copy
+ *	the counters, and retry if the sequence number was odd, or
+ *	changed while they were copying.
+ *
+ *	Per-client and per-listener counters are indexed by a shared
+ *	hash table, which maps the address to a slot.  Each thread
+ *	keeps its counters for a slot at the same index in its own
+ *	chunks of counters.  The shared table is locked only the
+ *	first time a thread sees a particular address.
+ */
+#define STATS_CACHE_LINE_SIZE	64
+#define STATS_CHUNK_SIZE	64				//!< Number of counter sets in a chunk.
+
+/** Counters for one thing, written only by the thread which owns them
+ *
+ * Aligned so that counters owned by different threads never share a cache line.
+ */
+typedef struct CC_HINT(aligned(STATS_CACHE_LINE_SIZE)) {
+	atomic_uint_fast64_t	stats[FR_RADIUS_CODE_MAX];
+} rlm_stats_counters_t;
+
+/** Per-thread counters, and the sequence number protecting them
+ *
+ */
+typedef struct {
+	alignas(STATS_CACHE_LINE_SIZE) atomic_uint_fast64_t seq;	//!< Odd while the owning thread is
+									//!< updating its counters.
+	rlm_stats_counters_t	global;				//!< Counters for all packets.
+} rlm_stats_slab_t;
+
+/** What statistics are being kept for
+ *
+ */
+typedef struct {
+	fr_ipaddr_t		ipaddr;				//!< IP address of this thing
+	uint32_t		type;				//!< FR_STATS4_TYPE_VALUE_CLIENT or FR_STATS4_TYPE_VALUE_LISTENER
+} rlm_stats_id_t;
+
+/** Entry in the shared index of clients and listeners
+ *
+ */
+typedef struct {
+	rlm_stats_id_t		id;				//!< Must be first.
+	uint32_t		slot;				//!< Index of the counters in each thread's chunks.
+	uint64_t		retired[FR_RADIUS_CODE_MAX];	//!< Counts from threads which have exited.
+} rlm_stats_key_t;
+
 typedef struct {
-	pthread_mutex_t		mutex;
+	uint32_t		max_entries;			//!< Maximum number of clients and listeners tracked.
+
+	pthread_mutex_t		mutex;				//!< Protects the list, keys, and retired counts.
 	fr_dict_attr_t const	*type_da;			//!< FreeRADIUS-Stats4-Type
 	fr_dict_attr_t const	*ipv4_da;			//!< FreeRADIUS-Stats4-IPv4-Address
 	fr_dict_attr_t const	*ipv6_da;			//!< FreeRADIUS-Stats4-IPv6-Address
 	fr_dlist_head_t		list;				//!< for threads to know about each other
 
-	uint64_t		stats[FR_RADIUS_CODE_MAX];
+	fr_hash_table_t		*keys;				//!< Shared index of clients and listeners.
+	atomic_uint_fast32_t	num_keys;			//!< Number of slots in use.
+	atomic_bool		full;				//!< We've warned that max_entries was reached.
+	uint32_t		num_chunks;			//!< Number of chunk pointers in each thread.
+
+	uint64_t		stats[FR_RADIUS_CODE_MAX];	//!< Counts from threads which have exited.
 } rlm_stats_t;
 
+/** Thread-local cache of the shared index
+ *
+ */
 typedef struct {
-	fr_rb_node_t		src_node;
-	fr_rb_node_t		dst_node;
-	fr_ipaddr_t		ipaddr;				//!< IP address of this thing
-	fr_time_t		created;			//!< when it was created
-	fr_time_t		last_packet;			//!< when we last saw a packet
-	uint64_t		stats[FR_RADIUS_CODE_MAX];	//!< actual statistic
-} rlm_stats_data_t;
+	rlm_stats_id_t		id;				//!< Must be first.
+	rlm_stats_key_t		*key;				//!< Entry in the shared index.
+} rlm_stats_local_t;
 
 typedef struct {
 	rlm_stats_t		*inst;
 
-	fr_time_t		last_global_update;
 	fr_dlist_t		entry;				//!< for threads to know about each other
 
-	fr_time_t		last_manage;			//!< when we deleted old things
-
-	fr_rb_tree_t		*src;				//!< stats by source
-	fr_rb_tree_t		*dst;				//!< stats by destination
-
-	uint64_t		stats[FR_RADIUS_CODE_MAX];
-
-	pthread_mutex_t		mutex;
+	rlm_stats_slab_t	*slab;				//!< Counters owned by this thread.
+	atomic_uintptr_t	*chunks;			//!< Per-client and per-listener counters,
+								//!< allocated on demand.
+	fr_hash_table_t		*local;				//!< Slots this thread has already looked up.
 } rlm_stats_thread_t;
 
 static const CONF_PARSER module_config[] = {
+	{ FR_CONF_OFFSET("max_entries", FR_TYPE_UINT32, rlm_stats_t, max_entries), .dflt = "4096" },
 	CONF_PARSER_TERMINATOR
 };
 
@@ -95,66 +157,247 @@ fr_dict_autoload_t rlm_stats_dict[] = {
 
 static fr_dict_attr_t const *attr_freeradius_stats4_ipv4_address;
 static fr_dict_attr_t const *attr_freeradius_stats4_ipv6_address;
+static fr_dict_attr_t const *attr_freeradius_stats4_packet_counters;
 static fr_dict_attr_t const *attr_freeradius_stats4_type;
 
 extern fr_dict_attr_autoload_t rlm_stats_dict_attr[];
 fr_dict_attr_autoload_t rlm_stats_dict_attr[] = {
 	{ .out = &attr_freeradius_stats4_ipv4_address, .name = "Vendor-Specific.FreeRADIUS.Stats4.Stats4-IPv4-Address", .type = FR_TYPE_IPV4_ADDR, .dict = &dict_radius },
 	{ .out = &attr_freeradius_stats4_ipv6_address, .name = "Vendor-Specific.FreeRADIUS.Stats4.Stats4-IPv6-Address", .type = FR_TYPE_IPV6_ADDR, .dict = &dict_radius },
+	{ .out = &attr_freeradius_stats4_packet_counters, .name = "Vendor-Specific.FreeRADIUS.Stats4.Stats4-Packet-Counters", .type = FR_TYPE_TLV, .dict = &dict_radius },
 	{ .out = &attr_freeradius_stats4_type, .name = "Vendor-Specific.FreeRADIUS.Stats4.Stats4-Type", .type = FR_TYPE_UINT32, .dict = &dict_radius },
 	{ NULL }
 };
 
-static void coalesce(uint64_t final_stats[FR_RADIUS_CODE_MAX], rlm_stats_thread_t *t,
-		     size_t tree_offset, rlm_stats_data_t *mydata)
+static uint32_t id_hash(void const *data)
 {
-	rlm_stats_data_t *stats;
-	rlm_stats_thread_t *other;
-	fr_rb_tree_t **tree;
-	uint64_t local_stats[FR_RADIUS_CODE_MAX];
+	rlm_stats_id_t const	*id = data;
+	uint32_t		hash;
 
-	tree = (fr_rb_tree_t **) (((uint8_t *) t) + tree_offset);
+	hash = fr_hash(&id->type, sizeof(id->type));
+	hash = fr_hash_update(&id->ipaddr.af, sizeof(id->ipaddr.af), hash);
+
+	if (id->ipaddr.af == AF_INET) return fr_hash_update(&id->ipaddr.addr.v4, sizeof(id->ipaddr.addr.v4), hash);
+
+	return fr_hash_update(&id->ipaddr.addr.v6, sizeof(id->ipaddr.addr.v6), hash);
+}
+
+static int8_t id_cmp(void const *one, void const *two)
+{
+	rlm_stats_id_t const *a = one;
+	rlm_stats_id_t const *b = two;
+	int8_t ret;
+
+	ret = CMP(a->type, b->type);
+	if (ret != 0) return ret;
+
+	return fr_ipaddr_cmp(&a->ipaddr, &b->ipaddr);
+}
+
+/** Start updating a thread's counters
+ *
+ * Only the thread which owns the slab may call this.
+ */
+static inline void stats_write_begin(rlm_stats_slab_t *slab)
+{
+	uint_fast64_t seq = atomic_load_explicit(&slab->seq, memory_order_relaxed);
+
+	atomic_store_explicit(&slab->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+/** Finish updating a thread's counters
+ *
+ */
+static inline void stats_write_end(rlm_stats_slab_t *slab)
+{
+	uint_fast64_t seq = atomic_load_explicit(&slab->seq, memory_order_relaxed);
+
+	atomic_store_explicit(&slab->seq, seq + 1, memory_order_release);
+}
+
+/** Increment a counter
+ *
+ * There is only one writer, so we don't need a locked read-modify-write.
+ */
+static inline void stats_inc(rlm_stats_counters_t *counters, int code)
+{
+	atomic_store_explicit(&counters->stats[code],
+			      atomic_load_explicit(&counters->stats[code], memory_order_relaxed) + 1,
+			      memory_order_relaxed);
+}
+
+/** Add a consistent snapshot of another thread's counters to a total
+ *
+ */
+static void stats_read(uint64_t final_stats[FR_RADIUS_CODE_MAX], rlm_stats_slab_t *slab, rlm_stats_counters_t *counters)
+{
+	uint64_t	local_stats[FR_RADIUS_CODE_MAX];
+	uint_fast64_t	seq;
+	int		i;
+
+	do {
+		while ((seq = atomic_load_explicit(&slab->seq, memory_order_acquire)) & 1);
+
+		for (i = 0; i < FR_RADIUS_CODE_MAX; i++) {
+			local_stats[i] = atomic_load_explicit(&counters->stats[i], memory_order_relaxed);
+		}
+
+		atomic_thread_fence(memory_order_acquire);
+	} while (atomic_load_explicit(&slab->seq, memory_order_relaxed) != seq);
+
+	for (i = 0; i < FR_RADIUS_CODE_MAX; i++) final_stats[i] += local_stats[i];
+}
+
+/** Return a thread's counters for a slot, or NULL if it has none
+ *
+ */
+static inline rlm_stats_counters_t *stats_slot(rlm_stats_thread_t *t, uint32_t slot)
+{
+	rlm_stats_counters_t *chunk;
+
+	chunk = (rlm_stats_counters_t *) atomic_load_explicit(&t->chunks[slot / STATS_CHUNK_SIZE], memory_order_acquire);
+	if (!chunk) return NULL;
+
+	return &chunk[slot % STATS_CHUNK_SIZE];
+}
+
+/** Warn, once, that new clients and listeners aren't being tracked
+ *
+ */
+static void stats_full(rlm_stats_t *inst, rlm_stats_id_t const *id)
+{
+	if (atomic_exchange_explicit(&inst->full, true, memory_order_relaxed)) return;
+
+	WARN("rlm_stats - Already tracking max_entries (%u) clients and listeners.  "
+	     "Packets from %s %pV are only counted in the global statistics",
+	     inst->max_entries, (id->type == FR_STATS4_TYPE_VALUE_CLIENT) ? "client" : "listener",
+	     fr_box_ipaddr(id->ipaddr));
+}
+
+/** Find or create this thread's counters for a client or listener
+ *
+ * @return
+ *	- The counters.
+ *	- NULL if the maximum number of entries is already being tracked.
+ */
+static rlm_stats_counters_t *stats_lookup(rlm_stats_thread_t *t, uint32_t type, fr_ipaddr_t const *ipaddr)
+{
+	rlm_stats_t		*inst = t->inst;
+	rlm_stats_local_t	find, *local;
+	rlm_stats_key_t		*key;
+	rlm_stats_counters_t	*counters, *chunk;
+	uint32_t		slot;
+
+	find.id.ipaddr = *ipaddr;
+	find.id.type = type;
+
+	local = fr_hash_table_find(t->local, &find);
+	if (local) goto found;
 
 	/*
-	 *	Bootstrap with my statistics, where we don't need a
-	 *	lock.
+	 *	Don't take the lock just to be told that
+	 *	there's no room.
 	 */
-	stats = fr_rb_find(*tree, mydata);
-	if (!stats) {
-		memset(final_stats, 0, sizeof(uint64_t) * FR_RADIUS_CODE_MAX);
-	} else {
-		memcpy(final_stats, stats->stats, sizeof(stats->stats));
+	if (atomic_load_explicit(&inst->num_keys, memory_order_relaxed) >= inst->max_entries) {
+		stats_full(inst, &find.id);
+		return NULL;
 	}
 
+	pthread_mutex_lock(&inst->mutex);
+	key = fr_hash_table_find(inst->keys, &find);
+	if (!key) {
+		slot = atomic_load_explicit(&inst->num_keys, memory_order_relaxed);
+		if (slot >= inst->max_entries) {
+			pthread_mutex_unlock(&inst->mutex);
+			stats_full(inst, &find.id);
+			return NULL;
+		}
+
+		MEM(key = talloc_zero(inst->keys, rlm_stats_key_t));
+		key->id = find.id;
+		key->slot = slot;
+		if (!fr_hash_table_insert(inst->keys, key)) {
+			pthread_mutex_unlock(&inst->mutex);
+			talloc_free(key);
+			return NULL;
+		}
+		atomic_store_explicit(&inst->num_keys, slot + 1, memory_order_relaxed);
+	}
+	pthread_mutex_unlock(&inst->mutex);
+
+	MEM(local = talloc_zero(t->local, rlm_stats_local_t));
+	local->id = find.id;
+	local->key = key;
+	if (!fr_hash_table_insert(t->local, local)) {
+		talloc_free(local);
+		return NULL;
+	}
+
+found:
+	counters = stats_slot(t, local->key->slot);
+	if (counters) return counters;
+
 	/*
-	 *	Loop over all of the other thread instances, locking
-	 *	them, and adding their statistics in.
+	 *	Allocate the chunk, and publish it only once
+	 *	the counters are zeroed.
 	 */
-	for (other = fr_dlist_head(&t->inst->list);
+	MEM(talloc_aligned_array(t, (void **) &chunk, STATS_CACHE_LINE_SIZE,
+				 sizeof(rlm_stats_counters_t) * STATS_CHUNK_SIZE));
+	memset(chunk, 0, sizeof(rlm_stats_counters_t) * STATS_CHUNK_SIZE);
+	atomic_store_explicit(&t->chunks[local->key->slot / STATS_CHUNK_SIZE], (uintptr_t) chunk, memory_order_release);
+
+	return &chunk[local->key->slot % STATS_CHUNK_SIZE];
+}
+
+/** Sum the global counters over all threads
+ *
+ */
+static void stats_global(uint64_t final_stats[FR_RADIUS_CODE_MAX], rlm_stats_t *inst)
+{
+	rlm_stats_thread_t *other;
+
+	pthread_mutex_lock(&inst->mutex);
+	memcpy(final_stats, inst->stats, sizeof(inst->stats));
+
+	for (other = fr_dlist_head(&inst->list);
 	     other != NULL;
-	     other = fr_dlist_next(&t->inst->list, other)) {
-		int i;
+	     other = fr_dlist_next(&inst->list, other)) {
+		stats_read(final_stats, other->slab, &other->slab->global);
+	}
+	pthread_mutex_unlock(&inst->mutex);
+}
 
-		pthread_mutex_lock(&other->mutex);
+/** Sum the counters for a client or listener over all threads
+ *
+ */
+static void coalesce(uint64_t final_stats[FR_RADIUS_CODE_MAX], rlm_stats_t *inst, rlm_stats_id_t const *id)
+{
+	rlm_stats_key_t		*key;
+	rlm_stats_counters_t	*counters;
+	rlm_stats_thread_t	*other;
 
-		if (other == t) continue;
+	pthread_mutex_lock(&inst->mutex);
+	key = fr_hash_table_find(inst->keys, id);
+	if (!key) {
+		pthread_mutex_unlock(&inst->mutex);
+		memset(final_stats, 0, sizeof(uint64_t) * FR_RADIUS_CODE_MAX);
+		return;
+	}
 
-		tree = (fr_rb_tree_t **) (((uint8_t *) other) + tree_offset);
-		stats = fr_rb_find(*tree, mydata);
-		if (!stats) {
-			continue;
-		}
-		memcpy(&local_stats, stats->stats, sizeof(stats->stats));
+	memcpy(final_stats, key->retired, sizeof(key->retired));
 
-		for (i = 0; i < FR_RADIUS_CODE_MAX; i++) {
-			final_stats[i] += local_stats[i];
-		}
+	for (other = fr_dlist_head(&inst->list);
+	     other != NULL;
+	     other = fr_dlist_next(&inst->list, other)) {
+		counters = stats_slot(other, key->slot);
+		if (!counters) continue;
 
-		pthread_mutex_unlock(&other->mutex);
+		stats_read(final_stats, other->slab, counters);
 	}
+	pthread_mutex_unlock(&inst->mutex);
 }
 
-
 /*
  *	Do the statistics
  */
@@ -167,7 +410,7 @@ static unlang_action_t CC_HINT(nonnull) mod_stats(rlm_rcode_t *p_result, module_
 
 
 	fr_pair_t *vp;
-	rlm_stats_data_t mydata;
+	rlm_stats_id_t id;
 	char buffer[64];
 	uint64_t local_stats[NUM_ELEMENTS(inst->stats)];
 
@@ -175,13 +418,10 @@ static unlang_action_t CC_HINT(nonnull) mod_stats(rlm_rcode_t *p_result, module_
 	 *	Increment counters only in "send foo" sections.
 	 *
 	 *	i.e. only when we have a reply to send.
-	 *
-	 *	FIXME - Nothing sets request_state anymore
 	 */
-#if 0
-	if (request->request_state == REQUEST_SEND) {
+	if (request->reply->code != 0) {
 		int src_code, dst_code;
-		rlm_stats_data_t *stats;
+		rlm_stats_counters_t *src, *dst;
 
 		src_code = request->packet->code;
 		if (src_code >= FR_RADIUS_CODE_MAX) src_code = 0;
@@ -189,67 +429,30 @@ static unlang_action_t CC_HINT(nonnull) mod_stats(rlm_rcode_t *p_result, module_
 		dst_code = request->reply->code;
 		if (dst_code >= FR_RADIUS_CODE_MAX) dst_code = 0;
 
-		pthread_mutex_lock(&t->mutex);
-		t->stats[src_code]++;
-		t->stats[dst_code]++;
-
-		/*
-		 *	Update source statistics
-		 */
-		mydata.ipaddr = request->packet->socket.inet.src_ipaddr;
-		stats = fr_rb_find(t->src, &mydata);
-		if (!stats) {
-			MEM(stats = talloc_zero(t, rlm_stats_data_t));
-
-			stats->ipaddr = request->packet->socket.inet.src_ipaddr;
-			stats->created = request->async->recv_time;
-
-			(void) fr_rb_insert(t->src, stats);
-		}
-
-		stats->last_packet = request->async->recv_time;
-		stats->stats[src_code]++;
-		stats->stats[dst_code]++;
-
 		/*
-		 *	Update destination statistics
+		 *	Find the counters first, as that may
+		 *	allocate memory, or take the shared lock.
 		 */
-		mydata.ipaddr = request->packet->socket.inet.dst_ipaddr;
-		stats = fr_rb_find(t->dst, &mydata);
-		if (!stats) {
-			MEM(stats = talloc_zero(t, rlm_stats_data_t));
+		src = stats_lookup(t, FR_STATS4_TYPE_VALUE_CLIENT, &request->packet->socket.inet.src_ipaddr);
+		dst = stats_lookup(t, FR_STATS4_TYPE_VALUE_LISTENER, &request->packet->socket.inet.dst_ipaddr);
 
-			stats->ipaddr = request->packet->socket.inet.dst_ipaddr;
-			stats->created = request->async->recv_time;
+		stats_write_begin(t->slab);
+		stats_inc(&t->slab->global, src_code);
+		stats_inc(&t->slab->global, dst_code);
 
-			(void) fr_rb_insert(t->dst, stats);
+		if (src) {
+			stats_inc(src, src_code);
+			stats_inc(src, dst_code);
 		}
 
-		stats->last_packet = request->async->recv_time;
-		stats->stats[src_code]++;
-		stats->stats[dst_code]++;
-		pthread_mutex_unlock(&t->mutex);
-
-		/*
-		 *	@todo - periodically clean up old entries.
-		 */
-
-		if ((t->last_global_update + NSEC) > request->async->recv_time) {
-			RETURN_MODULE_UPDATED;
-		}
-
-		t->last_global_update = request->async->recv_time;
-
-		pthread_mutex_lock(&inst->mutex);
-		for (i = 0; i < FR_RADIUS_CODE_MAX; i++) {
-			inst->stats[i] += t->stats[i];
-			t->stats[i] = 0;
+		if (dst) {
+			stats_inc(dst, src_code);
+			stats_inc(dst, dst_code);
 		}
-		pthread_mutex_unlock(&inst->mutex);
+		stats_write_end(t->slab);
 
 		RETURN_MODULE_UPDATED;
 	}
-#endif
 
 	/*
 	 *	Ignore "authenticate" and anything other than Status-Server
@@ -273,38 +476,19 @@ static unlang_action_t CC_HINT(nonnull) mod_stats(rlm_rcode_t *p_result, module_
 
 	switch (stats_type) {
 	case FR_STATS4_TYPE_VALUE_GLOBAL:			/* global */
-		/*
-		 *	Merge our stats with the global stats, and then copy
-		 *	the global stats to a thread-local variable.
-		 *
-		 *	The copy helps minimize mutex contention.
-		 */
-		pthread_mutex_lock(&inst->mutex);
-		for (i = 0; i < FR_RADIUS_CODE_MAX; i++) {
-			inst->stats[i] += t->stats[i];
-			t->stats[i] = 0;
-		}
-		memcpy(&local_stats, inst->stats, sizeof(inst->stats));
-		pthread_mutex_unlock(&inst->mutex);
+		stats_global(local_stats, inst);
 		vp = NULL;
 		break;
 
 	case FR_STATS4_TYPE_VALUE_CLIENT:			/* src */
-		vp = fr_pair_find_by_da(&request->request_pairs, attr_freeradius_stats4_ipv4_address, 0);
-		if (!vp) vp = fr_pair_find_by_da(&request->request_pairs, attr_freeradius_stats4_ipv6_address, 0);
-		if (!vp) RETURN_MODULE_NOOP;
-
-		mydata.ipaddr = vp->vp_ip;
-		coalesce(local_stats, t, offsetof(rlm_stats_thread_t, src), &mydata);
-		break;
-
 	case FR_STATS4_TYPE_VALUE_LISTENER:			/* dst */
 		vp = fr_pair_find_by_da(&request->request_pairs, attr_freeradius_stats4_ipv4_address, 0);
 		if (!vp) vp = fr_pair_find_by_da(&request->request_pairs, attr_freeradius_stats4_ipv6_address, 0);
 		if (!vp) RETURN_MODULE_NOOP;
 
-		mydata.ipaddr = vp->vp_ip;
-		coalesce(local_stats, t, offsetof(rlm_stats_thread_t, dst), &mydata);
+		id.ipaddr = vp->vp_ip;
+		id.type = stats_type;
+		coalesce(local_stats, inst, &id);
 		break;
 
 	default:
@@ -319,15 +503,13 @@ static unlang_action_t CC_HINT(nonnull) mod_stats(rlm_rcode_t *p_result, module_
 		}
 	}
 
-	strcpy(buffer, "FreeRADIUS-Stats4-");
-
 	for (i = 0; i < FR_RADIUS_CODE_MAX; i++) {
 		fr_dict_attr_t const *da;
 
 		if (!local_stats[i]) continue;
 
-		strlcpy(buffer + 18, fr_packet_codes[i], sizeof(buffer) - 18);
-		da = fr_dict_attr_by_name(NULL, fr_dict_root(dict_radius), buffer);
+		snprintf(buffer, sizeof(buffer), "Stats4-%s", fr_packet_codes[i]);
+		da = fr_dict_attr_by_name(NULL, attr_freeradius_stats4_packet_counters, buffer);
 		if (!da) continue;
 
 		MEM(vp = fr_pair_afrom_da(request->reply_ctx, da));
@@ -339,15 +521,6 @@ static unlang_action_t CC_HINT(nonnull) mod_stats(rlm_rcode_t *p_result, module_
 	RETURN_MODULE_OK;
 }
 
-
-static int8_t data_cmp(const void *one, const void *two)
-{
-	rlm_stats_data_t const *a = one;
-	rlm_stats_data_t const *b = two;
-
-	return fr_ipaddr_cmp(&a->ipaddr, &b->ipaddr);
-}
-
 /** Instantiate thread data for the submodule.
  *
  */
@@ -360,15 +533,18 @@ static int mod_thread_instantiate(UNUSED CONF_SECTION const *cs, void *instance,
 
 	t->inst = inst;
 
-	t->src = fr_rb_inline_talloc_alloc(t, rlm_stats_data_t, src_node, data_cmp, NULL);
-	if (unlikely(!t->src)) return -1;
+	/*
+	 *	The thread instance data isn't cache line aligned,
+	 *	so the counters are allocated separately.
+	 */
+	if (!talloc_aligned_array(t, (void **) &t->slab, STATS_CACHE_LINE_SIZE, sizeof(*t->slab))) return -1;
+	memset(t->slab, 0, sizeof(*t->slab));
 
-	t->dst = fr_rb_inline_talloc_alloc(t, rlm_stats_data_t, dst_node, data_cmp, NULL);
-	if (unlikely(!t->dst)) {
-		TALLOC_FREE(t->src);
-		return -1;
-	}
-	pthread_mutex_init(&t->mutex, 0);
+	t->chunks = talloc_zero_array(t, atomic_uintptr_t, inst->num_chunks);
+	if (unlikely(!t->chunks)) return -1;
+
+	t->local = fr_hash_table_alloc(t, id_hash, id_cmp, NULL);
+	if (unlikely(!t->local)) return -1;
 
 	pthread_mutex_lock(&inst->mutex);
 	fr_dlist_insert_head(&inst->list, t);
@@ -385,23 +561,51 @@ static int mod_thread_detach(UNUSED fr_event_list_t *el, void *thread)
 {
 	rlm_stats_thread_t	*t = talloc_get_type_abort(thread, rlm_stats_thread_t);
 	rlm_stats_t		*inst = t->inst;
+	rlm_stats_local_t	*local;
+	rlm_stats_counters_t	*counters;
+	fr_hash_iter_t		iter;
 	int			i;
 
+	/*
+	 *	We're the only writer, so we can read our own
+	 *	counters directly.
+	 */
 	pthread_mutex_lock(&inst->mutex);
 	for (i = 0; i < FR_RADIUS_CODE_MAX; i++) {
-		inst->stats[i] += t->stats[i];
+		inst->stats[i] += atomic_load_explicit(&t->slab->global.stats[i], memory_order_relaxed);
+	}
+
+	for (local = fr_hash_table_iter_init(t->local, &iter);
+	     local != NULL;
+	     local = fr_hash_table_iter_next(t->local, &iter)) {
+		counters = stats_slot(t, local->key->slot);
+		if (!counters) continue;
+
+		for (i = 0; i < FR_RADIUS_CODE_MAX; i++) {
+			local->key->retired[i] += atomic_load_explicit(&counters->stats[i], memory_order_relaxed);
+		}
 	}
 	fr_dlist_remove(&inst->list, t);
 	pthread_mutex_unlock(&inst->mutex);
-	pthread_mutex_destroy(&t->mutex);
 
 	return 0;
 }
 
-static int mod_instantiate(void *instance, UNUSED CONF_SECTION *conf)
+static int mod_instantiate(void *instance, CONF_SECTION *conf)
 {
 	rlm_stats_t	*inst = instance;
 
+	if (inst->max_entries == 0) {
+		cf_log_err(conf, "max_entries must be greater than zero");
+		return -1;
+	}
+
+	inst->keys = fr_hash_table_alloc(inst, id_hash, id_cmp, NULL);
+	if (!inst->keys) return -1;
+
+	atomic_init(&inst->num_keys, 0);
+	inst->num_chunks = (inst->max_entries + STATS_CHUNK_SIZE - 1) / STATS_CHUNK_SIZE;
+
 	pthread_mutex_init(&inst->mutex, NULL);
 	fr_dlist_init(&inst->list, rlm_stats_thread_t, entry);
 
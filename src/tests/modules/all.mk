@@ -75,6 +75,11 @@ $(foreach x, $(FILES), $(eval $$(OUTPUT.$(TEST))/$x: $(patsubst %,$(BUILD_DIR)/l
 #
 $(foreach x, $(filter sql_%,$(FILES)), $(eval $$(OUTPUT.$(TEST))/$x: $(patsubst %,$(BUILD_DIR)/lib/rlm_sql.la,$(patsubst %/,%,$(firstword $(subst /, ,$(dir $x)))))))
 
+#
+#  redis/ippool_foo depends on rlm_redis_ippool, and its tool.
+#
+$(foreach x, $(filter redis/ippool_%,$(FILES)), $(eval $$(OUTPUT.$(TEST))/$x: $(BUILD_DIR)/lib/rlm_redis_ippool.la $(TEST_BIN_DIR)/rlm_redis_ippool_tool))
+
 
 #
 #  Files in the output dir depend on the unit tests
@@ -0,0 +1,29 @@
+#!/bin/sh
+#
+#  Coprocess for the exec_coproc module.
+#
+#  Replies to every request with its User-Name, and returns
+#  reject for the user "reject".  Exits without replying for
+#  the user "exit".
+#
+user=""
+while read -r line; do
+	case "$line" in
+	"")
+		if [ "$user" = "exit" ]; then
+			exit 0
+		fi
+		echo "Reply-Message = \"coproc $user\""
+		if [ "$user" = "reject" ]; then
+			echo 1
+		else
+			echo 0
+		fi
+		user=""
+		;;
+
+	User-Name\ =*)
+		user=$(echo "$line" | sed 's/^User-Name = "\(.*\)"$/\1/')
+		;;
+	esac
+done
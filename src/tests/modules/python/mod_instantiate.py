@@ -0,0 +1,22 @@
+import freeradius
+
+instantiated = False
+
+
+def instantiate(p):
+    global instantiated
+    instantiated = True
+    return freeradius.RLM_MODULE_OK
+
+
+def authorize(p):
+    if instantiated:
+        return freeradius.RLM_MODULE_OK
+
+    return freeradius.RLM_MODULE_FAIL
+
+
+def detach(p):
+    global instantiated
+    instantiated = False
+    return freeradius.RLM_MODULE_OK
@@ -0,0 +1,18 @@
+import freeradius
+
+
+def authorize(p):
+    if p.request.getall("Filter-Id") != ["one", "two"]:
+        return freeradius.RLM_MODULE_FAIL
+
+    if p.request["Filter-Id"] != "one" or p.request["Filter-Id", 1] != "two":
+        return freeradius.RLM_MODULE_FAIL
+
+    if ("Filter-Id", 2) in p.request:
+        return freeradius.RLM_MODULE_FAIL
+
+    p.reply["Reply-Message"] = ["first", "second", "third"]
+    p.reply["Reply-Message", 0] = "replaced"
+    del p.reply["Reply-Message", 2]
+
+    return freeradius.RLM_MODULE_UPDATED
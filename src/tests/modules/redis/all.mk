@@ -4,3 +4,12 @@
 
 # Don't test redis if REDIS_TEST_SERVER ENV is not set
 redis_require_test_server := 1
+
+#
+#  The ippool_* tests need rlm_redis_ippool built with pipelining support.
+#
+ifneq "$(findstring rlm_redis_ippool.la,$(ALL_TGTS))" "rlm_redis_ippool.la"
+  FILES_SKIP += $(filter redis/ippool_%,$(FILES))
+else ifeq "$(WITH_REDIS_PIPELINE)" ""
+  FILES_SKIP += $(filter redis/ippool_%,$(FILES))
+endif
@@ -0,0 +1,10 @@
+#
+#  Test the "sqlippool" module
+#
+
+#
+#  The tests use an SQLite database.
+#
+ifneq "$(findstring rlm_sql_sqlite.la,$(ALL_TGTS))" "rlm_sql_sqlite.la"
+  FILES_SKIP += $(filter sqlippool/%,$(FILES))
+endif
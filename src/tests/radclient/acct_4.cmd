@@ -0,0 +1,70 @@
+#!/bin/sh
+#
+#	Replay a detail file with the mmap work file reader.  Entries
+#	which are already done should be skipped, failed entries
+#	should be retransmitted, and completed entries should be
+#	marked as done in the work file.
+#
+
+test_in="build/tests/radclient/acct_4.out"
+output="build/tests/radclient"
+log="${output}/replay.log"
+work="${output}/detail.work"
+
+if ! grep -q "Received Accounting-Response" ${test_in}; then
+	echo "ERROR: Expected 'Received Accounting-Response' in '${test_in}'"
+	exit 1
+fi
+
+#
+#	Rename the file into place, so the listener never sees
+#	a partial file.
+#
+cp src/tests/radclient/acct_4.detail ${output}/acct_4.detail.tmp
+mv ${output}/acct_4.detail.tmp ${output}/detail-20210101
+
+#
+#	"replay_stuck" always fails, so the work file stays open
+#	once everything else has been replayed.
+#
+i=0
+while [ $i -lt 30 ]; do
+	if grep -q "^replay_retry 1$" ${log} 2>/dev/null && \
+	   [ "$(grep -c 'Donestamp' ${work} 2>/dev/null)" = "3" ]; then
+		break
+	fi
+	sleep 1
+	i=$((i + 1))
+done
+
+if [ "$(grep -c '^replay_1 ' ${log})" != "1" ] || ! grep -q "^replay_1 0$" ${log}; then
+	echo "ERROR: Expected 'replay_1' to be replayed once in '${log}'"
+	cat ${log}
+	exit 1
+fi
+
+if grep -q "^replay_done " ${log}; then
+	echo "ERROR: 'replay_done' was already done, and should not have been replayed"
+	cat ${log}
+	exit 1
+fi
+
+if ! grep -q "^replay_retry 0$" ${log} || ! grep -q "^replay_retry 1$" ${log}; then
+	echo "ERROR: Expected 'replay_retry' to be retransmitted once in '${log}'"
+	cat ${log}
+	exit 1
+fi
+
+if [ ! -e ${work} ]; then
+	echo "ERROR: Expected the work file '${work}' to be open"
+	exit 1
+fi
+
+#
+#	The two completed entries are marked, and the stuck one isn't.
+#
+if [ "$(grep -c 'Donestamp' ${work})" != "3" ] || [ "$(grep -c 'Timestamp' ${work})" != "1" ]; then
+	echo "ERROR: Expected three entries to be marked as done in '${work}'"
+	cat ${work}
+	exit 1
+fi
@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+#	Replay a binary detail file written by rlm_detail.  The packet
+#	should be decoded exactly as it was received, and the work
+#	file should be deleted once it's been replayed.
+#
+
+test_in="build/tests/radclient/acct_5.out"
+output="build/tests/radclient"
+log="${output}/replay.log"
+work="${output}/spool.work"
+
+if ! grep -q "Received Accounting-Response" ${test_in}; then
+	echo "ERROR: Expected 'Received Accounting-Response' in '${test_in}'"
+	exit 1
+fi
+
+if [ ! -s ${output}/acct_5.spool ]; then
+	echo "ERROR: Expected the packet to be written to '${output}/acct_5.spool'"
+	exit 1
+fi
+
+#
+#	Rename the file into place, so the listener never sees
+#	a partial file.
+#
+mv ${output}/acct_5.spool ${output}/spool-20210101
+
+i=0
+while [ $i -lt 30 ]; do
+	if grep -q "^spool_1 0$" ${log} 2>/dev/null && [ ! -e ${work} ]; then
+		break
+	fi
+	sleep 1
+	i=$((i + 1))
+done
+
+if [ "$(grep -c '^spool_1 ' ${log})" != "1" ] || ! grep -q "^spool_1 0$" ${log}; then
+	echo "ERROR: Expected 'spool_1' to be replayed once in '${log}'"
+	cat ${log}
+	exit 1
+fi
+
+if [ -e ${work} ]; then
+	echo "ERROR: Expected the work file '${work}' to be deleted"
+	exit 1
+fi
@@ -29,6 +29,12 @@ CLIENT := radclient
 include src/tests/radiusd.mk
 $(eval $(call RADIUSD_SERVICE,radiusd,$(OUTPUT)))
 
+#
+#	The .cmd scripts may use radmin to check the server's statistics.
+#
+RADCLIENT_RADMIN := $(TEST_BIN)/radmin -q -f $(OUTPUT)/control-socket.sock
+$(foreach x,$(FILES.$(TEST)),$(eval $x: $(TEST_BIN_DIR)/radmin))
+
 #
 #	Run the radclient commands against the radiusd.
 #
@@ -82,7 +88,7 @@ $(OUTPUT)/%: $(DIR)/% | $(TEST).radiusd_kill $(TEST).radiusd_start
 		rm -f $(BUILD_DIR)/tests/test.radclient;		    \
 		$(MAKE) --no-print-directory test.radclient.radiusd_kill;   \
 		exit 1;                                                     \
-	elif [ -e "$(CMD_TEST)" ] && ! $(SHELL) $(CMD_TEST); then           \
+	elif [ -e "$(CMD_TEST)" ] && ! RADMIN="$(RADCLIENT_RADMIN)" $(SHELL) $(CMD_TEST); then \
 		echo "RADCLIENT FAILED $@";                                 \
 		echo "RADIUSD:   $(RADIUSD_RUN)";                           \
 		echo "RADCLIENT: $(TEST_BIN)/radclient $(ARGV) -C $(RADCLIENT_CLIENT_PORT) -f $< -d src/tests/radclient/config -D share/dictionary 127.0.0.1:$(PORT) $(TYPE) $(SECRET)"; \
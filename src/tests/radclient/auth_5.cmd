@@ -0,0 +1,60 @@
+#!/bin/sh
+#
+#	The calls to the stats module, and the sections
+#	the requests ran, should be timed
+#
+
+test_in="build/tests/radclient/auth_5.out"
+stats_out="build/tests/radclient/auth_5.stats"
+
+recv=$(grep "Received Access-Accept" ${test_in} | wc -l)
+if [ $recv -ne 2 ]; then
+	echo "ERROR: We expected 2 entries of 'Received Access-Accept' in '${test_in}', got ${recv}"
+	exit 1
+fi
+
+if ! echo "show module stats stats" | ${RADMIN} > ${stats_out} 2>&1; then
+	echo "ERROR: radmin failed"
+	cat ${stats_out}
+	exit 1
+fi
+
+#
+#	Other tests may have sent Access-Accepts too, so there are
+#	at least as many calls as this test sent requests.
+#
+calls=$(grep "^count.calls" ${stats_out} | awk '{ print $2 }')
+if [ -z "${calls}" ] || [ ${calls} -lt 2 ]; then
+	echo "ERROR: Expected at least 2 calls in '${stats_out}'"
+	cat ${stats_out}
+	exit 1
+fi
+
+#
+#	Each completed call is put in one of the run time buckets.
+#
+bucketed=$(grep "^run.calls\." ${stats_out} | awk '{ sum += $2 } END { print sum + 0 }')
+if [ ${bucketed} -lt 2 ]; then
+	echo "ERROR: Expected at least 2 calls in the run.calls buckets of '${stats_out}', got ${bucketed}"
+	cat ${stats_out}
+	exit 1
+fi
+
+#
+#	The interpreter times each section it runs.  The requests
+#	may have been handled by any worker, so add them all up.
+#
+sections_out="build/tests/radclient/auth_5.sections"
+: > ${sections_out}
+i=0
+while [ $i -lt 32 ]; do
+	echo "stats worker $i section" | ${RADMIN} >> ${sections_out} 2>/dev/null
+	i=$((i + 1))
+done
+
+bucketed=$(grep "^time\.test\.recv\.Access-Request\." ${sections_out} | awk '{ sum += $2 } END { print sum + 0 }')
+if [ ${bucketed} -lt 2 ]; then
+	echo "ERROR: Expected at least 2 runs of 'recv Access-Request' in '${sections_out}', got ${bucketed}"
+	cat ${sections_out}
+	exit 1
+fi
@@ -0,0 +1,16 @@
+#!/bin/sh
+#
+#	The reply should contain counters for the client
+#
+
+test_in="build/tests/radclient/status_1.out"
+
+if ! grep -q "Received Access-Accept" ${test_in}; then
+	echo "ERROR: Expected 'Received Access-Accept' in '${test_in}'"
+	exit 1
+fi
+
+if ! grep -q "Stats4-Access-Accept = " ${test_in}; then
+	echo "ERROR: Expected client counters in '${test_in}'"
+	exit 1
+fi
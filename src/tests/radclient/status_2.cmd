@@ -0,0 +1,16 @@
+#!/bin/sh
+#
+#	The reply should not contain counters for the listener
+#
+
+test_in="build/tests/radclient/status_2.out"
+
+if ! grep -q "Received Access-Accept" ${test_in}; then
+	echo "ERROR: Expected 'Received Access-Accept' in '${test_in}'"
+	exit 1
+fi
+
+if grep -q "Stats4-Access-" ${test_in}; then
+	echo "ERROR: Expected no listener counters in '${test_in}'"
+	exit 1
+fi